@@ -28,15 +28,36 @@
 
 #include "asset.h"
 
+#include <cerrno>
+#include <cmath>
 #include <cstring>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glm/gtc/packing.hpp>
+
+static size_t alignChunk(size_t offset) {
+  size_t align = asset::StaticMeshFileHeader::CHUNK_ALIGNMENT;
+
+  return (offset + align - 1) & ~(align - 1);
+}
+
 void asset::writeStaticMeshFile(char const             *path,
 				const StaticMeshData   *meshes,  uint32_t meshCount,
 				const StaticVertexData *verts,   uint32_t vertexCount,
-				const uint16_t         *indices, uint32_t indexCount)
+				const uint32_t         *indices, uint32_t indexCount,
+				const Meshlet          *meshlets, uint32_t meshletCount,
+				const MeshLOD          *lods,     uint32_t lodCount,
+				VertexFormat           vertexFormat,
+				int                    compressionLevel,
+				Span<char const>       dictionary)
 {
   StaticMeshFileHeader header;
 
@@ -44,31 +65,361 @@ void asset::writeStaticMeshFile(char const             *path,
   header.vertexCount = vertexCount;
   header.indexCount  = indexCount;
 
+  // Each mesh records its own vertex and index offsets, so the table can be
+  // written sorted by ID, for deterministic output and binary search.
+  std::vector<StaticMeshData> sorted(meshes, meshes + meshCount);
+
+  std::sort(sorted.begin(), sorted.end(),
+	    [](auto const &a, auto const &b) { return a.id < b.id; });
+
+  // The meshlet table follows the same order, with each mesh's meshlets
+  // together.
+  std::vector<Meshlet> meshletTable;
+
+  meshletTable.reserve(meshletCount);
+
+  for (auto &mesh : sorted) {
+    uint32_t first = (uint32_t)meshletTable.size();
+
+    meshletTable.insert(meshletTable.end(),
+			meshlets + mesh.meshletOffset,
+			meshlets + mesh.meshletOffset + mesh.meshletCount);
+
+    mesh.meshletOffset = mesh.meshletCount ? first : 0;
+  }
+
+  header.meshletCount = (uint32_t)meshletTable.size();
+
+  // And so does the LOD table. Its entries are relative to their mesh, so
+  // they're copied as they are.
+  std::vector<MeshLOD> lodTable;
+
+  lodTable.reserve(lodCount);
+
+  for (auto &mesh : sorted) {
+    uint32_t first = (uint32_t)lodTable.size();
+
+    lodTable.insert(lodTable.end(),
+		    lods + mesh.lodOffset,
+		    lods + mesh.lodOffset + mesh.lodCount);
+
+    mesh.lodOffset = mesh.lodCount ? first : 0;
+  }
+
+  header.lodCount = (uint32_t)lodTable.size();
+
+  ZSTD_CCtx  *cctx  = nullptr;
+  ZSTD_CDict *cdict = nullptr;
+
+  if (compressionLevel > 0) {
+    cctx = ZSTD_createCCtx();
+
+    if (!dictionary.empty()) {
+      cdict = ZSTD_createCDict(dictionary.data, dictionary.size, compressionLevel);
+      header.dictionaryID = ZSTD_getDictID_fromDict(dictionary.data, dictionary.size);
+    }
+  }
+
+  std::vector<StaticMeshChunk>       chunks(meshCount);
+  std::vector<std::vector<uint8_t>>  chunkData(meshCount);
+
+  size_t offset = alignChunk(sizeof(StaticMeshFileHeader)
+			     + meshCount * sizeof(StaticMeshData)
+			     + meshCount * sizeof(StaticMeshChunk)
+			     + meshletTable.size() * sizeof(Meshlet)
+			     + lodTable.size() * sizeof(MeshLOD));
+
+  for (uint32_t i = 0; i < meshCount; i++) {
+    auto &mesh = sorted[i];
+
+    // Meshlet indices are relative to the meshlet, so they always fit in 16
+    // bits.
+    bool narrow = mesh.meshletCount > 0 || mesh.vertexCount <= 0x10000;
+
+    mesh.vertexFormat = vertexFormat;
+    mesh.indexType    = narrow ? IndexType::U16 : IndexType::U32;
+
+    size_t vertBytes  = mesh.vertexCount * vertexSize(vertexFormat);
+    size_t indexBytes = mesh.indexCount * indexSize(mesh.indexType);
+
+    std::vector<uint8_t> raw(vertBytes + indexBytes);
+
+    if (vertexFormat == VertexFormat::Packed) {
+      auto packed = (PackedVertexData *)raw.data();
+
+      for (uint32_t v = 0; v < mesh.vertexCount; v++) {
+	packed[v] = PackedVertexData::pack(verts[mesh.vertexOffset + v], mesh.bounds);
+      }
+    } else {
+      memcpy(raw.data(), verts + mesh.vertexOffset, vertBytes);
+    }
+
+    if (narrow) {
+      auto narrowed = (uint16_t *)(raw.data() + vertBytes);
+
+      for (uint32_t k = 0; k < mesh.indexCount; k++) {
+	narrowed[k] = (uint16_t)indices[mesh.indexOffset + k];
+      }
+    } else {
+      memcpy(raw.data() + vertBytes, indices + mesh.indexOffset, indexBytes);
+    }
+
+    chunks[i].compression = Compression::None;
+
+    if (cctx) {
+      std::vector<uint8_t> packed(ZSTD_compressBound(raw.size()));
+
+      size_t packedSize = cdict
+	? ZSTD_compress_usingCDict(cctx, packed.data(), packed.size(), raw.data(), raw.size(), cdict)
+	: ZSTD_compressCCtx(cctx, packed.data(), packed.size(), raw.data(), raw.size(), compressionLevel);
+
+      if (!ZSTD_isError(packedSize) && packedSize < raw.size()) {
+	packed.resize(packedSize);
+
+	raw = std::move(packed);
+	chunks[i].compression = Compression::Zstd;
+      }
+    }
+
+    chunks[i].offset = offset;
+    chunks[i].size   = (uint32_t)raw.size();
+    chunkData[i]     = std::move(raw);
+
+    offset = alignChunk(offset + chunks[i].size);
+  }
+
+  ZSTD_freeCDict(cdict);
+  ZSTD_freeCCtx(cctx);
+
   std::ofstream out(path, std::ios::binary);
 
   out.write((char *)&header, sizeof header);
-  out.write((char *)meshes, sizeof(StaticMeshData)*meshCount);
+  out.write((char *)sorted.data(), sizeof(StaticMeshData)*meshCount);
+  out.write((char *)chunks.data(), sizeof(StaticMeshChunk)*meshCount);
+  out.write((char *)meshletTable.data(), sizeof(Meshlet)*meshletTable.size());
+  out.write((char *)lodTable.data(), sizeof(MeshLOD)*lodTable.size());
+
+  static char const padding[StaticMeshFileHeader::CHUNK_ALIGNMENT] = {};
 
-  out.write((char *)verts, sizeof(StaticVertexData)*vertexCount);
-  out.write((char *)indices, sizeof(uint16_t)*indexCount);
+  for (uint32_t i = 0; i < meshCount; i++) {
+    out.write(padding, chunks[i].offset - out.tellp());
+    out.write((char *)chunkData[i].data(), chunks[i].size);
+  }
 }
 
-asset::StaticMeshFileHandle asset::openStaticMeshFile(std::string const &path) {
-  std::ifstream stream(path, std::ios::binary);
+asset::StaticMeshFileHandle
+asset::openStaticMeshFile(std::string const &path, FileMode mode, ZSTD_DDict const *dict) {
+  StaticMeshFileHandle handle = std::make_unique<StaticMeshFileHandleBuffer>();
+
+  handle->_dict = dict;
+
+  handle->_fd = open(path.c_str(), O_RDONLY);
+
+  struct stat st;
+
+  if (handle->_fd < 0 || fstat(handle->_fd, &st) != 0) {
+    std::cerr << "Failed to open static mesh file '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+
+  handle->_fileSize = st.st_size;
+
+  if (mode == FileMode::Mapped) handle->_map();
+
+  if (!handle->_readTable()) {
+    std::cerr << "Bad or truncated static mesh file '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+
+  if (handle->_mapping) {
+    // The mapping holds its own reference to the file.
+    close(handle->_fd);
 
+    handle->_fd   = -1;
+    handle->_mode = FileMode::Mapped;
+  } else {
+    handle->_mode = FileMode::Stream;
+  }
+
+  handle->_buildIndex();
+
+  return handle;
+}
+
+asset::StaticMeshFileHandle
+asset::openStaticMeshRegion(std::string const    &name,
+			    Span<uint8_t const>  bytes,
+			    ZSTD_DDict const     *dict)
+{
   StaticMeshFileHandle handle = std::make_unique<StaticMeshFileHandleBuffer>();
 
-  stream.read((char *)&handle->_header, sizeof(StaticMeshFileHeader));
+  handle->_dict         = dict;
+  handle->_mode         = FileMode::Mapped;
+  handle->_fileSize     = bytes.size;
+  handle->_mapping      = bytes.data;
+  handle->_ownsMapping  = false;
 
-  handle->_meshes.resize(handle->_header.meshCount);
-  stream.read((char *)handle->_meshes.data(),
-	      handle->_header.meshCount * sizeof(StaticMeshData));
+  if (!handle->_mapping || !handle->_readTable()) {
+    std::cerr << "Bad or truncated static mesh file '" << name << "'" << std::endl;
+    std::exit(-1);
+  }
 
-  handle->_stream = std::move(stream);
+  handle->_buildIndex();
 
   return handle;
 }
 
+void asset::StaticMeshFileHandleBuffer::_buildIndex() {
+  _meshIndex.reset(_meshes.size());
+
+  for (uint32_t i = 0; i < (uint32_t)_meshes.size(); i++) {
+    _meshIndex.insert(_meshes[i].id, i);
+  }
+}
+
+// Map the whole of _fd read-only. Leaves _mapping null on failure, in which
+// case the handle falls back to Stream mode.
+void asset::StaticMeshFileHandleBuffer::_map() {
+  if (_fileSize == 0) return;
+
+  void *addr = mmap(nullptr, _fileSize, PROT_READ, MAP_PRIVATE, _fd, 0);
+
+  if (addr != MAP_FAILED) _mapping = (uint8_t const *)addr;
+}
+
+// Read `size` bytes at `offset` in the file, from the mapping if there is one
+// and with pread otherwise. Safe to call from several threads at once.
+//
+// Returns false on a short read.
+bool asset::StaticMeshFileHandleBuffer::_readAt(void *dst, size_t offset, size_t size) const {
+  if (offset + size > _fileSize) return false;
+
+  if (_mapping) {
+    memcpy(dst, _mapping + offset, size);
+    return true;
+  }
+
+  uint8_t *bytes = (uint8_t *)dst;
+
+  while (size > 0) {
+    ssize_t n = pread(_fd, bytes, size, offset);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+
+    bytes  += n;
+    offset += n;
+    size   -= n;
+  }
+
+  return true;
+}
+
+// Read the header, mesh table and chunk table, and check that every chunk
+// lies within the file -- touching past the end of a mapping would be a SIGBUS
+// rather than a short read.
+bool asset::StaticMeshFileHandleBuffer::_readTable() {
+  // If the read fails and we don't write to _header, this ensures that the
+  // magicNumber won't match.
+  _header.magicNumber[0] = '\0';
+
+  if (!_readAt(&_header, 0, sizeof(StaticMeshFileHeader))) return false;
+
+  if (strncmp(_header.magicNumber, StaticMeshFileHeader::MAGIC_NUMBER, 32)) return false;
+
+  if (_header.version != StaticMeshFileHeader::VERSION) {
+    std::cerr << "Static mesh file version " << _header.version << " isn't supported, "
+	      << "expected " << StaticMeshFileHeader::VERSION << std::endl;
+    return false;
+  }
+
+  if (_header.dictionaryID != 0
+      && (!_dict || ZSTD_getDictID_fromDDict(_dict) != _header.dictionaryID))
+  {
+    std::cerr << "Static mesh file needs zstd dictionary " << _header.dictionaryID
+	      << ", which its library doesn't have" << std::endl;
+    return false;
+  }
+
+  _meshes.resize(_header.meshCount);
+  _chunks.resize(_header.meshCount);
+  _meshlets.resize(_header.meshletCount);
+  _lods.resize(_header.lodCount);
+
+  size_t meshTable    = sizeof(StaticMeshFileHeader);
+  size_t chunkTable   = meshTable + _header.meshCount * sizeof(StaticMeshData);
+  size_t meshletTable = chunkTable + _header.meshCount * sizeof(StaticMeshChunk);
+  size_t lodTable     = meshletTable + _header.meshletCount * sizeof(Meshlet);
+
+  if (!_readAt(_meshes.data(), meshTable, _header.meshCount * sizeof(StaticMeshData))) {
+    return false;
+  }
+
+  if (!_readAt(_chunks.data(), chunkTable, _header.meshCount * sizeof(StaticMeshChunk))) {
+    return false;
+  }
+
+  if (!_readAt(_meshlets.data(), meshletTable, _header.meshletCount * sizeof(Meshlet))) {
+    return false;
+  }
+
+  if (!_readAt(_lods.data(), lodTable, _header.lodCount * sizeof(MeshLOD))) {
+    return false;
+  }
+
+  for (size_t i = 0; i < _meshes.size(); i++) {
+    auto const &mesh  = _meshes[i];
+    auto const &chunk = _chunks[i];
+
+    if (mesh.vertexFormat != VertexFormat::Full && mesh.vertexFormat != VertexFormat::Packed) {
+      return false;
+    }
+
+    if (mesh.indexType != IndexType::U16 && mesh.indexType != IndexType::U32) return false;
+
+    // Every meshlet has to lie within its mesh, or drawing it would read
+    // some other mesh's data.
+    if ((size_t)mesh.meshletOffset + mesh.meshletCount > _meshlets.size()) return false;
+
+    for (uint32_t m = 0; m < mesh.meshletCount; m++) {
+      auto const &meshlet = _meshlets[mesh.meshletOffset + m];
+
+      if ((size_t)meshlet.vertexOffset + meshlet.vertexCount > mesh.vertexCount) return false;
+      if ((size_t)meshlet.indexOffset + meshlet.indexCount > mesh.indexCount) return false;
+    }
+
+    // Likewise each level of detail.
+    if ((size_t)mesh.lodOffset + mesh.lodCount > _lods.size()) return false;
+
+    for (uint32_t l = 0; l < mesh.lodCount; l++) {
+      auto const &lod = _lods[mesh.lodOffset + l];
+
+      if ((size_t)lod.indexOffset + lod.indexCount > mesh.indexCount) return false;
+      if ((size_t)lod.meshletOffset + lod.meshletCount > mesh.meshletCount) return false;
+    }
+
+    size_t rawSize = mesh.vertexCount * vertexSize(mesh.vertexFormat)
+                   + mesh.indexCount * indexSize(mesh.indexType);
+
+    if (chunk.offset + chunk.size > _fileSize) return false;
+    if (chunk.offset % StaticMeshFileHeader::CHUNK_ALIGNMENT) return false;
+
+    switch (chunk.compression) {
+    case Compression::None:
+      if (chunk.size != rawSize) return false;
+      break;
+
+    case Compression::Zstd:
+      break;
+
+    default:
+      return false;
+    }
+  }
+
+  return true;
+}
+
 std::ostream &asset::operator <<(std::ostream &stream, const asset::StaticMeshFileHandle &handle) {
   stream << "StaticMesh {" << std::endl;
   stream << "  meshCount:   " << handle->_header.meshCount << "," << std::endl;
@@ -80,6 +431,21 @@ std::ostream &asset::operator <<(std::ostream &stream, const asset::StaticMeshFi
     stream << "    vertexCount:  " << handle->_meshes[i].vertexCount  << "," << std::endl;
     stream << "    indexOffset:  " << handle->_meshes[i].indexOffset  << "," << std::endl;
     stream << "    indexCount:   " << handle->_meshes[i].indexCount   << "," << std::endl;
+    stream << "    indexType:    "
+	   << (handle->_meshes[i].indexType == IndexType::U32 ? "u32" : "u16")
+	   << "," << std::endl;
+    stream << "    meshlets:     " << handle->_meshes[i].meshletCount << "," << std::endl;
+    stream << "    lods:         " << handle->_meshes[i].lodCount << "," << std::endl;
+    stream << "    vertexFormat: "
+	   << (handle->_meshes[i].vertexFormat == VertexFormat::Packed ? "packed" : "full")
+	   << "," << std::endl;
+    stream << "    chunk {" << std::endl;
+    stream << "      offset:      " << handle->_chunks[i].offset << "," << std::endl;
+    stream << "      size:        " << handle->_chunks[i].size << "," << std::endl;
+    stream << "      compression: "
+	   << (handle->_chunks[i].compression == Compression::Zstd ? "zstd" : "none")
+	   << std::endl;
+    stream << "    }" << std::endl;
     stream << "    bounds {" << std::endl;
     stream << "      max: vec3("
 	   << handle->_meshes[i].bounds.max.x << ", "
@@ -98,49 +464,199 @@ std::ostream &asset::operator <<(std::ostream &stream, const asset::StaticMeshFi
 }
 
 asset::StaticMeshFileHandleBuffer::~StaticMeshFileHandleBuffer() {
-  _stream.close();
+  if (_mapping && _ownsMapping) munmap((void *)_mapping, _fileSize);
+  if (_fd >= 0) close(_fd);
 }
 
 asset::StaticMeshData *
 asset::StaticMeshFileHandleBuffer::getMeshData(asset::MeshID id) {
-  for (size_t i = 0; i < _header.meshCount; i++) {
-    if (_meshes[i].id == id) {
-      return &_meshes[i];
-    }
-  }
+  uint32_t i = _find(id);
 
-  return nullptr;
+  if (i == IDIndex::NOT_FOUND) return nullptr;
+
+  return &_meshes[i];
+}
+
+// Every thread that decompresses meshes gets its own context, so readMesh can
+// run on several threads at once.
+static ZSTD_DCtx *threadDCtx() {
+  thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)>
+    dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+
+  return dctx.get();
 }
 
 bool asset::StaticMeshFileHandleBuffer::readMesh(asset::MeshID     id,
-						 StaticVertexData  *verts,
-						 uint16_t          *indices)
+						 void              *verts,
+						 void              *indices)
 {
-  int idx = -1;
+  uint32_t i = _find(id);
+
+  if (i == IDIndex::NOT_FOUND) return false;
+
+  auto const &mesh  = _meshes[i];
+  auto const &chunk = _chunks[i];
+
+  size_t vertBytes  = mesh.vertexCount * vertexSize(mesh.vertexFormat);
+  size_t indexBytes = mesh.indexCount * indexSize(mesh.indexType);
+
+  if (chunk.compression == Compression::None) {
+    return _readAt(verts, chunk.offset, vertBytes)
+      && _readAt(indices, chunk.offset + vertBytes, indexBytes);
+  }
+
+  ZSTD_inBuffer in = { nullptr, chunk.size, 0 };
+
+  // Mapped files decompress straight out of the mapping; otherwise we need the
+  // compressed bytes in memory first.
+  thread_local std::vector<uint8_t> packed;
+
+  if (_mapping) {
+    in.src = _mapping + chunk.offset;
+  } else {
+    packed.resize(chunk.size);
+
+    if (!_readAt(packed.data(), chunk.offset, chunk.size)) return false;
+
+    in.src = packed.data();
+  }
 
-  for (int i = 0; static_cast<size_t>(i) < _header.meshCount; i++) {
-    if (_meshes[i].id == id) {
-      idx = i;
+  ZSTD_DCtx *dctx = threadDCtx();
+
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+  ZSTD_DCtx_refDDict(dctx, _dict);
+
+  // The frame holds the vertices followed by the indices, so we decompress it
+  // as a stream that switches output buffers halfway through.
+  ZSTD_outBuffer outs[2] = {
+    { verts,   vertBytes,  0 },
+    { indices, indexBytes, 0 },
+  };
+
+  for (auto &out : outs) {
+    while (out.pos < out.size) {
+      size_t inPos  = in.pos;
+      size_t outPos = out.pos;
+
+      size_t result = ZSTD_decompressStream(dctx, &out, &in);
+
+      if (ZSTD_isError(result)) return false;
+
+      // Either the frame ended early, or the chunk is truncated.
+      if (in.pos == inPos && out.pos == outPos) return false;
     }
   }
 
-  if (idx == -1) return false;
+  return in.pos == in.size;
+}
+
+Span<uint8_t const>
+asset::StaticMeshFileHandleBuffer::vertices(asset::MeshID id) {
+  uint32_t i = _find(id);
+
+  if (!_mapping || i == IDIndex::NOT_FOUND || _chunks[i].compression != Compression::None) {
+    return {};
+  }
+
+  return {
+    .data = _mapping + _chunks[i].offset,
+    .size = _meshes[i].vertexCount * vertexSize(_meshes[i].vertexFormat),
+  };
+}
+
+Span<uint8_t const>
+asset::StaticMeshFileHandleBuffer::indices(asset::MeshID id) {
+  uint32_t i = _find(id);
+
+  if (!_mapping || i == IDIndex::NOT_FOUND || _chunks[i].compression != Compression::None) {
+    return {};
+  }
+
+  size_t vertBytes = _meshes[i].vertexCount * vertexSize(_meshes[i].vertexFormat);
+
+  return {
+    .data = _mapping + _chunks[i].offset + vertBytes,
+    .size = _meshes[i].indexCount * indexSize(_meshes[i].indexType),
+  };
+}
 
-  auto *mesh = &_meshes[idx];
+Span<asset::Meshlet const>
+asset::StaticMeshFileHandleBuffer::meshlets(asset::MeshID id) {
+  uint32_t i = _find(id);
 
-  size_t vertexByteOffs = _vertexOffsetToBytes(mesh->vertexOffset);
-  size_t indexByteOffs  = _indexOffsetToBytes(mesh->indexOffset);
+  if (i == IDIndex::NOT_FOUND) return {};
 
-  _stream.seekg(vertexByteOffs, std::ios::beg);
-  _stream.read((char *)verts,
-		      mesh->vertexCount*sizeof(StaticVertexData));
+  return {
+    .data = _meshlets.data() + _meshes[i].meshletOffset,
+    .size = _meshes[i].meshletCount,
+  };
+}
 
+Span<asset::MeshLOD const>
+asset::StaticMeshFileHandleBuffer::lods(asset::MeshID id) {
+  uint32_t i = _find(id);
 
-  _stream.seekg(indexByteOffs, std::ios::beg);
-  _stream.read((char *)indices,
-		      mesh->indexCount*sizeof(uint16_t));
+  if (i == IDIndex::NOT_FOUND) return {};
 
-  return true;
+  return {
+    .data = _lods.data() + _meshes[i].lodOffset,
+    .size = _meshes[i].lodCount,
+  };
+}
+
+bool asset::StaticMeshFileHandleBuffer::compressed(asset::MeshID id) {
+  uint32_t i = _find(id);
+
+  return i != IDIndex::NOT_FOUND && _chunks[i].compression != Compression::None;
+}
+
+// madvise only accepts page-aligned addresses, so round `bytes` down to the
+// start of its page. Mappings start on a page, so this never strays out of
+// the one `bytes` is in.
+static void adviseWillNeed(uint8_t const *bytes, size_t size) {
+  static size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+  uintptr_t start = (uintptr_t)bytes & ~(uintptr_t)(pageSize - 1);
+
+  madvise((void *)start, (uintptr_t)bytes + size - start, MADV_WILLNEED);
+}
+
+void asset::StaticMeshFileHandleBuffer::prefetch(asset::MeshID id) {
+  auto bytes = chunk(id);
+
+  if (!bytes.empty()) adviseWillNeed(bytes.data, bytes.size);
+}
+
+Span<uint8_t const>
+asset::StaticMeshFileHandleBuffer::chunk(asset::MeshID id) {
+  uint32_t i = _find(id);
+
+  if (!_mapping || i == IDIndex::NOT_FOUND) return {};
+
+  return {
+    .data = _mapping + _chunks[i].offset,
+    .size = _chunks[i].size,
+  };
+}
+
+// Touch one byte in every page of the mesh's chunk, so that whoever copies or
+// decompresses out of it later doesn't take the page faults.
+void asset::StaticMeshFileHandleBuffer::faultIn(asset::MeshID id) {
+  static size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+  uint32_t i = _find(id);
+
+  if (!_mapping || i == IDIndex::NOT_FOUND || _chunks[i].size == 0) return;
+
+  volatile uint8_t const  *bytes  = _mapping + _chunks[i].offset;
+  size_t                  size    = _chunks[i].size;
+  uint8_t                 sink    = 0;
+
+  for (size_t k = 0; k < size; k += pageSize) sink ^= bytes[k];
+
+  sink ^= bytes[size - 1];
+
+  (void)sink;
 }
 
 asset::VertexInputDescription
@@ -185,62 +701,487 @@ asset::StaticVertexData::vertexInputDescription() {
   return inputDesc;
 }
 
-size_t asset::StaticMeshFileHandleBuffer::_vertexOffsetToBytes(size_t vertOffset) const {
-  return sizeof(StaticMeshFileHeader)
-    + _header.meshCount * sizeof(StaticMeshData)
-    + vertOffset * sizeof(StaticVertexData)
-    ;
+asset::VertexInputDescription
+asset::PackedVertexData::vertexInputDescription() {
+  asset::VertexInputDescription inputDesc;
+
+  VkVertexInputBindingDescription binding = {
+    .binding   = 0,
+    .stride    = sizeof(PackedVertexData),
+    .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+  };
+
+  inputDesc.bindings.push_back(binding);
+
+  VkVertexInputAttributeDescription position = {
+    .binding   = 0,
+    .location  = 0,
+    .format    = VK_FORMAT_R16G16B16A16_SNORM,
+    .offset    = offsetof(asset::PackedVertexData, position),
+  };
+
+  VkVertexInputAttributeDescription normal = {
+    .binding   = 0,
+    .location  = 1,
+    .format    = VK_FORMAT_R16G16_SNORM,
+    .offset    = offsetof(asset::PackedVertexData, normal),
+  };
+
+  VkVertexInputAttributeDescription uv = {
+    .binding   = 0,
+    .location  = 2,
+    .format    = VK_FORMAT_R16G16_SFLOAT,
+    .offset    = offsetof(asset::PackedVertexData, uv),
+  };
+
+  inputDesc.attribs.push_back(position);
+  inputDesc.attribs.push_back(normal);
+  inputDesc.attribs.push_back(uv);
+
+  inputDesc.flags = 0;
+
+  return inputDesc;
 }
 
-size_t asset::StaticMeshFileHandleBuffer::_indexOffsetToBytes(size_t indexOffset) const {
-  return sizeof(StaticMeshFileHeader)
-    + _header.meshCount * sizeof(StaticMeshData)
-    + _header.vertexCount * sizeof(StaticVertexData)
-    + indexOffset * sizeof(uint16_t)
-    ;
+static int16_t packSnorm16(float x) {
+  return (int16_t)std::round(glm::clamp(x, -1.0f, 1.0f) * 32767.0f);
 }
 
-asset::LibraryFileHandle asset::openLibraryFile(std::string const & path) {
-  std::ifstream file(path, std::ios::binary);
+static float unpackSnorm16(int16_t x) {
+  return glm::clamp(x / 32767.0f, -1.0f, 1.0f);
+}
 
-  LibraryFileHandle handle = std::make_unique<LibraryFileHandleBuffer>();
+// Octahedral encoding: project the unit vector onto the octahedron
+// |x| + |y| + |z| = 1, and fold the lower half over the upper half, which maps
+// the whole sphere onto [-1, 1]^2.
+static void packOctahedral(glm::vec3 n, int16_t out[2]) {
+  float sum = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
 
-  if (!file.is_open()) {
-    std::cerr << "Failed to open library file '" << path << "'" << std::endl;
-    std::exit(-1);
+  if (sum == 0.0f) {
+    out[0] = out[1] = 0;
+    return;
   }
 
-  LibraryFileHeader header;
-
-  // If file.read fails and we don't write to header, this ensures that the
-  // magicNumber won't match.
-  header.magicNumber[0] = '\0';
+  n /= sum;
 
-  file.read((char *)&header, sizeof(LibraryFileHeader));
+  float x = n.x;
+  float y = n.y;
 
-  if (strncmp(header.magicNumber, LibraryFileHeader::MAGIC_NUMBER, 32)) {
-    std::cerr << "Bad magic number for library file '" << path << "'" << std::endl;
-    std::exit(-1);
+  if (n.z < 0.0f) {
+    x = (1.0f - std::fabs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+    y = (1.0f - std::fabs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
   }
 
-  handle->_assetRefs.resize(header.assetRefCount);
-  handle->_pathData.resize(header.pathByteCount);
+  out[0] = packSnorm16(x);
+  out[1] = packSnorm16(y);
+}
 
-  file.read((char *)handle->_assetRefs.data(), header.assetRefCount*sizeof(LibraryAssetRef));
-  file.read((char *)handle->_pathData.data(), header.pathByteCount);
+// Must match octDecode in static-mesh-packed.vert.
+static glm::vec3 unpackOctahedral(int16_t const in[2]) {
+  glm::vec3 n(unpackSnorm16(in[0]), unpackSnorm16(in[1]), 0.0f);
 
-  file.close();
+  n.z = 1.0f - std::fabs(n.x) - std::fabs(n.y);
 
-  return handle;
-}
+  float t = std::max(-n.z, 0.0f);
+
+  n.x += n.x >= 0.0f ? -t : t;
+  n.y += n.y >= 0.0f ? -t : t;
+
+  return glm::normalize(n);
+}
+
+// Positions are stored relative to the center of `bounds`, scaled by its
+// half-extent. Flat axes (a half-extent of 0) always decode to the center.
+asset::PackedVertexData
+asset::PackedVertexData::pack(StaticVertexData const &vertex, BoundingBox const &bounds) {
+  PackedVertexData packed;
+
+  glm::vec3 center = (bounds.max + bounds.min) * 0.5f;
+  glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+
+  for (int i = 0; i < 3; i++) {
+    float offset = vertex.position[i] - center[i];
+
+    packed.position[i] = extent[i] > 0.0f ? packSnorm16(offset / extent[i]) : 0;
+  }
+
+  packed.position[3] = 0;
+
+  packOctahedral(vertex.normal, packed.normal);
+  packOctahedral(vertex.tangent, packed.tangent);
+
+  packed.uv[0] = glm::packHalf1x16(vertex.uv.x);
+  packed.uv[1] = glm::packHalf1x16(vertex.uv.y);
+
+  return packed;
+}
+
+asset::StaticVertexData
+asset::PackedVertexData::unpack(BoundingBox const &bounds) const {
+  StaticVertexData vertex;
+
+  glm::vec3 center = (bounds.max + bounds.min) * 0.5f;
+  glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+
+  for (int i = 0; i < 3; i++) {
+    vertex.position[i] = center[i] + unpackSnorm16(position[i]) * extent[i];
+  }
+
+  vertex.normal  = unpackOctahedral(normal);
+  vertex.tangent = unpackOctahedral(tangent);
+
+  vertex.uv.x = glm::unpackHalf1x16(uv[0]);
+  vertex.uv.y = glm::unpackHalf1x16(uv[1]);
+
+  return vertex;
+}
+
+size_t asset::textureLevelSize(TextureFormat format, uint32_t width, uint32_t height) {
+  size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+
+  switch (format) {
+  case TextureFormat::RGBA8:    return (size_t)width * height * 4;
+  case TextureFormat::BC1:      return blocks * 8;
+  case TextureFormat::BC3:
+  case TextureFormat::BC5:
+  case TextureFormat::BC7:
+  case TextureFormat::ASTC4x4:  return blocks * 16;
+  }
+
+  return 0;
+}
+
+static size_t alignMip(size_t offset) {
+  size_t align = asset::TextureFileHeader::MIP_ALIGNMENT;
+
+  return (offset + align - 1) / align * align;
+}
+
+void asset::writeTextureFile(char const                 *path,
+			     TextureData const          *textures,  uint32_t textureCount,
+			     Span<uint8_t const> const  *mips,      uint32_t mipCount)
+{
+  TextureFileHeader header;
+
+  header.textureCount  = textureCount;
+  header.mipCount      = mipCount;
+
+  std::vector<TextureMip> mipTable(mipCount);
+
+  size_t offset = sizeof(TextureFileHeader)
+                + textureCount * sizeof(TextureData)
+                + mipCount * sizeof(TextureMip);
+
+  for (uint32_t t = 0; t < textureCount; t++) {
+    auto const &texture = textures[t];
+
+    for (uint32_t l = 0; l < texture.mipCount; l++) {
+      auto &mip = mipTable[texture.mipOffset + l];
+
+      offset = alignMip(offset);
+
+      mip = {
+	.offset  = offset,
+	.size    = (uint32_t)mips[texture.mipOffset + l].size,
+	.width   = std::max(texture.width >> l, 1u),
+	.height  = std::max(texture.height >> l, 1u),
+      };
+
+      offset += mip.size;
+    }
+  }
+
+  std::ofstream out(path, std::ios::binary);
+
+  out.write((char *)&header, sizeof(TextureFileHeader));
+  out.write((char *)textures, sizeof(TextureData)*textureCount);
+  out.write((char *)mipTable.data(), sizeof(TextureMip)*mipCount);
+
+  static char const padding[TextureFileHeader::MIP_ALIGNMENT] = {};
+
+  for (uint32_t m = 0; m < mipCount; m++) {
+    out.write(padding, mipTable[m].offset - out.tellp());
+    out.write((char *)mips[m].data, mipTable[m].size);
+  }
+}
+
+asset::TextureFileHandle asset::openTextureFile(std::string const &path) {
+  TextureFileHandle handle = std::make_unique<TextureFileHandleBuffer>();
+
+  handle->_fd = open(path.c_str(), O_RDONLY);
+
+  struct stat st;
+
+  if (handle->_fd < 0 || fstat(handle->_fd, &st) != 0) {
+    std::cerr << "Failed to open texture file '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+
+  handle->_fileSize = st.st_size;
+
+  if (handle->_fileSize > 0) {
+    void *addr = mmap(nullptr, handle->_fileSize, PROT_READ, MAP_PRIVATE, handle->_fd, 0);
+
+    if (addr != MAP_FAILED) handle->_mapping = (uint8_t const *)addr;
+  }
+
+  if (!handle->_readTable()) {
+    std::cerr << "Bad or truncated texture file '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+
+  // The mapping holds its own reference to the file.
+  if (handle->_mapping) {
+    close(handle->_fd);
+    handle->_fd = -1;
+  }
+
+  handle->_textureIndex.reset(handle->_textures.size());
+
+  for (uint32_t i = 0; i < (uint32_t)handle->_textures.size(); i++) {
+    handle->_textureIndex.insert(handle->_textures[i].id, i);
+  }
+
+  return handle;
+}
+
+asset::TextureFileHandleBuffer::~TextureFileHandleBuffer() {
+  if (_mapping) munmap((void *)_mapping, _fileSize);
+  if (_fd >= 0) close(_fd);
+}
+
+// See StaticMeshFileHandleBuffer::_readAt.
+bool asset::TextureFileHandleBuffer::_readAt(void *dst, size_t offset, size_t size) const {
+  if (offset + size > _fileSize) return false;
+
+  if (_mapping) {
+    memcpy(dst, _mapping + offset, size);
+    return true;
+  }
+
+  uint8_t *bytes = (uint8_t *)dst;
+
+  while (size > 0) {
+    ssize_t n = pread(_fd, bytes, size, offset);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+
+    bytes  += n;
+    offset += n;
+    size   -= n;
+  }
+
+  return true;
+}
+
+// Read the header, texture table and mip table, and check that every level is
+// where and as big as its texture says it should be.
+bool asset::TextureFileHandleBuffer::_readTable() {
+  // If the read fails and we don't write to _header, this ensures that the
+  // magicNumber won't match.
+  _header.magicNumber[0] = '\0';
+
+  if (!_readAt(&_header, 0, sizeof(TextureFileHeader))) return false;
+
+  if (strncmp(_header.magicNumber, TextureFileHeader::MAGIC_NUMBER, 32)) return false;
+
+  if (_header.version != TextureFileHeader::VERSION) {
+    std::cerr << "Texture file version " << _header.version << " isn't supported, "
+	      << "expected " << TextureFileHeader::VERSION << std::endl;
+    return false;
+  }
+
+  _textures.resize(_header.textureCount);
+  _mips.resize(_header.mipCount);
+
+  size_t textureTable = sizeof(TextureFileHeader);
+  size_t mipTable     = textureTable + _header.textureCount * sizeof(TextureData);
+
+  if (!_readAt(_textures.data(), textureTable, _header.textureCount * sizeof(TextureData))) {
+    return false;
+  }
+
+  if (!_readAt(_mips.data(), mipTable, _header.mipCount * sizeof(TextureMip))) return false;
+
+  for (auto const &texture : _textures) {
+    if (texture.format > TextureFormat::ASTC4x4) return false;
+    if (texture.mipCount == 0) return false;
+    if ((size_t)texture.mipOffset + texture.mipCount > _mips.size()) return false;
+
+    for (uint32_t l = 0; l < texture.mipCount; l++) {
+      auto const &mip = _mips[texture.mipOffset + l];
+
+      if (mip.width != std::max(texture.width >> l, 1u)) return false;
+      if (mip.height != std::max(texture.height >> l, 1u)) return false;
+      if (mip.size != textureLevelSize(texture.format, mip.width, mip.height)) return false;
+      if (mip.offset + mip.size > _fileSize) return false;
+    }
+  }
+
+  return true;
+}
+
+asset::TextureData *
+asset::TextureFileHandleBuffer::getTextureData(TextureID id) {
+  uint32_t i = _textureIndex.find(id);
+
+  return i == IDIndex::NOT_FOUND ? nullptr : &_textures[i];
+}
+
+Span<asset::TextureMip const>
+asset::TextureFileHandleBuffer::mips(TextureID id) {
+  auto *texture = getTextureData(id);
+
+  if (!texture) return { };
+
+  return { _mips.data() + texture->mipOffset, texture->mipCount };
+}
+
+bool asset::TextureFileHandleBuffer::readMip(TextureID id, uint32_t level, void *dst) {
+  auto levels = mips(id);
+
+  if (level >= levels.size) return false;
+
+  return _readAt(dst, levels[level].offset, levels[level].size);
+}
+
+asset::LibraryFileHandle asset::openLibraryFile(std::string const & path) {
+  std::ifstream file(path, std::ios::binary);
+
+  LibraryFileHandle handle = std::make_unique<LibraryFileHandleBuffer>();
+
+  if (!file.is_open()) {
+    std::cerr << "Failed to open library file '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+
+  LibraryFileHeader header;
+
+  // If file.read fails and we don't write to header, this ensures that the
+  // magicNumber won't match.
+  header.magicNumber[0] = '\0';
+
+  file.read((char *)&header, sizeof(LibraryFileHeader));
+
+  if (strncmp(header.magicNumber, LibraryFileHeader::MAGIC_NUMBER, 32)) {
+    std::cerr << "Bad magic number for library file '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+
+  if (header.version != LibraryFileHeader::VERSION) {
+    std::cerr << "Library file '" << path << "' has version " << header.version
+	      << ", expected " << LibraryFileHeader::VERSION << std::endl;
+    std::exit(-1);
+  }
+
+  handle->_assetRefs.resize(header.assetRefCount);
+  handle->_pathData.resize(header.pathByteCount);
+  handle->_dictionary.resize(header.dictionaryByteCount);
+
+  file.read((char *)handle->_assetRefs.data(), header.assetRefCount*sizeof(LibraryAssetRef));
+  file.read((char *)handle->_pathData.data(), header.pathByteCount);
+  file.read((char *)handle->_dictionary.data(), header.dictionaryByteCount);
+
+  std::vector<LibraryArchiveFile> archiveFiles(header.archiveFileCount);
+
+  file.read((char *)archiveFiles.data(), header.archiveFileCount*sizeof(LibraryArchiveFile));
+
+  if (!file) {
+    std::cerr << "Library file '" << path << "' is truncated" << std::endl;
+    std::exit(-1);
+  }
+
+  file.close();
+
+  if (!handle->_dictionary.empty()) {
+    handle->_ddict = ZSTD_createDDict(handle->_dictionary.data(), handle->_dictionary.size());
+
+    if (!handle->_ddict) {
+      std::cerr << "Bad zstd dictionary in library file '" << path << "'" << std::endl;
+      std::exit(-1);
+    }
+  }
+
+  for (auto const &ref : handle->_assetRefs) {
+    if (ref.pathOffset >= header.pathByteCount || ref.nameOffset >= header.pathByteCount) {
+      std::cerr << "Bad path offset for asset " << ref.assetID
+		<< " in library file '" << path << "'" << std::endl;
+      std::exit(-1);
+    }
+  }
+
+  // Make sure every path is terminated, even in a corrupt file.
+  if (!handle->_pathData.empty()) handle->_pathData.back() = '\0';
+
+  handle->_refIndex.reset(handle->_assetRefs.size());
+
+  for (uint32_t i = 0; i < (uint32_t)handle->_assetRefs.size(); i++) {
+    handle->_indexRef(i);
+  }
+
+  if (!archiveFiles.empty()) handle->_mapArchive(path, archiveFiles);
+
+  return handle;
+}
+
+void asset::LibraryFileHandleBuffer::_mapArchive(std::string const                      &path,
+						 std::vector<LibraryArchiveFile> const  &files)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::cerr << "Failed to open library file '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  // The mapping holds its own reference to the file.
+  close(fd);
+
+  // Unlike a mesh file there's no falling back on pread here, since the packed
+  // files' handles hold views into the mapping.
+  if (addr == MAP_FAILED) {
+    std::cerr << "Failed to map library archive '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+
+  _archive      = (uint8_t const *)addr;
+  _archiveSize  = st.st_size;
+
+  for (auto const &packed : files) {
+    if (packed.pathOffset >= _pathData.size()
+	|| packed.offset % LibraryFileHeader::ARCHIVE_ALIGNMENT
+	|| packed.offset > _archiveSize
+	|| packed.size > _archiveSize - packed.offset)
+    {
+      std::cerr << "Bad archive table in library file '" << path << "'" << std::endl;
+      std::exit(-1);
+    }
+
+    auto found = _meshFileSlots.find(std::string(_pathData.data() + packed.pathOffset));
+
+    // A packed file that no ref names is dead weight, but harmless.
+    if (found == _meshFileSlots.end()) continue;
+
+    _archiveFiles[found->second] = {
+      .data = _archive + packed.offset,
+      .size = packed.size,
+    };
+  }
+}
 
 std::ostream & asset::operator <<(std::ostream &os,
 				  const asset::LibraryFileHandle &handle)
 {
   os << "library {" << std::endl;
   for (const auto &ref : handle->_assetRefs) {
-    os << "  mesh {" << std::endl;
+    os << (ref.assetType == asset::AssetType::Texture ? "  texture {" : "  mesh {") << std::endl;
     os << "    id:   " << ref.assetID << std::endl;
+    os << "    name: " << (handle->_pathData.data() + ref.nameOffset) << std::endl;
     os << "    path: " << (handle->_pathData.data() + ref.pathOffset) << std::endl;
     os << "  }" << std::endl;
   }
@@ -253,57 +1194,301 @@ asset::LibraryFileHandle asset::emptyLibraryFileHandle() {
   return std::make_unique<LibraryFileHandleBuffer>();
 }
 
+asset::LibraryFileHandleBuffer::~LibraryFileHandleBuffer() {
+  // Mesh files hold on to the dictionary, so they have to go first.
+  _meshFiles.clear();
+  _textureFiles.clear();
+
+  // So do packed ones on the archive.
+  if (_archive) munmap((void *)_archive, _archiveSize);
+
+  for (auto ddict : _retiredDDicts) ZSTD_freeDDict(ddict);
+
+  ZSTD_freeDDict(_ddict);
+}
+
+// Replace the library's dictionary. Mesh files that were already opened keep
+// the old one, which stays alive until the library is destroyed, so a reader
+// that's part way through one of them isn't pulled out from under.
+void asset::LibraryFileHandleBuffer::setDictionary(std::vector<char> dictionary) {
+  std::lock_guard<std::mutex> lock(_openMutex);
+
+  if (_ddict) _retiredDDicts.push_back(_ddict);
+
+  _ddict      = nullptr;
+  _dictionary = std::move(dictionary);
+
+  if (!_dictionary.empty()) {
+    _ddict = ZSTD_createDDict(_dictionary.data(), _dictionary.size());
+  }
+}
+
+// Strings orphaned by addMeshRef replacing a ref are dropped.
+void asset::LibraryFileHandleBuffer::_packRefs(std::vector<LibraryAssetRef>  *refs,
+					       std::vector<char>             *pathData) const
+{
+  *refs = _assetRefs;
+
+  std::sort(refs->begin(), refs->end(),
+	    [](auto const &a, auto const &b) { return a.assetID < b.assetID; });
+
+  std::unordered_map<std::string, uint32_t> offsets;
+
+  pathData->clear();
+
+  auto pack = [&](uint32_t offset) {
+    std::string str(_pathData.data() + offset);
+
+    auto found = offsets.find(str);
+
+    if (found == offsets.end()) {
+      found = offsets.emplace(str, (uint32_t)pathData->size()).first;
+      pathData->insert(pathData->end(), str.begin(), str.end());
+      pathData->push_back('\0');
+    }
+
+    return found->second;
+  };
+
+  for (auto &ref : *refs) {
+    ref.pathOffset = pack(ref.pathOffset);
+    ref.nameOffset = pack(ref.nameOffset);
+  }
+}
+
+// Write the library to `path` with its refs sorted by ID, and each distinct
+// path stored once.
 void asset::LibraryFileHandleBuffer::write(const std::string &path) const {
+  std::vector<LibraryAssetRef>  refs;
+  std::vector<char>             pathData;
+
+  _packRefs(&refs, &pathData);
+
   LibraryFileHeader header;
   std::ofstream file(path, std::ios::binary);
 
-  header.assetRefCount = (uint32_t)_assetRefs.size();
-  header.pathByteCount = (uint32_t)_pathData.size();
+  header.assetRefCount = (uint32_t)refs.size();
+  header.pathByteCount = (uint32_t)pathData.size();
+  header.dictionaryByteCount = (uint32_t)_dictionary.size();
   file.write((char const *)&header, sizeof(LibraryFileHeader));
 
-  file.write((char const *)_assetRefs.data(), _assetRefs.size()*sizeof(LibraryAssetRef));
-  file.write((char const *)_pathData.data(),  _pathData.size());
+  file.write((char const *)refs.data(), refs.size()*sizeof(LibraryAssetRef));
+  file.write((char const *)pathData.data(),  pathData.size());
+  file.write((char const *)_dictionary.data(), _dictionary.size());
+}
+
+static size_t alignArchive(size_t offset) {
+  size_t align = asset::LibraryFileHeader::ARCHIVE_ALIGNMENT;
+
+  return (offset + align - 1) & ~(align - 1);
 }
 
-void asset::LibraryFileHandleBuffer::addMeshRef(MeshID id, std::string const &path) {
+// Like write, followed by the packed mesh files, in the order their first
+// refs sort in -- so meshes with neighbouring IDs end up next to each other.
+void asset::LibraryFileHandleBuffer::writeArchive(const std::string &path) const {
+  std::vector<LibraryAssetRef>  refs;
+  std::vector<char>             pathData;
+
+  _packRefs(&refs, &pathData);
+
+  // Parallel to packed: the bytes of files that are already in this library's
+  // archive, and empty spans for those that have to come from disk.
+  std::vector<LibraryArchiveFile>   packed;
+  std::vector<Span<uint8_t const>>  sources;
+  std::vector<bool>                 seen(pathData.size(), false);
+
+  for (auto const &ref : refs) {
+    if (ref.assetType != AssetType::StaticMesh || seen[ref.pathOffset]) continue;
+
+    seen[ref.pathOffset] = true;
+
+    char const *refPath = pathData.data() + ref.pathOffset;
+
+    Span<uint8_t const> source = _archiveFiles[_meshFileSlots.at(refPath)];
+
+    struct stat st;
+
+    if (source.empty()) {
+      if (stat(refPath, &st) != 0) {
+	std::cerr << "Failed to open static mesh file '" << refPath << "'" << std::endl;
+	std::exit(-1);
+      }
+    }
+
+    packed.push_back({
+	.offset      = 0,
+	.size        = source.empty() ? (uint64_t)st.st_size : source.size,
+	.pathOffset  = ref.pathOffset,
+      });
+
+    sources.push_back(source);
+  }
+
+  size_t offset = sizeof(LibraryFileHeader)
+    + refs.size()*sizeof(LibraryAssetRef)
+    + pathData.size()
+    + _dictionary.size()
+    + packed.size()*sizeof(LibraryArchiveFile);
+
+  for (auto &file : packed) {
+    file.offset = alignArchive(offset);
+    offset      = file.offset + file.size;
+  }
+
+  LibraryFileHeader header;
+  std::ofstream out(path, std::ios::binary);
+
+  header.assetRefCount        = (uint32_t)refs.size();
+  header.pathByteCount        = (uint32_t)pathData.size();
+  header.dictionaryByteCount  = (uint32_t)_dictionary.size();
+  header.archiveFileCount     = (uint32_t)packed.size();
+  out.write((char const *)&header, sizeof(LibraryFileHeader));
+
+  out.write((char const *)refs.data(), refs.size()*sizeof(LibraryAssetRef));
+  out.write((char const *)pathData.data(),  pathData.size());
+  out.write((char const *)_dictionary.data(), _dictionary.size());
+  out.write((char const *)packed.data(), packed.size()*sizeof(LibraryArchiveFile));
+
+  static char const padding[LibraryFileHeader::ARCHIVE_ALIGNMENT] = {};
+
+  for (size_t i = 0; i < packed.size(); i++) {
+    char const *filePath = pathData.data() + packed[i].pathOffset;
+
+    out.write(padding, packed[i].offset - out.tellp());
+
+    if (!sources[i].empty()) {
+      out.write((char const *)sources[i].data, sources[i].size);
+    } else {
+      std::ifstream in(filePath, std::ios::binary);
+
+      if (!in.is_open()) {
+	std::cerr << "Failed to open static mesh file '" << filePath << "'" << std::endl;
+	std::exit(-1);
+      }
+
+      out << in.rdbuf();
+    }
+
+    if ((uint64_t)out.tellp() != packed[i].offset + packed[i].size) {
+      std::cerr << "Static mesh file '" << filePath << "' changed while packing it into '"
+		<< path << "'" << std::endl;
+      std::exit(-1);
+    }
+  }
+
+  if (!out) {
+    std::cerr << "Failed to write library archive '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+}
+
+asset::MeshID
+asset::LibraryFileHandleBuffer::addMeshRef(std::string const &name, std::string const &path) {
+  return _addRef(AssetType::StaticMesh, name, path);
+}
+
+asset::TextureID
+asset::LibraryFileHandleBuffer::addTextureRef(std::string const &name, std::string const &path) {
+  return _addRef(AssetType::Texture, name, path);
+}
+
+asset::AssetID asset::LibraryFileHandleBuffer::_addRef(AssetType           type,
+						       std::string const  &name,
+						       std::string const  &path)
+{
+  AssetID id = ID(name);
+
+  if (id == NULL_ASSET_ID) {
+    std::cerr << "Asset '" << name << "' has the null ID; rename it" << std::endl;
+    std::exit(-1);
+  }
+
+  uint32_t existing = _refIndex.find(id);
+
+  if (existing != IDIndex::NOT_FOUND) {
+    char const *other = _pathData.data() + _assetRefs[existing].nameOffset;
+
+    if (name != other) {
+      std::cerr << "Assets '" << other << "' and '" << name << "' both have ID " << id
+		<< "; rename one of them" << std::endl;
+      std::exit(-1);
+    }
+  }
+
   LibraryAssetRef assetRef = {
-    .assetID    = id,
-    .assetType  = AssetType::StaticMesh,
-    .pathOffset = (uint32_t)_pathData.size(),
+    .assetID     = id,
+    .assetType   = type,
+    .pathOffset  = _addString(path),
+    .nameOffset  = _addString(name),
   };
 
-  _assetRefs.push_back(assetRef);
-  _pathData.insert(_pathData.end(), path.begin(), path.end());
+  if (existing != IDIndex::NOT_FOUND) {
+    _assetRefs[existing] = assetRef;
+    _indexRef(existing);
+  } else {
+    _assetRefs.push_back(assetRef);
+    _indexRef((uint32_t)_assetRefs.size() - 1);
+  }
+
+  return id;
+}
+
+uint32_t asset::LibraryFileHandleBuffer::_addString(std::string const &s) {
+  uint32_t offset = (uint32_t)_pathData.size();
+
+  _pathData.insert(_pathData.end(), s.begin(), s.end());
   _pathData.push_back('\0');
+
+  return offset;
 }
 
-asset::StaticMeshFileHandle &
-asset::LibraryFileHandleBuffer::_getStaticMeshFileHandle(std::string const &path)
-{
-  auto cached = _staticMeshHandleCache.find(path);
-  if (cached != _staticMeshHandleCache.end()) {
-    return cached->second;
-  } else {
-    return _staticMeshHandleCache.emplace(path, openStaticMeshFile(path)).first->second;
+void asset::LibraryFileHandleBuffer::_indexRef(uint32_t refIdx) {
+  auto const &ref = _assetRefs[refIdx];
+
+  _refIndex.insert(ref.assetID, refIdx);
+
+  std::string path(_pathData.data() + ref.pathOffset);
+
+  auto found = _meshFileSlots.find(path);
+
+  if (found == _meshFileSlots.end()) {
+    found = _meshFileSlots.emplace(path, (uint32_t)_meshFilePaths.size()).first;
+
+    _meshFilePaths.push_back(path);
+    _meshFiles.emplace_back();
+    _textureFiles.emplace_back();
+    _archiveFiles.emplace_back();
   }
+
+  if (_refFileSlot.size() <= refIdx) _refFileSlot.resize(refIdx + 1);
+
+  _refFileSlot[refIdx] = found->second;
 }
 
+// Log and exit if there's no mesh `id` in this library.
 asset::StaticMeshFileHandle &
 asset::LibraryFileHandleBuffer::_getStaticMeshFileHandle(MeshID id)
 {
-  std::string path;
-  for (const LibraryAssetRef & ref : _assetRefs) {
-    if (ref.assetID == id && ref.assetType == AssetType::StaticMesh) {
-      path = std::string(_pathData.data() + ref.pathOffset);
-    }
-  }
+  uint32_t i = _refIndex.find(id);
 
-  if (path.empty()) {
+  if (i == IDIndex::NOT_FOUND || _assetRefs[i].assetType != AssetType::StaticMesh) {
     std::cerr << "Can't find mesh with ID " << id << " in asset library." << std::endl;
     std::exit(-1);
   }
 
-  return _getStaticMeshFileHandle(path);
+  uint32_t slot = _refFileSlot[i];
+
+  std::lock_guard<std::mutex> lock(_openMutex);
+
+  if (_meshFiles[slot]) return _meshFiles[slot];
+
+  if (!_archiveFiles[slot].empty()) {
+    _meshFiles[slot] = openStaticMeshRegion(_meshFilePaths[slot], _archiveFiles[slot], _ddict);
+  } else {
+    _meshFiles[slot] = openStaticMeshFile(_meshFilePaths[slot], FileMode::Mapped, _ddict);
+  }
+
+  return _meshFiles[slot];
 }
 
 asset::StaticMeshData *
@@ -314,12 +1499,90 @@ asset::LibraryFileHandleBuffer::getMeshData(MeshID id) {
 }
 
 bool
-asset::LibraryFileHandleBuffer::readMesh(MeshID id, StaticVertexData *verts, uint16_t *indices) {
+asset::LibraryFileHandleBuffer::readMesh(MeshID id, void *verts, void *indices) {
   auto &handle = _getStaticMeshFileHandle(id);
 
   return handle->readMesh(id, verts, indices);
 }
 
+Span<uint8_t const>
+asset::LibraryFileHandleBuffer::meshVertices(MeshID id) {
+  return _getStaticMeshFileHandle(id)->vertices(id);
+}
+
+Span<uint8_t const>
+asset::LibraryFileHandleBuffer::meshIndices(MeshID id) {
+  return _getStaticMeshFileHandle(id)->indices(id);
+}
+
+Span<asset::Meshlet const>
+asset::LibraryFileHandleBuffer::meshMeshlets(MeshID id) {
+  return _getStaticMeshFileHandle(id)->meshlets(id);
+}
+
+Span<asset::MeshLOD const>
+asset::LibraryFileHandleBuffer::meshLODs(MeshID id) {
+  return _getStaticMeshFileHandle(id)->lods(id);
+}
+
+void
+asset::LibraryFileHandleBuffer::prefetchMesh(MeshID id) {
+  _getStaticMeshFileHandle(id)->prefetch(id);
+}
+
+// Chunks closer together than this are prefetched as one range, since paging
+// in a small gap costs less than another trip to the disk.
+static constexpr size_t PREFETCH_MERGE_GAP = 64 * 1024;
+
+void
+asset::LibraryFileHandleBuffer::prefetchMultiMesh(MeshID const *ids, size_t count) {
+  // Only chunks in the same mapping can be merged: that's the archive for any
+  // packed file, and the file's own mapping otherwise.
+  struct Range {
+    void const     *mapping;
+    uint8_t const  *begin;
+    uint8_t const  *end;
+  };
+
+  std::vector<Range> ranges;
+
+  ranges.reserve(count);
+
+  for (size_t i = 0; i < count; i++) {
+    auto *file  = _getStaticMeshFileHandle(ids[i]).get();
+    auto bytes  = file->chunk(ids[i]);
+
+    if (bytes.empty()) continue;
+
+    uint32_t slot = _refFileSlot[_refIndex.find(ids[i])];
+
+    ranges.push_back({
+	.mapping = _archiveFiles[slot].empty() ? (void const *)file : (void const *)_archive,
+	.begin   = bytes.data,
+	.end     = bytes.data + bytes.size,
+      });
+  }
+
+  std::sort(ranges.begin(), ranges.end(), [](auto const &a, auto const &b) {
+    if (a.mapping != b.mapping) return (uintptr_t)a.mapping < (uintptr_t)b.mapping;
+
+    return a.begin < b.begin;
+  });
+
+  for (size_t i = 0; i < ranges.size();) {
+    Range merged = ranges[i++];
+
+    while (i < ranges.size()
+	   && ranges[i].mapping == merged.mapping
+	   && ranges[i].begin <= merged.end + PREFETCH_MERGE_GAP)
+    {
+      merged.end = std::max(merged.end, ranges[i++].end);
+    }
+
+    adviseWillNeed(merged.begin, merged.end - merged.begin);
+  }
+}
+
 bool
 asset::LibraryFileHandleBuffer::getMultiMeshData(MeshID *ids, StaticMeshData *data, size_t count) {
   for (size_t i = 0; i < count; i++) {
@@ -336,19 +1599,169 @@ asset::LibraryFileHandleBuffer::getMultiMeshData(MeshID *ids, StaticMeshData *da
 bool
 asset::LibraryFileHandleBuffer::readMultiMesh(
   MeshID *ids, size_t count,
-  StaticVertexData *verts,
-  uint16_t *indices)
+  void *verts,
+  void *indices)
 {
   for (size_t i = 0; i < count; i++) {
-    auto *meshData = getMeshData(ids[i]);
+    auto &handle   = _getStaticMeshFileHandle(ids[i]);
+    auto *meshData = handle->getMeshData(ids[i]);
 
     if (!meshData) return false;
 
-    if (!readMesh(ids[i], verts, indices)) return false;
+    if (!handle->readMesh(ids[i], verts, indices)) return false;
+
+    verts    = (uint8_t *)verts + meshData->vertexCount * vertexSize(meshData->vertexFormat);
+    indices  = (uint8_t *)indices + meshData->indexCount * indexSize(meshData->indexType);
+  }
+
+  return true;
+}
+
+asset::TextureFileHandleBuffer *
+asset::LibraryFileHandleBuffer::textureFile(TextureID id) {
+  uint32_t i = _refIndex.find(id);
+
+  if (i == IDIndex::NOT_FOUND || _assetRefs[i].assetType != AssetType::Texture) return nullptr;
+
+  uint32_t slot = _refFileSlot[i];
+
+  std::lock_guard<std::mutex> lock(_openMutex);
+
+  if (!_textureFiles[slot]) _textureFiles[slot] = openTextureFile(_meshFilePaths[slot]);
+
+  return _textureFiles[slot].get();
+}
+
+void asset::StreamService::init(size_t workerCount, size_t queueDepth) {
+  _completions = std::make_unique<BoundedQueue<MeshLoad>>(queueDepth);
+  _stopping    = false;
+
+  for (size_t i = 0; i < workerCount; i++) {
+    _workers.emplace_back([this]() { _work(); });
+  }
+}
+
+// Stop the workers once they finish their current job. Jobs that haven't
+// started yet are dropped.
+void asset::StreamService::cleanup() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _stopping = true;
+    _jobs.clear();
+  }
+
+  _wake.notify_all();
 
-    verts   += meshData->vertexCount;
-    indices += meshData->indexCount;
+  for (auto &worker : _workers) worker.join();
+
+  _workers.clear();
+  _completions.reset();
+  _pending = 0;
+}
+
+uint64_t
+asset::StreamService::request(LibraryFileHandleBuffer *library, MeshID const *ids, size_t count) {
+  uint64_t ticket = _nextTicket++;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (uint32_t i = 0; i < (uint32_t)count; i++) {
+      _jobs.push_back({
+	  .library = library,
+	  .ticket  = ticket,
+	  .index   = i,
+	  .id      = ids[i],
+	});
+    }
   }
 
+  _pending += count;
+  _wake.notify_all();
+
+  return ticket;
+}
+
+bool asset::StreamService::poll(MeshLoad *load) {
+  if (!_completions || !_completions->pop(load)) return false;
+
+  _pending--;
+
   return true;
 }
+
+void asset::StreamService::_load(Job const &job, MeshLoad *load) {
+  load->ticket = job.ticket;
+  load->index  = job.index;
+  load->id     = job.id;
+
+  auto *data = job.library->getMeshData(job.id);
+
+  if (!data) return;
+
+  load->data = *data;
+
+  // Mapped files only need their pages brought in; everything else is read
+  // into memory owned by the load.
+  auto *file = job.library->meshFile(job.id);
+
+  file->prefetch(job.id);
+
+  load->verts   = file->vertices(job.id);
+  load->indices = file->indices(job.id);
+
+  if (!load->verts.empty() && !load->indices.empty()) {
+    file->faultIn(job.id);
+
+    load->ok = true;
+    return;
+  }
+
+  // Compressed meshes in mapped files are left for the consumer to decompress
+  // straight into its staging memory.
+  if (file->mode() == FileMode::Mapped && file->compressed(job.id)) {
+    file->faultIn(job.id);
+
+    load->file = file;
+    load->ok   = true;
+    return;
+  }
+
+  load->ownedVerts.resize(data->vertexCount * vertexSize(data->vertexFormat));
+  load->ownedIndices.resize(data->indexCount * indexSize(data->indexType));
+
+  load->ok = file->readMesh(job.id, load->ownedVerts.data(), load->ownedIndices.data());
+
+  load->verts   = { .data = load->ownedVerts.data(),   .size = load->ownedVerts.size() };
+  load->indices = { .data = load->ownedIndices.data(), .size = load->ownedIndices.size() };
+}
+
+void asset::StreamService::_work() {
+  for (;;) {
+    Job job;
+
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+
+      _wake.wait(lock, [this]() { return _stopping || !_jobs.empty(); });
+
+      if (_stopping) return;
+
+      job = _jobs.front();
+      _jobs.pop_front();
+    }
+
+    MeshLoad load;
+
+    _load(job, &load);
+
+    // The completion queue is bounded, so a consumer that falls behind
+    // throttles the workers rather than letting finished loads pile up.
+    while (!_completions->push(std::move(load))) {
+      if (_stopping) return;
+
+      std::this_thread::yield();
+    }
+  }
+}
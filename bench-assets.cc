@@ -0,0 +1,514 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+// Measures how fast meshes come off disk, and how fast convert-gltf makes
+// them, without touching the GPU:
+//
+//     bench-assets [-n <meshes>] [-v <vertices>] ... <work directory>
+//
+// A synthetic library of `-n` grid meshes is written into the work directory,
+// `-p` to a file, and packed into an archive. Both are read back each of the
+// ways the engine reads meshes -- once with the files dropped from the page
+// cache, and once with them cached.
+// Then a large glTF file is generated and converted with a few sets of
+// convert-gltf flags.
+
+#include "asset.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void usage(char const *argv0) {
+  char const *strippedName = strrchr(argv0, '/');
+
+  strippedName = strippedName ? strippedName + 1 : argv0;
+
+  fprintf(stderr,
+	  "\n"
+	  "    usage: %s [options] <work directory>\n"
+	  "\n"
+	  "    -n <meshes>      meshes in the synthetic library (default 4096)\n"
+	  "    -v <vertices>    vertices per mesh, rounded to a square grid (default 1024)\n"
+	  "    -p <meshes>      meshes per mesh file (default 64)\n"
+	  "    -f <format>      vertex format, 'full' or 'packed' (default full)\n"
+	  "    -l <level>       zstd level for mesh chunks, 0 to store them raw (default 0)\n"
+	  "    -g <side>        vertices along each side of the glTF grid (default 512)\n"
+	  "    -c <path>        convert-gltf to time, or '-' to skip it (default bin/convert-gltf)\n"
+	  "\n",
+	  strippedName);
+
+  std::exit(-1);
+}
+
+// A `side` x `side` grid of vertices over the unit square, with a bump in it
+// so that no two meshes' vertices are the same. Indices are appended to
+// `indices`, relative to the grid's first vertex.
+static void gridMesh(uint32_t                              side,
+		     float                                 phase,
+		     std::vector<asset::StaticVertexData>  *verts,
+		     std::vector<uint32_t>                 *indices)
+{
+  for (uint32_t y = 0; y < side; y++) {
+    for (uint32_t x = 0; x < side; x++) {
+      float u = x / float(side - 1);
+      float v = y / float(side - 1);
+
+      verts->push_back({
+	  .position  = { u, 0.1f * std::sin(6.0f * u + phase) * std::cos(6.0f * v), v },
+	  .uv        = { u, v },
+	  .normal    = { 0.0f, 1.0f, 0.0f },
+	  .tangent   = { 1.0f, 0.0f, 0.0f },
+	});
+    }
+  }
+
+  for (uint32_t y = 0; y + 1 < side; y++) {
+    for (uint32_t x = 0; x + 1 < side; x++) {
+      uint32_t i = y * side + x;
+
+      indices->insert(indices->end(), { i, i + side, i + 1, i + 1, i + side, i + side + 1 });
+    }
+  }
+}
+
+// Write `count` meshes of `side` x `side` vertices into files of `perFile`
+// meshes under `dir`, and a library referencing them all. Returns the meshes'
+// IDs, grouped by file.
+static std::vector<std::vector<asset::MeshID>>
+writeLibrary(std::filesystem::path const  &dir,
+	     uint32_t                     count,
+	     uint32_t                     side,
+	     uint32_t                     perFile,
+	     asset::VertexFormat          format,
+	     int                          level)
+{
+  auto library = asset::emptyLibraryFileHandle();
+
+  std::vector<std::vector<asset::MeshID>> files;
+  std::set<asset::MeshID>                 seen;
+
+  for (uint32_t first = 0; first < count; first += perFile) {
+    std::vector<asset::StaticMeshData>    meshes;
+    std::vector<asset::StaticVertexData>  verts;
+    std::vector<uint32_t>                 indices;
+
+    auto path = dir / ("bench-" + std::to_string(files.size()) + ".mesh");
+
+    files.emplace_back();
+
+    for (uint32_t m = first; m < std::min(count, first + perFile); m++) {
+      asset::StaticMeshData data;
+
+      data.id            = ID("bench:mesh:" + std::to_string(m));
+      data.vertexOffset  = verts.size();
+      data.indexOffset   = indices.size();
+
+      if (!seen.insert(data.id).second) {
+	std::cerr << "Mesh " << m << "'s ID collides with another's" << std::endl;
+	std::exit(-1);
+      }
+
+      gridMesh(side, 0.01f * m, &verts, &indices);
+
+      data.vertexCount  = verts.size() - data.vertexOffset;
+      data.indexCount   = indices.size() - data.indexOffset;
+      data.bounds       = { { 0.0f, -0.1f, 0.0f }, { 1.0f, 0.1f, 1.0f } };
+
+      meshes.push_back(data);
+      files.back().push_back(data.id);
+    }
+
+    asset::writeStaticMeshFile(path.c_str(),
+			       meshes.data(), meshes.size(),
+			       verts.data(), verts.size(),
+			       indices.data(), indices.size(),
+			       nullptr, 0, nullptr, 0,
+			       format, level);
+
+    for (uint32_t m = first; m < std::min(count, first + perFile); m++) {
+      library->addMeshRef("bench:mesh:" + std::to_string(m), path.string());
+    }
+  }
+
+  library->write((dir / "bench.assets").string());
+
+  return files;
+}
+
+// Ask the kernel to forget its cached pages of every file in `dir`. Dropping
+// the whole page cache takes root; this doesn't, but only works on pages that
+// are clean, hence the fdatasync. Returns false if any file couldn't be
+// dropped.
+static bool dropCache(std::filesystem::path const &dir) {
+  bool dropped = true;
+
+  for (auto const &entry : std::filesystem::directory_iterator(dir)) {
+    int fd = open(entry.path().c_str(), O_RDONLY);
+
+    if (fd < 0) {
+      dropped = false;
+      continue;
+    }
+
+    fdatasync(fd);
+
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) dropped = false;
+
+    close(fd);
+  }
+
+  return dropped;
+}
+
+// `bytes` of 0 leaves out the MB/s.
+static void report(char const  *what,
+		   char const  *cache,
+		   double      seconds,
+		   double      bytes,
+		   double      count,
+		   char const  *unit)
+{
+  std::cout << "    " << std::left << std::setw(28) << what << std::setw(6) << cache
+	    << std::right << std::fixed << std::setprecision(1)
+	    << std::setw(10) << seconds * 1e3 << " ms";
+
+  if (bytes > 0) {
+    std::cout << std::setw(10) << bytes / seconds / (1024 * 1024) << " MB/s";
+  } else {
+    std::cout << std::setw(15) << "";
+  }
+
+  std::cout << std::setw(12) << count / seconds << " " << unit << "/s" << std::endl;
+}
+
+// Read every mesh in `files` from the library `name` in `dir` the way `how`
+// says, starting from a fresh LibraryFileHandle:
+//
+//     "read"  - getMultiMeshData and readMultiMesh per file, into memory.
+//     "load"  - What gfx::Engine::_uploadMesh does short of the GPU, after
+//               prefetching everything: copy each mesh out of its mapped
+//               view, or readMesh it if it's compressed.
+//
+// The opening of the library and its mesh files is timed on its own.
+static void readLibrary(std::filesystem::path const                    &dir,
+			char const                                     *name,
+			std::vector<std::vector<asset::MeshID>> const  &files,
+			char const                                     *how,
+			char const                                     *cache)
+{
+  auto start = Clock::now();
+
+  auto library = asset::openLibraryFile((dir / name).string());
+
+  for (auto const &ids : files) library->meshFile(ids[0]);
+
+  double openSeconds = secondsSince(start);
+
+  std::vector<uint8_t>                verts, indices;
+  std::vector<asset::StaticMeshData>  data;
+
+  double  bytes   = 0;
+  size_t  meshes  = 0;
+
+  start = Clock::now();
+
+  if (!strcmp(how, "load")) {
+    for (auto const &ids : files) library->prefetchMultiMesh(ids.data(), ids.size());
+  }
+
+  for (auto ids : files) {
+    data.resize(ids.size());
+
+    if (!library->getMultiMeshData(ids.data(), data.data(), ids.size())) {
+      std::cerr << "Lost a mesh from the synthetic library" << std::endl;
+      std::exit(-1);
+    }
+
+    size_t vertBytes = 0, indexBytes = 0;
+
+    for (auto const &mesh : data) {
+      vertBytes   += mesh.vertexCount * asset::vertexSize(mesh.vertexFormat);
+      indexBytes  += mesh.indexCount * asset::indexSize(mesh.indexType);
+    }
+
+    verts.resize(vertBytes);
+    indices.resize(indexBytes);
+
+    bool ok = true;
+
+    if (!strcmp(how, "read")) {
+      ok = library->readMultiMesh(ids.data(), ids.size(), verts.data(), indices.data());
+    } else {
+      uint8_t *v = verts.data(), *i = indices.data();
+
+      for (auto id : ids) {
+	auto vertSpan   = library->meshVertices(id);
+	auto indexSpan  = library->meshIndices(id);
+
+	if (!vertSpan.empty() && !indexSpan.empty()) {
+	  memcpy(v, vertSpan.data, vertSpan.bytes());
+	  memcpy(i, indexSpan.data, indexSpan.bytes());
+	} else {
+	  ok = ok && library->readMesh(id, v, i);
+	}
+
+	auto mesh = library->getMeshData(id);
+
+	v += mesh->vertexCount * asset::vertexSize(mesh->vertexFormat);
+	i += mesh->indexCount * asset::indexSize(mesh->indexType);
+      }
+    }
+
+    if (!ok) {
+      std::cerr << "Failed to read the synthetic library" << std::endl;
+      std::exit(-1);
+    }
+
+    bytes   += vertBytes + indexBytes;
+    meshes  += ids.size();
+  }
+
+  double readSeconds = secondsSince(start);
+
+  std::string openWhat = std::string("open ") + name + " (" + how + ")";
+  std::string readWhat = std::string(how) + " " + name;
+
+  report(openWhat.c_str(), cache, openSeconds, 0, files.size(), "files");
+  report(readWhat.c_str(), cache, readSeconds, bytes, meshes, "meshes");
+}
+
+// A glTF holding one `side` x `side` grid, with its buffer in a .bin beside
+// it, laid out the way convert-gltf wants: one mesh, one primitive, and the
+// four attributes it reads -- TANGENT as the three components it reads, too.
+// Returns the size of the buffer.
+static size_t writeGLTF(std::filesystem::path const &path, uint32_t side) {
+  std::vector<asset::StaticVertexData>  verts;
+  std::vector<uint32_t>                 indices;
+
+  gridMesh(side, 0.0f, &verts, &indices);
+
+  size_t n = verts.size();
+
+  std::vector<float> positions, normals, uvs, tangents;
+
+  for (auto const &vert : verts) {
+    positions.insert(positions.end(), { vert.position.x, vert.position.y, vert.position.z });
+    normals.insert(normals.end(), { vert.normal.x, vert.normal.y, vert.normal.z });
+    uvs.insert(uvs.end(), { vert.uv.x, vert.uv.y });
+    tangents.insert(tangents.end(), { vert.tangent.x, vert.tangent.y, vert.tangent.z });
+  }
+
+  auto binPath = path;
+  binPath.replace_extension(".bin");
+
+  std::ofstream bin(binPath, std::ios::binary);
+
+  size_t offsets[5], sizes[5];
+  size_t offset = 0;
+
+  auto put = [&](int view, void const *data, size_t size) {
+    offsets[view] = offset;
+    sizes[view]   = size;
+    bin.write((char const *)data, size);
+    offset += size;
+  };
+
+  put(0, positions.data(), positions.size() * sizeof(float));
+  put(1, normals.data(), normals.size() * sizeof(float));
+  put(2, uvs.data(), uvs.size() * sizeof(float));
+  put(3, tangents.data(), tangents.size() * sizeof(float));
+  put(4, indices.data(), indices.size() * sizeof(uint32_t));
+
+  std::ofstream gltf(path);
+
+  gltf << "{\"asset\":{\"version\":\"2.0\"},"
+       << "\"buffers\":[{\"uri\":\"" << binPath.filename().string() << "\",\"byteLength\":" << offset << "}],"
+       << "\"bufferViews\":[";
+
+  for (int i = 0; i < 5; i++) {
+    gltf << (i ? "," : "") << "{\"buffer\":0,\"byteOffset\":" << offsets[i]
+	 << ",\"byteLength\":" << sizes[i] << "}";
+  }
+
+  gltf << "],\"accessors\":["
+       << "{\"bufferView\":0,\"componentType\":5126,\"count\":" << n << ",\"type\":\"VEC3\","
+       << "\"min\":[0,-0.1,0],\"max\":[1,0.1,1]},"
+       << "{\"bufferView\":1,\"componentType\":5126,\"count\":" << n << ",\"type\":\"VEC3\"},"
+       << "{\"bufferView\":2,\"componentType\":5126,\"count\":" << n << ",\"type\":\"VEC2\"},"
+       << "{\"bufferView\":3,\"componentType\":5126,\"count\":" << n << ",\"type\":\"VEC3\"},"
+       << "{\"bufferView\":4,\"componentType\":5125,\"count\":" << indices.size() << ",\"type\":\"SCALAR\"}],"
+       << "\"meshes\":[{\"name\":\"bench:mesh:grid\",\"primitives\":[{"
+       << "\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TEXCOORD_0\":2,\"TANGENT\":3},"
+       << "\"indices\":4}]}]}\n";
+
+  return offset;
+}
+
+// Time convert-gltf on a `side` x `side` grid with each set of flags worth
+// comparing.
+static void benchConvert(std::filesystem::path const &dir, char const *convert, uint32_t side) {
+  auto gltfPath = dir / "grid.gltf";
+
+  size_t bytes = writeGLTF(gltfPath, side);
+
+  std::cout << std::endl << "convert-gltf on a " << side << "x" << side << " grid, "
+	    << bytes / (1024 * 1024) << " MB of buffers" << std::endl;
+
+  static char const *flagSets[] = {
+    "",
+    "-f packed",
+    "-l 3",
+    "-L 4",
+    "-m 64",
+  };
+
+  for (auto flags : flagSets) {
+    auto meshPath  = dir / "grid.mesh";
+    auto libPath   = dir / "grid.assets";
+
+    std::filesystem::remove(libPath);
+
+    std::string command = std::string(convert) + " " + flags + " "
+      + gltfPath.string() + " " + meshPath.string() + " " + libPath.string() + " > /dev/null";
+
+    auto start = Clock::now();
+
+    if (system(command.c_str()) != 0) {
+      std::cerr << "Failed to run '" << command << "'" << std::endl;
+      std::exit(-1);
+    }
+
+    double seconds = secondsSince(start);
+
+    std::string what = std::string("convert ") + (flags[0] ? flags : "(defaults)");
+
+    std::cout << "    " << std::left << std::setw(34) << what
+	      << std::right << std::fixed << std::setprecision(1)
+	      << std::setw(10) << seconds * 1e3 << " ms"
+	      << std::setw(10) << bytes / seconds / (1024 * 1024) << " MB/s"
+	      << std::setw(12) << std::setprecision(3) << (double)side * side / seconds / 1e6
+	      << " Mverts/s" << std::endl;
+  }
+}
+
+int main(int argc, char const *argv[]) {
+  uint32_t             count    = 4096;
+  uint32_t             vertices = 1024;
+  uint32_t             perFile  = 64;
+  asset::VertexFormat  format   = asset::VertexFormat::Full;
+  int                  level    = 0;
+  uint32_t             gridSide = 512;
+  char const           *convert = "bin/convert-gltf";
+
+  int arg = 1;
+
+  for (; arg < argc && argv[arg][0] == '-'; arg += 2) {
+    if (arg + 1 >= argc) usage(argv[0]);
+
+    char const *value = argv[arg + 1];
+
+    if (!strcmp(argv[arg], "-n")) {
+      count = atoi(value);
+    } else if (!strcmp(argv[arg], "-v")) {
+      vertices = atoi(value);
+    } else if (!strcmp(argv[arg], "-p")) {
+      perFile = atoi(value);
+    } else if (!strcmp(argv[arg], "-f")) {
+      if (!strcmp(value, "full")) {
+	format = asset::VertexFormat::Full;
+      } else if (!strcmp(value, "packed")) {
+	format = asset::VertexFormat::Packed;
+      } else {
+	usage(argv[0]);
+      }
+    } else if (!strcmp(argv[arg], "-l")) {
+      level = atoi(value);
+    } else if (!strcmp(argv[arg], "-g")) {
+      gridSide = atoi(value);
+    } else if (!strcmp(argv[arg], "-c")) {
+      convert = strcmp(value, "-") ? value : nullptr;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (argc - arg != 1 || count == 0 || perFile == 0 || gridSide < 2) usage(argv[0]);
+
+  std::filesystem::path dir = argv[arg];
+
+  std::filesystem::create_directories(dir);
+
+  // Keeps every mesh on 16-bit indices, like a meshlet would.
+  uint32_t side = std::clamp((uint32_t)std::lround(std::sqrt((double)vertices)), 2u, 256u);
+
+  auto start = Clock::now();
+
+  auto files = writeLibrary(dir, count, side, perFile, format, level);
+
+  std::cout << count << " meshes of " << side * side << " vertices in " << files.size()
+	    << " files, written in " << std::fixed << std::setprecision(1)
+	    << secondsSince(start) * 1e3 << " ms" << std::endl;
+
+  asset::openLibraryFile((dir / "bench.assets").string())
+    ->writeArchive((dir / "bench.archive").string());
+
+  for (char const *name : { "bench.assets", "bench.archive" }) {
+    for (char const *how : { "read", "load" }) {
+      if (!dropCache(dir)) {
+	std::cerr << "    (couldn't drop every file from the page cache, cold numbers are optimistic)"
+		  << std::endl;
+      }
+
+      readLibrary(dir, name, files, how, "cold");
+      readLibrary(dir, name, files, how, "warm");
+    }
+  }
+
+  if (convert) benchConvert(dir, convert, gridSide);
+
+  return 0;
+}
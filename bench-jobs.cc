@@ -0,0 +1,129 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+// Measures what jobs::System costs per job, as opposed to per unit of real
+// work: every job here does next to nothing, so the times are all overhead.
+//
+//     bench-jobs [workers] [jobs]
+
+#include "jobs.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+using Clock = std::chrono::steady_clock;
+
+// Run `fn` `reps` times and report the best, in nanoseconds per `perRep`.
+template <typename F>
+static void
+report(char const *what, size_t perRep, F &&fn) {
+  static const int reps = 5;
+
+  double best = 1e300;
+
+  for (int r = 0; r < reps; r++) {
+    auto start = Clock::now();
+    fn();
+    auto end   = Clock::now();
+
+    best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count());
+  }
+
+  std::cout << "    " << std::left << std::setw(32) << what
+	    << std::right << std::fixed << std::setprecision(1) << std::setw(10)
+	    << best / perRep << " ns/job" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  size_t workers = argc > 1
+    ? std::strtoul(argv[1], nullptr, 10)
+    : std::max(1u, std::thread::hardware_concurrency()) - 1;
+
+  size_t count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100000;
+
+  jobs::System system;
+  system.init(workers);
+
+  std::cout << "jobs::System with " << system.threadCount() << " threads, "
+	    << count << " jobs per run" << std::endl;
+
+  std::atomic<size_t> sink { 0 };
+
+  // Everything from one thread, the way a frame's worth of independent work
+  // gets spawned; the workers have to steal all of it.
+  report("submit + wait, independent", count, [&]() {
+    std::vector<jobs::Handle> handles;
+    handles.reserve(count);
+
+    for (size_t i = 0; i < count; i++) {
+      handles.push_back(system.submit([&]() { sink.fetch_add(1, std::memory_order_relaxed); }));
+    }
+
+    for (auto const &handle : handles) system.wait(handle);
+  });
+
+  // Each job depends on the last, so nothing runs in parallel and this is the
+  // latency of handing a finished job's continuation to a thread.
+  report("dependency chain", count, [&]() {
+    jobs::Handle last;
+
+    for (size_t i = 0; i < count; i++) {
+      last = system.submit([&]() { sink.fetch_add(1, std::memory_order_relaxed); }, { last });
+    }
+
+    system.wait(last);
+  });
+
+  // Jobs that spawn jobs: a binary tree of depth log2(count), as recursive
+  // work splitting would build it.
+  std::function<void (size_t)> split = [&](size_t n) {
+    if (n <= 1) {
+      sink.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    jobs::Handle left = system.submit([&, n]() { split(n / 2); });
+
+    split(n - n / 2);
+    system.wait(left);
+  };
+
+  report("recursive split", count, [&]() { split(count); });
+
+  report("parallelFor, per item", count, [&]() {
+    system.parallelFor(count, [&](size_t, size_t) {
+      sink.fetch_add(1, std::memory_order_relaxed);
+    });
+  });
+
+  system.cleanup();
+
+  return 0;
+}
@@ -0,0 +1,344 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+// Renders a generated scene headless for a fixed number of frames, and writes
+// what it cost as JSON, for comparing against a baseline:
+//
+//     bench [-n <instances>] [-f <frames>] [-m <mesh>[:<weight>],...] ...
+//
+// The scene is `-n` instances of the meshes given with `-m`, picked at random
+// in proportion to their weights -- each mesh brings its own textures, so the
+// weights set the material mix. They're scattered in front of the camera at
+// distances between `-d near:far`, which sets the mix of levels of detail,
+// with a fraction `-c` of them behind it for culling to throw away.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+#include <glm/gtx/transform.hpp>
+
+#include "gfx.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+  uint32_t     instances     { 4096 };
+  uint32_t     frames        { 600 };
+  uint32_t     warmup        { 60 };
+  float        near          { 2.0f };
+  float        far           { 60.0f };
+  float        culled        { 0.25f };
+  uint32_t     seed          { 1 };
+  char const   *output       { "bench.json" };
+  char const   *trace        { nullptr };
+
+  std::vector<std::pair<std::string, float>>  meshes;
+};
+
+static void usage(char const *argv0) {
+  char const *strippedName = strrchr(argv0, '/');
+
+  strippedName = strippedName ? strippedName + 1 : argv0;
+
+  fprintf(stderr,
+	  "\n"
+	  "    usage: %s [options]\n"
+	  "\n"
+	  "    -n <instances>       instances in the scene (default 4096)\n"
+	  "    -f <frames>          frames to measure (default 600)\n"
+	  "    -w <frames>          frames to draw first, once the scene is loaded (default 60)\n"
+	  "    -m <mesh>[:<w>],...  meshes from the library, and how often each is picked\n"
+	  "                         (default monkey,fancy-cube)\n"
+	  "    -d <near>:<far>      range of distances from the camera (default 2:60)\n"
+	  "    -c <fraction>        fraction of instances behind the camera (default 0.25)\n"
+	  "    -s <seed>            seed for placing instances (default 1)\n"
+	  "    -l <library>         library to load meshes from (default .data/library.assets)\n"
+	  "    -r <width>x<height>  resolution (default 1920x1080)\n"
+	  "    -F <frames>          frames in flight, 1 to 4 (default 2)\n"
+	  "    -o <file>            write results as JSON here (default bench.json)\n"
+	  "    -t <file>            write a Chrome trace of the last frames here\n"
+	  "\n",
+	  strippedName);
+
+  std::exit(-1);
+}
+
+// Parse "name[:weight],..." into `meshes`.
+static void parseMeshes(char const *arg, std::vector<std::pair<std::string, float>> *meshes) {
+  std::string list = arg;
+
+  meshes->clear();
+
+  for (size_t start = 0; start <= list.size();) {
+    size_t end = std::min(list.find(',', start), list.size());
+
+    std::string entry = list.substr(start, end - start);
+    size_t      colon = entry.find(':');
+
+    if (!entry.empty()) {
+      float weight = colon == std::string::npos ? 1.0f : strtof(entry.c_str() + colon + 1, nullptr);
+
+      meshes->emplace_back(entry.substr(0, colon), weight);
+    }
+
+    start = end + 1;
+  }
+}
+
+// Everything in front of the camera is spread over a cone narrower than the
+// field of view, so only the instances put behind it are frustum culled.
+static void
+generateScene(gfx::Engine                       *engine,
+	      BenchOptions const                &options,
+	      std::vector<asset::MeshID> const  &ids)
+{
+  std::mt19937 rng(options.seed);
+
+  std::vector<float> weights;
+  for (auto const &mesh : options.meshes) weights.push_back(mesh.second);
+
+  std::discrete_distribution<size_t>     pickMesh(weights.begin(), weights.end());
+  std::uniform_real_distribution<float>  unit(0.0f, 1.0f);
+
+  for (uint32_t i = 0; i < options.instances; i++) {
+    float distance = options.near + (options.far - options.near) * unit(rng);
+    float yaw      = glm::radians(-30.0f + 60.0f * unit(rng));
+    float pitch    = glm::radians(-15.0f + 30.0f * unit(rng));
+
+    if (unit(rng) < options.culled) yaw += glm::radians(180.0f);
+
+    // The camera looks down -z.
+    glm::vec3 position = distance * glm::vec3(std::sin(yaw) * std::cos(pitch),
+					      std::sin(pitch),
+					      -std::cos(yaw) * std::cos(pitch));
+
+    glm::mat4 model = glm::rotate(glm::translate(glm::mat4 { 1.0f }, position),
+				  glm::radians(360.0f * unit(rng)),
+				  glm::vec3(0, 1, 0));
+
+    engine->createInstance(ids[pickMesh(rng)], model);
+  }
+}
+
+// Nearest-rank, as profile::Profiler does it.
+static void writeTimes(std::ostream &out, std::vector<double> times) {
+  std::sort(times.begin(), times.end());
+
+  double sum = 0.0;
+  for (double t : times) sum += t;
+
+  size_t n = times.size();
+
+  out << "{\"mean\":" << (n ? sum / n : 0.0)
+      << ",\"p50\":" << (n ? times[(n - 1) * 50 / 100] : 0.0)
+      << ",\"p99\":" << (n ? times[(n - 1) * 99 / 100] : 0.0)
+      << ",\"max\":" << (n ? times.back() : 0.0) << "}";
+}
+
+int main(int argc, char const *argv[]) {
+  BenchOptions        bench;
+  gfx::EngineOptions  options;
+
+  options.headless = true;
+
+  for (int arg = 1; arg < argc; arg += 2) {
+    if (argv[arg][0] != '-' || arg + 1 >= argc) usage(argv[0]);
+
+    char const *value = argv[arg + 1];
+
+    if (!strcmp(argv[arg], "-n")) {
+      bench.instances = atoi(value);
+    } else if (!strcmp(argv[arg], "-f")) {
+      bench.frames = atoi(value);
+    } else if (!strcmp(argv[arg], "-w")) {
+      bench.warmup = atoi(value);
+    } else if (!strcmp(argv[arg], "-m")) {
+      parseMeshes(value, &bench.meshes);
+    } else if (!strcmp(argv[arg], "-d")) {
+      if (sscanf(value, "%f:%f", &bench.near, &bench.far) != 2) usage(argv[0]);
+    } else if (!strcmp(argv[arg], "-c")) {
+      bench.culled = strtof(value, nullptr);
+    } else if (!strcmp(argv[arg], "-s")) {
+      bench.seed = atoi(value);
+    } else if (!strcmp(argv[arg], "-l")) {
+      options.library = value;
+    } else if (!strcmp(argv[arg], "-r")) {
+      if (sscanf(value, "%ux%u", &options.headlessExtent.width, &options.headlessExtent.height) != 2) {
+	usage(argv[0]);
+      }
+    } else if (!strcmp(argv[arg], "-F")) {
+      options.framesInFlight = atoi(value);
+    } else if (!strcmp(argv[arg], "-o")) {
+      bench.output = value;
+    } else if (!strcmp(argv[arg], "-t")) {
+      bench.trace = value;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (bench.meshes.empty()) bench.meshes = { { "monkey", 1.0f }, { "fancy-cube", 1.0f } };
+
+  for (auto const &mesh : bench.meshes) {
+    if (!(mesh.second > 0.0f)) {
+      std::cerr << "Mesh '" << mesh.first << "' needs a positive weight" << std::endl;
+      std::exit(-1);
+    }
+
+    options.meshes.push_back(ID("asset:mesh:" + mesh.first));
+  }
+
+  if (bench.instances == 0 || bench.frames == 0 || !(bench.near > 0.0f) || bench.far < bench.near) {
+    usage(argv[0]);
+  }
+
+  gfx::Engine engine { { }, options };
+
+  engine.init();
+
+  engine.setCamera(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+  generateScene(&engine, bench, options.meshes);
+
+  // Streaming is part of what's measured, but as its own number.
+  auto loadStart = Clock::now();
+
+  while (!engine.sceneResident()) {
+    if (engine.sceneFailed()) {
+      std::cerr << "Failed to stream the scene's meshes" << std::endl;
+      std::exit(-1);
+    }
+
+    engine.draw();
+  }
+
+  double loadMs = std::chrono::duration<double, std::milli>(Clock::now() - loadStart).count();
+
+  for (uint32_t i = 0; i < bench.warmup; i++) engine.draw();
+
+  // From the start of one draw() to the next, so this covers waiting on the
+  // GPU as well as recording.
+  std::vector<double> frameMs;
+  frameMs.reserve(bench.frames);
+
+  auto last = Clock::now();
+
+  for (uint32_t i = 0; i < bench.frames; i++) {
+    engine.draw();
+
+    auto now = Clock::now();
+    frameMs.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+    last = now;
+  }
+
+  gfx::CullStats    cull    = engine.cullStats();
+  gfx::MemoryStats  memory  = engine.memoryStats();
+
+  // Not stdout, which the engine logs to.
+  std::ofstream out(bench.output);
+
+  if (!out.is_open()) {
+    std::cerr << "Failed to open '" << bench.output << "' for writing" << std::endl;
+    std::exit(-1);
+  }
+
+  out << "{\n";
+  out << "  \"scene\": {\"instances\":" << bench.instances
+      << ",\"near\":" << bench.near << ",\"far\":" << bench.far
+      << ",\"culled\":" << bench.culled << ",\"seed\":" << bench.seed
+      << ",\"width\":" << options.headlessExtent.width
+      << ",\"height\":" << options.headlessExtent.height
+      << ",\"framesInFlight\":" << options.framesInFlight << ",\"meshes\":{";
+
+  for (size_t i = 0; i < bench.meshes.size(); i++) {
+    out << (i ? "," : "") << "\"" << bench.meshes[i].first << "\":" << bench.meshes[i].second;
+  }
+
+  out << "}},\n";
+  out << "  \"frames\": " << bench.frames << ",\n";
+  out << "  \"loadMs\": " << loadMs << ",\n";
+  out << "  \"frameMs\": ";
+  writeTimes(out, frameMs);
+  out << ",\n";
+
+  // Over the last profile::Profiler::HISTORY frames.
+  out << "  \"zones\": {";
+
+  bool first = true;
+
+  for (auto const &[name, stats] : engine.profiler().allStats()) {
+    out << (first ? "\n" : ",\n") << "    \"" << name << "\": {\"mean\":" << stats.mean
+	<< ",\"p50\":" << stats.p50 << ",\"p99\":" << stats.p99 << ",\"max\":" << stats.max << "}";
+    first = false;
+  }
+
+  out << "\n  },\n";
+  out << "  \"draws\": {\"instances\":" << cull.instances
+      << ",\"frustumCulled\":" << cull.frustumCulled
+      << ",\"occlusionCulled\":" << cull.occlusionCulled
+      << ",\"drawnEarly\":" << cull.drawnEarly
+      << ",\"drawnLate\":" << cull.drawnLate << "},\n";
+  out << "  \"memory\": {\"deviceAllocated\":" << memory.deviceAllocated
+      << ",\"deviceBlocks\":" << memory.deviceBlocks
+      << ",\"hostAllocated\":" << memory.hostAllocated
+      << ",\"hostBlocks\":" << memory.hostBlocks
+      << ",\"budgetExtension\":" << (memory.budgetExtension ? "true" : "false")
+      << ",\"heaps\":[";
+
+  for (size_t h = 0; h < memory.heaps.size(); h++) {
+    auto const &heap = memory.heaps[h];
+
+    out << (h ? "," : "") << "{\"size\":" << heap.size << ",\"usage\":" << heap.usage
+	<< ",\"budget\":" << heap.budget << ",\"allocated\":" << heap.allocated
+	<< ",\"blocks\":" << heap.blocks
+	<< ",\"deviceLocal\":" << (heap.deviceLocal ? "true" : "false") << "}";
+  }
+
+  out << "],\"categories\":{";
+
+  for (uint32_t c = 0; c < gfx::MemoryCategory::MAX; c++) {
+    out << (c ? "," : "") << "\"" << gfx::memoryCategoryName(c) << "\":{\"allocations\":"
+	<< memory.allocations[c] << ",\"bytes\":" << memory.bytes[c] << "}";
+  }
+
+  out << "}}\n";
+  out << "}\n";
+
+  if (bench.trace && !engine.profiler().writeChromeTrace(bench.trace)) {
+    std::cerr << "Failed to write trace to " << bench.trace << std::endl;
+  }
+
+  engine.cleanup();
+
+  return 0;
+}
@@ -29,12 +29,23 @@
 #include <cstdio>
 #include <cstring>
 
+#include <algorithm>
 #include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <zdict.h>
 
 #define CGLTF_IMPLEMENTATION
 #include "cgltf.h"
 
 #include "asset.h"
+#include "jobs.h"
+#include "meshopt.h"
 #include "util.h"
 
 #define FAILURE(FMT, ...) do {			\
@@ -47,12 +58,27 @@
   } while (0)					\
   // End of multi-line macro
 
+// The ID convert-texture gives a texture image: its name if it has one, or
+// else the stem of its URI. NULL_ASSET_ID if there's no texture at all.
+static asset::TextureID textureID(cgltf_texture_view const &view) {
+  if (!view.texture || !view.texture->image) return asset::NULL_ASSET_ID;
+
+  cgltf_image const *image = view.texture->image;
+
+  if (image->name && image->name[0]) return ID(std::string(image->name));
+  if (image->uri) return ID(std::filesystem::path(image->uri).stem().string());
+
+  return asset::NULL_ASSET_ID;
+}
+
 // This is a specialized parser designed to convert a single-mesh glTF as
-// exported by blender.
+// exported by blender. The mesh's name, which its ID is the ID of, goes in
+// `name` if that isn't null.
 static void staticMeshFromGLTF(asset::StaticMeshData    *meshData,
 			       asset::StaticVertexData  **vertexData,
-			       uint16_t                 **indexData,
-			       char const               *gltfPath)
+			       uint32_t                 **indexData,
+			       char const               *gltfPath,
+			       std::string              *name)
 {
   cgltf_options options { };
   cgltf_data *data { NULL };
@@ -127,27 +153,39 @@ static void staticMeshFromGLTF(asset::StaticMeshData    *meshData,
 
   asset::StaticVertexData  *vertsOut =
     (asset::StaticVertexData *)malloc(vertexCount * sizeof(asset::StaticVertexData));
-  uint16_t *indicesOut  =
-    (uint16_t *)malloc(indexCount * sizeof(uint16_t));
+  uint32_t *indicesOut  =
+    (uint32_t *)malloc(indexCount * sizeof(uint32_t));
 
   if (cgltf_result_success != cgltf_load_buffers(&options, data, gltfPath)) {
     FAILURE("Failed to load buffers for glTF file: %s",
 	    gltfPath);
   }
 
+  if (!mesh->name || !mesh->name[0]) FAILURE("The mesh in %s has no name", gltfPath);
+
+  if (name) *name = mesh->name;
+
   meshData->id           = ID(mesh->name);
   meshData->indexOffset  = 0;
   meshData->vertexOffset = 0;
   meshData->indexCount   = indexCount;
   meshData->vertexCount  = vertexCount;
 
-  for (size_t i = 0; i < indexCount; i++) {
-    size_t index = cgltf_accessor_read_index(primitive->indices, i);
-    if (index > 0xFFFF) {
-      FAILURE("This mesh has %zu as an index, which won't fit in a uint16_t!", index);
+  if (cgltf_material const *material = primitive->material) {
+    if (material->has_pbr_metallic_roughness) {
+      auto const &pbr = material->pbr_metallic_roughness;
+
+      meshData->color      = textureID(pbr.base_color_texture);
+      meshData->roughness  = textureID(pbr.metallic_roughness_texture);
     }
 
-    indicesOut[i] = (uint16_t)index;
+    meshData->normal     = textureID(material->normal_texture);
+    meshData->occlusion  = textureID(material->occlusion_texture);
+    meshData->emission   = textureID(material->emissive_texture);
+  }
+
+  for (size_t i = 0; i < indexCount; i++) {
+    indicesOut[i] = (uint32_t)cgltf_accessor_read_index(primitive->indices, i);
   }
 
   if (pos_attr->data->is_sparse) {
@@ -181,46 +219,686 @@ static void staticMeshFromGLTF(asset::StaticMeshData    *meshData,
   cgltf_free(data);
 }
 
-int main(int argc, char const *argv[]) {
-  if (argc != 4) {
-    char const *strippedName = strrchr(argv[0], '/');
+// Run the meshopt passes over a mesh fresh out of staticMeshFromGLTF, and
+// report how its vertex cache behaviour changed.
+static void optimizeMesh(asset::StaticMeshData    *meshData,
+			 asset::StaticVertexData  *vertexData,
+			 uint32_t                 *indexData,
+			 char const               *gltfPath)
+{
+  meshopt::CacheStats before, after;
+
+  uint32_t vertexCount = meshData->vertexCount;
+
+  meshopt::optimizeMesh(meshData, vertexData, indexData, &before, &after);
+
+  printf("    [OPTIMIZE]   %s: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, %u -> %u vertices\n",
+	 gltfPath,
+	 before.acmr, after.acmr,
+	 before.atvr, after.atvr,
+	 vertexCount, meshData->vertexCount);
+}
+
+static const int DEFAULT_LOD_LEVELS = 4;
+
+// Build up to `maxLevels` levels of detail from a mesh fresh out of
+// optimizeMesh, each aiming for half the triangles of the one before. We stop
+// early once simplification stops paying for a level's indices.
+//
+// Level 0 is `indices` as they are. Every level's indices go back to back into
+// `lodIndices`, and the coarser ones are re-optimized for the vertex cache.
+//
+// The report goes out in one printf, so batch conversions on several threads
+// don't interleave their lines.
+static std::vector<asset::MeshLOD>
+buildLODs(asset::StaticMeshData const    &meshData,
+	  asset::StaticVertexData const  *vertexData,
+	  uint32_t const                 *indexData,
+	  int                            maxLevels,
+	  std::vector<uint32_t>          *lodIndices,
+	  char const                     *gltfPath)
+{
+  std::vector<asset::MeshLOD> lods;
+
+  lodIndices->assign(indexData, indexData + meshData.indexCount);
+
+  lods.push_back({
+      .error          = 0.0f,
+      .indexOffset    = 0,
+      .indexCount     = meshData.indexCount,
+      .meshletOffset  = 0,
+      .meshletCount   = 0,
+    });
+
+  std::string report = std::to_string(meshData.indexCount / 3);
+
+  while ((int)lods.size() < maxLevels) {
+    uint32_t previous = lods.back().indexCount;
+    size_t   target   = previous / 6 * 3;
+    float    error;
+
+    // Always simplifying the full-detail mesh keeps each level's error
+    // measured against it, rather than against the level before.
+    auto level = meshopt::simplify(vertexData, meshData.vertexCount,
+				   indexData, meshData.indexCount,
+				   target, &error);
+
+    if (level.empty() || level.size() > previous * 4 / 5) break;
+
+    meshopt::optimizeVertexCache(level.data(), level.size(), meshData.vertexCount);
+
+    lods.push_back({
+	.error          = std::max(error, lods.back().error),
+	.indexOffset    = (uint32_t)lodIndices->size(),
+	.indexCount     = (uint32_t)level.size(),
+	.meshletOffset  = 0,
+	.meshletCount   = 0,
+      });
+
+    lodIndices->insert(lodIndices->end(), level.begin(), level.end());
+
+    report += " -> " + std::to_string(level.size() / 3);
+  }
+
+  printf("    [LOD]        %s: %s triangles, %zu levels\n", gltfPath, report.c_str(), lods.size());
+
+  return lods;
+}
+
+static void usage(char const *argv0) {
+  char const *strippedName = strrchr(argv0, '/');
+
+  strippedName = strippedName ? strippedName + 1 : argv0;
+
+  fprintf(stderr,
+	  "\n"
+	  "    usage: %s [-O <0|1>] [-L <levels>] [-m <max vertices>] [-f <format>] [-l <level>] [-d <dictionary>] <gltf filename> <output filename> <library filename>\n"
+	  "           %s [options] [-j <threads>] [-o <directory>] -b <library filename> <gltf filename or @manifest>...\n"
+	  "           %s --train-dictionary <dictionary> <gltf filename>...\n"
+	  "\n"
+	  "    -O <0|1>         run the vertex cache, overdraw and fetch optimizations (default 1)\n"
+	  "    -L <levels>      build up to this many levels of detail, 1 for none (default 4)\n"
+	  "    -m <vertices>    split the mesh into meshlets of at most this many vertices, 0 for none (default 0)\n"
+	  "    -f <format>      vertex format, 'full' or 'packed' (default full)\n"
+	  "    -l <level>       zstd compression level for mesh chunks, 0 to store them raw (default 3)\n"
+	  "    -d <dictionary>  compress with a dictionary, which is stored in the library\n"
+	  "\n"
+	  "    -b <library>     batch mode: convert every input into this library, skipping unchanged ones\n"
+	  "    -j <threads>     threads to convert on in batch mode (default: one per core)\n"
+	  "    -o <directory>   where batch mode writes <input stem>.mesh (default: beside each input)\n"
+	  "\n",
+	  strippedName,
+	  strippedName,
+	  strippedName);
+
+  std::exit(-1);
+}
+
+static std::vector<char> readWholeFile(char const *path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+  if (!file.is_open()) {
+    FAILURE("Failed to open file: %s", path);
+  }
+
+  std::vector<char> bytes((size_t)file.tellg());
+
+  file.seekg(0);
+  file.read(bytes.data(), bytes.size());
+
+  return bytes;
+}
+
+// Train a zstd dictionary on the meshes in `gltfPaths`, and write it to
+// `dictPath`. Each mesh's bytes are cut into samples about the size of a
+// small mesh, since small meshes are what a dictionary helps most.
+static void trainDictionary(char const *dictPath, char const **gltfPaths, int gltfCount) {
+  static const size_t SAMPLE_SIZE     = 16 * 1024;
+  static const size_t DICTIONARY_SIZE = 64 * 1024;
+
+  std::vector<char>    samples;
+  std::vector<size_t>  sampleSizes;
+
+  for (int i = 0; i < gltfCount; i++) {
+    asset::StaticMeshData   meshData;
+    asset::StaticVertexData *vertexData;
+    uint32_t                *indexData;
+
+    staticMeshFromGLTF(&meshData, &vertexData, &indexData, gltfPaths[i], nullptr);
+
+    // Train on what convert-gltf will actually write by default.
+    optimizeMesh(&meshData, vertexData, indexData, gltfPaths[i]);
+
+    std::vector<uint32_t> lodIndices;
 
-    fprintf(stderr,
-	    "\n"
-	    "    error: got %d arguments\n"
-	    "\n"
-	    "    usage: %s <gltf filename> <output filename> <library filename>\n"
-	    "\n",
-	    argc - 1,
-	    strippedName ? strippedName + 1 : argv[0]);
+    buildLODs(meshData, vertexData, indexData, DEFAULT_LOD_LEVELS, &lodIndices, gltfPaths[i]);
 
-    std::exit(-1);
+    size_t start = samples.size();
+
+    samples.insert(samples.end(),
+		   (char *)vertexData,
+		   (char *)(vertexData + meshData.vertexCount));
+    // writeStaticMeshFile narrows indices to 16 bits wherever they fit.
+    if (meshData.vertexCount <= 0x10000) {
+      std::vector<uint16_t> narrowed(lodIndices.begin(), lodIndices.end());
+
+      samples.insert(samples.end(),
+		     (char *)narrowed.data(),
+		     (char *)(narrowed.data() + narrowed.size()));
+    } else {
+      samples.insert(samples.end(),
+		     (char *)lodIndices.data(),
+		     (char *)(lodIndices.data() + lodIndices.size()));
+    }
+
+    for (size_t offset = start; offset < samples.size(); offset += SAMPLE_SIZE) {
+      sampleSizes.push_back(std::min(SAMPLE_SIZE, samples.size() - offset));
+    }
+
+    free(vertexData);
+    free(indexData);
   }
 
-  char const *gltfPath  = argv[1];
-  char const *meshPath  = argv[2];
-  char const *libPath   = argv[3];
+  std::vector<char> dictionary(DICTIONARY_SIZE);
+
+  size_t dictSize = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(),
+					  samples.data(),
+					  sampleSizes.data(), (unsigned)sampleSizes.size());
 
+  if (ZDICT_isError(dictSize)) {
+    FAILURE("Failed to train dictionary: %s", ZDICT_getErrorName(dictSize));
+  }
+
+  std::ofstream out(dictPath, std::ios::binary);
+
+  out.write(dictionary.data(), dictSize);
+}
+
+struct ConvertOptions {
+  int                  level            { 3 };
+  asset::VertexFormat  format           { asset::VertexFormat::Full };
+  bool                 optimize         { true };
+  size_t               meshletVertices  { 0 };
+  int                  lodLevels        { DEFAULT_LOD_LEVELS };
+};
+
+// Convert the mesh in `gltfPath`, and write it to `meshPath` -- compressed
+// with `dictionary`, if it isn't empty. Returns the mesh's name.
+//
+// Safe to call from several threads at once, for different meshPaths.
+static std::string convertMesh(ConvertOptions const  &options,
+			       char const            *gltfPath,
+			       char const            *meshPath,
+			       Span<char const>      dictionary)
+{
   asset::StaticMeshData   meshData;
   asset::StaticVertexData *vertexData;
-  uint16_t                *indexData;
+  uint32_t                *indexData;
+  std::string             name;
+
+  staticMeshFromGLTF(&meshData, &vertexData, &indexData, gltfPath, &name);
+
+  if (options.optimize) optimizeMesh(&meshData, vertexData, indexData, gltfPath);
+
+  std::vector<asset::StaticVertexData> vertices(vertexData, vertexData + meshData.vertexCount);
+  std::vector<uint32_t>                indices;
+  std::vector<asset::MeshLOD>          lods;
+
+  if (options.lodLevels > 1) {
+    lods = buildLODs(meshData, vertexData, indexData, options.lodLevels, &indices, gltfPath);
+  } else {
+    indices.assign(indexData, indexData + meshData.indexCount);
+  }
+
+  free(vertexData);
+  free(indexData);
+
+  // Just the one level, so there's nothing to choose between.
+  if (lods.size() == 1) lods.clear();
+
+  meshData.indexCount = indices.size();
+  meshData.lodOffset  = 0;
+  meshData.lodCount   = lods.size();
+
+  std::vector<asset::Meshlet> meshlets;
+
+  size_t meshletVertices = options.meshletVertices;
+
+  if (meshletVertices > 0) {
+    if (meshletVertices < 3) {
+      FAILURE("A meshlet needs room for at least 3 vertices, got %zu", meshletVertices);
+    }
 
-  staticMeshFromGLTF(&meshData, &vertexData, &indexData, gltfPath);
+    std::vector<asset::StaticVertexData> meshletVerts;
+    std::vector<uint32_t>                meshletIndices;
+
+    // Each level is split on its own, and its meshlets and their vertices
+    // follow the previous level's.
+    size_t levelCount = std::max(lods.size(), (size_t)1);
+
+    for (size_t l = 0; l < levelCount; l++) {
+      uint32_t  first = lods.empty() ? 0 : lods[l].indexOffset;
+      uint32_t  count = lods.empty() ? meshData.indexCount : lods[l].indexCount;
+
+      std::vector<asset::StaticVertexData> levelVerts;
+      std::vector<uint32_t>                levelIndices;
+
+      // A closed mesh has about two triangles per vertex, which is where
+      // MESHLET_MAX_TRIANGLES comes from for 64 vertices.
+      auto levelMeshlets = meshopt::buildMeshlets(vertices.data(), vertices.size(),
+						  indices.data() + first, count,
+						  meshletVertices, 2 * meshletVertices - 4,
+						  &levelVerts, &levelIndices);
+
+      if (!lods.empty()) {
+	lods[l].indexOffset    = meshletIndices.size();
+	lods[l].indexCount     = levelIndices.size();
+	lods[l].meshletOffset  = meshlets.size();
+	lods[l].meshletCount   = levelMeshlets.size();
+      }
+
+      for (auto &meshlet : levelMeshlets) {
+	meshlet.vertexOffset += meshletVerts.size();
+	meshlet.indexOffset  += meshletIndices.size();
+      }
+
+      meshlets.insert(meshlets.end(), levelMeshlets.begin(), levelMeshlets.end());
+      meshletVerts.insert(meshletVerts.end(), levelVerts.begin(), levelVerts.end());
+      meshletIndices.insert(meshletIndices.end(), levelIndices.begin(), levelIndices.end());
+    }
+
+    vertices = std::move(meshletVerts);
+    indices  = std::move(meshletIndices);
+
+    meshData.vertexCount   = vertices.size();
+    meshData.indexCount    = indices.size();
+    meshData.meshletOffset = 0;
+    meshData.meshletCount  = meshlets.size();
+
+    printf("    [MESHLETS]   %s: %zu meshlets, %u vertices\n",
+	   gltfPath, meshlets.size(), meshData.vertexCount);
+  }
 
   asset::writeStaticMeshFile(meshPath,
 			     &meshData, 1,
-			     vertexData, meshData.vertexCount,
-			     indexData, meshData.indexCount);
+			     vertices.data(), meshData.vertexCount,
+			     indices.data(), meshData.indexCount,
+			     meshlets.data(), meshlets.size(),
+			     lods.data(), lods.size(),
+			     options.format,
+			     options.level,
+			     dictionary);
+
+  return name;
+}
 
+// Open the library at `libPath`, creating it if it isn't there yet. If
+// `dictPath` is given its dictionary goes in `dictionary`, and becomes the
+// library's -- every mesh file in a library shares its one dictionary.
+static asset::LibraryFileHandle openLibrary(char const         *libPath,
+					    char const         *dictPath,
+					    std::vector<char>  *dictionary)
+{
   if (!std::filesystem::exists(std::filesystem::path(libPath))) {
     asset::emptyLibraryFileHandle()->write(libPath);
   }
 
   auto library = asset::openLibraryFile(libPath);
 
-  library->addMeshRef(meshData.id, meshPath);
+  dictionary->clear();
+
+  if (dictPath) {
+    *dictionary = readWholeFile(dictPath);
+
+    auto existing = library->dictionary();
+
+    if (existing.empty()) {
+      library->setDictionary(*dictionary);
+    } else if (existing.size != dictionary->size()
+	       || memcmp(existing.data, dictionary->data(), existing.size)) {
+      FAILURE("Library %s already has a different dictionary", libPath);
+    }
+  }
+
+  return library;
+}
+
+// Bump this whenever a change to convert-gltf changes what it writes, so that
+// batch mode doesn't skip inputs it converted the old way.
+static const uint64_t BUILD_CACHE_VERSION = 2;
+
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325;
+static const uint64_t FNV_PRIME        = 0x100000001b3;
+
+// 64-bit FNV-1a, continuing from `hash`.
+static uint64_t fnv1a(uint64_t hash, void const *data, size_t size) {
+  auto *bytes = (uint8_t const *)data;
+
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+template <typename T>
+static uint64_t fnv1a(uint64_t hash, T const &value) {
+  return fnv1a(hash, &value, sizeof(T));
+}
+
+// A hash of everything that goes into converting `gltfPath`: the file itself,
+// any buffers it keeps in files of their own, the dictionary, and the options.
+static uint64_t hashInput(ConvertOptions const  &options,
+			  Span<char const>      dictionary,
+			  char const            *gltfPath)
+{
+  uint64_t hash = fnv1a(FNV_OFFSET_BASIS, BUILD_CACHE_VERSION);
+
+  hash = fnv1a(hash, options.level);
+  hash = fnv1a(hash, options.format);
+  hash = fnv1a(hash, options.optimize);
+  hash = fnv1a(hash, (uint64_t)options.meshletVertices);
+  hash = fnv1a(hash, options.lodLevels);
+  hash = fnv1a(hash, (uint64_t)dictionary.size);
+  hash = fnv1a(hash, dictionary.data, dictionary.size);
+
+  auto bytes = readWholeFile(gltfPath);
+
+  hash = fnv1a(hash, bytes.data(), bytes.size());
+
+  cgltf_options  parseOptions { };
+  cgltf_data     *data { NULL };
+
+  if (cgltf_result_success != cgltf_parse(&parseOptions, bytes.data(), bytes.size(), &data)) {
+    FAILURE("Failed to parse glTF file: %s", gltfPath);
+  }
+
+  // A .glb's own buffer is in `bytes` already, as are data: URIs.
+  for (size_t i = 0; i < data->buffers_count; i++) {
+    char const *uri = data->buffers[i].uri;
+
+    if (!uri || !strncmp(uri, "data:", 5)) continue;
+
+    std::string decoded(uri);
+
+    cgltf_decode_uri(&decoded[0]);
+    decoded.resize(strlen(decoded.c_str()));
+
+    auto path = std::filesystem::path(gltfPath).parent_path() / decoded;
+
+    auto buffer = readWholeFile(path.string().c_str());
+
+    hash = fnv1a(hash, (uint64_t)buffer.size());
+    hash = fnv1a(hash, buffer.data(), buffer.size());
+  }
+
+  cgltf_free(data);
+
+  return hash;
+}
+
+// What batch mode remembers about an input, from one run to the next.
+struct BuildCacheEntry {
+  uint64_t     hash;
+  std::string  name;
+  std::string  meshPath;
+};
+
+// The build cache lives beside its library, as `<library filename>.cache`,
+// with one tab-separated line per input:
+//
+//     <hash, in hex> <mesh name> <mesh filename> <gltf filename>
+//
+// There's nothing in it that can't be rebuilt, so a line that doesn't parse
+// is just dropped.
+static std::unordered_map<std::string, BuildCacheEntry>
+readBuildCache(std::string const &path) {
+  std::unordered_map<std::string, BuildCacheEntry> cache;
+
+  std::ifstream file(path);
+  std::string   line;
+
+  while (std::getline(file, line)) {
+    size_t nameTab  = line.find('\t');
+    size_t meshTab  = line.find('\t', nameTab + 1);
+    size_t gltfTab  = line.find('\t', meshTab + 1);
+
+    if (nameTab == std::string::npos || meshTab == std::string::npos
+	|| gltfTab == std::string::npos) {
+      continue;
+    }
+
+    BuildCacheEntry entry;
+
+    entry.hash      = strtoull(line.c_str(), nullptr, 16);
+    entry.name      = line.substr(nameTab + 1, meshTab - nameTab - 1);
+    entry.meshPath  = line.substr(meshTab + 1, gltfTab - meshTab - 1);
+
+    cache[line.substr(gltfTab + 1)] = entry;
+  }
+
+  return cache;
+}
+
+static void writeBuildCache(std::string const                                       &path,
+			    std::unordered_map<std::string, BuildCacheEntry> const  &cache)
+{
+  std::ofstream file(path);
+
+  for (auto const &[gltfPath, entry] : cache) {
+    char hash[17];
+
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)entry.hash);
+
+    file << hash << '\t' << entry.name << '\t' << entry.meshPath << '\t' << gltfPath << '\n';
+  }
+
+  if (!file) FAILURE("Failed to write build cache: %s", path.c_str());
+}
+
+// Add `arg` to `gltfPaths`, or every path in it if it's an @manifest -- a
+// file with one glTF filename per line, where blank lines and lines starting
+// with '#' are skipped.
+static void addInputs(char const *arg, std::vector<std::string> *gltfPaths) {
+  if (arg[0] != '@') {
+    gltfPaths->push_back(arg);
+    return;
+  }
+
+  std::ifstream manifest(arg + 1);
+
+  if (!manifest.is_open()) FAILURE("Failed to open manifest: %s", arg + 1);
+
+  std::string line;
+
+  while (std::getline(manifest, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+
+    if (line.empty() || line[0] == '#') continue;
+
+    gltfPaths->push_back(line);
+  }
+}
+
+// Convert every file in `gltfPaths` on `threadCount` threads, and add them
+// all to the library at `libPath`, which is only written once at the end.
+// Inputs whose hash matches the build cache, and whose mesh file is still
+// there, aren't converted again.
+//
+// Meshes go in `outDir` if it's given, named after their inputs' stems, and
+// beside them otherwise.
+static void convertBatch(ConvertOptions const            &options,
+			 char const                      *libPath,
+			 char const                      *dictPath,
+			 char const                      *outDir,
+			 size_t                          threadCount,
+			 std::vector<std::string> const  &gltfPaths)
+{
+  // Makefiles build into directories that might not be there yet.
+  auto libDir = std::filesystem::path(libPath).parent_path();
+
+  if (!libDir.empty()) std::filesystem::create_directories(libDir);
+  if (outDir) std::filesystem::create_directories(outDir);
+
+  std::vector<char> dictionary;
+
+  auto library = openLibrary(libPath, dictPath, &dictionary);
+
+  std::string cachePath = std::string(libPath) + ".cache";
+
+  auto cache = readBuildCache(cachePath);
+
+  std::vector<std::string>         meshPaths;
+  std::unordered_set<std::string>  seen;
+
+  for (auto const &gltfPath : gltfPaths) {
+    std::filesystem::path meshPath(gltfPath);
+
+    meshPath.replace_extension(".mesh");
+
+    if (outDir) meshPath = std::filesystem::path(outDir) / meshPath.filename();
+
+    // Two threads writing the same mesh file would leave garbage in it.
+    if (!seen.insert(meshPath.string()).second) {
+      FAILURE("More than one input would be written to %s", meshPath.c_str());
+    }
+
+    meshPaths.push_back(meshPath.string());
+  }
+
+  std::vector<BuildCacheEntry>  results(gltfPaths.size());
+  std::vector<char>             skipped(gltfPaths.size(), false);
+
+  jobs::System system;
+
+  system.init(threadCount - 1);
+
+  system.parallelFor(gltfPaths.size(), [&](size_t i, size_t) {
+    char const *gltfPath = gltfPaths[i].c_str();
+    char const *meshPath = meshPaths[i].c_str();
+
+    uint64_t hash = hashInput(options, { dictionary.data(), dictionary.size() }, gltfPath);
+
+    auto found = cache.find(gltfPaths[i]);
+
+    if (found != cache.end()
+	&& found->second.hash == hash
+	&& found->second.meshPath == meshPaths[i]
+	&& std::filesystem::exists(meshPaths[i]))
+    {
+      results[i] = found->second;
+      skipped[i] = true;
+
+      printf("    [UNCHANGED]  %s\n", gltfPath);
+
+      return;
+    }
+
+    printf("    [CONVERT]    %s\n", gltfPath);
+
+    results[i] = {
+      .hash      = hash,
+      .name      = convertMesh(options, gltfPath, meshPath, { dictionary.data(), dictionary.size() }),
+      .meshPath  = meshPaths[i],
+    };
+  });
+
+  system.cleanup();
+
+  // Skipped meshes get their refs again too, in case the library was deleted
+  // out from under its mesh files.
+  for (size_t i = 0; i < gltfPaths.size(); i++) {
+    library->addMeshRef(results[i].name, results[i].meshPath);
+
+    cache[gltfPaths[i]] = results[i];
+  }
+
+  library->write(libPath);
+
+  writeBuildCache(cachePath, cache);
+
+  size_t skipCount = std::count(skipped.begin(), skipped.end(), true);
+
+  printf("    [BATCH]      %s: %zu converted, %zu unchanged\n",
+	 libPath, gltfPaths.size() - skipCount, skipCount);
+}
+
+int main(int argc, char const *argv[]) {
+  if (argc >= 2 && !strcmp(argv[1], "--train-dictionary")) {
+    if (argc < 4) usage(argv[0]);
+
+    trainDictionary(argv[2], argv + 3, argc - 3);
+
+    return 0;
+  }
+
+  ConvertOptions  options;
+  char const      *dictPath    = nullptr;
+  char const      *batchPath   = nullptr;
+  char const      *outDir      = nullptr;
+  size_t          threadCount  = std::max(std::thread::hardware_concurrency(), 1u);
+  int             arg          = 1;
+
+  for (; arg < argc && argv[arg][0] == '-'; arg += 2) {
+    if (arg + 1 >= argc) usage(argv[0]);
+
+    if (!strcmp(argv[arg], "-O")) {
+      options.optimize = atoi(argv[arg + 1]) != 0;
+    } else if (!strcmp(argv[arg], "-L")) {
+      options.lodLevels = atoi(argv[arg + 1]);
+    } else if (!strcmp(argv[arg], "-m")) {
+      options.meshletVertices = (size_t)atoi(argv[arg + 1]);
+    } else if (!strcmp(argv[arg], "-f")) {
+      if (!strcmp(argv[arg + 1], "full")) {
+	options.format = asset::VertexFormat::Full;
+      } else if (!strcmp(argv[arg + 1], "packed")) {
+	options.format = asset::VertexFormat::Packed;
+      } else {
+	usage(argv[0]);
+      }
+    } else if (!strcmp(argv[arg], "-l")) {
+      options.level = atoi(argv[arg + 1]);
+    } else if (!strcmp(argv[arg], "-d")) {
+      dictPath = argv[arg + 1];
+    } else if (!strcmp(argv[arg], "-b")) {
+      batchPath = argv[arg + 1];
+    } else if (!strcmp(argv[arg], "-j")) {
+      threadCount = (size_t)atoi(argv[arg + 1]);
+    } else if (!strcmp(argv[arg], "-o")) {
+      outDir = argv[arg + 1];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (batchPath) {
+    std::vector<std::string> gltfPaths;
+
+    for (; arg < argc; arg++) addInputs(argv[arg], &gltfPaths);
+
+    if (gltfPaths.empty() || threadCount == 0) usage(argv[0]);
+
+    convertBatch(options, batchPath, dictPath, outDir, threadCount, gltfPaths);
+
+    return 0;
+  }
+
+  if (argc - arg != 3 || outDir) usage(argv[0]);
+
+  char const *gltfPath  = argv[arg];
+  char const *meshPath  = argv[arg + 1];
+  char const *libPath   = argv[arg + 2];
+
+  std::vector<char> dictionary;
+
+  auto library = openLibrary(libPath, dictPath, &dictionary);
+
+  std::string name = convertMesh(options, gltfPath, meshPath, { dictionary.data(), dictionary.size() });
+
+  library->addMeshRef(name, meshPath);
 
-  library->write(argv[3]);
+  library->write(libPath);
 
   return 0;
 }
@@ -0,0 +1,376 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "asset.h"
+#include "util.h"
+
+#define FAILURE(FMT, ...) do {			\
+    fprintf (stderr,				\
+	     "\n"				\
+	     "    error: " FMT "\n"		\
+	     "\n"				\
+	     , ##__VA_ARGS__);			\
+    std::exit(-1);				\
+  } while (0)					\
+  // End of multi-line macro
+
+// There's no block compressor in the tree, so this takes textures that are
+// already compressed -- DDS files as written by texconv, compressonator and
+// friends, or .astc files from astcenc -- and repackages their levels. Only
+// uncompressed RGBA8 textures get their mip chains built here.
+struct SourceTexture {
+  asset::TextureFormat              format;
+  uint32_t                          width;
+  uint32_t                          height;
+  uint32_t                          flags  { 0 };
+  std::vector<std::vector<uint8_t>> levels;
+};
+
+static std::vector<uint8_t> readWholeFile(char const *path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+  if (!file.is_open()) {
+    FAILURE("Failed to open file: %s", path);
+  }
+
+  std::vector<uint8_t> bytes((size_t)file.tellg());
+
+  file.seekg(0);
+  file.read((char *)bytes.data(), bytes.size());
+
+  return bytes;
+}
+
+static constexpr uint32_t fourCC(char const (&s)[5]) {
+  return (uint32_t)s[0] | (uint32_t)s[1] << 8 | (uint32_t)s[2] << 16 | (uint32_t)s[3] << 24;
+}
+
+struct DDSPixelFormat {
+  uint32_t size;
+  uint32_t flags;
+  uint32_t fourCC;
+  uint32_t rgbBitCount;
+  uint32_t rMask;
+  uint32_t gMask;
+  uint32_t bMask;
+  uint32_t aMask;
+};
+
+struct DDSHeader {
+  uint32_t        size;
+  uint32_t        flags;
+  uint32_t        height;
+  uint32_t        width;
+  uint32_t        pitchOrLinearSize;
+  uint32_t        depth;
+  uint32_t        mipMapCount;
+  uint32_t        reserved1[11];
+  DDSPixelFormat  pixelFormat;
+  uint32_t        caps[4];
+  uint32_t        reserved2;
+};
+
+struct DDSHeaderDX10 {
+  uint32_t dxgiFormat;
+  uint32_t resourceDimension;
+  uint32_t miscFlag;
+  uint32_t arraySize;
+  uint32_t miscFlags2;
+};
+
+static const uint32_t DDPF_FOURCC = 0x4;
+static const uint32_t DDPF_RGB    = 0x40;
+
+// Map a DXGI_FORMAT onto a TextureFormat, setting SRGB in `flags` for the
+// _SRGB variants.
+static bool formatFromDXGI(uint32_t dxgiFormat, asset::TextureFormat *format, uint32_t *flags) {
+  switch (dxgiFormat) {
+  case 29: *flags |= asset::TextureData::SRGB; // fallthrough
+  case 28: *format = asset::TextureFormat::RGBA8; return true;
+  case 72: *flags |= asset::TextureData::SRGB; // fallthrough
+  case 71: *format = asset::TextureFormat::BC1;   return true;
+  case 78: *flags |= asset::TextureData::SRGB; // fallthrough
+  case 77: *format = asset::TextureFormat::BC3;   return true;
+  case 83: *format = asset::TextureFormat::BC5;   return true;
+  case 99: *flags |= asset::TextureData::SRGB; // fallthrough
+  case 98: *format = asset::TextureFormat::BC7;   return true;
+  }
+
+  return false;
+}
+
+static SourceTexture readDDS(std::vector<uint8_t> const &bytes, char const *path) {
+  if (bytes.size() < 4 + sizeof(DDSHeader)) FAILURE("Truncated DDS file: %s", path);
+
+  DDSHeader header;
+
+  memcpy(&header, bytes.data() + 4, sizeof(DDSHeader));
+
+  size_t offset = 4 + sizeof(DDSHeader);
+
+  SourceTexture texture;
+
+  texture.width  = header.width;
+  texture.height = header.height;
+
+  DDSPixelFormat const &pf = header.pixelFormat;
+
+  bool swizzle = false;
+
+  if ((pf.flags & DDPF_FOURCC) && pf.fourCC == fourCC("DX10")) {
+    if (bytes.size() < offset + sizeof(DDSHeaderDX10)) FAILURE("Truncated DDS file: %s", path);
+
+    DDSHeaderDX10 dx10;
+
+    memcpy(&dx10, bytes.data() + offset, sizeof(DDSHeaderDX10));
+    offset += sizeof(DDSHeaderDX10);
+
+    if (dx10.arraySize > 1 || dx10.resourceDimension != 3) {
+      FAILURE("Only single 2D textures are supported: %s", path);
+    }
+
+    if (!formatFromDXGI(dx10.dxgiFormat, &texture.format, &texture.flags)) {
+      FAILURE("Unsupported DXGI format %u in %s", dx10.dxgiFormat, path);
+    }
+  } else if (pf.flags & DDPF_FOURCC) {
+    if (pf.fourCC == fourCC("DXT1")) {
+      texture.format = asset::TextureFormat::BC1;
+    } else if (pf.fourCC == fourCC("DXT5")) {
+      texture.format = asset::TextureFormat::BC3;
+    } else if (pf.fourCC == fourCC("ATI2") || pf.fourCC == fourCC("BC5U")) {
+      texture.format = asset::TextureFormat::BC5;
+    } else {
+      FAILURE("Unsupported DDS FourCC %.4s in %s", (char const *)&pf.fourCC, path);
+    }
+  } else if ((pf.flags & DDPF_RGB) && pf.rgbBitCount == 32) {
+    texture.format = asset::TextureFormat::RGBA8;
+
+    if (pf.rMask == 0x00ff0000 && pf.bMask == 0x000000ff) {
+      swizzle = true;
+    } else if (pf.rMask != 0x000000ff || pf.bMask != 0x00ff0000) {
+      FAILURE("Unsupported 32-bit channel layout in %s", path);
+    }
+  } else {
+    FAILURE("Unsupported DDS pixel format in %s", path);
+  }
+
+  uint32_t levelCount = std::max(header.mipMapCount, 1u);
+
+  for (uint32_t l = 0; l < levelCount; l++) {
+    uint32_t w = std::max(texture.width >> l, 1u);
+    uint32_t h = std::max(texture.height >> l, 1u);
+
+    size_t size = asset::textureLevelSize(texture.format, w, h);
+
+    if (bytes.size() < offset + size) FAILURE("Truncated DDS file: %s", path);
+
+    texture.levels.emplace_back(bytes.begin() + offset, bytes.begin() + offset + size);
+    offset += size;
+
+    // BGRA to RGBA.
+    if (swizzle) {
+      auto &level = texture.levels.back();
+
+      for (size_t i = 0; i < level.size(); i += 4) std::swap(level[i], level[i + 2]);
+    }
+  }
+
+  return texture;
+}
+
+struct ASTCHeader {
+  uint8_t magic[4];
+  uint8_t blockX, blockY, blockZ;
+  uint8_t sizeX[3];
+  uint8_t sizeY[3];
+  uint8_t sizeZ[3];
+};
+
+// .astc files hold a single level, so the texture won't have a mip chain
+// until there's an encoder to build one.
+static SourceTexture readASTC(std::vector<uint8_t> const &bytes, char const *path) {
+  if (bytes.size() < sizeof(ASTCHeader)) FAILURE("Truncated ASTC file: %s", path);
+
+  ASTCHeader header;
+
+  memcpy(&header, bytes.data(), sizeof(ASTCHeader));
+
+  if (header.blockX != 4 || header.blockY != 4 || header.blockZ != 1) {
+    FAILURE("Only 4x4 ASTC blocks are supported, got %ux%ux%u in %s",
+	    header.blockX, header.blockY, header.blockZ, path);
+  }
+
+  SourceTexture texture;
+
+  texture.format = asset::TextureFormat::ASTC4x4;
+  texture.width  = header.sizeX[0] | header.sizeX[1] << 8 | header.sizeX[2] << 16;
+  texture.height = header.sizeY[0] | header.sizeY[1] << 8 | header.sizeY[2] << 16;
+
+  size_t size = asset::textureLevelSize(texture.format, texture.width, texture.height);
+
+  if (bytes.size() < sizeof(ASTCHeader) + size) FAILURE("Truncated ASTC file: %s", path);
+
+  texture.levels.emplace_back(bytes.begin() + sizeof(ASTCHeader),
+			      bytes.begin() + sizeof(ASTCHeader) + size);
+
+  return texture;
+}
+
+// Fill out the rest of an RGBA8 texture's mip chain with a 2x2 box filter.
+static void buildMips(SourceTexture *texture) {
+  for (uint32_t l = texture->levels.size(); ; l++) {
+    uint32_t pw = std::max(texture->width >> (l - 1), 1u);
+    uint32_t ph = std::max(texture->height >> (l - 1), 1u);
+
+    if (pw == 1 && ph == 1) break;
+
+    uint32_t w = std::max(pw >> 1, 1u);
+    uint32_t h = std::max(ph >> 1, 1u);
+
+    std::vector<uint8_t> const &prev = texture->levels.back();
+    std::vector<uint8_t>       level(asset::textureLevelSize(texture->format, w, h));
+
+    for (uint32_t y = 0; y < h; y++) {
+      for (uint32_t x = 0; x < w; x++) {
+	uint32_t x0 = std::min(2*x, pw - 1), x1 = std::min(2*x + 1, pw - 1);
+	uint32_t y0 = std::min(2*y, ph - 1), y1 = std::min(2*y + 1, ph - 1);
+
+	for (uint32_t c = 0; c < 4; c++) {
+	  uint32_t sum = prev[(y0*pw + x0)*4 + c] + prev[(y0*pw + x1)*4 + c]
+	               + prev[(y1*pw + x0)*4 + c] + prev[(y1*pw + x1)*4 + c];
+
+	  level[(y*w + x)*4 + c] = (uint8_t)((sum + 2) / 4);
+	}
+      }
+    }
+
+    texture->levels.push_back(std::move(level));
+  }
+}
+
+static void usage(char const *argv0) {
+  char const *strippedName = strrchr(argv0, '/');
+
+  strippedName = strippedName ? strippedName + 1 : argv0;
+
+  fprintf(stderr,
+	  "\n"
+	  "    usage: %s [-n <name>] [-s <0|1>] <dds or astc filename> <output filename> <library filename>\n"
+	  "\n"
+	  "    -n <name>   name the texture is looked up by (default: the input's stem)\n"
+	  "    -s <0|1>    treat the texels as sRGB color, overriding the input (default: from the input)\n"
+	  "\n",
+	  strippedName);
+
+  std::exit(-1);
+}
+
+int main(int argc, char const *argv[]) {
+  char const  *name  = nullptr;
+  int         srgb   = -1;
+  int         arg    = 1;
+
+  for (; arg < argc && argv[arg][0] == '-'; arg += 2) {
+    if (arg + 1 >= argc) usage(argv[0]);
+
+    if (!strcmp(argv[arg], "-n")) {
+      name = argv[arg + 1];
+    } else if (!strcmp(argv[arg], "-s")) {
+      srgb = atoi(argv[arg + 1]) != 0;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (argc - arg != 3) usage(argv[0]);
+
+  char const *inPath   = argv[arg];
+  char const *outPath  = argv[arg + 1];
+  char const *libPath  = argv[arg + 2];
+
+  std::vector<uint8_t> bytes = readWholeFile(inPath);
+
+  SourceTexture source;
+
+  if (bytes.size() >= 4 && !memcmp(bytes.data(), "DDS ", 4)) {
+    source = readDDS(bytes, inPath);
+  } else if (bytes.size() >= 4 && bytes[0] == 0x13 && bytes[1] == 0xab
+	     && bytes[2] == 0xa1 && bytes[3] == 0x5c) {
+    source = readASTC(bytes, inPath);
+  } else {
+    FAILURE("Not a DDS or ASTC file: %s", inPath);
+  }
+
+  if (source.width == 0 || source.height == 0) FAILURE("Empty texture: %s", inPath);
+
+  if (source.format == asset::TextureFormat::RGBA8) buildMips(&source);
+
+  if (srgb == 0) source.flags &= ~asset::TextureData::SRGB;
+  if (srgb == 1) source.flags |= asset::TextureData::SRGB;
+
+  std::string textureName = name ? name : std::filesystem::path(inPath).stem().string();
+
+  asset::TextureData texture = {
+    .id        = ID(textureName),
+    .format    = source.format,
+    .width     = source.width,
+    .height    = source.height,
+    .flags     = source.flags,
+    .mipOffset = 0,
+    .mipCount  = (uint32_t)source.levels.size(),
+  };
+
+  std::vector<Span<uint8_t const>> mips;
+
+  for (auto const &level : source.levels) mips.push_back({ level.data(), level.size() });
+
+  asset::writeTextureFile(outPath, &texture, 1, mips.data(), mips.size());
+
+  printf("    [TEXTURE]    %s: %ux%u, %zu levels\n",
+	 textureName.c_str(), source.width, source.height, source.levels.size());
+
+  if (!std::filesystem::exists(std::filesystem::path(libPath))) {
+    asset::emptyLibraryFileHandle()->write(libPath);
+  }
+
+  auto library = asset::openLibraryFile(libPath);
+
+  library->addTextureRef(textureName, outPath);
+
+  library->write(libPath);
+
+  return 0;
+}
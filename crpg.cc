@@ -26,25 +26,88 @@
  *
  */
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
 #include "gfx.h"
 
-int main() {
+static void usage(char const *argv0) {
+  char const *strippedName = strrchr(argv0, '/');
+
+  strippedName = strippedName ? strippedName + 1 : argv0;
+
+  fprintf(stderr,
+	  "\n"
+	  "    usage: %s [-f <frames>] [-p <present mode>] [-l <frames>] [-t <trace file>]\n"
+	  "\n"
+	  "    -f <frames>      frames the CPU may record ahead of the GPU, 1 to 4 (default 2)\n"
+	  "    -p <mode>        present mode, 'fifo', 'relaxed', 'mailbox' or 'immediate' (default fifo)\n"
+	  "    -l <frames>      wait for all but this many frames before polling input, 0 for no limit (default 0)\n"
+	  "    -t <file>        write a Chrome trace (chrome://tracing, Perfetto) of the last frames at exit\n"
+	  "\n",
+	  strippedName);
+
+  std::exit(-1);
+}
+
+int main(int argc, char const *argv[]) {
+  gfx::EngineOptions options;
+
+  char const *tracePath = nullptr;
+
+  for (int arg = 1; arg < argc; arg += 2) {
+    if (argv[arg][0] != '-' || arg + 1 >= argc) usage(argv[0]);
+
+    if (!strcmp(argv[arg], "-f")) {
+      options.framesInFlight = atoi(argv[arg + 1]);
+    } else if (!strcmp(argv[arg], "-p")) {
+      if (!strcmp(argv[arg + 1], "fifo")) {
+	options.presentMode = gfx::PresentMode::Fifo;
+      } else if (!strcmp(argv[arg + 1], "relaxed")) {
+	options.presentMode = gfx::PresentMode::FifoRelaxed;
+      } else if (!strcmp(argv[arg + 1], "mailbox")) {
+	options.presentMode = gfx::PresentMode::Mailbox;
+      } else if (!strcmp(argv[arg + 1], "immediate")) {
+	options.presentMode = gfx::PresentMode::Immediate;
+      } else {
+	usage(argv[0]);
+      }
+    } else if (!strcmp(argv[arg], "-l")) {
+      options.latencyLimit = atoi(argv[arg + 1]);
+    } else if (!strcmp(argv[arg], "-t")) {
+      tracePath = argv[arg + 1];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
   gfx::Engine engine {
-    "VK_LAYER_KHRONOS_validation"
+    { "VK_LAYER_KHRONOS_validation" },
+    options,
   };
 
   engine.init();
 
+  std::cout << "present mode: " << gfx::presentModeName(engine.presentMode()) << std::endl;
+
   bool shutdown = false;
   SDL_Event event;
 
   while (!shutdown) {
+    engine.limitLatency();
+
     while (SDL_PollEvent(&event)) {
       switch (event.type) {
       case SDL_QUIT:
 	shutdown = true;
 	break;
 
+      case SDL_WINDOWEVENT:
+	if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+	  engine.resized();
+	} break;
+
       case SDL_KEYDOWN:
 	if (event.key.keysym.sym == SDLK_q) {
 	  shutdown = true;
@@ -58,6 +121,18 @@ int main() {
 
   std::cout << "frames drawn: " << engine.framesDrawn() << std::endl;
 
+  printf("\n    %-24s %10s %10s %10s\n", "zone", "p50 (ms)", "p99 (ms)", "max (ms)");
+
+  for (auto const &[name, stats] : engine.profiler().allStats()) {
+    printf("    %-24s %10.3f %10.3f %10.3f\n", name.c_str(), stats.p50, stats.p99, stats.max);
+  }
+
+  printf("\n");
+
+  if (tracePath && !engine.profiler().writeChromeTrace(tracePath)) {
+    std::cerr << "Failed to write trace to " << tracePath << std::endl;
+  }
+
   engine.cleanup();
   return 0;
 }
@@ -37,6 +37,21 @@ roundUp(size_t n, size_t nearest) {
   return ((n + (nearest - 1)) / nearest) * nearest;
 }
 
+// A mask of the low `validBits` bits of a timestamp, or 0 if the queue
+// doesn't write them.
+static inline uint64_t
+timestampMask(uint32_t validBits) {
+  if (validBits == 0) return 0;
+  return validBits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << validBits) - 1;
+}
+
+// Nanoseconds from timestamp `from` to `to`, allowing for the counter having
+// wrapped around in between.
+static inline uint64_t
+timestampDelta(uint64_t from, uint64_t to, uint64_t mask, float period) {
+  return (uint64_t)(((to - from) & mask) * (double)period);
+}
+
 // Read the entire contents of the file at `path` into a vector and
 // return that vector.
 //
@@ -67,16 +82,12 @@ readFile(const std::string &path) {
   return buffer;
 }
 
-// Read SPIR-V from the file at `spirvPath`, create a VkShaderModule for the
-// stage described by `stageBit`, and return a VkPipelinShaderStageCreateInfo
-// struct referencing that module.
-//
-// You must eventually call `vkDestroyShaderModule` on the .module field of the
-// returned structure. Currently this happens at the end of `_initPipelines`.
+// Read SPIR-V from the file at `spirvPath` and create a VkShaderModule from
+// it.
 //
 // Log and exit on failure.
-VkPipelineShaderStageCreateInfo
-gfx::Engine::_loadShaderStageInfo(const std::string &spirvPath, VkShaderStageFlagBits stageBit) {
+static VkShaderModule
+loadShaderModule(VkDevice device, const std::string &spirvPath) {
   auto spirv = readFile(spirvPath);
 
   VkShaderModuleCreateInfo createInfo = {
@@ -88,11 +99,28 @@ gfx::Engine::_loadShaderStageInfo(const std::string &spirvPath, VkShaderStageFla
   };
 
   VkShaderModule shaderModule;
-  if (vkCreateShaderModule(_device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
+  if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
     std::cerr << "failed to create shader module!" << std::endl;
     std::exit(-1);
   }
 
+  return shaderModule;
+}
+
+// Read SPIR-V from the file at `spirvPath`, create a VkShaderModule for the
+// stage described by `stageBit`, and return a VkPipelinShaderStageCreateInfo
+// struct referencing that module.
+//
+// You must eventually call `vkDestroyShaderModule` on the .module field of the
+// returned structure. Currently this happens at the end of
+// `_initComputePipeline`; graphics pipelines get their modules from the
+// PipelineRegistry instead.
+//
+// Log and exit on failure.
+VkPipelineShaderStageCreateInfo
+gfx::Engine::_loadShaderStageInfo(const std::string &spirvPath, VkShaderStageFlagBits stageBit) {
+  VkShaderModule shaderModule = loadShaderModule(_device, spirvPath);
+
   VkPipelineShaderStageCreateInfo stageInfo = {
     .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
     .pNext  = nullptr,
@@ -148,8 +176,61 @@ gfx::Engine::_rasterStateInfo(VkPolygonMode polyMode) {
   return info;
 }
 
-// Loads a mesh into Vulkan buffers and writes the corresponding handles (etc)
-// into the structure pointed to by `mesh`.
+// Read mesh `id` from `handle` into device-local buffers, via the _uploader.
+//
+// When the mesh file is mapped we copy straight from the mapping into staging
+// memory. Otherwise meshes that fit in a staging slot are read straight into
+// staging memory, and anything bigger is read into host memory first and split
+// up by Uploader::upload. Nothing is submitted until the uploader is flushed.
+bool
+gfx::Engine::_uploadMesh(asset::LibraryFileHandle &handle,
+			 asset::MeshID              id,
+			 VkBuffer                   vbuffer,
+			 size_t                     firstVertex,
+			 VkBuffer                   ibuffer,
+			 VkDeviceSize               indexOffset)
+{
+  auto meshData = handle->getMeshData(id);
+
+  if (!meshData) return false;
+
+  size_t        stride      = asset::vertexSize(meshData->vertexFormat);
+  VkDeviceSize  vertOffset  = firstVertex * stride;
+  VkDeviceSize  vertSize    = meshData->vertexCount * stride;
+  VkDeviceSize  indexSize   = meshData->indexCount * asset::indexSize(meshData->indexType);
+
+  auto vertSpan  = handle->meshVertices(id);
+  auto indexSpan = handle->meshIndices(id);
+
+  if (!vertSpan.empty() && !indexSpan.empty()) {
+    _uploader.upload(vbuffer, vertOffset, vertSpan.data, vertSpan.bytes());
+    _uploader.upload(ibuffer, indexOffset, indexSpan.data, indexSpan.bytes());
+
+    return true;
+  }
+
+  if (_uploader.reserve(vertSize + indexSize, 2)) {
+    auto verts   = _uploader.stage(vbuffer, vertOffset, vertSize);
+    auto indices = _uploader.stage(ibuffer, indexOffset, indexSize);
+
+    return handle->readMesh(id, verts, indices);
+  }
+
+  std::vector<uint8_t>  verts(vertSize);
+  std::vector<uint8_t>  indices(indexSize);
+
+  if (!handle->readMesh(id, verts.data(), indices.data())) return false;
+
+  _uploader.upload(vbuffer, vertOffset, verts.data(), vertSize);
+  _uploader.upload(ibuffer, indexOffset, indices.data(), indexSize);
+
+  return true;
+}
+
+// Loads a mesh into the _geometry pool and writes where it went (etc) into the
+// structure pointed to by `mesh`.
+//
+// The mesh is device-local, and ready to use when this returns.
 bool
 gfx::Engine::_loadMesh(std::string const &path, asset::MeshID id, gfx::Mesh *mesh) {
   auto handle    = asset::openLibraryFile(path);
@@ -157,1582 +238,6853 @@ gfx::Engine::_loadMesh(std::string const &path, asset::MeshID id, gfx::Mesh *mes
 
   if (!meshData) return false;
 
-  _allocBuffer(meshData->vertexCount*sizeof(asset::StaticVertexData),
-	       VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-	       VMA_MEMORY_USAGE_CPU_TO_GPU,
-	       &mesh->vbuffer);
-
-  _allocBuffer(meshData->indexCount*sizeof(uint16_t),
-	       VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-	       VMA_MEMORY_USAGE_CPU_TO_GPU,
-	       &mesh->ibuffer);
+  if (!_geometry.alloc(&mesh->geometry, meshData->vertexFormat, meshData->vertexCount,
+		       meshData->indexCount*asset::indexSize(meshData->indexType)))
+  {
+    std::cerr << "No room in the geometry pool for mesh " << id << std::endl;
+    return false;
+  }
 
   mesh->meshData = *meshData;
 
-  asset::StaticVertexData  *verts;
-  uint16_t                 *indices;
-
-  vmaMapMemory(_allocator, mesh->vbuffer.alloc, (void **)&verts);
-  vmaMapMemory(_allocator, mesh->ibuffer.alloc, (void **)&indices);
+  if (!_uploadMesh(handle, id,
+		   _geometry.vertexBuffer(meshData->vertexFormat), mesh->geometry.vertices.offset,
+		   _geometry.indexBuffer(),                        mesh->geometry.indices.offset))
+  {
+    return false;
+  }
 
-  handle->readMesh(id, verts, indices);
+  mesh->geometry.serial = _uploader.nextSerial();
 
-  vmaUnmapMemory(_allocator, mesh->vbuffer.alloc);
-  vmaUnmapMemory(_allocator, mesh->ibuffer.alloc);
+  _uploader.wait();
 
   return true;
 }
 
-// Loads multiple meshes into a single pair of buffers and writes the
-// corresponding handles (etc) into the structure pointed to by
-// `mesh`.
+// Lay out `count` meshes from `handle` back to back in one allocation from the
+// _geometry pool, and upload the MultiMesh's draw commands. The vertex and
+// index data itself is left to the caller.
+//
+// Meshes with 16-bit indices come first in the index buffer, then those with
+// 32-bit indices, each group with its own run of draws. The 16-bit group
+// usually covers everything, since convert-gltf only writes 32-bit indices
+// for large meshes it hasn't split into meshlets.
+//
+// Within a group, every mesh's full-detail draws come before any of their
+// coarser levels, so that drawing a group's base draws draws each mesh once.
 bool
-gfx::Engine::_loadMultiMesh(
-  std::string const &path,
+gfx::Engine::_allocMultiMesh(
+  std::string const &path, asset::LibraryFileHandle &handle,
   asset::MeshID *ids, gfx::MultiMesh *meshes, size_t count)
 {
-  auto handle = asset::openLibraryFile(path);
   std::vector<asset::StaticMeshData> meshData(count);
-  std::vector<VkDrawIndexedIndirectCommand> cmds(count);
+
+  // The culling passes keep a visible instance count for each level of
+  // detail, and every mesh has at least one. See also the check on the total
+  // below.
+  if (count > MAX_DRAWS) {
+    std::cerr << "A MultiMesh can hold at most " << MAX_DRAWS << " meshes, not "
+	      << count << std::endl;
+    return false;
+  }
 
   if (!handle->getMultiMeshData(ids, meshData.data(), count)) return false;
 
-  size_t totalVerts   = 0;
-  size_t totalIndices = 0;
+  auto format = count > 0 ? meshData[0].vertexFormat : asset::VertexFormat::Full;
+
+  std::vector<MeshInfo>                      infos(count);
+  std::vector<MultiMesh::MeshRange>          ranges(count);
+  std::vector<MultiMesh::IndexGroup>         groups;
+  std::vector<VkDrawIndexedIndirectCommand>  cmds;
+  std::vector<asset::BoundingBox>            drawBounds;
+  std::vector<LODInfo>                       lods;
 
   for (size_t i = 0; i < count; i++) {
-    cmds[i].firstIndex    = totalIndices;
-    cmds[i].indexCount    = meshData[i].indexCount;
-    cmds[i].vertexOffset  = totalVerts;
+    if (meshData[i].vertexFormat != format) {
+      std::cerr << "Mesh " << ids[i] << " doesn't share a vertex format with mesh "
+		<< ids[0] << ", so they can't go in one MultiMesh" << std::endl;
+      return false;
+    }
 
-    totalVerts   += meshData[i].vertexCount;
-    totalIndices += meshData[i].indexCount;
+    auto const &bounds = meshData[i].bounds;
+
+    infos[i] = {
+      .center     = glm::vec4((bounds.max + bounds.min) * 0.5f, 0.0f),
+      .halfExtent = glm::vec4((bounds.max - bounds.min) * 0.5f, 0.0f),
+      .lods       = glm::uvec4(0),
+      .textures   = { },
+    };
   }
 
-  _allocBuffer(totalVerts*sizeof(asset::StaticVertexData),
-	       VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-	       VMA_MEMORY_USAGE_CPU_TO_GPU,
-	       &meshes->vertexBuffer);
+  // Append the draws for level `l` of mesh `i`, whose indices start at
+  // `firstIndex` within its group.
+  auto addLevel = [&](size_t i, uint32_t firstIndex, uint32_t l) {
+    auto const  &range    = ranges[i];
+    auto        meshlets  = handle->meshMeshlets(ids[i]);
+    auto        meshLODs  = handle->meshLODs(ids[i]);
+
+    // A mesh without LODs is its own single level.
+    asset::MeshLOD level = meshLODs.empty()
+      ? asset::MeshLOD {
+	  .error          = 0.0f,
+	  .indexOffset    = 0,
+	  .indexCount     = meshData[i].indexCount,
+	  .meshletOffset  = 0,
+	  .meshletCount   = (uint32_t)meshlets.size,
+	}
+      : meshLODs[l];
+
+    LODInfo &lod = lods[range.firstLOD + l];
+
+    lod.firstDraw = (uint32_t)cmds.size();
+    lod.error     = level.error;
+
+    if (meshlets.empty()) {
+      cmds.push_back({
+	  .indexCount     = level.indexCount,
+	  .instanceCount  = 1,
+	  .firstIndex     = firstIndex + level.indexOffset,
+	  .vertexOffset   = (int32_t)range.firstVertex,
+	  .firstInstance  = 0,
+	});
+      drawBounds.push_back(meshData[i].bounds);
+    } else {
+      for (uint32_t m = 0; m < level.meshletCount; m++) {
+	auto const &meshlet = meshlets[level.meshletOffset + m];
+
+	cmds.push_back({
+	    .indexCount     = meshlet.indexCount,
+	    .instanceCount  = 1,
+	    .firstIndex     = firstIndex + meshlet.indexOffset,
+	    .vertexOffset   = (int32_t)(range.firstVertex + meshlet.vertexOffset),
+	    .firstInstance  = 0,
+	  });
+	drawBounds.push_back(meshlet.bounds);
+      }
+    }
 
-  _allocBuffer(totalIndices*sizeof(uint16_t),
-	       VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-	       VMA_MEMORY_USAGE_CPU_TO_GPU,
-	       &meshes->indexBuffer);
+    lod.drawCount = (uint32_t)cmds.size() - lod.firstDraw;
+  };
 
-  // In the future we'll want to copy this into a GPU-side buffer.
+  static constexpr asset::IndexType indexTypes[MultiMesh::MAX_INDEX_GROUPS] = {
+    asset::IndexType::U16,
+    asset::IndexType::U32,
+  };
 
-  asset::StaticVertexData  *verts;
-  uint16_t                 *indices;
+  size_t        totalVerts   = 0;
+  VkDeviceSize  indexBytes   = 0;
 
-  vmaMapMemory(_allocator, meshes->vertexBuffer.alloc, (void **)&verts);
-  vmaMapMemory(_allocator, meshes->indexBuffer.alloc, (void **)&indices);
+  for (auto type : indexTypes) {
+    size_t        indexSize     = asset::indexSize(type);
+    uint32_t      groupIndices  = 0;
 
-  if (!handle->readMultiMesh(ids, count, verts, indices)) return false;
+    // The device reads indices at their natural alignment.
+    indexBytes = (indexBytes + indexSize - 1) & ~(VkDeviceSize)(indexSize - 1);
 
-  vmaUnmapMemory(_allocator, meshes->vertexBuffer.alloc);
-  vmaUnmapMemory(_allocator, meshes->indexBuffer.alloc);
+    MultiMesh::IndexGroup group = {
+      .type           = type == asset::IndexType::U32 ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16,
+      .offset         = indexBytes,
+      .firstDraw      = (uint32_t)cmds.size(),
+      .drawCount      = 0,
+      .baseDrawCount  = 0,
+    };
 
-  meshes->ids  = std::vector(ids, ids + count);
-  meshes->cmds = std::move(cmds);
+    // Where each of the group's meshes starts, in indices from the group's
+    // start, for placing their coarser levels' draws below.
+    std::vector<uint32_t> firstIndices(count);
 
-  return true;
-}
+    for (size_t i = 0; i < count; i++) {
+      if (meshData[i].indexType != type) continue;
 
-bool
-gfx::Engine::_drawMultiMesh(VkCommandBuffer cmdBuf, MultiMesh *meshes, asset::MeshID id) {
-  int i = 0;
-  for (int j = 0; j < meshes->ids.size(); j++) {
-    if (meshes->ids[j] == id) {
-      i = j;
+      uint32_t lodCount = std::max(meshData[i].lodCount, 1u);
+
+      ranges[i] = {
+	.firstDraw    = (uint32_t)cmds.size(),
+	.drawCount    = 0,
+	.firstLOD     = (uint32_t)lods.size(),
+	.lodCount     = lodCount,
+	.firstVertex  = (uint32_t)totalVerts,
+	.group        = (uint32_t)groups.size(),
+	.indexOffset  = indexBytes + groupIndices * indexSize,
+      };
+
+      lods.resize(lods.size() + lodCount, LODInfo {});
+
+      firstIndices[i] = groupIndices;
+
+      addLevel(i, groupIndices, 0);
+
+      ranges[i].drawCount = (uint32_t)cmds.size() - ranges[i].firstDraw;
+
+      infos[i].lods = glm::uvec4(ranges[i].firstLOD, ranges[i].lodCount, ranges[i].group, 0);
+
+      totalVerts   += meshData[i].vertexCount;
+      groupIndices += meshData[i].indexCount;
     }
-  }
 
-  if (i == -1) return false;
+    group.baseDrawCount = (uint32_t)cmds.size() - group.firstDraw;
 
-  auto drawCmd = meshes->cmds[i];
+    for (size_t i = 0; i < count; i++) {
+      if (meshData[i].indexType != type) continue;
 
-  vkCmdDrawIndexed(cmdBuf, drawCmd.indexCount, 1, drawCmd.firstIndex, drawCmd.vertexOffset, 0);
+      for (uint32_t l = 1; l < ranges[i].lodCount; l++) {
+	addLevel(i, firstIndices[i], l);
+      }
+    }
 
-  return true;
-}
+    group.drawCount = (uint32_t)cmds.size() - group.firstDraw;
 
+    if (group.drawCount > 0) {
+      groups.push_back(group);
+    }
 
+    indexBytes += groupIndices * indexSize;
+  }
 
-// Allocate a Buffer with the given parameters using the VmaAllocator
-//
-// Log and exit on failure.
-void gfx::Engine::_allocBuffer(size_t              size,
-			       VkBufferUsageFlags  vkUsage,
-			       VmaMemoryUsage      memoryUsage,
-			       gfx::Buffer         *buffer)
-{
-  VkBufferCreateInfo bufferInfo = {
-    .sType  = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-    .pNext  = nullptr,
+  if (lods.size() > MAX_DRAWS) {
+    std::cerr << "A MultiMesh can hold at most " << MAX_DRAWS << " levels of detail, not "
+	      << lods.size() << std::endl;
+    return false;
+  }
 
-    .size   = size,
-    .usage  = vkUsage,
-  };
+  meshes->vertexFormat = format;
 
-  VmaAllocationCreateInfo vmaAllocInfo = {};
+  if (!_geometry.alloc(&meshes->geometry, format, totalVerts, indexBytes)) {
+    std::cerr << "No room in the geometry pool for " << totalVerts << " vertices and "
+	      << indexBytes << " bytes of indices" << std::endl;
+    return false;
+  }
 
-  vmaAllocInfo.usage = memoryUsage;
+  meshes->geometry.owner = meshes;
 
-  if (vmaCreateBuffer(_allocator,
-		      &bufferInfo,
-		      &vmaAllocInfo,
-		      &buffer->buffer,
-		      &buffer->alloc,
-		      nullptr) != VK_SUCCESS)
-  {
-    std::cerr << "Failed to allocate a buffer of size " << size << std::endl;
-    std::exit(-1);
+  // Everything above counts from the start of the allocation, and each
+  // group's firstIndex from the group's start. Move it all into the pool.
+  uint32_t      vertexBase  = (uint32_t)meshes->geometry.vertices.offset;
+  VkDeviceSize  indexBase   = meshes->geometry.indices.offset;
+
+  for (auto &range : ranges) {
+    range.firstVertex += vertexBase;
+    range.indexOffset += indexBase;
   }
-}
 
+  for (auto &group : groups) {
+    group.offset += indexBase;
 
-// Free a buffer allocated by _allocBuffer
-void gfx::Engine::_freeBuffer(Buffer *buf) {
-  vmaDestroyBuffer(_allocator, buf->buffer, buf->alloc);
-}
+    uint32_t firstIndex = (uint32_t)(group.offset
+				     / (group.type == VK_INDEX_TYPE_UINT32 ? 4 : 2));
 
-// Free a mesh allocated by _loadMesh
-void gfx::Engine::_freeMesh(Mesh *mesh) {
-  _freeBuffer(&mesh->vbuffer);
-  _freeBuffer(&mesh->ibuffer);
-}
+    for (uint32_t d = group.firstDraw; d < group.firstDraw + group.drawCount; d++) {
+      cmds[d].firstIndex   += firstIndex;
+      cmds[d].vertexOffset += (int32_t)vertexBase;
+    }
+  }
 
-// Free a mesh allocated by _loadMesh
-void gfx::Engine::_freeMultiMesh(MultiMesh *meshes) {
-  _freeBuffer(&meshes->vertexBuffer);
-  _freeBuffer(&meshes->indexBuffer);
-}
+  meshes->ids         = std::vector(ids, ids + count);
+  meshes->ranges      = std::move(ranges);
+  meshes->groups      = std::move(groups);
+  meshes->cmds        = std::move(cmds);
+  meshes->drawBounds  = std::move(drawBounds);
+  meshes->lods        = lods;
 
-// Abstract the creation of VkPipelineMultisampleStateCreateInfo
-//
-// Used in _initPipelines
-VkPipelineMultisampleStateCreateInfo
-gfx::Engine::_multisampleInfo() {
-  VkPipelineMultisampleStateCreateInfo info = {
-    .sType  = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-    .pNext  = nullptr,
+  meshes->index.reset(count);
 
-    .rasterizationSamples  = VK_SAMPLE_COUNT_1_BIT,
+  for (uint32_t i = 0; i < (uint32_t)count; i++) {
+    meshes->index.insert(ids[i], i);
+  }
 
-    .sampleShadingEnable  = VK_FALSE,
-    .minSampleShading     = 1.0f,
-    .pSampleMask          = nullptr,
+  // The indirect buffer holds two copies of every draw command, each
+  // followed by the number of draws in each group (for
+  // vkCmdDrawIndexedIndirectCount), and each bound by a meshSet of its own.
+  VkDeviceSize copySize = meshes->indirectCountOffset()
+                        + MultiMesh::MAX_INDEX_GROUPS * sizeof(uint32_t);
+
+  meshes->indirectStride  = (copySize + _storageAlignment - 1) / _storageAlignment * _storageAlignment;
+  meshes->indirectSide    = 0;
+  meshes->rebaseSerial    = 0;
+  meshes->sideFrame       = 0;
+
+  _allocBuffer(2 * meshes->indirectStride,
+	       VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+	       | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+	       | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+	       VMA_MEMORY_USAGE_GPU_ONLY,
+	       MemoryCategory::Other,
+	       &meshes->indirectBuffer);
+
+  _allocBuffer(count * sizeof(MeshInfo),
+	       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+	       VMA_MEMORY_USAGE_GPU_ONLY,
+	       MemoryCategory::Other,
+	       &meshes->meshInfoBuffer);
+
+  _allocBuffer(std::max(lods.size(), (size_t)1) * sizeof(LODInfo),
+	       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+	       VMA_MEMORY_USAGE_GPU_ONLY,
+	       MemoryCategory::Other,
+	       &meshes->lodBuffer);
+
+  VkDescriptorBufferInfo meshInfo = {
+    .buffer  = meshes->meshInfoBuffer.buffer,
+    .offset  = 0,
+    .range   = VK_WHOLE_SIZE,
+  };
 
-    .alphaToCoverageEnable  = VK_FALSE,
-    .alphaToOneEnable       = VK_FALSE,
+  VkDescriptorBufferInfo lodInfo = {
+    .buffer  = meshes->lodBuffer.buffer,
+    .offset  = 0,
+    .range   = VK_WHOLE_SIZE,
   };
 
-  return info;
-}
+  bool built = true;
 
+  // The sets live as long as _descriptorAllocator's pools; there's no
+  // freeing individual sets back to them.
+  for (uint32_t side = 0; side < 2 && built; side++) {
+    VkDescriptorBufferInfo cmdInfo = {
+      .buffer  = meshes->indirectBuffer.buffer,
+      .offset  = side * meshes->indirectStride,
+      .range   = meshes->indirectCountOffset(),
+    };
 
-// Abstract the creation of VkPipelineColorBlendAttachmentState
-//
-// Used in _initPipelines
-VkPipelineColorBlendAttachmentState
-gfx::Engine::_colorBlendAttachState() {
-  VkPipelineColorBlendAttachmentState state = {
-    .colorWriteMask  = VK_COLOR_COMPONENT_R_BIT
-                     | VK_COLOR_COMPONENT_G_BIT
-                     | VK_COLOR_COMPONENT_B_BIT
-                     | VK_COLOR_COMPONENT_A_BIT,
+    built = DescriptorBuilder::begin(&_descriptorLayoutCache, &_descriptorAllocator)
+      .bind_buffer(0, &meshInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		   VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT)
+      .bind_buffer(1, &cmdInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+      .bind_buffer(2, &lodInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+      .build(meshes->meshSets[side]);
+  }
 
-    .blendEnable  = VK_FALSE,
-  };
+  // Nothing has been uploaded into any of it yet, so it can all go straight
+  // back.
+  if (!built) {
+    std::cerr << "Failed to build MultiMesh descriptor set" << std::endl;
 
-  return state;
-}
+    _freeBuffer(&meshes->indirectBuffer);
+    _freeBuffer(&meshes->meshInfoBuffer);
+    _freeBuffer(&meshes->lodBuffer);
+    _geometry.free(&meshes->geometry);
 
-// Abstract the creation of VkPipelineDepthStencilStateCreateInfo
-//
-// Used in _initPipelines
-VkPipelineDepthStencilStateCreateInfo
-gfx::Engine::_depthStencilState(bool depthTest, bool depthWrite, VkCompareOp cmp) {
-  VkPipelineDepthStencilStateCreateInfo info = {
-    .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
-    .pNext = nullptr,
+    return false;
+  }
 
-    .depthTestEnable  = (depthTest ? VK_TRUE : VK_FALSE),
-    .depthWriteEnable = (depthWrite ? VK_TRUE : VK_FALSE),
-    .depthCompareOp   = (depthTest ? cmp : VK_COMPARE_OP_ALWAYS),
+  // Textures are only acquired once nothing can fail, since every slot taken
+  // here is given back by _freeMultiMesh.
+  for (size_t i = 0; i < count; i++) {
+    asset::TextureID textures[MaterialTexture::MAX] = {
+      meshData[i].color,
+      meshData[i].normal,
+      meshData[i].roughness,
+      meshData[i].occlusion,
+      meshData[i].emission,
+    };
 
-    .depthBoundsTestEnable = VK_FALSE,
-    .minDepthBounds        = 0.0f,
-    .maxDepthBounds        = 1.0f,
-    .stencilTestEnable     = VK_FALSE,
-  };
+    for (uint32_t t = 0; t < MaterialTexture::MAX; t++) {
+      if (textures[t] != asset::NULL_ASSET_ID) {
+	infos[i].textures[t] = _textures.acquire(path, textures[t]);
+      }
+    }
+  }
 
-  return info;
-}
+  meshes->meshInfos = infos;
 
-// Abstract the creation of VkPushConstantRange
-//
-// Used in _initPipelines
-VkPushConstantRange
-gfx::Engine::_pushConstantRange() {
-  VkPushConstantRange range = {
-    .offset = 0,
-    .size   = sizeof(MeshPushConstants),
+  uint32_t drawCounts[MultiMesh::MAX_INDEX_GROUPS] = { };
 
-    .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-  };
+  // Anything drawing straight from indirectBuffer only wants full detail.
+  for (size_t g = 0; g < meshes->groups.size(); g++) {
+    drawCounts[g] = meshes->groups[g].baseDrawCount;
+  }
 
-  return range;
-}
+  // Both copies start out the same; only _rebaseMultiMesh ever rewrites
+  // one, and never the counts.
+  for (uint32_t side = 0; side < 2; side++) {
+    VkDeviceSize offset = side * meshes->indirectStride;
 
-// Abstract the creation of VkPipelineLayoutCreateInfo
-//
-// Used in _initPipelines
-VkPipelineLayoutCreateInfo
-gfx::Engine::_pipelineLayoutInfo(VkPushConstantRange *range) {
-  VkPipelineLayoutCreateInfo info = {
-    .sType  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-    .pNext  = nullptr,
-    .flags  = 0,
+    _uploader.upload(meshes->indirectBuffer.buffer, offset,
+		     meshes->cmds.data(), meshes->indirectCountOffset());
+    _uploader.upload(meshes->indirectBuffer.buffer, offset + meshes->indirectCountOffset(),
+		     drawCounts, sizeof(drawCounts));
+  }
 
-    .setLayoutCount  = 0,
-    .pSetLayouts     = nullptr,
+  _uploader.upload(meshes->meshInfoBuffer.buffer, 0, infos.data(), count * sizeof(MeshInfo));
+  _uploader.upload(meshes->lodBuffer.buffer, 0, lods.data(), lods.size() * sizeof(LODInfo));
 
-    .pushConstantRangeCount  = 1,
-    .pPushConstantRanges     = range,
-  };
+  meshes->streamTicket     = 0;
+  meshes->pendingMeshes    = 0;
+  meshes->failed           = false;
+  meshes->uploadSerial     = _uploader.nextSerial();
+  meshes->geometry.serial  = meshes->uploadSerial;
 
-  return info;
+  return true;
 }
 
-// Here is where we actually initialize our pipelines. Right now there's just
-// one pipeline for rendering static meshes.
+// Queue the meshes `ids` from the library at `path` with the _streamer, and
+// return without waiting for any of them. Their buffers are allocated up
+// front; _pumpStreaming fills them in as loads finish.
 //
-// Log and exit on failure.
-void gfx::Engine::_initPipelines() {
-  auto pushRange   = _pushConstantRange();
-  auto layoutInfo  = _pipelineLayoutInfo(&pushRange);
-  if (vkCreatePipelineLayout(_device, &layoutInfo, nullptr, &_pipelineLayout) != VK_SUCCESS) {
-    std::cerr << "Failed to create pipeline layout." << std::endl;
-    std::exit(-1);
+// Returns false, and marks `meshes` failed, if any of the meshes aren't in
+// the library or there's no geometry memory for them.
+bool
+gfx::Engine::_streamMultiMesh(
+  std::string const &path,
+  asset::MeshID *ids, gfx::MultiMesh *meshes, size_t count)
+{
+  auto found = _streamLibraries.find(path);
+
+  if (found == _streamLibraries.end()) {
+    found = _streamLibraries.emplace(path, asset::openLibraryFile(path)).first;
   }
 
-  auto assemblyInfo  = _inputAssemblyInfo(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
-  auto rasterInfo    = _rasterStateInfo(VK_POLYGON_MODE_FILL);
-  auto msInfo        = _multisampleInfo();
+  if (!_allocMultiMesh(path, found->second, ids, meshes, count)) {
+    meshes->failed = true;
+    return false;
+  }
 
-  auto colorBlendState  = _colorBlendAttachState();
+  // Without this, the draw commands would only go out with the first streamed
+  // mesh. They're tiny, so send them now.
+  _uploader.flush();
 
-  auto vertStageInfo = _loadShaderStageInfo(".data/static-mesh.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
-  auto fragStageInfo = _loadShaderStageInfo(".data/static-mesh.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT);
+  meshes->streamTicket   = _streamer.request(found->second.get(), ids, count);
+  meshes->pendingMeshes  = (uint32_t)count;
 
-  std::vector shaderStages {
-    vertStageInfo,
-    fragStageInfo,
-  };
+  // The streamed meshes land at the offsets we just worked out, so they have
+  // to stay put until the last of them is in.
+  meshes->geometry.pinned = count > 0;
 
-  auto vertInputDesc = asset::StaticVertexData::vertexInputDescription();
-  auto vertInputInfo = vertInputDesc.vertexInputInfo();
+  _streamTargets[meshes->streamTicket] = meshes;
 
-  auto depthStencil = _depthStencilState(true, true, VK_COMPARE_OP_LESS_OR_EQUAL);
+  return true;
+}
 
-  VkViewport viewport = {
-    .x  = 0,
-    .y  = 0,
+// Stage finished loads from the _streamer into their MultiMeshes, until we've
+// staged STREAM_BUDGET bytes this frame. A load that would go over budget is
+// held back for the next frame, unless it's the first of this one.
+void gfx::Engine::_pumpStreaming() {
+  VkDeviceSize  staged  = 0;
+  bool          any     = false;
+
+  for (;;) {
+    asset::MeshLoad load;
+
+    if (_deferredLoad) {
+      load = std::move(*_deferredLoad);
+      _deferredLoad.reset();
+    } else if (!_streamer.poll(&load)) {
+      break;
+    }
 
-    .width   = (float)_swapExtent.width,
-    .height  = (float)_swapExtent.height,
+    size_t       stride    = asset::vertexSize(load.data.vertexFormat);
+    VkDeviceSize vertSize  = load.data.vertexCount * stride;
+    VkDeviceSize indexSize = load.data.indexCount * asset::indexSize(load.data.indexType);
+    VkDeviceSize size      = vertSize + indexSize;
 
-    .minDepth  = 0.0f,
-    .maxDepth  = 1.0f,
-  };
+    if (any && staged + size > STREAM_BUDGET) {
+      _deferredLoad = std::move(load);
+      break;
+    }
 
-  VkRect2D scissor = {
-    .offset  = { 0, 0 },
-    .extent  = _swapExtent,
-  };
+    auto target = _streamTargets.find(load.ticket);
 
-  VkPipelineViewportStateCreateInfo viewportInfo = {
-    .sType  = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
-    .pNext  = nullptr,
+    // The MultiMesh was freed while its meshes were in flight.
+    if (target == _streamTargets.end()) continue;
 
-    .viewportCount  = 1,
-    .pViewports     = (&viewport),
+    MultiMesh *meshes = target->second;
 
-    .scissorCount  = 1,
-    .pScissors     = (&scissor),
-  };
+    VkBuffer vertexBuffer = _geometry.vertexBuffer(meshes->vertexFormat);
+    VkBuffer indexBuffer  = _geometry.indexBuffer();
 
-  VkPipelineColorBlendStateCreateInfo blendInfo = {
-    .sType  = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-    .pNext  = nullptr,
+    // Nothing lands in this mesh's range, so nothing in the MultiMesh may be
+    // drawn. The rest of its loads still count down, so that it's unpinned.
+    if (!load.ok) {
+      std::cerr << "Failed to stream mesh " << load.id << std::endl;
+      meshes->failed = true;
+    } else {
+      auto const &range = meshes->ranges[load.index];
+
+      VkDeviceSize vertOffset  = range.firstVertex * stride;
+      VkDeviceSize indexOffset = range.indexOffset;
+
+      if (!load.file) {
+	_uploader.upload(vertexBuffer, vertOffset, load.verts.data, vertSize);
+	_uploader.upload(indexBuffer, indexOffset, load.indices.data, indexSize);
+      } else if (_uploader.reserve(size, 2)) {
+	// Compressed meshes decompress straight into staging memory. If that
+	// fails, the copies still go out, but only into this mesh's own range,
+	// and a failed MultiMesh is never drawn.
+	auto verts   = _uploader.stage(vertexBuffer, vertOffset, vertSize);
+	auto indices = _uploader.stage(indexBuffer, indexOffset, indexSize);
+
+	if (!load.file->readMesh(load.id, verts, indices)) {
+	  std::cerr << "Failed to decompress mesh " << load.id << std::endl;
+	  meshes->failed = true;
+	}
+      } else {
+	std::vector<uint8_t>  verts(vertSize);
+	std::vector<uint8_t>  indices(indexSize);
+
+	if (load.file->readMesh(load.id, verts.data(), indices.data())) {
+	  _uploader.upload(vertexBuffer, vertOffset, verts.data(), vertSize);
+	  _uploader.upload(indexBuffer, indexOffset, indices.data(), indexSize);
+	} else {
+	  std::cerr << "Failed to decompress mesh " << load.id << std::endl;
+	  meshes->failed = true;
+	}
+      }
+
+      staged += size;
+      any     = true;
+    }
 
-    .logicOpEnable  = VK_FALSE,
-    .logicOp        = VK_LOGIC_OP_COPY,
+    if (--meshes->pendingMeshes == 0) {
+      meshes->uploadSerial     = _uploader.nextSerial();
+      meshes->geometry.serial  = meshes->uploadSerial;
+      meshes->geometry.pinned  = false;
+      _streamTargets.erase(target);
+    }
+  }
 
-    .attachmentCount = 1,
-    .pAttachments    = (&colorBlendState),
-  };
+  _uploader.flush();
+}
 
-  VkGraphicsPipelineCreateInfo pipelineInfo = {
-    .sType  = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-    .pNext  = nullptr,
+bool gfx::Engine::_isResident(MultiMesh *meshes) {
+  return !meshes->failed
+      && meshes->pendingMeshes == 0
+      && _uploader.completed(meshes->uploadSerial);
+}
 
-    .stageCount  = (uint32_t)shaderStages.size(),
-    .pStages     = shaderStages.data(),
+// Issue up to `maxDraws` indirect draws from `buffer`, starting with the
+// command at byte `offset`.
+//
+// Every command with a non-zero firstInstance needs drawIndirectFirstInstance;
+// when the device lacks it we replay `cpuCmds` as direct draws instead, which
+// always honor firstInstance.
+void
+gfx::Engine::_drawIndirect(VkCommandBuffer                     cmdBuf,
+			   VkBuffer                            buffer,
+			   VkDeviceSize                        offset,
+			   VkDeviceSize                        countOffset,
+			   uint32_t                            maxDraws,
+			   VkDrawIndexedIndirectCommand const  *cpuCmds)
+{
+  uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+
+  if (!_drawIndirectFirstInstance) {
+    for (uint32_t i = 0; i < maxDraws; i++) {
+      auto const &cmd = cpuCmds[i];
+      vkCmdDrawIndexed(cmdBuf,
+		       cmd.indexCount,
+		       cmd.instanceCount,
+		       cmd.firstIndex,
+		       cmd.vertexOffset,
+		       cmd.firstInstance);
+    }
+  } else if (_drawIndirectCount) {
+    vkCmdDrawIndexedIndirectCount(cmdBuf,
+				  buffer, offset,
+				  buffer, countOffset,
+				  maxDraws,
+				  stride);
+  } else if (_multiDrawIndirect) {
+    vkCmdDrawIndexedIndirect(cmdBuf, buffer, offset, maxDraws, stride);
+  } else {
+    for (uint32_t i = 0; i < maxDraws; i++) {
+      vkCmdDrawIndexedIndirect(cmdBuf, buffer, offset + i * stride, 1, stride);
+    }
+  }
+}
 
-    .pVertexInputState   = (&vertInputInfo),
-    .pInputAssemblyState = (&assemblyInfo),
-    .pViewportState      = (&viewportInfo),
-    .pRasterizationState = (&rasterInfo),
-    .pMultisampleState   = (&msInfo),
-    .pColorBlendState    = (&blendInfo),
-    .pDepthStencilState  = (&depthStencil),
-    .layout              = _pipelineLayout,
-    .renderPass          = _renderPass,
-    .subpass             = 0,
-    .basePipelineHandle  = VK_NULL_HANDLE,
+gfx::Frustum gfx::Frustum::fromViewProject(glm::mat4 const &m) {
+  auto row = [&](int i) { return glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]); };
+
+  Frustum frustum = {
+    .planes = {
+      row(3) + row(0),  // left
+      row(3) - row(0),  // right
+      row(3) + row(1),  // bottom
+      row(3) - row(1),  // top
+      row(2),           // near
+      row(3) - row(2),  // far
+    },
   };
 
-  if (vkCreateGraphicsPipelines(_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &_graphicsPipeline)
-      != VK_SUCCESS)
-    {
-      std::cerr << "Failed to construct graphics pipeline!" << std::endl;
-      std::exit(-1);
-    }
-
-  // IMPORTANT it's safe to delete VkShaderModule's after the pipeline is built,
-  // we need to make sure they're all deleted here to avoid a leak.
-  for (auto &shinfo : shaderStages) {
-    vkDestroyShaderModule(_device, shinfo.module, nullptr);
+  for (auto &plane : frustum.planes) {
+    plane /= glm::length(glm::vec3(plane));
   }
-}
 
-// Abstract the construction of VkImageCreateInfo
-//
-// Used in various places where images are constructed. Mostly in
-// gfx::Engine::init() at the moment.
-VkImageCreateInfo
-gfx::Engine::_imageInfo(VkFormat format, VkImageUsageFlags usageFlags, VkExtent3D extent) {
-  VkImageCreateInfo info = {
-    .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-    .pNext = nullptr,
+  return frustum;
+}
 
-    .imageType = VK_IMAGE_TYPE_2D,
+bool gfx::Frustum::intersects(glm::vec3 const &center,
+			      glm::vec3 const &halfExtent,
+			      glm::mat4 const &model) const
+{
+  glm::vec3 worldCenter = glm::vec3(model * glm::vec4(center, 1.0f));
 
-    .format = format,
-    .extent = extent,
+  // The half extent of the transformed box's own AABB.
+  glm::vec3 worldExtent = glm::abs(glm::vec3(model[0])) * halfExtent.x
+                        + glm::abs(glm::vec3(model[1])) * halfExtent.y
+                        + glm::abs(glm::vec3(model[2])) * halfExtent.z;
 
-    .mipLevels   = 1,
-    .arrayLayers = 1,
+  for (auto const &plane : planes) {
+    glm::vec3 normal = glm::vec3(plane);
 
-    .samples = VK_SAMPLE_COUNT_1_BIT,
-    .tiling  = VK_IMAGE_TILING_OPTIMAL,
-    .usage   = usageFlags,
-  };
+    if (glm::dot(normal, worldCenter) + plane.w + glm::dot(glm::abs(normal), worldExtent) < 0.0f) {
+      return false;
+    }
+  }
 
-  return info;
+  return true;
 }
 
-// Abstract the construction of VkImageCreateInfo
-//
-// Used in various places where image views are constructed. Mostly in
-// gfx::Engine::init() at the moment.
-VkImageViewCreateInfo
-gfx::Engine::_imageViewInfo(VkFormat format, VkImage image, VkImageAspectFlags aspectFlags) {
-  VkImageViewCreateInfo info = {
-    .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-    .pNext = nullptr,
+// Which level of detail to draw an instance of the mesh described by `info`
+// at: the coarsest whose error stays within LOD_PIXEL_ERROR on screen, judged
+// from the nearest point of the instance's bounding sphere. Returns an index
+// into `lods`. Must match selectLOD in cull-instances.comp.
+static uint32_t
+selectLOD(gfx::MeshInfo const    &info,
+	  gfx::LODInfo const     *lods,
+	  glm::mat4 const        &model,
+	  gfx::CameraData const  &camera)
+{
+  uint32_t first = info.lods.x;
+  uint32_t count = info.lods.y;
 
-    .image    = image,
+  float scale = std::max(glm::length(glm::vec3(model[0])),
+			 std::max(glm::length(glm::vec3(model[1])),
+				  glm::length(glm::vec3(model[2]))));
 
-    .viewType = VK_IMAGE_VIEW_TYPE_2D,
-    .format   = format,
-    .subresourceRange = {
-      .baseMipLevel   = 0,
-      .levelCount     = 1,
-      .baseArrayLayer = 0,
-      .layerCount     = 1,
-      .aspectMask     = aspectFlags,
-    },
-  };
+  glm::vec3 center   = glm::vec3(model * glm::vec4(glm::vec3(info.center), 1.0f));
+  float     radius   = glm::length(glm::vec3(info.halfExtent)) * scale;
+  float     distance = glm::length(center - camera.position) - radius;
 
-  return info;
-}
+  if (distance <= 0.0f) return first;
 
-// Monster function where SDL and Vulkan are initialized, and all
-// graphics-related systems with the same lifetime as the engine are
-// initialized.
-//
-// This includes building pipelines and initializing per-frame synchronization
-// primitives.
-//
-// Log and exit on failure.
-void gfx::Engine::init() {
-  SDL_Init(SDL_INIT_EVERYTHING);
+  float pixelsPerError = camera.lodScale * scale / distance;
 
-  _window = SDL_CreateWindow(
-    "crpg", 0, 0, 1920, 1080, SDL_WINDOW_SHOWN | SDL_WINDOW_VULKAN);
+  uint32_t lod = 0;
 
-  uint32_t extensionCount = 0;
+  while (lod + 1 < count && lods[first + lod + 1].error * pixelsPerError <= 1.0f) lod++;
 
-  SDL_Vulkan_GetInstanceExtensions(_window, &extensionCount, nullptr);
+  return first + lod;
+}
 
-  std::vector<char const*> extensionNames(extensionCount);
+// Ask _textures for enough of each visible instance's textures to cover it
+// texel for pixel, taking the texture to span the instance's bounding sphere.
+// Like selectLOD, that's judged from the sphere's nearest point, so anything
+// the camera is inside of gets every level.
+void
+gfx::Engine::_requestTextureCoverage(MultiMesh         *meshes,
+				     Frustum const     &frustum,
+				     CameraData const  &camera)
+{
+  // Pixels a unit spans at a distance of 1.
+  float pixelsPerUnit = camera.lodScale * LOD_PIXEL_ERROR;
 
-  SDL_Vulkan_GetInstanceExtensions(_window, &extensionCount, extensionNames.data());
+  if (!_isResident(meshes)) return;
 
-  for (auto const & ext : extensionNames) {
-    std::cout << "Extension '" << ext << "' supported" << std::endl;
-  }
+  glm::mat4 const  *models       = _scene.models();
+  uint32_t const   *meshIndices  = _scene.meshIndices();
 
-  VkApplicationInfo appInfo {
-    .sType              = VK_STRUCTURE_TYPE_APPLICATION_INFO,
-    .pApplicationName   = "crpg",
-    .applicationVersion = VK_MAKE_VERSION(0, 0, 1),
-    .pEngineName        = "crpg",
-    .engineVersion      = VK_MAKE_VERSION(0, 0, 1),
-    .apiVersion         = VK_API_VERSION_1_2,
-  };
+  for (size_t i = 0; i < _scene.size(); i++) {
+    auto const &info  = meshes->meshInfos[meshIndices[i]];
+    auto const &model = models[i];
 
-  VkInstanceCreateInfo createInfo {
-    .sType                   = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-    .pApplicationInfo        = &appInfo,
-    .enabledExtensionCount   = extensionCount,
-    .ppEnabledExtensionNames = extensionNames.data(),
-    .enabledLayerCount       = static_cast<uint32_t>(_enabledLayers.size()),
-    .ppEnabledLayerNames     = _enabledLayers.data(),
-  };
+    if (!frustum.intersects(glm::vec3(info.center), glm::vec3(info.halfExtent), model)) {
+      continue;
+    }
 
-  if (vkCreateInstance(&createInfo, nullptr, &_instance) != VK_SUCCESS) {
-    std::cerr << "failed to create instance!" << std::endl;
-    std::exit(-1);
+    float scale = std::max(glm::length(glm::vec3(model[0])),
+			   std::max(glm::length(glm::vec3(model[1])),
+				    glm::length(glm::vec3(model[2]))));
+
+    glm::vec3 center   = glm::vec3(model * glm::vec4(glm::vec3(info.center), 1.0f));
+    float     radius   = glm::length(glm::vec3(info.halfExtent)) * scale;
+    float     distance = glm::length(center - camera.position) - radius;
+
+    float pixels = distance <= 0.0f
+      ? std::numeric_limits<float>::max()
+      : 2.0f * radius * pixelsPerUnit / distance;
+
+    for (uint32_t slot : info.textures) {
+      if (slot != 0) _textures.request(slot, pixels);
+    }
   }
+}
 
-  uint32_t layerCount;
+// Hand _scene to `frame`, to be culled against `frustum` and each of
+// `frame`'s shadow cascades. Until `meshes` is resident there's nothing to
+// cull.
+//
+// With _gpuCulling the scene lives in _sceneBuffer, and only the places that
+// changed since the last frame are written, into sceneAlloc; the early phase
+// copies them over, merging runs of neighbouring places into one region.
+// _cullInstances then records the passes that test every instance and build
+// the draws for the camera and every cascade. Otherwise _writeDraws does it
+// here, once for each view, and the camera's draws are all in the early phase.
+//
+// Meshes whose draws won't fit in MAX_DRAWS are dropped.
+void
+gfx::Engine::_flushInstances(PerFrame *frame, MultiMesh *meshes, Frustum const &frustum) {
+  uint32_t instanceCount = _isResident(meshes) ? (uint32_t)_scene.size() : 0;
 
-  vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+  if (!_gpuCulling) {
+    // Nothing keeps a copy of the scene on the GPU.
+    _scene.clearDirty();
 
-  std::vector<VkLayerProperties> availableLayers(layerCount);
+    // Copied out once, since cameraData is mapped device memory.
+    CameraData camera = *frame->cameraData;
 
-  vkEnumerateInstanceLayerProperties(&layerCount, availableLayers.data());
+    for (auto &view : frame->shadows) {
+      _writeDraws(frame, meshes, view.frustum, camera, MeshPass::DirectionalShadow, &view.draws);
 
-  std::cout << "Available layers:" << std::endl;
-  for (auto & layer : availableLayers) {
-    std::cout << "    '" << layer.layerName << "'" << std::endl;
-  }
-  std::cout << std::endl;
+      view.globalOffsets = {
+	(uint32_t)view.cameraAlloc.offset,
+	(uint32_t)view.draws.instanceAlloc.offset,
+      };
+    }
 
-  uint32_t physicalDeviceCount = 0;
+    // Sorted for the prepass, which is where front to back pays off. The
+    // forward pass draws the same list.
+    uint32_t drawn = _writeDraws(frame, meshes, frustum, camera, MeshPass::DepthPrepass,
+				 &frame->draws);
 
-  vkEnumeratePhysicalDevices(_instance, &physicalDeviceCount, nullptr);
+    frame->globalOffsets = {
+      (uint32_t)frame->cameraAlloc.offset,
+      (uint32_t)frame->draws.instanceAlloc.offset,
+    };
 
-  if (physicalDeviceCount == 0) {
-    std::cerr << "No Devices with Vulkan Support!" << std::endl;
-    std::exit(-1);
+    _cullStats = {
+      .instances        = instanceCount,
+      .frustumCulled    = instanceCount - drawn,
+      .occlusionCulled  = 0,
+      .drawnEarly       = drawn,
+      .drawnLate        = 0,
+    };
+
+    return;
   }
 
-  std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
+  // Places past the end of the scene were vacated; whatever's left there is
+  // never read.
+  std::vector<uint32_t> const &dirty = _scene.dirty();
 
-  vkEnumeratePhysicalDevices(_instance, &physicalDeviceCount, physicalDevices.data());
+  glm::mat4 const  *models       = _scene.models();
+  uint32_t const   *meshIndices  = _scene.meshIndices();
 
-  std::cout << "Available devices: " << std::endl;
-  for (const auto & candidate : physicalDevices) {
-    VkPhysicalDeviceProperties props;
-    VkPhysicalDeviceFeatures   feats;
+  uint32_t live = (uint32_t)(std::lower_bound(dirty.begin(), dirty.end(), _scene.size())
+			     - dirty.begin());
 
-    vkGetPhysicalDeviceProperties(candidate, &props);
-    vkGetPhysicalDeviceFeatures(candidate, &feats);
+  InstanceData *changed = frame->transient.alloc<InstanceData>(live, &frame->sceneAlloc);
 
-    std::cout << "device '"<<  props.deviceName << "' {" << std::endl;
-    std::cout << "  properties {" << std::endl;
-    std::cout << "    // TODO ..." << std::endl;
-    std::cout << "  }" << std::endl;
-    std::cout << "  features {" << std::endl;
-    std::cout << "    alphaToOne:               "
-	      << (feats.alphaToOne ? "true" : "false") << std::endl;
-    std::cout << "    depthBiasClamp:           "
-	      << (feats.depthBiasClamp ? "true" : "false") << std::endl;
-    std::cout << "    depthBounds:              "
-	      << (feats.depthBounds ? "true" : "false") << std::endl;
-    std::cout << "    depthClamp:               "
-	      << (feats.depthClamp ? "true" : "false") << std::endl;
-    std::cout << "    dualSrcBlend:             "
-	      << (feats.dualSrcBlend ? "true" : "false") << std::endl;
-    std::cout << "    fillModeNonSolid:         "
-	      << (feats.fillModeNonSolid ? "true" : "false") << std::endl;
-    std::cout << "    fragmentStoresAndAtomics: "
-	      << (feats.fragmentStoresAndAtomics ? "true" : "false") << std::endl;
-    std::cout << "    fullDrawIndexUint32:      "
-	      << (feats.fullDrawIndexUint32 ? "true" : "false") << std::endl;
-    std::cout << "    geometryShader:           "
-	      << (feats.geometryShader ? "true" : "false") << std::endl;
-    std::cout << "    imageCubeArray:           "
-	      << (feats.imageCubeArray ? "true" : "false") << std::endl;
-    std::cout << "    independentBlend:         "
-	      << (feats.independentBlend ? "true" : "false") << std::endl;
-    std::cout << "    inheritedQueries:         "
-	      << (feats.inheritedQueries ? "true" : "false") << std::endl;
-    std::cout << "    largePoints:              "
-	      << (feats.largePoints ? "true" : "false") << std::endl;
-    std::cout << "    logicOp:                  "
-	      << (feats.logicOp ? "true" : "false") << std::endl;
-    std::cout << "    multiDrawIndirect:        "
-	      << (feats.multiDrawIndirect ? "true" : "false") << std::endl;
-    std::cout << "    multiViewport:            "
-	      << (feats.multiViewport ? "true" : "false") << std::endl;
-    std::cout << "    occlusionQueryPrecise:    "
-	      << (feats.occlusionQueryPrecise ? "true" : "false") << std::endl;
-    std::cout << "    pipelineStatisticsQuery:  "
-	      << (feats.pipelineStatisticsQuery ? "true" : "false") << std::endl;
-    std::cout << "    robustBufferAccess:       "
-	      << (feats.robustBufferAccess ? "true" : "false") << std::endl;
-    std::cout << "  }" << std::endl;
-    std::cout << "}" << std::endl;
-  }
+  frame->sceneCopies.clear();
 
+  for (uint32_t d = 0; d < live; d++) {
+    uint32_t place = dirty[d];
 
-  SDL_Vulkan_CreateSurface(_window, _instance, &_surface);
+    changed[d] = {
+      .model      = models[place],
+      .meshIndex  = meshIndices[place],
+    };
 
-  _physicalDevice = physicalDevices[0];
+    VkDeviceSize src = frame->sceneAlloc.offset + d * sizeof(InstanceData);
+    VkDeviceSize dst = place * sizeof(InstanceData);
 
-  uint32_t queueFamilyCount = 0;
-  vkGetPhysicalDeviceQueueFamilyProperties(_physicalDevice, &queueFamilyCount, nullptr);
-  std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
-  vkGetPhysicalDeviceQueueFamilyProperties(
-    _physicalDevice,
-    &queueFamilyCount,
-    queueFamilies.data()
-    );
+    if (!frame->sceneCopies.empty()) {
+      auto &prev = frame->sceneCopies.back();
 
-  int i = 0;
-  for (auto const & qf : queueFamilies) {
-    if (qf.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-      _graphicsFamily = i;
-    }
-    VkBool32 presentSupport = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(_physicalDevice, i, _surface, &presentSupport);
-    if (presentSupport) {
-      _presentFamily = i;
+      if (prev.dstOffset + prev.size == dst) {
+	prev.size += sizeof(InstanceData);
+	continue;
+      }
     }
 
-    i++;
+    frame->sceneCopies.push_back({
+	.srcOffset  = src,
+	.dstOffset  = dst,
+	.size       = sizeof(InstanceData),
+      });
   }
 
-  if (!_graphicsFamily.has_value()) {
-    std::cerr << "No Queue Family capable of Graphics!" << std::endl;
-    std::exit(-1);
-  }
+  _scene.clearDirty();
 
-  float queuePriority = 1.0f;
+  size_t meshCount = meshes->ids.size();
 
-  std::set<uint32_t> uniqueFamilies = {
-    _graphicsFamily.value(),
-    _presentFamily.value(),
-  };
+  // Each mesh's bucket starts where the one before it ends. The culling
+  // shaders pick levels of detail themselves, and lay them out within it.
+  frame->cullMeshFirst = frame->transient.alloc<uint32_t>(meshCount, &frame->cullMeshAlloc);
 
-  std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+  auto const &meshCounts = _scene.meshCounts();
 
-  for (uint32_t queueIdx : uniqueFamilies) {
-    queueCreateInfos.push_back(VkDeviceQueueCreateInfo {
-	.sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-	.queueFamilyIndex = queueIdx,
-	.queueCount       = 1,
-	.pQueuePriorities = &queuePriority,
-      });
+  for (size_t m = 0, first = 0; m < meshCount; m++) {
+    frame->cullMeshFirst[m]  = (uint32_t)first;
+    first                   += meshCounts[m];
   }
 
-  VkPhysicalDeviceFeatures  deviceFeatures {};
-  std::vector<char const *> deviceExtensions {
-    "VK_KHR_swapchain",
+  // Survivors are always bound from the start of visibleInstanceBuffer, and
+  // candidates from the start of _sceneBuffer.
+  frame->globalOffsets = {
+    (uint32_t)frame->cameraAlloc.offset,
+    0,
   };
 
-  VkDeviceCreateInfo deviceCreateInfo {
-    .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-    .pQueueCreateInfos       = queueCreateInfos.data(),
-    .queueCreateInfoCount    = static_cast<uint32_t>(queueCreateInfos.size()),
-    .pEnabledFeatures        = &deviceFeatures,
-    .enabledLayerCount       = static_cast<uint32_t>(_enabledLayers.size()),
-    .ppEnabledLayerNames     = _enabledLayers.data(),
-    .enabledExtensionCount   = static_cast<uint32_t>(deviceExtensions.size()),
-    .ppEnabledExtensionNames = deviceExtensions.data(),
+  frame->cullOffsets = {
+    0,
+    (uint32_t)frame->cullMeshAlloc.offset,
+    (uint32_t)frame->cameraAlloc.offset,
   };
 
-  if (vkCreateDevice(_physicalDevice, &deviceCreateInfo, nullptr, &_device) != VK_SUCCESS) {
-    std::cerr << "Failed to create logical device" << std::endl;
-    std::exit (-1);
+  for (auto &view : frame->shadows) {
+    view.globalOffsets = {
+      (uint32_t)view.cameraAlloc.offset,
+      0,
+    };
   }
 
-  VmaAllocatorCreateInfo allocatorInfo = {};
+  frame->frustum        = frustum;
+  frame->instanceCount  = instanceCount;
+}
 
-  allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_2;
-  allocatorInfo.physicalDevice   = _physicalDevice;
-  allocatorInfo.device           = _device;
-  allocatorInfo.instance         = _instance;
+// Test each of _scene's instances against `frustum`, pick each survivor's
+// level of detail, and sort them through _renderQueue, for `pass`. Each run of
+// survivors sharing a level of the same mesh is one instanced command per
+// meshlet (or one for a mesh that wasn't split), whose firstInstance points at
+// the run's start, with the run's instances front to back. static-mesh.vert
+// then finds its transform at instances[gl_InstanceIndex].
+//
+// Draws nothing until `meshes` is resident. Leaves _scene alone, so it can be
+// called once per view.
+uint32_t
+gfx::Engine::_writeDraws(PerFrame          *frame,
+			 MultiMesh         *meshes,
+			 Frustum const     &frustum,
+			 CameraData const  &camera,
+			 uint32_t          pass,
+			 DrawList          *draws)
+{
+  Material *material = _meshMaterial(meshes);
+  uint32_t pipeline  = material->shaders[pass]->id;
 
-  vmaCreateAllocator(&allocatorInfo, &_allocator);
+  // An instance's depth is how far its center is in front of the near plane,
+  // in steps of CAMERA_FAR / 0xFFFF.
+  glm::vec4 const &nearPlane = frustum.planes[4];
 
-  struct SwapChainSupportDetails {
-    VkSurfaceCapabilitiesKHR        capabilities;
-    std::vector<VkSurfaceFormatKHR> formats;
+  glm::mat4 const  *models       = _scene.models();
+  uint32_t const   *meshIndices  = _scene.meshIndices();
+
+  uint32_t sceneSize = _isResident(meshes) ? (uint32_t)_scene.size() : 0;
+
+  _renderQueue.clear();
+
+  for (uint32_t i = 0; i < sceneSize; i++) {
+    auto const &info  = meshes->meshInfos[meshIndices[i]];
+    auto const &model = models[i];
+
+    if (!frustum.intersects(glm::vec3(info.center), glm::vec3(info.halfExtent), model)) {
+      continue;
+    }
+
+    uint32_t lod = selectLOD(info, meshes->lods.data(), model, camera);
+
+    glm::vec3 center = glm::vec3(model * glm::vec4(glm::vec3(info.center), 1.0f));
+    float     depth  = glm::dot(glm::vec3(nearPlane), center) + nearPlane.w;
+
+    _renderQueue.push(RenderQueue::key(pass, pipeline, material->id,
+				       meshes->ranges[meshIndices[i]].group, lod,
+				       (uint32_t)(std::clamp(depth / CAMERA_FAR, 0.0f, 1.0f) * 0xFFFF)),
+		      i);
+  }
+
+  _renderQueue.sort();
+
+  uint32_t instanceCount = (uint32_t)_renderQueue.size();
+
+  InstanceData *instanceData =
+    frame->transient.alloc<InstanceData>(instanceCount, &draws->instanceAlloc);
+
+  // Where each run of the sorted queue that a single command can draw ends.
+  auto runEnd = [&](uint32_t first) {
+    uint32_t end = first + 1;
+
+    while (end < instanceCount
+	   && RenderQueue::sameDraw(_renderQueue[first].key, _renderQueue[end].key)) end++;
+
+    return end;
+  };
+
+  // Only levels with instances get draws, so that's all we need room for.
+  uint32_t maxDraws = 0;
+
+  for (uint32_t first = 0; first < instanceCount; first = runEnd(first)) {
+    maxDraws += meshes->lods[RenderQueue::mesh(_renderQueue[first].key)].drawCount;
+  }
+
+  draws->drawCmds = frame->transient.alloc<VkDrawIndexedIndirectCommand>(
+    std::min(maxDraws, (uint32_t)MAX_DRAWS), &draws->drawAlloc);
+
+  uint32_t  *drawCounts  =
+    frame->transient.alloc<uint32_t>(MultiMesh::MAX_INDEX_GROUPS, &draws->drawCountAlloc);
+  uint32_t  drawCount    = 0;
+
+  std::fill(std::begin(draws->groupDrawCount), std::end(draws->groupDrawCount), 0);
+
+  // The pool sorts above the mesh, so each group's draws come out in one run.
+  for (uint32_t first = 0, end; first < instanceCount; first = end) {
+    end = runEnd(first);
+
+    for (uint32_t slot = first; slot < end; slot++) {
+      uint32_t place = _renderQueue[slot].item;
+
+      instanceData[slot] = {
+	.model      = models[place],
+	.meshIndex  = meshIndices[place],
+      };
+    }
+
+    uint64_t    key  = _renderQueue[first].key;
+    auto const  &lod = meshes->lods[RenderQueue::mesh(key)];
+
+    if (drawCount + lod.drawCount > MAX_DRAWS) continue;
+
+    for (uint32_t d = 0; d < lod.drawCount; d++) {
+      VkDrawIndexedIndirectCommand cmd = meshes->cmds[lod.firstDraw + d];
+
+      cmd.instanceCount  = end - first;
+      cmd.firstInstance  = first;
+
+      draws->drawCmds[drawCount++] = cmd;
+    }
+
+    draws->groupDrawCount[RenderQueue::pool(key)] += lod.drawCount;
+  }
+
+  for (uint32_t g = 0, firstDraw = 0; g < MultiMesh::MAX_INDEX_GROUPS; g++) {
+    draws->groupFirstDraw[g]  = firstDraw;
+    drawCounts[g]             = draws->groupDrawCount[g];
+    firstDraw                += draws->groupDrawCount[g];
+  }
+
+  return instanceCount;
+}
+
+// Split the first SHADOW_DISTANCE of the view into CASCADE_COUNT slices, each
+// SHADOW_SPLIT_LAMBDA of the way from even to logarithmic spacing, and fit a
+// cascade around each: an orthographic view down the light over the slice's
+// bounding sphere, reaching SHADOW_CASTER_MARGIN further towards the light for
+// anything that might cast into it.
+//
+// The sphere doesn't change size as the camera turns, and its center is
+// snapped to whole texels in a light view that only rotates, so shadow edges
+// stay put while the camera moves.
+void
+gfx::Engine::_updateShadows(PerFrame *frame, glm::mat4 const &view, glm::mat4 const &project) {
+  ShadowData *data = frame->transient.alloc<ShadowData>(1, &frame->shadowAlloc);
+
+  float nearDist = CAMERA_NEAR;
+  float farDist  = std::min(SHADOW_DISTANCE, CAMERA_FAR);
+
+  // Half the view's width and height at a distance of 1.
+  float tanX = 1.0f / project[0][0];
+  float tanY = 1.0f / std::abs(project[1][1]);
+
+  glm::mat4 toWorld = glm::inverse(view);
+
+  glm::vec3 up = std::abs(_toLight.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+
+  glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), -_toLight, up);
+
+  float sliceNear = nearDist;
+
+  for (uint32_t c = 0; c < ShadowData::CASCADE_COUNT; c++) {
+    float t = (float)(c + 1) / ShadowData::CASCADE_COUNT;
+
+    float logSplit  = nearDist * std::pow(farDist / nearDist, t);
+    float evenSplit = nearDist + (farDist - nearDist) * t;
+    float sliceFar  = SHADOW_SPLIT_LAMBDA * logSplit + (1.0f - SHADOW_SPLIT_LAMBDA) * evenSplit;
+
+    glm::vec3 corners[8];
+    glm::vec3 center { 0.0f };
+
+    for (int i = 0; i < 8; i++) {
+      float d  = (i & 4) ? sliceFar : sliceNear;
+      float sx = (i & 1) ? 1.0f : -1.0f;
+      float sy = (i & 2) ? 1.0f : -1.0f;
+
+      corners[i] = glm::vec3(toWorld * glm::vec4(sx * d * tanX, sy * d * tanY, -d, 1.0f));
+      center    += corners[i] / 8.0f;
+    }
+
+    float radius = 0.0f;
+
+    for (auto const &corner : corners) radius = std::max(radius, glm::length(corner - center));
+
+    // Rounded up, so float error doesn't make it flicker from frame to frame.
+    radius = std::ceil(radius * 16.0f) / 16.0f;
+
+    float texel = 2.0f * radius / SHADOW_MAP_SIZE;
+
+    glm::vec3 lightCenter = glm::vec3(lightView * glm::vec4(center, 1.0f));
+
+    lightCenter.x = std::floor(lightCenter.x / texel) * texel;
+    lightCenter.y = std::floor(lightCenter.y / texel) * texel;
+
+    // The light view looks down -z, so nearer the light is larger z.
+    glm::mat4 lightProject = glm::orthoRH_ZO(lightCenter.x - radius, lightCenter.x + radius,
+					     lightCenter.y - radius, lightCenter.y + radius,
+					     -(lightCenter.z + radius + SHADOW_CASTER_MARGIN),
+					     radius - lightCenter.z);
+
+    glm::mat4 viewProject = lightProject * lightView;
+
+    auto &cascade = frame->shadows[c];
+
+    cascade.frustum = Frustum::fromViewProject(viewProject);
+
+    // Only viewProject is read when drawing into the cascade; culling goes by
+    // the frame's own camera.
+    *frame->transient.alloc<CameraData>(1, &cascade.cameraAlloc) = {
+      .view         = lightView,
+      .project      = lightProject,
+      .viewProject  = viewProject,
+      .position     = frame->cameraData->position,
+      .lodScale     = frame->cameraData->lodScale,
+    };
+
+    data->viewProject[c]  = viewProject;
+    data->splits[c]       = sliceFar;
+
+    sliceNear = sliceFar;
+  }
+
+  data->toLight = glm::vec4(_toLight, 0.0f);
+}
+
+// Record a global memory barrier between `src` and `dst`.
+static void
+memoryBarrier(VkCommandBuffer       cmdBuf,
+	      VkPipelineStageFlags  srcStage,
+	      VkAccessFlags         srcAccess,
+	      VkPipelineStageFlags  dstStage,
+	      VkAccessFlags         dstAccess)
+{
+  VkMemoryBarrier barrier = {
+    .sType  = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .pNext  = nullptr,
+
+    .srcAccessMask  = srcAccess,
+    .dstAccessMask  = dstAccess,
+  };
+
+  vkCmdPipelineBarrier(cmdBuf, srcStage, dstStage, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+// Each CullPhase is three compute passes over `frame`'s buffers.
+//
+// cull-instances.comp tests each candidate instance's bounds against the
+// frustum and, in the late phase, the depth pyramid, then picks a level of
+// detail for each instance the phase should draw. It claims a slot for the
+// instance in its level's bucket, counting them as it goes, and records its
+// pick in cullPickBuffer. The early phase only considers instances that were
+// visible last frame, and the late phase only draws those that weren't, so
+// between them nothing is drawn twice.
+//
+// cull-draws.comp then lays each mesh's levels out one after another within
+// the mesh's run of visibleInstanceBuffer, and appends the draws of each level
+// with any instances for this phase to its group's run of visibleDrawBuffer,
+// which is laid out like `meshes`' own indirect buffer, bumping the group's
+// draw count. _drawInstances draws each group with
+// vkCmdDrawIndexedIndirectCount, so the CPU never learns how many draws there
+// were.
+//
+// cull-scatter.comp finally copies each picked instance into its slot, now
+// that the buckets have been placed.
+//
+// The shadow phase runs the same passes once per cascade, against its frustum
+// alone, into the cascade's own buffers. It leaves the stats and
+// _visibilityBuffer alone, and lays its draws out like the early phase's.
+void
+gfx::Engine::_cullInstances(VkCommandBuffer  cmdBuf,
+			    PerFrame         *frame,
+			    PerSwapImage     *swap,
+			    MultiMesh        *meshes,
+			    CullPhase        phase,
+			    uint32_t         cascade)
+{
+  uint32_t meshCount = (uint32_t)meshes->ids.size();
+
+  auto &view = frame->shadows[cascade];
+
+  if (phase == CullPhase::Shadow) {
+    vkCmdFillBuffer(cmdBuf, view.visibleDrawBuffer.buffer,
+		    VISIBLE_DRAW_COUNT_OFFSET, VK_WHOLE_SIZE, 0);
+
+    memoryBarrier(cmdBuf,
+		  VK_PIPELINE_STAGE_TRANSFER_BIT,
+		  VK_ACCESS_TRANSFER_WRITE_BIT,
+		  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		  VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+  }
+
+  if (phase == CullPhase::Early) {
+    // Whatever in the scene changed goes into _sceneBuffer once the frames
+    // before us are done culling from it, which the barrier below makes
+    // visible to this frame's passes.
+    if (!frame->sceneCopies.empty()) {
+      memoryBarrier(cmdBuf,
+		    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		    0,
+		    VK_PIPELINE_STAGE_TRANSFER_BIT,
+		    VK_ACCESS_TRANSFER_WRITE_BIT);
+
+      vkCmdCopyBuffer(cmdBuf, frame->transient.buffer(), _sceneBuffer.buffer,
+		      (uint32_t)frame->sceneCopies.size(), frame->sceneCopies.data());
+    }
+
+    // Every count starts at zero, whether or not anything gets culled.
+    vkCmdFillBuffer(cmdBuf, frame->visibleDrawBuffer.buffer,
+		    VISIBLE_DRAW_COUNT_OFFSET, VK_WHOLE_SIZE, 0);
+    vkCmdFillBuffer(cmdBuf, frame->statsBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+
+    if (_resetVisibility) {
+      vkCmdFillBuffer(cmdBuf, _visibilityBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+      _resetVisibility = false;
+    }
+
+    // The pyramid is rebuilt from scratch every frame, but the culling
+    // shaders' set 2 expects it in GENERAL from the early phase on.
+    VkImageMemoryBarrier pyramidBarrier = {
+      .sType  = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .pNext  = nullptr,
+
+      .srcAccessMask  = 0,
+      .dstAccessMask  = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+
+      .oldLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
+      .newLayout  = VK_IMAGE_LAYOUT_GENERAL,
+
+      .srcQueueFamilyIndex  = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex  = VK_QUEUE_FAMILY_IGNORED,
+
+      .image  = swap->depthPyramid,
+      .subresourceRange = {
+	.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+	.baseMipLevel   = 0,
+	.levelCount     = swap->depthPyramidLevels,
+	.baseArrayLayer = 0,
+	.layerCount     = 1,
+      },
+    };
+
+    vkCmdPipelineBarrier(cmdBuf,
+			 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			 0, 0, nullptr, 0, nullptr, 1, &pyramidBarrier);
+
+    // This also orders us after the previous frame's late phase, which wrote
+    // the _visibilityBuffer we're about to read.
+    memoryBarrier(cmdBuf,
+		  VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		  VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+		  VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+		  | VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+
+    frame->statsValid = true;
+  }
+
+  if (frame->instanceCount == 0) return;
+
+  bool shadow = phase == CullPhase::Shadow;
+
+  CullConstants constants = {
+    .frustum        = shadow ? view.frustum : frame->frustum,
+    .instanceCount  = frame->instanceCount,
+    .meshCount      = meshCount,
+    .phase          = phase,
+    .occlusion      = _occlusionCulling && !shadow ? 1u : 0u,
+    .groupFirstDraw = { },
+  };
+
+  for (size_t g = 0; g < meshes->groups.size(); g++) {
+    constants.groupFirstDraw[g] = meshes->groups[g].firstDraw;
+  }
+
+  VkDescriptorSet sets[] = {
+    shadow ? view.cullSet : frame->cullSet, meshes->meshSet(), swap->depthPyramidSet,
+  };
+
+  vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, _cullPipelineLayout,
+			  0, 3, sets,
+			  (uint32_t)frame->cullOffsets.size(), frame->cullOffsets.data());
+
+  vkCmdPushConstants(cmdBuf, _cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+		     0, sizeof(CullConstants), &constants);
+
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, _cullInstancesPipeline);
+  vkCmdDispatch(cmdBuf, (frame->instanceCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+  memoryBarrier(cmdBuf,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_ACCESS_SHADER_WRITE_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, _cullDrawsPipeline);
+  vkCmdDispatch(cmdBuf, (meshCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+  memoryBarrier(cmdBuf,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_ACCESS_SHADER_WRITE_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, _cullScatterPipeline);
+  vkCmdDispatch(cmdBuf, (frame->instanceCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+  memoryBarrier(cmdBuf,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_ACCESS_SHADER_WRITE_BIT,
+		VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+		VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+}
+
+// Reduce `swap`'s depth image into its depth pyramid, one level per dispatch.
+// _renderPass's outgoing dependency makes the depth visible to us.
+void gfx::Engine::_buildDepthPyramid(VkCommandBuffer cmdBuf, PerSwapImage *swap) {
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, _reducePipeline);
+
+  for (uint32_t level = 0; level < swap->depthPyramidLevels; level++) {
+    uint32_t width  = std::max(swap->depthPyramidExtent.width  >> level, 1u);
+    uint32_t height = std::max(swap->depthPyramidExtent.height >> level, 1u);
+
+    vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, _reducePipelineLayout,
+			    0, 1, &swap->reduceSets[level], 0, nullptr);
+
+    vkCmdDispatch(cmdBuf, (width + 7) / 8, (height + 7) / 8, 1);
+
+    memoryBarrier(cmdBuf,
+		  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		  VK_ACCESS_SHADER_WRITE_BIT,
+		  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		  VK_ACCESS_SHADER_READ_BIT);
+  }
+}
+
+// Draw whatever _flushInstances or _cullInstances left in `frame` for `phase`
+// in index group `g`. Culling on the CPU draws everything in the early phase,
+// and each cascade's draws are laid out like the early phase's.
+//
+// Only reads Engine state, so any number of job threads can call this at once.
+void
+gfx::Engine::_drawInstances(VkCommandBuffer  cmdBuf,
+			    PerFrame         *frame,
+			    MultiMesh        *meshes,
+			    CullPhase        phase,
+			    uint32_t         cascade,
+			    uint32_t         g)
+{
+  bool      shadow  = phase == CullPhase::Shadow;
+  uint32_t  p       = phase == CullPhase::Late ? 1 : 0;
+
+  if (!_gpuCulling && phase == CullPhase::Late) return;
+
+  if (_gpuCulling) {
+    auto const &group = meshes->groups[g];
+
+    if (group.firstDraw >= MAX_DRAWS) return;
+
+    VkBuffer buffer = shadow
+      ? frame->shadows[cascade].visibleDrawBuffer.buffer
+      : frame->visibleDrawBuffer.buffer;
+
+    VkDeviceSize countOffset =
+      VISIBLE_DRAW_COUNT_OFFSET + (p * MultiMesh::MAX_INDEX_GROUPS + g) * sizeof(uint32_t);
+
+    _bindIndexGroup(cmdBuf, meshes, g);
+
+    _drawIndirect(cmdBuf,
+		  buffer,
+		  (p * MAX_DRAWS + group.firstDraw) * sizeof(VkDrawIndexedIndirectCommand),
+		  countOffset,
+		  std::min(group.drawCount, (uint32_t)MAX_DRAWS - group.firstDraw),
+		  nullptr);
+
+    return;
+  }
+
+  DrawList const &draws = shadow ? frame->shadows[cascade].draws : frame->draws;
+
+  if (draws.groupDrawCount[g] == 0) return;
+
+  _bindIndexGroup(cmdBuf, meshes, g);
+
+  _drawIndirect(cmdBuf,
+		draws.drawAlloc.buffer,
+		draws.drawAlloc.offset
+		+ draws.groupFirstDraw[g] * sizeof(VkDrawIndexedIndirectCommand),
+		draws.drawCountAlloc.offset + g * sizeof(uint32_t),
+		draws.groupDrawCount[g],
+		draws.drawCmds + draws.groupFirstDraw[g]);
+}
+
+// Each bucket is one pass over one view, and binds its pipeline, sets and
+// vertex buffer once; only the index buffer changes, between index groups.
+// Every bucket gets a command buffer, even if it turns out to draw nothing, so
+// `draws` doesn't depend on what was culled.
+void
+gfx::Engine::_recordDraws(PerFrame      *frame,
+			  PerSwapImage  *swap,
+			  MultiMesh     *meshes,
+			  FrameDraws    *draws)
+{
+  uint32_t groupCount = (uint32_t)meshes->groups.size();
+
+  struct Bucket {
+    uint32_t   pass;
+    CullPhase  phase;
+    uint32_t   cascade;
+
+    VkCommandBuffer *out;
+  };
+
+  std::vector<Bucket> buckets;
+
+  for (uint32_t c = 0; c < ShadowData::CASCADE_COUNT; c++) {
+    buckets.push_back({ MeshPass::DirectionalShadow, CullPhase::Shadow, c, &draws->shadows[c] });
+  }
+
+  for (uint32_t p = 0; p < 2; p++) {
+    CullPhase phase = p == 0 ? CullPhase::Early : CullPhase::Late;
+
+    buckets.push_back({ MeshPass::DepthPrepass, phase, 0, &draws->prepass[p] });
+    buckets.push_back({ MeshPass::Forward,      phase, 0, &draws->forward[p] });
+  }
+
+  _jobs.parallelFor(buckets.size(), [&](size_t b, size_t thread) {
+    Bucket const &run = buckets[b];
+
+    bool shadow = run.phase == CullPhase::Shadow;
+
+    VkRenderPass renderPass = shadow                         ? _shadowRenderPass
+                            : run.phase == CullPhase::Early  ? _renderPass
+                            :                                  _lateRenderPass;
+
+    VkCommandBufferInheritanceInfo inheritance = {
+      .sType  = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+      .pNext  = nullptr,
+
+      .renderPass   = renderPass,
+      .subpass      = run.pass == MeshPass::Forward ? 1u : 0u,
+      .framebuffer  = shadow ? _shadowFramebuffers[run.cascade] : swap->framebuf,
+
+      .occlusionQueryEnable  = VK_FALSE,
+      .queryFlags            = 0,
+      .pipelineStatistics    = 0,
+    };
+
+    VkCommandBuffer cmdBuf = _allocCmdBuffer(frame->recordPools[thread],
+					     VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+
+    _beginCmdBuffer(cmdBuf,
+		    VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+		    | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+		    &inheritance);
+
+    // Secondaries inherit nothing bound or set in the primary, including the
+    // viewport and scissor that the mesh pipelines leave dynamic.
+    auto const &view = frame->shadows[run.cascade];
+
+    VkDescriptorSet                 globalSet      = shadow ? view.globalSet : frame->globalSet;
+    std::array<uint32_t, 2> const  &globalOffsets  = shadow ? view.globalOffsets : frame->globalOffsets;
+
+    vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, _pipelineLayout,
+			    0, 1, &globalSet,
+			    (uint32_t)globalOffsets.size(), globalOffsets.data());
+
+    // Only the forward pass has a fragment shader to read them.
+    if (run.pass == MeshPass::Forward) {
+      VkDescriptorSet  textureSet    = _textures.set(_currentFrame);
+      uint32_t         shadowOffset  = (uint32_t)frame->shadowAlloc.offset;
+
+      vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, _pipelineLayout,
+			      2, 1, &textureSet, 0, nullptr);
+      vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, _pipelineLayout,
+			      3, 1, &frame->shadowSet, 1, &shadowOffset);
+    }
+
+    VkExtent2D extent = shadow ? VkExtent2D { SHADOW_MAP_SIZE, SHADOW_MAP_SIZE } : _swapExtent;
+
+    VkViewport viewport = {
+      .x  = 0,
+      .y  = 0,
+
+      .width   = (float)extent.width,
+      .height  = (float)extent.height,
+
+      .minDepth  = 0.0f,
+      .maxDepth  = 1.0f,
+    };
+
+    VkRect2D scissor = {
+      .offset  = { 0, 0 },
+      .extent  = extent,
+    };
+
+    vkCmdSetViewport(cmdBuf, 0, 1, &viewport);
+    vkCmdSetScissor(cmdBuf, 0, 1, &scissor);
+
+    _bindMultiMesh(cmdBuf, meshes, run.pass);
+
+    for (uint32_t g = 0; g < groupCount; g++) {
+      _drawInstances(cmdBuf, frame, meshes, run.phase, run.cascade, g);
+    }
+
+    if (vkEndCommandBuffer(cmdBuf) != VK_SUCCESS) {
+      std::cerr << "failed to end secondary command buffer." << std::endl;
+      std::exit(-1);
+    }
+
+    *run.out = cmdBuf;
+  });
+}
+
+void gfx::Engine::setOcclusionCulling(bool enabled) {
+  if (enabled && !_gpuCulling) {
+    std::cerr << "Occlusion culling needs GPU culling, which this device can't do" << std::endl;
+    return;
+  }
+
+  // Visibility from before it was turned off is long stale.
+  if (enabled && !_occlusionCulling) _resetVisibility = true;
+
+  _occlusionCulling = enabled;
+}
+
+// Allocate a Buffer with the given parameters using the VmaAllocator, counted
+// under `category`.
+//
+// Log and exit on failure.
+void gfx::Engine::_allocBuffer(size_t              size,
+			       VkBufferUsageFlags  vkUsage,
+			       VmaMemoryUsage      memoryUsage,
+			       uint32_t            category,
+			       gfx::Buffer         *buffer)
+{
+  uint32_t families[2] = { _graphicsFamily.value(), _transferFamily.value() };
+
+  // Buffers filled by the _uploader are written on the transfer queue and read
+  // on the graphics queue. Sharing them concurrently saves us from having to
+  // transfer ownership after every upload.
+  bool concurrent = (vkUsage & VK_BUFFER_USAGE_TRANSFER_DST_BIT)
+                 && families[0] != families[1];
+
+  VkBufferCreateInfo bufferInfo = {
+    .sType  = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .pNext  = nullptr,
+
+    .size   = size,
+    .usage  = vkUsage,
+
+    .sharingMode            = concurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+    .queueFamilyIndexCount  = concurrent ? 2u : 0u,
+    .pQueueFamilyIndices    = concurrent ? families : nullptr,
+  };
+
+  VmaAllocationCreateInfo vmaAllocInfo = {};
+
+  vmaAllocInfo.usage = memoryUsage;
+
+  if (vmaCreateBuffer(_allocator,
+		      &bufferInfo,
+		      &vmaAllocInfo,
+		      &buffer->buffer,
+		      &buffer->alloc,
+		      nullptr) != VK_SUCCESS)
+  {
+    std::cerr << "Failed to allocate a buffer of size " << size << std::endl;
+    std::exit(-1);
+  }
+
+  _memory.track(category, buffer->alloc);
+}
+
+
+// Allocate a persistently mapped, host-visible Buffer using the VmaAllocator,
+// and return a pointer to its mapping.
+//
+// Writes through the pointer must be followed by vmaFlushAllocation, which is
+// a no-op on host-coherent memory.
+//
+// Log and exit on failure.
+void *gfx::Engine::_allocMappedBuffer(size_t              size,
+				      VkBufferUsageFlags  vkUsage,
+				      uint32_t            category,
+				      gfx::Buffer         *buffer)
+{
+  VkBufferCreateInfo bufferInfo = {
+    .sType  = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .pNext  = nullptr,
+
+    .size   = size,
+    .usage  = vkUsage,
+  };
+
+  VmaAllocationCreateInfo vmaAllocInfo = {};
+
+  vmaAllocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+  vmaAllocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+  VmaAllocationInfo allocInfo;
+
+  if (vmaCreateBuffer(_allocator,
+		      &bufferInfo,
+		      &vmaAllocInfo,
+		      &buffer->buffer,
+		      &buffer->alloc,
+		      &allocInfo) != VK_SUCCESS)
+  {
+    std::cerr << "Failed to allocate a mapped buffer of size " << size << std::endl;
+    std::exit(-1);
+  }
+
+  _memory.track(category, buffer->alloc);
+
+  return allocInfo.pMappedData;
+}
+
+// Free a buffer allocated by _allocBuffer
+void gfx::Engine::_freeBuffer(Buffer *buf) {
+  _memory.untrack(buf->alloc);
+  vmaDestroyBuffer(_allocator, buf->buffer, buf->alloc);
+}
+
+// Free a mesh allocated by _loadMesh
+void gfx::Engine::_freeMesh(Mesh *mesh) {
+  _geometry.free(&mesh->geometry);
+}
+
+// Free a mesh allocated by _streamMultiMesh. Any of its meshes still in
+// flight are dropped when they arrive.
+void gfx::Engine::_freeMultiMesh(MultiMesh *meshes) {
+  _streamTargets.erase(meshes->streamTicket);
+  _rebasing.erase(std::remove(_rebasing.begin(), _rebasing.end(), meshes), _rebasing.end());
+
+  // Copies into these buffers may still be running on the transfer queue,
+  // including the draws _rebaseMultiMesh sent after a move.
+  if (!_uploader.completed(meshes->uploadSerial)
+      || !_uploader.completed(meshes->geometry.serial))
+  {
+    _uploader.wait();
+  }
+
+  _geometry.free(&meshes->geometry);
+  _freeBuffer(&meshes->indirectBuffer);
+  _freeBuffer(&meshes->meshInfoBuffer);
+  _freeBuffer(&meshes->lodBuffer);
+
+  for (auto const &info : meshes->meshInfos) {
+    for (uint32_t slot : info.textures) {
+      if (slot != 0) _textures.release(slot);
+    }
+  }
+}
+
+// Called by _geometry once it has moved `meshes`' vertices by `vertexDelta`
+// vertices, or its indices by `indexDelta` bytes. Point its ranges and draws at
+// the new place, and send the draws to the copy of indirectBuffer that no frame
+// reads. Frames keep drawing the old copy, and so the old range, until
+// _switchIndirect sees the upload land; the _geometry pool holds on to the old
+// range until then.
+//
+// The other copy is free once every frame drawn from it is done, which is
+// the case once framesInFlight frames have started since the last switch.
+bool gfx::Engine::_rebaseMultiMesh(MultiMesh *meshes, int64_t vertexDelta, int64_t indexDelta) {
+  if (meshes->rebaseSerial != 0) return false;
+  if (_framesDrawn < meshes->sideFrame + _perFrames.size()) return false;
+
+  for (auto &range : meshes->ranges) {
+    range.firstVertex += vertexDelta;
+    range.indexOffset += indexDelta;
+  }
+
+  for (auto &group : meshes->groups) {
+    int64_t indexSize = group.type == VK_INDEX_TYPE_UINT32 ? 4 : 2;
+
+    group.offset += indexDelta;
+
+    for (uint32_t d = group.firstDraw; d < group.firstDraw + group.drawCount; d++) {
+      meshes->cmds[d].firstIndex   += indexDelta / indexSize;
+      meshes->cmds[d].vertexOffset += vertexDelta;
+    }
+  }
+
+  _uploader.upload(meshes->indirectBuffer.buffer, (1 - meshes->indirectSide) * meshes->indirectStride,
+		   meshes->cmds.data(), meshes->indirectCountOffset());
+
+  meshes->rebaseSerial = _uploader.nextSerial();
+
+  _rebasing.push_back(meshes);
+
+  return true;
+}
+
+void gfx::Engine::_switchIndirect() {
+  for (auto *meshes : _rebasing) {
+    if (!_uploader.completed(meshes->rebaseSerial)) continue;
+
+    meshes->indirectSide  = 1 - meshes->indirectSide;
+    meshes->sideFrame     = _framesDrawn;
+    meshes->rebaseSerial  = 0;
+  }
+
+  _rebasing.erase(std::remove_if(_rebasing.begin(), _rebasing.end(),
+				 [](MultiMesh *meshes) { return meshes->rebaseSerial == 0; }),
+		  _rebasing.end());
+}
+
+// Abstract the creation of VkPipelineMultisampleStateCreateInfo
+//
+// Used in _initPipelines
+VkPipelineMultisampleStateCreateInfo
+gfx::Engine::_multisampleInfo() {
+  VkPipelineMultisampleStateCreateInfo info = {
+    .sType  = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+    .pNext  = nullptr,
+
+    .rasterizationSamples  = VK_SAMPLE_COUNT_1_BIT,
+
+    .sampleShadingEnable  = VK_FALSE,
+    .minSampleShading     = 1.0f,
+    .pSampleMask          = nullptr,
+
+    .alphaToCoverageEnable  = VK_FALSE,
+    .alphaToOneEnable       = VK_FALSE,
+  };
+
+  return info;
+}
+
+
+// Abstract the creation of VkPipelineColorBlendAttachmentState
+//
+// Used in _initPipelines
+VkPipelineColorBlendAttachmentState
+gfx::Engine::_colorBlendAttachState() {
+  VkPipelineColorBlendAttachmentState state = {
+    .colorWriteMask  = VK_COLOR_COMPONENT_R_BIT
+                     | VK_COLOR_COMPONENT_G_BIT
+                     | VK_COLOR_COMPONENT_B_BIT
+                     | VK_COLOR_COMPONENT_A_BIT,
+
+    .blendEnable  = VK_FALSE,
+  };
+
+  return state;
+}
+
+// Abstract the creation of VkPipelineDepthStencilStateCreateInfo
+//
+// Used in _initPipelines
+VkPipelineDepthStencilStateCreateInfo
+gfx::Engine::_depthStencilState(bool depthTest, bool depthWrite, VkCompareOp cmp) {
+  VkPipelineDepthStencilStateCreateInfo info = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+    .pNext = nullptr,
+
+    .depthTestEnable  = (depthTest ? VK_TRUE : VK_FALSE),
+    .depthWriteEnable = (depthWrite ? VK_TRUE : VK_FALSE),
+    .depthCompareOp   = (depthTest ? cmp : VK_COMPARE_OP_ALWAYS),
+
+    .depthBoundsTestEnable = VK_FALSE,
+    .minDepthBounds        = 0.0f,
+    .maxDepthBounds        = 1.0f,
+    .stencilTestEnable     = VK_FALSE,
+  };
+
+  return info;
+}
+
+// Abstract the creation of VkPipelineLayoutCreateInfo
+//
+// Used in _initPipelines
+VkPipelineLayoutCreateInfo
+gfx::Engine::_pipelineLayoutInfo(VkDescriptorSetLayout *setLayouts, uint32_t setLayoutCount) {
+  VkPipelineLayoutCreateInfo info = {
+    .sType  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+    .pNext  = nullptr,
+    .flags  = 0,
+
+    .setLayoutCount  = setLayoutCount,
+    .pSetLayouts     = setLayouts,
+
+    .pushConstantRangeCount  = 0,
+    .pPushConstantRanges     = nullptr,
+  };
+
+  return info;
+}
+
+// Here is where we actually initialize our pipelines. Right now there's one
+// material for rendering static meshes in each vertex format, all sharing one
+// layout: set 0 is per-frame (or per-cascade), set 1 is per-MultiMesh, set 2
+// is the _textures array for the frame, and set 3 its shadows. Each material
+// has a pass for the shadow cascades, the depth prepass and the forward pass,
+// and all six pipelines are compiled in parallel, through the on-disk pipeline
+// cache.
+//
+// Log and exit on failure.
+void gfx::Engine::_initPipelines() {
+  _pipelines.init(_device, _physicalDevice, ".data/pipeline.cache", &_jobs,
+		  [this](ShaderEffect const *effect, PassVariant const &variant, VkPipelineCache cache) {
+		    return _initMeshPipeline(effect, variant, cache);
+		  });
+
+  VkDescriptorSetLayoutBinding meshSetBindings[] = {
+    {
+      .descriptorCount    = 1,
+      .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .pImmutableSamplers = nullptr,
+      .stageFlags         = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+      .binding            = 0,
+    },
+    {
+      .descriptorCount    = 1,
+      .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .pImmutableSamplers = nullptr,
+      .stageFlags         = VK_SHADER_STAGE_COMPUTE_BIT,
+      .binding            = 1,
+    },
+    {
+      .descriptorCount    = 1,
+      .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .pImmutableSamplers = nullptr,
+      .stageFlags         = VK_SHADER_STAGE_COMPUTE_BIT,
+      .binding            = 2,
+    },
+  };
+
+  VkDescriptorSetLayoutCreateInfo meshSetInfo = {
+    .sType  = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .pNext  = nullptr,
+    .flags  = 0,
+
+    .bindingCount  = 3,
+    .pBindings     = meshSetBindings,
+  };
+
+  // This matches the layout DescriptorBuilder gets from the cache in
+  // _allocMultiMesh.
+  _meshSetLayout = _descriptorLayoutCache.createDescriptorLayout(&meshSetInfo);
+
+  VkDescriptorSetLayout setLayouts[] = {
+    _globalSetLayout, _meshSetLayout, _textures.layout(), _shadowSetLayout,
+  };
+
+  auto layoutInfo  = _pipelineLayoutInfo(setLayouts, 4);
+  if (vkCreatePipelineLayout(_device, &layoutInfo, nullptr, &_pipelineLayout) != VK_SUCCESS) {
+    std::cerr << "Failed to create pipeline layout." << std::endl;
+    std::exit(-1);
+  }
+
+  ShaderEffect *staticEffect = _pipelines.effect(".data/static-mesh.vert.spv",
+						 ".data/static-mesh.frag.spv",
+						 _pipelineLayout);
+
+  ShaderEffect *packedEffect = _pipelines.effect(".data/static-mesh-packed.vert.spv",
+						 ".data/static-mesh.frag.spv",
+						 _pipelineLayout);
+
+  ShaderEffect *staticDepthEffect = _pipelines.effect(".data/static-mesh-depth.vert.spv", "",
+						      _pipelineLayout);
+
+  ShaderEffect *packedDepthEffect = _pipelines.effect(".data/static-mesh-packed-depth.vert.spv", "",
+						      _pipelineLayout);
+
+  MaterialInfo staticInfo = { };
+  MaterialInfo packedInfo = { };
+
+  staticInfo.effects[MeshPass::DirectionalShadow]  = staticDepthEffect;
+  staticInfo.effects[MeshPass::DepthPrepass]       = staticDepthEffect;
+  staticInfo.effects[MeshPass::Forward]            = staticEffect;
+
+  packedInfo.effects[MeshPass::DirectionalShadow]  = packedDepthEffect;
+  packedInfo.effects[MeshPass::DepthPrepass]       = packedDepthEffect;
+  packedInfo.effects[MeshPass::Forward]            = packedEffect;
+
+  // _lateRenderPass is compatible with _renderPass, so the prepass and
+  // forward pass draw in either.
+  for (uint32_t p : { MeshPass::DirectionalShadow, MeshPass::DepthPrepass, MeshPass::Forward }) {
+    PassVariant variant = {
+      .vertexFormat  = asset::VertexFormat::Full,
+      .renderPass    = p == MeshPass::DirectionalShadow ? _shadowRenderPass : _renderPass,
+      .subpass       = p == MeshPass::Forward ? 1u : 0u,
+      .pass          = p,
+    };
+
+    staticInfo.variants[p]  = variant;
+
+    variant.vertexFormat    = asset::VertexFormat::Packed;
+    packedInfo.variants[p]  = variant;
+  }
+
+  // Everything at once, rather than one material at a time.
+  std::vector<std::pair<ShaderEffect *, PassVariant>> passes;
+
+  for (MaterialInfo const *info : { &staticInfo, &packedInfo }) {
+    for (size_t p = 0; p < MeshPass::MAX; p++) {
+      if (info->effects[p]) passes.push_back({ info->effects[p], info->variants[p] });
+    }
+  }
+
+  _pipelines.compile(passes);
+
+  _staticMaterial = _pipelines.material("static-mesh", staticInfo);
+  _packedMaterial = _pipelines.material("static-mesh-packed", packedInfo);
+
+  if (_gpuCulling) _initCullPipelines();
+}
+
+void gfx::Engine::_initCullPipelines() {
+  VkDescriptorSetLayout setLayouts[] = {
+    _cullSetLayout, _meshSetLayout, _depthPyramidSetLayout,
+  };
+
+  VkPushConstantRange constantRange = {
+    .stageFlags  = VK_SHADER_STAGE_COMPUTE_BIT,
+    .offset      = 0,
+    .size        = sizeof(CullConstants),
+  };
+
+  auto layoutInfo = _pipelineLayoutInfo(setLayouts, 3);
+
+  layoutInfo.pushConstantRangeCount  = 1;
+  layoutInfo.pPushConstantRanges     = &constantRange;
+
+  if (vkCreatePipelineLayout(_device, &layoutInfo, nullptr, &_cullPipelineLayout) != VK_SUCCESS) {
+    std::cerr << "Failed to create culling pipeline layout." << std::endl;
+    std::exit(-1);
+  }
+
+  _cullInstancesPipeline = _initComputePipeline(".data/cull-instances.comp.spv",
+						_cullPipelineLayout);
+  _cullDrawsPipeline     = _initComputePipeline(".data/cull-draws.comp.spv",
+						_cullPipelineLayout);
+  _cullScatterPipeline   = _initComputePipeline(".data/cull-scatter.comp.spv",
+						_cullPipelineLayout);
+
+  auto reduceLayoutInfo = _pipelineLayoutInfo(&_reduceSetLayout, 1);
+
+  if (vkCreatePipelineLayout(_device, &reduceLayoutInfo, nullptr, &_reducePipelineLayout)
+      != VK_SUCCESS)
+    {
+      std::cerr << "Failed to create depth reduction pipeline layout." << std::endl;
+      std::exit(-1);
+    }
+
+  _reducePipeline = _initComputePipeline(".data/depth-reduce.comp.spv", _reducePipelineLayout);
+}
+
+VkPipeline
+gfx::Engine::_initComputePipeline(char const *shaderPath, VkPipelineLayout layout) {
+  auto stageInfo = _loadShaderStageInfo(shaderPath, VK_SHADER_STAGE_COMPUTE_BIT);
+
+  VkComputePipelineCreateInfo pipelineInfo = {
+    .sType  = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+    .pNext  = nullptr,
+    .flags  = 0,
+
+    .stage               = stageInfo,
+    .layout              = layout,
+    .basePipelineHandle  = VK_NULL_HANDLE,
+    .basePipelineIndex   = -1,
+  };
+
+  VkPipeline pipeline;
+
+  if (vkCreateComputePipelines(_device, _pipelines.cache(), 1, &pipelineInfo, nullptr, &pipeline)
+      != VK_SUCCESS)
+    {
+      std::cerr << "Failed to construct compute pipeline " << shaderPath << std::endl;
+      std::exit(-1);
+    }
+
+  vkDestroyShaderModule(_device, stageInfo.module, nullptr);
+
+  return pipeline;
+}
+
+// The depth-only passes -- the prepass and the shadow cascades -- fetch just
+// the position attribute, have no color attachments, and write depth. The
+// forward pass only shades what its phase's prepass left nearest, so it
+// leaves depth alone, and anything behind that fails the test before
+// static-mesh.frag runs.
+VkPipeline
+gfx::Engine::_initMeshPipeline(ShaderEffect const  *effect,
+			       PassVariant const   &variant,
+			       VkPipelineCache     cache)
+{
+  bool depthOnly = variant.pass == MeshPass::DepthPrepass
+                || variant.pass == MeshPass::DirectionalShadow;
+
+  auto assemblyInfo  = _inputAssemblyInfo(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+  auto rasterInfo    = _rasterStateInfo(VK_POLYGON_MODE_FILL);
+  auto msInfo        = _multisampleInfo();
+
+  // Keeps lit surfaces from shadowing themselves.
+  if (variant.pass == MeshPass::DirectionalShadow) {
+    rasterInfo.depthBiasEnable          = VK_TRUE;
+    rasterInfo.depthBiasConstantFactor  = SHADOW_DEPTH_BIAS;
+    rasterInfo.depthBiasSlopeFactor     = SHADOW_SLOPE_BIAS;
+  }
+
+  auto colorBlendState  = _colorBlendAttachState();
+
+  std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+
+  for (auto const &stage : effect->stages) {
+    shaderStages.push_back({
+	.sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+	.pNext  = nullptr,
+
+	.stage   = stage.stage,
+	.module  = stage.module,
+	.pName   = "main",
+      });
+  }
+
+  auto vertInputDesc = variant.vertexFormat == asset::VertexFormat::Packed
+    ? asset::PackedVertexData::vertexInputDescription()
+    : asset::StaticVertexData::vertexInputDescription();
+
+  // Position always comes first, so the depth-only passes read the same
+  // interleaved vertex buffer, with the same stride, and skip the rest.
+  if (depthOnly) vertInputDesc.attribs.resize(1);
+
+  auto vertInputInfo = vertInputDesc.vertexInputInfo();
+
+  auto depthStencil = _depthStencilState(true, depthOnly, VK_COMPARE_OP_LESS_OR_EQUAL);
+
+  VkViewport viewport = {
+    .x  = 0,
+    .y  = 0,
+
+    .width   = (float)_swapExtent.width,
+    .height  = (float)_swapExtent.height,
+
+    .minDepth  = 0.0f,
+    .maxDepth  = 1.0f,
+  };
+
+  VkRect2D scissor = {
+    .offset  = { 0, 0 },
+    .extent  = _swapExtent,
+  };
+
+  VkPipelineViewportStateCreateInfo viewportInfo = {
+    .sType  = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+    .pNext  = nullptr,
+
+    .viewportCount  = 1,
+    .pViewports     = (&viewport),
+
+    .scissorCount  = 1,
+    .pScissors     = (&scissor),
+  };
+
+  // The viewport and scissor are set when recording instead, so the pipeline
+  // survives the swapchain being resized.
+  std::array<VkDynamicState, 2> dynamicStates = {
+    VK_DYNAMIC_STATE_VIEWPORT,
+    VK_DYNAMIC_STATE_SCISSOR,
+  };
+
+  VkPipelineDynamicStateCreateInfo dynamicInfo = {
+    .sType  = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+    .pNext  = nullptr,
+    .flags  = 0,
+
+    .dynamicStateCount  = (uint32_t)dynamicStates.size(),
+    .pDynamicStates     = dynamicStates.data(),
+  };
+
+  VkPipelineColorBlendStateCreateInfo blendInfo = {
+    .sType  = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+    .pNext  = nullptr,
+
+    .logicOpEnable  = VK_FALSE,
+    .logicOp        = VK_LOGIC_OP_COPY,
+
+    .attachmentCount = depthOnly ? 0u : 1u,
+    .pAttachments    = (&colorBlendState),
+  };
+
+  VkGraphicsPipelineCreateInfo pipelineInfo = {
+    .sType  = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+    .pNext  = nullptr,
+
+    .stageCount  = (uint32_t)shaderStages.size(),
+    .pStages     = shaderStages.data(),
+
+    .pVertexInputState   = (&vertInputInfo),
+    .pInputAssemblyState = (&assemblyInfo),
+    .pViewportState      = (&viewportInfo),
+    .pRasterizationState = (&rasterInfo),
+    .pMultisampleState   = (&msInfo),
+    .pColorBlendState    = (&blendInfo),
+    .pDepthStencilState  = (&depthStencil),
+    .pDynamicState       = (&dynamicInfo),
+    .layout              = effect->layout,
+    .renderPass          = variant.renderPass,
+    .subpass             = variant.subpass,
+    .basePipelineHandle  = VK_NULL_HANDLE,
+  };
+
+  VkPipeline pipeline;
+
+  if (vkCreateGraphicsPipelines(_device, cache, 1, &pipelineInfo, nullptr, &pipeline)
+      != VK_SUCCESS)
+    {
+      std::cerr << "Failed to construct graphics pipeline!" << std::endl;
+      std::exit(-1);
+    }
+
+  // The shader modules belong to _pipelines, which keeps them around for
+  // building other variants.
+  return pipeline;
+}
+
+gfx::Material *gfx::Engine::_meshMaterial(MultiMesh *meshes) {
+  return meshes->vertexFormat == asset::VertexFormat::Packed ? _packedMaterial : _staticMaterial;
+}
+
+void gfx::Engine::_bindMultiMesh(VkCommandBuffer cmdBuf, MultiMesh *meshes, uint32_t pass) {
+  VkPipeline pipeline = _meshMaterial(meshes)->shaders[pass]->pipeline;
+
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+
+  VkDescriptorSet meshSet = meshes->meshSet();
+
+  vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, _pipelineLayout,
+			  1, 1, &meshSet, 0, nullptr);
+
+  VkBuffer      vertexBuffer  = _geometry.vertexBuffer(meshes->vertexFormat);
+  VkDeviceSize  offset        = 0;
+
+  vkCmdBindVertexBuffers(cmdBuf, 0, 1, &vertexBuffer, &offset);
+}
+
+// Every group binds the whole of the pool's index buffer, since their draws'
+// firstIndex count from its start.
+void gfx::Engine::_bindIndexGroup(VkCommandBuffer cmdBuf, MultiMesh *meshes, uint32_t group) {
+  auto const &g = meshes->groups[group];
+
+  vkCmdBindIndexBuffer(cmdBuf, _geometry.indexBuffer(), 0, g.type);
+}
+
+// Return the largest power of two that's no greater than `n`, which must be
+// nonzero.
+static inline uint32_t
+floorPow2(uint32_t n) {
+  uint32_t p = 1;
+  while (p <= n / 2) p *= 2;
+  return p;
+}
+
+// Abstract the construction of VkImageCreateInfo
+//
+// Used in various places where images are constructed. Mostly in
+// gfx::Engine::init() at the moment.
+VkImageCreateInfo
+gfx::Engine::_imageInfo(VkFormat format, VkImageUsageFlags usageFlags, VkExtent3D extent) {
+  VkImageCreateInfo info = {
+    .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+    .pNext = nullptr,
+
+    .imageType = VK_IMAGE_TYPE_2D,
+
+    .format = format,
+    .extent = extent,
+
+    .mipLevels   = 1,
+    .arrayLayers = 1,
+
+    .samples = VK_SAMPLE_COUNT_1_BIT,
+    .tiling  = VK_IMAGE_TILING_OPTIMAL,
+    .usage   = usageFlags,
+  };
+
+  return info;
+}
+
+// Abstract the construction of VkImageCreateInfo
+//
+// Used in various places where image views are constructed. Mostly in
+// gfx::Engine::init() at the moment.
+VkImageViewCreateInfo
+gfx::Engine::_imageViewInfo(VkFormat format, VkImage image, VkImageAspectFlags aspectFlags) {
+  VkImageViewCreateInfo info = {
+    .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+    .pNext = nullptr,
+
+    .image    = image,
+
+    .viewType = VK_IMAGE_VIEW_TYPE_2D,
+    .format   = format,
+    .subresourceRange = {
+      .baseMipLevel   = 0,
+      .levelCount     = 1,
+      .baseArrayLayer = 0,
+      .layerCount     = 1,
+      .aspectMask     = aspectFlags,
+    },
+  };
+
+  return info;
+}
+
+// Monster function where SDL and Vulkan are initialized, and all
+// graphics-related systems with the same lifetime as the engine are
+// initialized.
+//
+// This includes building pipelines and initializing per-frame synchronization
+// primitives.
+//
+// Log and exit on failure.
+void gfx::Engine::init() {
+  uint32_t extensionCount = 0;
+
+  std::vector<char const*> extensionNames;
+
+  // Offscreen there's no window, so no surface for SDL's extensions to serve.
+  if (!_options.headless) {
+    SDL_Init(SDL_INIT_EVERYTHING);
+
+    _window = SDL_CreateWindow(
+      "crpg", 0, 0, 1920, 1080, SDL_WINDOW_SHOWN | SDL_WINDOW_VULKAN | SDL_WINDOW_RESIZABLE);
+
+    SDL_Vulkan_GetInstanceExtensions(_window, &extensionCount, nullptr);
+
+    extensionNames.resize(extensionCount);
+
+    SDL_Vulkan_GetInstanceExtensions(_window, &extensionCount, extensionNames.data());
+  }
+
+  for (auto const & ext : extensionNames) {
+    std::cout << "Extension '" << ext << "' supported" << std::endl;
+  }
+
+  VkApplicationInfo appInfo {
+    .sType              = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+    .pApplicationName   = "crpg",
+    .applicationVersion = VK_MAKE_VERSION(0, 0, 1),
+    .pEngineName        = "crpg",
+    .engineVersion      = VK_MAKE_VERSION(0, 0, 1),
+    .apiVersion         = VK_API_VERSION_1_2,
+  };
+
+  VkInstanceCreateInfo createInfo {
+    .sType                   = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+    .pApplicationInfo        = &appInfo,
+    .enabledExtensionCount   = extensionCount,
+    .ppEnabledExtensionNames = extensionNames.data(),
+    .enabledLayerCount       = static_cast<uint32_t>(_enabledLayers.size()),
+    .ppEnabledLayerNames     = _enabledLayers.data(),
+  };
+
+  if (vkCreateInstance(&createInfo, nullptr, &_instance) != VK_SUCCESS) {
+    std::cerr << "failed to create instance!" << std::endl;
+    std::exit(-1);
+  }
+
+  uint32_t layerCount;
+
+  vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+
+  std::vector<VkLayerProperties> availableLayers(layerCount);
+
+  vkEnumerateInstanceLayerProperties(&layerCount, availableLayers.data());
+
+  std::cout << "Available layers:" << std::endl;
+  for (auto & layer : availableLayers) {
+    std::cout << "    '" << layer.layerName << "'" << std::endl;
+  }
+  std::cout << std::endl;
+
+  uint32_t physicalDeviceCount = 0;
+
+  vkEnumeratePhysicalDevices(_instance, &physicalDeviceCount, nullptr);
+
+  if (physicalDeviceCount == 0) {
+    std::cerr << "No Devices with Vulkan Support!" << std::endl;
+    std::exit(-1);
+  }
+
+  std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
+
+  vkEnumeratePhysicalDevices(_instance, &physicalDeviceCount, physicalDevices.data());
+
+  std::cout << "Available devices: " << std::endl;
+  for (const auto & candidate : physicalDevices) {
+    VkPhysicalDeviceProperties props;
+    VkPhysicalDeviceFeatures   feats;
+
+    vkGetPhysicalDeviceProperties(candidate, &props);
+    vkGetPhysicalDeviceFeatures(candidate, &feats);
+
+    std::cout << "device '"<<  props.deviceName << "' {" << std::endl;
+    std::cout << "  properties {" << std::endl;
+    std::cout << "    // TODO ..." << std::endl;
+    std::cout << "  }" << std::endl;
+    std::cout << "  features {" << std::endl;
+    std::cout << "    alphaToOne:               "
+	      << (feats.alphaToOne ? "true" : "false") << std::endl;
+    std::cout << "    depthBiasClamp:           "
+	      << (feats.depthBiasClamp ? "true" : "false") << std::endl;
+    std::cout << "    depthBounds:              "
+	      << (feats.depthBounds ? "true" : "false") << std::endl;
+    std::cout << "    depthClamp:               "
+	      << (feats.depthClamp ? "true" : "false") << std::endl;
+    std::cout << "    dualSrcBlend:             "
+	      << (feats.dualSrcBlend ? "true" : "false") << std::endl;
+    std::cout << "    fillModeNonSolid:         "
+	      << (feats.fillModeNonSolid ? "true" : "false") << std::endl;
+    std::cout << "    fragmentStoresAndAtomics: "
+	      << (feats.fragmentStoresAndAtomics ? "true" : "false") << std::endl;
+    std::cout << "    fullDrawIndexUint32:      "
+	      << (feats.fullDrawIndexUint32 ? "true" : "false") << std::endl;
+    std::cout << "    geometryShader:           "
+	      << (feats.geometryShader ? "true" : "false") << std::endl;
+    std::cout << "    imageCubeArray:           "
+	      << (feats.imageCubeArray ? "true" : "false") << std::endl;
+    std::cout << "    independentBlend:         "
+	      << (feats.independentBlend ? "true" : "false") << std::endl;
+    std::cout << "    inheritedQueries:         "
+	      << (feats.inheritedQueries ? "true" : "false") << std::endl;
+    std::cout << "    largePoints:              "
+	      << (feats.largePoints ? "true" : "false") << std::endl;
+    std::cout << "    logicOp:                  "
+	      << (feats.logicOp ? "true" : "false") << std::endl;
+    std::cout << "    multiDrawIndirect:        "
+	      << (feats.multiDrawIndirect ? "true" : "false") << std::endl;
+    std::cout << "    multiViewport:            "
+	      << (feats.multiViewport ? "true" : "false") << std::endl;
+    std::cout << "    occlusionQueryPrecise:    "
+	      << (feats.occlusionQueryPrecise ? "true" : "false") << std::endl;
+    std::cout << "    pipelineStatisticsQuery:  "
+	      << (feats.pipelineStatisticsQuery ? "true" : "false") << std::endl;
+    std::cout << "    robustBufferAccess:       "
+	      << (feats.robustBufferAccess ? "true" : "false") << std::endl;
+    std::cout << "  }" << std::endl;
+    std::cout << "}" << std::endl;
+  }
+
+
+  if (!_options.headless) SDL_Vulkan_CreateSurface(_window, _instance, &_surface);
+
+  _physicalDevice = physicalDevices[0];
+
+  uint32_t queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(_physicalDevice, &queueFamilyCount, nullptr);
+  std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(
+    _physicalDevice,
+    &queueFamilyCount,
+    queueFamilies.data()
+    );
+
+  int i = 0;
+  for (auto const & qf : queueFamilies) {
+    if (qf.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+      _graphicsFamily = i;
+    }
+    VkBool32 presentSupport = false;
+    if (_surface) vkGetPhysicalDeviceSurfaceSupportKHR(_physicalDevice, i, _surface, &presentSupport);
+    if (presentSupport) {
+      _presentFamily = i;
+    }
+
+    // Prefer a transfer-only family (usually backed by a DMA engine) over one
+    // that can also do compute.
+    if ((qf.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(qf.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+      if (!_transferFamily.has_value() || !(qf.queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+	_transferFamily = i;
+      }
+    }
+
+    i++;
+  }
+
+  if (!_graphicsFamily.has_value()) {
+    std::cerr << "No Queue Family capable of Graphics!" << std::endl;
+    std::exit(-1);
+  }
+
+  // Nothing is ever presented offscreen.
+  if (_options.headless) _presentFamily = _graphicsFamily;
+
+  if (_transferFamily.has_value()) {
+    std::cout << "Using dedicated transfer queue family " << _transferFamily.value() << std::endl;
+  } else {
+    _transferFamily = _graphicsFamily;
+  }
+
+  float queuePriority = 1.0f;
+
+  std::set<uint32_t> uniqueFamilies = {
+    _graphicsFamily.value(),
+    _presentFamily.value(),
+    _transferFamily.value(),
+  };
+
+  std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+
+  for (uint32_t queueIdx : uniqueFamilies) {
+    queueCreateInfos.push_back(VkDeviceQueueCreateInfo {
+	.sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+	.queueFamilyIndex = queueIdx,
+	.queueCount       = 1,
+	.pQueuePriorities = &queuePriority,
+      });
+  }
+
+  // Query the optional features we know how to take advantage of, and enable
+  // whichever of them the device supports.
+  VkPhysicalDeviceVulkan12Features supported12 {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    .pNext = nullptr,
+  };
+
+  VkPhysicalDeviceFeatures2 supported {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+    .pNext = &supported12,
+  };
+
+  vkGetPhysicalDeviceFeatures2(_physicalDevice, &supported);
+
+  _multiDrawIndirect          = supported.features.multiDrawIndirect;
+  _drawIndirectFirstInstance  = supported.features.drawIndirectFirstInstance;
+  _drawIndirectCount          = supported12.drawIndirectCount;
+
+  _gpuCulling = _drawIndirectCount && _drawIndirectFirstInstance
+             && (queueFamilies[_graphicsFamily.value()].queueFlags & VK_QUEUE_COMPUTE_BIT);
+
+  _occlusionCulling = _gpuCulling;
+
+  _textureCompressionBC    = supported.features.textureCompressionBC;
+  _textureCompressionASTC  = supported.features.textureCompressionASTC_LDR;
+
+  _hostQueryReset = supported12.hostQueryReset;
+
+  // Textures are one big array, indexed per instance and rewritten while
+  // frames that use it are in flight, so these aren't optional.
+  if (!supported12.runtimeDescriptorArray
+      || !supported12.descriptorBindingPartiallyBound
+      || !supported12.descriptorBindingSampledImageUpdateAfterBind
+      || !supported12.shaderSampledImageArrayNonUniformIndexing)
+  {
+    std::cerr << "Device doesn't support the descriptor indexing features bindless textures need"
+	      << std::endl;
+    std::exit(-1);
+  }
+
+  VkPhysicalDeviceVulkan12Features enabled12 {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    .pNext = nullptr,
+
+    .drawIndirectCount = _drawIndirectCount ? VK_TRUE : VK_FALSE,
+
+    .shaderSampledImageArrayNonUniformIndexing     = VK_TRUE,
+    .descriptorBindingSampledImageUpdateAfterBind  = VK_TRUE,
+    .descriptorBindingPartiallyBound               = VK_TRUE,
+    .runtimeDescriptorArray                        = VK_TRUE,
+
+    .hostQueryReset = _hostQueryReset ? VK_TRUE : VK_FALSE,
+  };
+
+  VkPhysicalDeviceFeatures2 deviceFeatures {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+    .pNext = &enabled12,
+
+    .features = {
+      .multiDrawIndirect           = _multiDrawIndirect ? VK_TRUE : VK_FALSE,
+      .drawIndirectFirstInstance   = _drawIndirectFirstInstance ? VK_TRUE : VK_FALSE,
+      .textureCompressionASTC_LDR  = _textureCompressionASTC ? VK_TRUE : VK_FALSE,
+      .textureCompressionBC        = _textureCompressionBC ? VK_TRUE : VK_FALSE,
+    },
+  };
+
+  std::cout << "multiDrawIndirect: " << (_multiDrawIndirect ? "enabled" : "unsupported") << std::endl;
+  std::cout << "drawIndirectCount: " << (_drawIndirectCount ? "enabled" : "unsupported") << std::endl;
+  std::cout << "drawIndirectFirstInstance: "
+	    << (_drawIndirectFirstInstance ? "enabled" : "unsupported") << std::endl;
+  std::cout << "culling on the " << (_gpuCulling ? "GPU" : "CPU") << std::endl;
+  std::cout << "hostQueryReset: " << (_hostQueryReset ? "enabled" : "unsupported") << std::endl;
+  std::cout << "textureCompressionBC: "
+	    << (_textureCompressionBC ? "enabled" : "unsupported") << std::endl;
+  std::cout << "textureCompressionASTC_LDR: "
+	    << (_textureCompressionASTC ? "enabled" : "unsupported") << std::endl;
+
+  // Lets VMA report each heap's real budget and our usage of it, rather than
+  // guessing, which matters most when the GPU shares system memory.
+  uint32_t deviceExtensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(_physicalDevice, nullptr, &deviceExtensionCount, nullptr);
+
+  std::vector<VkExtensionProperties> supportedExtensions(deviceExtensionCount);
+  vkEnumerateDeviceExtensionProperties(_physicalDevice, nullptr,
+				       &deviceExtensionCount, supportedExtensions.data());
+
+  bool memoryBudget = false;
+
+  for (auto const &ext : supportedExtensions) {
+    if (strcmp(ext.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) memoryBudget = true;
+  }
+
+  std::cout << "memoryBudget: " << (memoryBudget ? "enabled" : "unsupported") << std::endl;
+
+  std::vector<char const *> deviceExtensions;
+
+  if (!_options.headless) deviceExtensions.push_back("VK_KHR_swapchain");
+  if (memoryBudget) deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+  VkDeviceCreateInfo deviceCreateInfo {
+    .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+    .pNext                   = &deviceFeatures,
+    .pQueueCreateInfos       = queueCreateInfos.data(),
+    .queueCreateInfoCount    = static_cast<uint32_t>(queueCreateInfos.size()),
+    .pEnabledFeatures        = nullptr,
+    .enabledLayerCount       = static_cast<uint32_t>(_enabledLayers.size()),
+    .ppEnabledLayerNames     = _enabledLayers.data(),
+    .enabledExtensionCount   = static_cast<uint32_t>(deviceExtensions.size()),
+    .ppEnabledExtensionNames = deviceExtensions.data(),
+  };
+
+  if (vkCreateDevice(_physicalDevice, &deviceCreateInfo, nullptr, &_device) != VK_SUCCESS) {
+    std::cerr << "Failed to create logical device" << std::endl;
+    std::exit (-1);
+  }
+
+  VmaAllocatorCreateInfo allocatorInfo = {};
+
+  allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_2;
+  allocatorInfo.physicalDevice   = _physicalDevice;
+  allocatorInfo.device           = _device;
+  allocatorInfo.instance         = _instance;
+
+  if (memoryBudget) allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+
+  vmaCreateAllocator(&allocatorInfo, &_allocator);
+
+  _memory.init(_allocator, memoryBudget);
+
+  _depthFormat = VK_FORMAT_D32_SFLOAT;
+
+  if (_options.headless) {
+    _initOffscreenImages();
+  } else {
+    _initSwapchain();
+  }
+
+  vkGetDeviceQueue(_device, _graphicsFamily.value(), 0, &_graphicsQueue);
+  vkGetDeviceQueue(_device, _presentFamily.value(), 0, &_presentQueue);
+  vkGetDeviceQueue(_device, _transferFamily.value(), 0, &_transferQueue);
+
+  // GPU zones are only recorded on queues that can write timestamps; the
+  // rest of the profiler works regardless.
+  VkPhysicalDeviceProperties deviceProps;
+  vkGetPhysicalDeviceProperties(_physicalDevice, &deviceProps);
+
+  _timestampPeriod  = deviceProps.limits.timestampPeriod;
+  _timestampMask    = timestampMask(queueFamilies[_graphicsFamily.value()].timestampValidBits);
+
+  _storageAlignment = deviceProps.limits.minStorageBufferOffsetAlignment;
+
+  // A transfer-only queue can't reset queries itself, so the uploader resets
+  // them from the host.
+  _uploader.init(_device, _allocator, &_memory, _transferFamily.value(), _transferQueue,
+		 &_profiler,
+		 _hostQueryReset ? queueFamilies[_transferFamily.value()].timestampValidBits : 0,
+		 _timestampPeriod);
+
+  _streamer.init();
+
+  // This thread runs jobs too, whenever it waits on one.
+  _jobs.init(std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+			      MAX_JOB_THREADS) - 1);
+
+  VkCommandPoolCreateInfo globalPoolInfo = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .pNext = nullptr,
+
+    .queueFamilyIndex = _graphicsFamily.value(),
+    .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+  };
+
+  if (vkCreateCommandPool(_device, &globalPoolInfo, nullptr, &_globalCommandPool) != VK_SUCCESS) {
+    std::cerr << "Failed to create global command pool" << std::endl;
+    std::exit(-1);
+  }
+
+  VkCommandBufferAllocateInfo globalBufferAllocInfo = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .pNext = nullptr,
+
+    .commandPool          = _globalCommandPool,
+    .commandBufferCount   = 1,
+    .level                = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+  };
+
+  if (vkAllocateCommandBuffers(_device, &globalBufferAllocInfo, &_globalCommandBuffer) != VK_SUCCESS) {
+    std::cerr << "Failed to allocate global command buffer" << std::endl;
+    std::exit(-1);
+  }
+
+  VkAttachmentDescription colorAttach = {
+    .format   = _swapFormat,
+    .samples  = VK_SAMPLE_COUNT_1_BIT,
+
+    .loadOp   = VK_ATTACHMENT_LOAD_OP_CLEAR,
+    .storeOp  = VK_ATTACHMENT_STORE_OP_STORE,
+
+    .stencilLoadOp   = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+    .stencilStoreOp  = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+
+    .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
+    .finalLayout    = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+  };
+
+  VkAttachmentReference colorRef = {
+    .attachment = 0,
+    .layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+  };
+
+  VkAttachmentDescription depthAttach = {
+    .flags  = 0,
+
+    .format   = _depthFormat,
+    .samples  = VK_SAMPLE_COUNT_1_BIT,
+
+    .loadOp   = VK_ATTACHMENT_LOAD_OP_CLEAR,
+    .storeOp  = VK_ATTACHMENT_STORE_OP_STORE,
+
+    .stencilLoadOp   = VK_ATTACHMENT_LOAD_OP_CLEAR,
+    .stencilStoreOp  = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+
+    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    .finalLayout   = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+  };
+
+  VkAttachmentReference depthRef = {
+    .attachment = 1,
+    .layout     = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+  };
+
+  // Both render passes lay their phase's depth down in a prepass, then shade
+  // against it.
+  VkSubpassDescription subpasses[2] = {
+    {
+      .pipelineBindPoint  = VK_PIPELINE_BIND_POINT_GRAPHICS,
+
+      .colorAttachmentCount  = 0,
+      .pColorAttachments     = nullptr,
+
+      .pDepthStencilAttachment  = (&depthRef),
+    },
+    {
+      .pipelineBindPoint  = VK_PIPELINE_BIND_POINT_GRAPHICS,
+
+      .colorAttachmentCount  = 1,
+      .pColorAttachments     = (&colorRef),
+
+      .pDepthStencilAttachment  = (&depthRef),
+    },
+  };
+
+  VkSubpassDependency prepassDependency = {
+    .srcSubpass  = 0,
+    .dstSubpass  = 1,
+
+    .srcStageMask  = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+    .dstStageMask  = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                   | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+
+    .srcAccessMask  = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+    .dstAccessMask  = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
+
+    .dependencyFlags  = VK_DEPENDENCY_BY_REGION_BIT,
+  };
+
+  // The early phase's depth goes to _buildDepthPyramid, and both attachments
+  // on to _lateRenderPass.
+  VkSubpassDependency earlyDependency = {
+    .srcSubpass  = 1,
+    .dstSubpass  = VK_SUBPASS_EXTERNAL,
+
+    .srcStageMask  = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+                   | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .dstStageMask  = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                   | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                   | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+
+    .srcAccessMask  = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+                    | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+    .dstAccessMask  = VK_ACCESS_SHADER_READ_BIT
+                    | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+                    | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+                    | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
+                    | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+
+    .dependencyFlags  = 0,
+  };
+
+  VkAttachmentDescription attachments[2] = { colorAttach, depthAttach };
+
+  VkSubpassDependency earlyDependencies[2] = { prepassDependency, earlyDependency };
+
+  VkRenderPassCreateInfo renderPassInfo = {
+    .sType  = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+
+    .attachmentCount  = 2,
+    .pAttachments     = attachments,
+
+    .subpassCount  = 2,
+    .pSubpasses    = subpasses,
+
+    .dependencyCount  = 2,
+    .pDependencies    = earlyDependencies,
+  };
+
+  if (vkCreateRenderPass(_device, &renderPassInfo, nullptr, &_renderPass) != VK_SUCCESS) {
+    std::cerr << "Failed to create render pass..." << std::endl;
+    std::exit(-1);
+  }
+
+  // _lateRenderPass picks up where _renderPass left off, once the late phase's
+  // culling is done with the depth pyramid.
+  attachments[0].loadOp         = VK_ATTACHMENT_LOAD_OP_LOAD;
+  attachments[0].initialLayout  = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  attachments[0].finalLayout    = _options.headless
+                                ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+  attachments[1].loadOp         = VK_ATTACHMENT_LOAD_OP_LOAD;
+  attachments[1].storeOp        = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  attachments[1].stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  attachments[1].initialLayout  = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+  attachments[1].finalLayout    = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+  VkSubpassDependency lateDependency = {
+    .srcSubpass  = VK_SUBPASS_EXTERNAL,
+    .dstSubpass  = 0,
+
+    .srcStageMask  = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                   | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+                   | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .dstStageMask  = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                   | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+                   | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+
+    .srcAccessMask  = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+                    | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+    .dstAccessMask  = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+                    | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+                    | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
+                    | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+
+    .dependencyFlags  = 0,
+  };
+
+  // Color isn't touched until the forward subpass.
+  VkSubpassDependency lateColorDependency = {
+    .srcSubpass  = VK_SUBPASS_EXTERNAL,
+    .dstSubpass  = 1,
+
+    .srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .dstStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+
+    .srcAccessMask  = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+    .dstAccessMask  = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
+                    | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+
+    .dependencyFlags  = 0,
+  };
+
+  VkSubpassDependency lateDependencies[3] = {
+    lateDependency, lateColorDependency, prepassDependency,
+  };
+
+  renderPassInfo.dependencyCount  = 3;
+  renderPassInfo.pDependencies    = lateDependencies;
+
+  if (vkCreateRenderPass(_device, &renderPassInfo, nullptr, &_lateRenderPass) != VK_SUCCESS) {
+    std::cerr << "Failed to create late render pass..." << std::endl;
+    std::exit(-1);
+  }
+
+  _initShadows();
+
+  _initFramebuffers();
+
+  _initPerFrames();
+
+  _geometry.init(_allocator, &_memory, &_uploader,
+		 _graphicsFamily.value(), _transferFamily.value(),
+		 (uint32_t)_perFrames.size(),
+		 [this](GeometryAlloc *alloc, int64_t vertexDelta, int64_t indexDelta) {
+		   if (!alloc->owner) return true;
+
+		   return _rebaseMultiMesh((MultiMesh *)alloc->owner, vertexDelta, indexDelta);
+		 });
+
+  _textures.init(_device, _physicalDevice, _allocator, &_memory, &_uploader,
+		 _graphicsFamily.value(), _transferFamily.value(),
+		 (uint32_t)_perFrames.size(),
+		 _textureCompressionBC, _textureCompressionASTC);
+
+  if (_gpuCulling) _initDepthPyramids();
+
+  _initPipelines();
+
+  _initTestData();
+
+  _initialized = true;
+}
+
+static VkPresentModeKHR
+presentModeKHR(gfx::PresentMode mode) {
+  switch (mode) {
+  case gfx::PresentMode::Fifo:         return VK_PRESENT_MODE_FIFO_KHR;
+  case gfx::PresentMode::FifoRelaxed:  return VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+  case gfx::PresentMode::Mailbox:      return VK_PRESENT_MODE_MAILBOX_KHR;
+  case gfx::PresentMode::Immediate:    return VK_PRESENT_MODE_IMMEDIATE_KHR;
+  }
+
+  return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+char const *gfx::presentModeName(PresentMode mode) {
+  switch (mode) {
+  case PresentMode::Fifo:         return "fifo";
+  case PresentMode::FifoRelaxed:  return "relaxed";
+  case PresentMode::Mailbox:      return "mailbox";
+  case PresentMode::Immediate:    return "immediate";
+  }
+
+  return "unknown";
+}
+
+// Pick the swapchain's present mode, format, extent and image count, create
+// it, and set up each PerSwapImage's image view and depth image.
+//
+// Log and exit on failure.
+void gfx::Engine::_initSwapchain() {
+  struct SwapChainSupportDetails {
+    VkSurfaceCapabilitiesKHR        capabilities;
+    std::vector<VkSurfaceFormatKHR> formats;
     std::vector<VkPresentModeKHR>   presentModes;
   };
 
-  SwapChainSupportDetails details;
+  SwapChainSupportDetails details;
+
+  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_physicalDevice, _surface, &details.capabilities);
+
+  uint32_t formatCount = 0;
+  vkGetPhysicalDeviceSurfaceFormatsKHR(_physicalDevice, _surface, &formatCount, nullptr);
+  if (formatCount != 0) {
+    details.formats.resize(formatCount);
+    vkGetPhysicalDeviceSurfaceFormatsKHR(
+      _physicalDevice,
+      _surface,
+      &formatCount,
+      details.formats.data());
+  }
+
+
+  uint32_t presentModeCount = 0;
+  vkGetPhysicalDeviceSurfacePresentModesKHR(_physicalDevice, _surface, &presentModeCount, nullptr);
+  if (presentModeCount != 0) {
+    details.presentModes.resize(presentModeCount);
+    vkGetPhysicalDeviceSurfacePresentModesKHR(
+      _physicalDevice,
+      _surface,
+      &presentModeCount,
+      details.presentModes.data());
+  }
+
+  if (details.presentModes.empty() || details.formats.empty()) {
+    std::cerr << "swap  chain is inadequate!" << std::endl;
+  }
+
+  VkPresentModeKHR wanted = presentModeKHR(_options.presentMode);
+
+  VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  _presentMode                 = PresentMode::Fifo;
+
+  for (const auto &pm : details.presentModes) {
+    if (pm == wanted) {
+      presentMode   = pm;
+      _presentMode  = _options.presentMode;
+      break;
+    }
+  }
+
+  if (_presentMode != _options.presentMode) {
+    std::cerr << "Present mode " << presentModeName(_options.presentMode)
+	      << " isn't supported, falling back to " << presentModeName(_presentMode)
+	      << std::endl;
+  }
+
+  VkSurfaceFormatKHR format = details.formats[0];
+
+  for (const auto &fmt : details.formats) {
+    if (fmt.format == VK_FORMAT_B8G8R8A8_SRGB &&
+	fmt.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+      format = fmt;
+    }
+  }
+
+  VkExtent2D swapExtent;
+
+  if (details.capabilities.currentExtent.width != UINT32_MAX) {
+    swapExtent = details.capabilities.currentExtent;
+  } else {
+    int width, height;
+
+    SDL_Vulkan_GetDrawableSize(_window, &width, &height);
+
+    swapExtent = { (uint32_t)width, (uint32_t)height };
+
+    auto const & caps = details.capabilities;
+
+    swapExtent.width = std::max(
+      caps.minImageExtent.width,
+      std::min(caps.maxImageExtent.width, swapExtent.width));
+
+    swapExtent.height = std::max(
+      caps.minImageExtent.height,
+      std::min(caps.maxImageExtent.height, swapExtent.height));
+  }
+
+  uint32_t imageCount = std::min(
+    details.capabilities.minImageCount + 1,
+    details.capabilities.maxImageCount == 0 ? UINT32_MAX
+    : details.capabilities.maxImageCount);
+
+  std::set<uint32_t> familySet {
+    _graphicsFamily.value(),
+    _presentFamily.value(),
+  };
+
+  std::vector<uint32_t> familyIndices(familySet.begin(), familySet.end());
+
+  VkSwapchainCreateInfoKHR swapCreateInfo {
+    .sType                 = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+    .surface               = _surface,
+    .minImageCount         = imageCount,
+    .imageFormat           = format.format,
+    .imageColorSpace       = format.colorSpace,
+    .imageExtent           = swapExtent,
+    .imageArrayLayers      = 1,
+    .imageUsage            = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+    .imageSharingMode      = familyIndices.empty() ? VK_SHARING_MODE_CONCURRENT
+    : VK_SHARING_MODE_EXCLUSIVE,
+    .queueFamilyIndexCount = familyIndices.empty() ? 0
+    : (uint32_t)familyIndices.size(),
+    .pQueueFamilyIndices   = familyIndices.empty() ? nullptr
+    : familyIndices.data(),
+    .preTransform          = details.capabilities.currentTransform,
+    .compositeAlpha        = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+    .presentMode           = presentMode,
+    .clipped               = VK_TRUE,
+    .oldSwapchain          = _swapChain,
+  };
+
+  VkSwapchainKHR oldSwapchain = _swapChain;
+
+  if (vkCreateSwapchainKHR(_device, &swapCreateInfo, nullptr, &_swapChain)
+      != VK_SUCCESS)
+    {
+      std::cerr << "failed to create swapchain!" << std::endl;
+      std::exit (-1);
+    }
+
+  // Everything presented from it is done, since _recreateSwapchain waited
+  // for the device to go idle.
+  if (oldSwapchain != VK_NULL_HANDLE) vkDestroySwapchainKHR(_device, oldSwapchain, nullptr);
+
+  _swapFormat = format.format;
+  _swapExtent = swapExtent;
+
+  std::vector<VkImage> swapImages;
+
+  vkGetSwapchainImagesKHR(_device, _swapChain, &imageCount, nullptr);
+  _perSwaps.clear();
+  _perSwaps.resize(imageCount);
+  swapImages.resize(imageCount);
+  vkGetSwapchainImagesKHR(_device, _swapChain, &imageCount, swapImages.data());
+
+  for (size_t i = 0; i < _perSwaps.size(); i++) _perSwaps[i].image = swapImages[i];
+
+  _initSwapImages();
+}
+
+// The images are in the format the swapchain would most likely have picked,
+// and left in VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL by _lateRenderPass so they
+// can be read back.
+void gfx::Engine::_initOffscreenImages() {
+  _swapFormat = VK_FORMAT_B8G8R8A8_SRGB;
+  _swapExtent = _options.headlessExtent;
+
+  // draw() renders each frame into the image of the same index.
+  _perSwaps.clear();
+  _perSwaps.resize(std::clamp<uint32_t>(_options.framesInFlight, 1, MAX_FRAMES_IN_FLIGHT));
+
+  VkExtent3D extent = {
+    .width  = _swapExtent.width,
+    .height = _swapExtent.height,
+    .depth  = 1,
+  };
+
+  auto imageInfo = _imageInfo(_swapFormat,
+			      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+			      | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+			      extent);
+
+  VmaAllocationCreateInfo allocInfo = {
+    .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+    .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+  };
+
+  for (auto &swap : _perSwaps) {
+    if (vmaCreateImage(_allocator, &imageInfo, &allocInfo, &swap.image, &swap.imageAlloc, nullptr)
+	!= VK_SUCCESS)
+    {
+      std::cerr << "Failed to allocate offscreen image" << std::endl;
+      std::exit(-1);
+    }
+
+    _memory.track(MemoryCategory::RenderTarget, swap.imageAlloc);
+  }
+
+  _initSwapImages();
+}
+
+void gfx::Engine::_initSwapImages() {
+  for (size_t i = 0; i < _perSwaps.size(); i++) {
+    VkImageViewCreateInfo swapViewInfo {
+      .sType    = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+      .image    = _perSwaps[i].image,
+      .viewType = VK_IMAGE_VIEW_TYPE_2D,
+      .format   = _swapFormat,
+      .components = {
+	.r = VK_COMPONENT_SWIZZLE_IDENTITY,
+	.g = VK_COMPONENT_SWIZZLE_IDENTITY,
+	.b = VK_COMPONENT_SWIZZLE_IDENTITY,
+	.a = VK_COMPONENT_SWIZZLE_IDENTITY,
+      },
+      .subresourceRange = {
+	.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+	.baseMipLevel   = 0,
+	.levelCount     = 1,
+	.baseArrayLayer = 0,
+	.layerCount     = 1,
+      },
+    };
+
+    if (vkCreateImageView(_device, &swapViewInfo, nullptr, &_perSwaps[i].imageView) != VK_SUCCESS) {
+      std::cerr << "Failed to create image views" << std::endl;
+      std::exit(-1);
+    }
+
+    VkExtent3D depthExtent = {
+      .width  = _swapExtent.width,
+      .height = _swapExtent.height,
+      .depth  = 1,
+    };
+
+    // Sampled for building the depth pyramid.
+    auto depthInfo = _imageInfo(_depthFormat,
+				VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+				| VK_IMAGE_USAGE_SAMPLED_BIT,
+				depthExtent);
+    VmaAllocationCreateInfo depthAllocInfo = {
+      .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+      .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    };
+
+    if (vmaCreateImage(_allocator,
+		       &depthInfo,
+		       &depthAllocInfo,
+		       &_perSwaps[i].depth,
+		       &_perSwaps[i].depthAlloc,
+		       nullptr) != VK_SUCCESS)
+      {
+	std::cerr << "Failed to allocate depth image" << std::endl;
+	std::exit(-1);
+      }
+
+    _memory.track(MemoryCategory::RenderTarget, _perSwaps[i].depthAlloc);
+
+    auto depthViewInfo = _imageViewInfo(_depthFormat, _perSwaps[i].depth, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+    if (vkCreateImageView(_device, &depthViewInfo, nullptr, &_perSwaps[i].depthView) != VK_SUCCESS) {
+      std::cerr << "Failed to create depth image view" << std::endl;
+      std::exit(-1);
+    }
+  }
+}
+
+// Log and exit on failure.
+void gfx::Engine::_initFramebuffers() {
+  VkFramebufferCreateInfo framebufInfo = {
+    .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+    .pNext = nullptr,
+
+    .renderPass       = _renderPass,
+    .attachmentCount  = 2,
+
+    .width   = _swapExtent.width,
+    .height  = _swapExtent.height,
+    .layers  = 1,
+  };
+
+  for (auto & swap : _perSwaps) {
+    VkImageView attachments[2] = { swap.imageView, swap.depthView };
+    framebufInfo.pAttachments = attachments;
+    if (vkCreateFramebuffer(_device, &framebufInfo, nullptr, &swap.framebuf) != VK_SUCCESS) {
+      std::cerr << "Unable to create framebuffer" << std::endl;
+      std::exit(1);
+    }
+  }
+}
+
+// The shadow map never changes size, so none of this is rebuilt with the
+// swapchain.
+void gfx::Engine::_initShadows() {
+  VkAttachmentDescription depthAttach = {
+    .flags  = 0,
+
+    .format   = _depthFormat,
+    .samples  = VK_SAMPLE_COUNT_1_BIT,
+
+    .loadOp   = VK_ATTACHMENT_LOAD_OP_CLEAR,
+    .storeOp  = VK_ATTACHMENT_STORE_OP_STORE,
+
+    .stencilLoadOp   = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+    .stencilStoreOp  = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+
+    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    .finalLayout   = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+  };
+
+  VkAttachmentReference depthRef = {
+    .attachment = 0,
+    .layout     = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+  };
+
+  VkSubpassDescription subpass = {
+    .pipelineBindPoint  = VK_PIPELINE_BIND_POINT_GRAPHICS,
+
+    .colorAttachmentCount  = 0,
+    .pColorAttachments     = nullptr,
+
+    .pDepthStencilAttachment  = (&depthRef),
+  };
+
+  // Every frame in flight shares the one shadow map, so a cascade can't be
+  // redrawn until the last frame's forward pass is done reading it, and the
+  // next forward pass can't read it until it's drawn.
+  VkSubpassDependency dependencies[2] = {
+    {
+      .srcSubpass  = VK_SUBPASS_EXTERNAL,
+      .dstSubpass  = 0,
+
+      .srcStageMask  = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      .dstStageMask  = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                     | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+
+      .srcAccessMask  = 0,
+      .dstAccessMask  = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+                      | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+
+      .dependencyFlags  = 0,
+    },
+    {
+      .srcSubpass  = 0,
+      .dstSubpass  = VK_SUBPASS_EXTERNAL,
+
+      .srcStageMask  = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+      .dstStageMask  = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+
+      .srcAccessMask  = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask  = VK_ACCESS_SHADER_READ_BIT,
+
+      .dependencyFlags  = 0,
+    },
+  };
+
+  VkRenderPassCreateInfo renderPassInfo = {
+    .sType  = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+
+    .attachmentCount  = 1,
+    .pAttachments     = &depthAttach,
+
+    .subpassCount  = 1,
+    .pSubpasses    = (&subpass),
+
+    .dependencyCount  = 2,
+    .pDependencies    = dependencies,
+  };
+
+  if (vkCreateRenderPass(_device, &renderPassInfo, nullptr, &_shadowRenderPass) != VK_SUCCESS) {
+    std::cerr << "Failed to create shadow render pass..." << std::endl;
+    std::exit(-1);
+  }
+
+  VkExtent3D extent = {
+    .width  = SHADOW_MAP_SIZE,
+    .height = SHADOW_MAP_SIZE,
+    .depth  = 1,
+  };
+
+  auto imageInfo = _imageInfo(_depthFormat,
+			      VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+			      | VK_IMAGE_USAGE_SAMPLED_BIT,
+			      extent);
+
+  imageInfo.arrayLayers = ShadowData::CASCADE_COUNT;
+
+  VmaAllocationCreateInfo allocInfo = {
+    .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+    .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+  };
+
+  if (vmaCreateImage(_allocator, &imageInfo, &allocInfo, &_shadowMap, &_shadowMapAlloc, nullptr)
+      != VK_SUCCESS)
+    {
+      std::cerr << "Failed to allocate shadow map" << std::endl;
+      std::exit(-1);
+    }
+
+  _memory.track(MemoryCategory::RenderTarget, _shadowMapAlloc);
+
+  auto viewInfo = _imageViewInfo(_depthFormat, _shadowMap, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+  viewInfo.viewType                     = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+  viewInfo.subresourceRange.layerCount  = ShadowData::CASCADE_COUNT;
+
+  if (vkCreateImageView(_device, &viewInfo, nullptr, &_shadowMapView) != VK_SUCCESS) {
+    std::cerr << "Failed to create shadow map view" << std::endl;
+    std::exit(-1);
+  }
+
+  // Each cascade renders into a layer of its own.
+  for (uint32_t c = 0; c < ShadowData::CASCADE_COUNT; c++) {
+    auto layerInfo = _imageViewInfo(_depthFormat, _shadowMap, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+    layerInfo.subresourceRange.baseArrayLayer = c;
+
+    if (vkCreateImageView(_device, &layerInfo, nullptr, &_shadowLayerViews[c]) != VK_SUCCESS) {
+      std::cerr << "Failed to create shadow map layer view" << std::endl;
+      std::exit(-1);
+    }
+
+    VkFramebufferCreateInfo framebufInfo = {
+      .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+      .pNext = nullptr,
+
+      .renderPass       = _shadowRenderPass,
+      .attachmentCount  = 1,
+      .pAttachments     = &_shadowLayerViews[c],
+
+      .width   = SHADOW_MAP_SIZE,
+      .height  = SHADOW_MAP_SIZE,
+      .layers  = 1,
+    };
+
+    if (vkCreateFramebuffer(_device, &framebufInfo, nullptr, &_shadowFramebuffers[c]) != VK_SUCCESS) {
+      std::cerr << "Unable to create shadow framebuffer" << std::endl;
+      std::exit(-1);
+    }
+  }
+
+  // Hardware PCF where the format allows, a single comparison otherwise.
+  VkFormatProperties formatProps;
+  vkGetPhysicalDeviceFormatProperties(_physicalDevice, _depthFormat, &formatProps);
+
+  VkFilter filter =
+    (formatProps.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)
+    ? VK_FILTER_LINEAR
+    : VK_FILTER_NEAREST;
+
+  // Anything outside a cascade compares against the far plane, so it's lit.
+  VkSamplerCreateInfo samplerInfo = {
+    .sType  = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+    .pNext  = nullptr,
+    .flags  = 0,
+
+    .magFilter   = filter,
+    .minFilter   = filter,
+    .mipmapMode  = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+
+    .addressModeU  = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+    .addressModeV  = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+    .addressModeW  = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+
+    .mipLodBias        = 0.0f,
+    .anisotropyEnable  = VK_FALSE,
+    .maxAnisotropy     = 1.0f,
+    .compareEnable     = VK_TRUE,
+    .compareOp         = VK_COMPARE_OP_LESS_OR_EQUAL,
+    .minLod            = 0.0f,
+    .maxLod            = 0.0f,
+
+    .borderColor              = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
+    .unnormalizedCoordinates  = VK_FALSE,
+  };
+
+  if (vkCreateSampler(_device, &samplerInfo, nullptr, &_shadowSampler) != VK_SUCCESS) {
+    std::cerr << "Failed to create shadow sampler" << std::endl;
+    std::exit(-1);
+  }
+}
+
+void gfx::Engine::_cleanupSwapImages() {
+  for (auto &swap : _perSwaps) {
+    vkDestroyFramebuffer(_device, swap.framebuf, nullptr);
+
+    if (_gpuCulling) {
+      for (auto mip : swap.depthPyramidMips) vkDestroyImageView(_device, mip, nullptr);
+
+      vkDestroyImageView(_device, swap.depthPyramidView, nullptr);
+      _memory.untrack(swap.depthPyramidAlloc);
+      vmaDestroyImage(_allocator, swap.depthPyramid, swap.depthPyramidAlloc);
+    }
+
+    _memory.untrack(swap.depthAlloc);
+    vmaDestroyImage(_allocator, swap.depth, swap.depthAlloc);
+    vkDestroyImageView(_device, swap.depthView, nullptr);
+    vkDestroyImageView(_device, swap.imageView, nullptr);
+
+    if (swap.imageAlloc) {
+      _memory.untrack(swap.imageAlloc);
+      vmaDestroyImage(_allocator, swap.image, swap.imageAlloc);
+    }
+  }
+
+  _perSwaps.clear();
+
+  // Every set in here referred to one of the views we just destroyed.
+  _swapDescriptorAllocator.resetPools();
+}
+
+// The render passes only depend on the swapchain's format, which we pick the
+// same way every time, so they survive.
+bool gfx::Engine::_recreateSwapchain() {
+  int width, height;
+
+  SDL_Vulkan_GetDrawableSize(_window, &width, &height);
+
+  if (width == 0 || height == 0) return false;
+
+  vkDeviceWaitIdle(_device);
+
+  _cleanupSwapImages();
+
+  _initSwapchain();
+  _initFramebuffers();
+
+  if (_gpuCulling) _initDepthPyramids();
+
+  // Last frame's visibility was judged in a different pyramid.
+  _resetVisibility = true;
+  _swapchainStale  = false;
+
+  return true;
+}
+
+void gfx::Engine::setPresentMode(PresentMode mode) {
+  _options.presentMode = mode;
+
+  if (_initialized && !_options.headless) _swapchainStale = true;
+}
+
+gfx::InstanceID gfx::Engine::createInstance(asset::MeshID mesh, glm::mat4 const &model) {
+  uint32_t i = _testMultiMesh.index.find(mesh);
+
+  if (i == IDIndex::NOT_FOUND) {
+    std::cerr << "Can't create an instance of mesh " << mesh << ", which isn't loaded"
+	      << std::endl;
+    return NO_INSTANCE;
+  }
+
+  if (_scene.size() >= MAX_INSTANCES) {
+    std::cerr << "Can't create more than " << MAX_INSTANCES << " instances" << std::endl;
+    return NO_INSTANCE;
+  }
+
+  return _scene.create(i, model);
+}
+
+void gfx::Engine::updateTransform(InstanceID id, glm::mat4 const &model) {
+  _scene.update(id, model);
+}
+
+void gfx::Engine::destroyInstance(InstanceID id) {
+  _scene.destroy(id);
+}
+
+void gfx::Engine::setCamera(glm::vec3 const &position, glm::vec3 const &target) {
+  _cameraPosition  = position;
+  _cameraTarget    = target;
+}
+
+gfx::MemoryStats gfx::Engine::memoryStats() {
+  VkPhysicalDeviceMemoryProperties const *memProps;
+  vmaGetMemoryProperties(_allocator, &memProps);
+
+  std::vector<VmaBudget> budgets(memProps->memoryHeapCount);
+  vmaGetBudget(_allocator, budgets.data());
+
+  MemoryStats stats;
+
+  stats.budgetExtension = _memory.budgetExtension();
+
+  for (uint32_t h = 0; h < memProps->memoryHeapCount; h++) {
+    bool deviceLocal = memProps->memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+
+    if (deviceLocal) {
+      stats.deviceAllocated  += budgets[h].allocationBytes;
+      stats.deviceBlocks     += budgets[h].blockBytes;
+    } else {
+      stats.hostAllocated  += budgets[h].allocationBytes;
+      stats.hostBlocks     += budgets[h].blockBytes;
+    }
+
+    stats.heaps.push_back({
+	.size         = memProps->memoryHeaps[h].size,
+	.usage        = budgets[h].usage,
+	.budget       = budgets[h].budget,
+	.allocated    = budgets[h].allocationBytes,
+	.blocks       = budgets[h].blockBytes,
+	.deviceLocal  = deviceLocal,
+      });
+  }
+
+  for (uint32_t c = 0; c < MemoryCategory::MAX; c++) {
+    stats.allocations[c]  = _memory.allocations(c);
+    stats.bytes[c]        = _memory.bytes(c);
+  }
+
+  return stats;
+}
+
+// Helper function to allocate per-frame synchronization primitives and the
+// persistently mapped buffers behind set 0, called from Engine::init().
+//
+// Also creates _globalSetLayout, so this must run before _initPipelines.
+//
+// Log and exit on failure.
+void gfx::Engine::_initPerFrames() {
+  _descriptorAllocator.init(_device);
+  _swapDescriptorAllocator.init(_device);
+  _descriptorLayoutCache.init(_device);
+
+  _perFrames.resize(std::clamp<uint32_t>(_options.framesInFlight, 1, MAX_FRAMES_IN_FLIGHT));
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(_physicalDevice, &props);
+
+  // Anything in a transient buffer might be bound as a dynamic uniform or
+  // storage buffer, and InstanceData wants 16 bytes anyway.
+  VkDeviceSize transientAlignment = std::max({
+      props.limits.minUniformBufferOffsetAlignment,
+      props.limits.minStorageBufferOffsetAlignment,
+      (VkDeviceSize)16,
+    });
+
+  // Which instances were drawn last frame, indexed by their place in the
+  // scene, and the scene itself. Every frame reads and writes them, but never
+  // two at once, since their culling passes are ordered on the one queue.
+  if (_gpuCulling) {
+    _allocBuffer(MAX_INSTANCES * sizeof(uint32_t),
+		 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		 | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		 VMA_MEMORY_USAGE_GPU_ONLY,
+		 MemoryCategory::Other,
+		 &_visibilityBuffer);
+
+    _allocBuffer(MAX_INSTANCES * sizeof(InstanceData),
+		 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		 | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		 VMA_MEMORY_USAGE_GPU_ONLY,
+		 MemoryCategory::Other,
+		 &_sceneBuffer);
+  }
+
+  for (auto &frame : _perFrames) {
+    VkFenceCreateInfo fenceInfo = {
+      .sType  = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+      .pNext  = nullptr,
+      .flags  = VK_FENCE_CREATE_SIGNALED_BIT,
+    };
+
+    if (vkCreateFence(_device, &fenceInfo, nullptr, &frame.renderFinishedFence) != VK_SUCCESS) {
+      std::cerr << "Failed to create 'render finished' fence" << std::endl;
+      std::exit(-1);
+    }
+
+    VkSemaphoreCreateInfo semInfo = {
+      .sType  = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      .pNext  = nullptr,
+      .flags  = 0,
+    };
+
+    if (vkCreateSemaphore(_device, &semInfo, nullptr, &frame.imageAcquiredSem) != VK_SUCCESS) {
+      std::cerr << "Failed to create 'render finished' fence" << std::endl;
+      std::exit(-1);
+    }
+    if (vkCreateSemaphore(_device, &semInfo, nullptr, &frame.renderFinishedSem) != VK_SUCCESS) {
+      std::cerr << "Failed to create 'render finished' fence" << std::endl;
+      std::exit(-1);
+    }
+
+    VkCommandPoolCreateInfo framePoolInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .pNext = nullptr,
+
+      .queueFamilyIndex = _graphicsFamily.value(),
+      .flags = 0,
+    };
+
+    if (vkCreateCommandPool(_device, &framePoolInfo, nullptr, &frame.commandPool) != VK_SUCCESS) {
+      std::cerr << "Failed to create frame command pool" << std::endl;
+      std::exit(-1);
+    }
+
+    frame.recordPools.resize(_jobs.threadCount());
+
+    for (VkCommandPool &pool : frame.recordPools) {
+      if (vkCreateCommandPool(_device, &framePoolInfo, nullptr, &pool) != VK_SUCCESS) {
+	std::cerr << "Failed to create frame recording pool" << std::endl;
+	std::exit(-1);
+      }
+    }
+
+    if (_timestampMask) {
+      VkQueryPoolCreateInfo queryInfo = {
+	.sType  = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+	.pNext  = nullptr,
+	.flags  = 0,
+
+	.queryType   = VK_QUERY_TYPE_TIMESTAMP,
+	.queryCount  = 2 * MAX_GPU_ZONES,
+      };
+
+      if (vkCreateQueryPool(_device, &queryInfo, nullptr, &frame.timestampPool) != VK_SUCCESS) {
+	std::cerr << "Failed to create frame timestamp pool" << std::endl;
+	std::exit(-1);
+      }
+
+      frame.gpuZones.reserve(MAX_GPU_ZONES);
+    }
+
+    frame.transient.init(_allocator,
+			 &_memory,
+			 TRANSIENT_SIZE,
+			 TRANSIENT_SLACK,
+			 transientAlignment,
+			 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+			 | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+			 | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+			 | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+
+    if (_gpuCulling) {
+      _allocBuffer(MAX_INSTANCES * sizeof(InstanceData),
+		   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		   VMA_MEMORY_USAGE_GPU_ONLY,
+		   MemoryCategory::PerFrame,
+		   &frame.visibleInstanceBuffer);
+
+      _allocBuffer(VISIBLE_LOD_FIRST_OFFSET + 2 * MAX_DRAWS * sizeof(uint32_t),
+		   VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+		   | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		   | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		   VMA_MEMORY_USAGE_GPU_ONLY,
+		   MemoryCategory::PerFrame,
+		   &frame.visibleDrawBuffer);
+
+      _allocBuffer(MAX_INSTANCES * 2 * sizeof(uint32_t),
+		   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		   VMA_MEMORY_USAGE_GPU_ONLY,
+		   MemoryCategory::PerFrame,
+		   &frame.cullPickBuffer);
+
+      frame.stats = (CullStats *)
+	_allocMappedBuffer(sizeof(CullStats),
+			   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+			   | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			   MemoryCategory::PerFrame,
+			   &frame.statsBuffer);
+
+      *frame.stats = { };
+
+      // Each cascade culls into buffers of its own, but only ever uses the
+      // early phase's half of its visibleDrawBuffer.
+      for (auto &view : frame.shadows) {
+	_allocBuffer(MAX_INSTANCES * sizeof(InstanceData),
+		     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		     VMA_MEMORY_USAGE_GPU_ONLY,
+		     MemoryCategory::PerFrame,
+		     &view.visibleInstanceBuffer);
+
+	_allocBuffer(VISIBLE_LOD_FIRST_OFFSET + 2 * MAX_DRAWS * sizeof(uint32_t),
+		     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+		     | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		     | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		     VMA_MEMORY_USAGE_GPU_ONLY,
+		     MemoryCategory::PerFrame,
+		     &view.visibleDrawBuffer);
+
+	_allocBuffer(MAX_INSTANCES * 2 * sizeof(uint32_t),
+		     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		     VMA_MEMORY_USAGE_GPU_ONLY,
+		     MemoryCategory::PerFrame,
+		     &view.cullPickBuffer);
+      }
+    }
+
+    // Ranges are fixed, and offsets given at bind time, since wherever the
+    // data lands in `transient` changes from frame to frame.
+    VkDescriptorBufferInfo cameraInfo = {
+      .buffer  = frame.transient.buffer(),
+      .offset  = 0,
+      .range   = sizeof(CameraData),
+    };
+
+    // With GPU culling, static-mesh.vert only sees the instances that passed,
+    // which are always bound at offset 0.
+    VkDescriptorBufferInfo instanceInfo = {
+      .buffer  = _gpuCulling ? frame.visibleInstanceBuffer.buffer : frame.transient.buffer(),
+      .offset  = 0,
+      .range   = MAX_INSTANCES * sizeof(InstanceData),
+    };
+
+    bool built = DescriptorBuilder::begin(&_descriptorLayoutCache, &_descriptorAllocator)
+      .bind_buffer(0, &cameraInfo,
+		   VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT)
+      .bind_buffer(1, &instanceInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT)
+      .build(frame.globalSet, _globalSetLayout);
+
+    if (!built) {
+      std::cerr << "Failed to build per-frame descriptor set" << std::endl;
+      std::exit(-1);
+    }
+
+    // The same for each cascade, but with its own survivors when culling on
+    // the GPU.
+    for (auto &view : frame.shadows) {
+      VkDescriptorBufferInfo viewInstanceInfo = instanceInfo;
+
+      if (_gpuCulling) viewInstanceInfo.buffer = view.visibleInstanceBuffer.buffer;
+
+      built = DescriptorBuilder::begin(&_descriptorLayoutCache, &_descriptorAllocator)
+	.bind_buffer(0, &cameraInfo,
+		     VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT)
+	.bind_buffer(1, &viewInstanceInfo,
+		     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT)
+	.build(view.globalSet, _globalSetLayout);
+
+      if (!built) {
+	std::cerr << "Failed to build shadow cascade descriptor set" << std::endl;
+	std::exit(-1);
+      }
+    }
+
+    VkDescriptorBufferInfo shadowInfo = {
+      .buffer  = frame.transient.buffer(),
+      .offset  = 0,
+      .range   = sizeof(ShadowData),
+    };
+
+    VkDescriptorImageInfo shadowMapInfo = {
+      .sampler      = _shadowSampler,
+      .imageView    = _shadowMapView,
+      .imageLayout  = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+
+    built = DescriptorBuilder::begin(&_descriptorLayoutCache, &_descriptorAllocator)
+      .bind_buffer(0, &shadowInfo,
+		   VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_FRAGMENT_BIT)
+      .bind_image(1, &shadowMapInfo,
+		  VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT)
+      .build(frame.shadowSet, _shadowSetLayout);
+
+    if (!built) {
+      std::cerr << "Failed to build per-frame shadow descriptor set" << std::endl;
+      std::exit(-1);
+    }
+
+    if (!_gpuCulling) continue;
+
+    VkDescriptorBufferInfo candidateInfo = {
+      .buffer  = _sceneBuffer.buffer,
+      .offset  = 0,
+      .range   = MAX_INSTANCES * sizeof(InstanceData),
+    };
+
+    VkDescriptorBufferInfo meshFirstInfo = {
+      .buffer  = frame.transient.buffer(),
+      .offset  = 0,
+      .range   = MAX_DRAWS * sizeof(uint32_t),
+    };
+
+    VkDescriptorBufferInfo visibleInstanceInfo = {
+      .buffer  = frame.visibleInstanceBuffer.buffer,
+      .offset  = 0,
+      .range   = VK_WHOLE_SIZE,
+    };
+
+    VkDescriptorBufferInfo visibleDrawInfo = {
+      .buffer  = frame.visibleDrawBuffer.buffer,
+      .offset  = 0,
+      .range   = VK_WHOLE_SIZE,
+    };
+
+    VkDescriptorBufferInfo visibilityInfo = {
+      .buffer  = _visibilityBuffer.buffer,
+      .offset  = 0,
+      .range   = VK_WHOLE_SIZE,
+    };
+
+    VkDescriptorBufferInfo statsInfo = {
+      .buffer  = frame.statsBuffer.buffer,
+      .offset  = 0,
+      .range   = sizeof(CullStats),
+    };
+
+    VkDescriptorBufferInfo pickInfo = {
+      .buffer  = frame.cullPickBuffer.buffer,
+      .offset  = 0,
+      .range   = VK_WHOLE_SIZE,
+    };
+
+    built = DescriptorBuilder::begin(&_descriptorLayoutCache, &_descriptorAllocator)
+      .bind_buffer(0, &candidateInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT)
+      .bind_buffer(1, &meshFirstInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT)
+      .bind_buffer(2, &visibleInstanceInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+      .bind_buffer(3, &visibleDrawInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+      .bind_buffer(4, &cameraInfo,
+		   VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT)
+      .bind_buffer(5, &visibilityInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+      .bind_buffer(6, &statsInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+      .bind_buffer(7, &pickInfo,
+		   VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+      .build(frame.cullSet, _cullSetLayout);
+
+    if (!built) {
+      std::cerr << "Failed to build per-frame culling descriptor set" << std::endl;
+      std::exit(-1);
+    }
+
+    // Each cascade reads the same candidates, camera and history, with
+    // the same dynamic offsets, and writes its own survivors.
+    for (auto &view : frame.shadows) {
+      VkDescriptorBufferInfo viewInstanceInfo = {
+	.buffer  = view.visibleInstanceBuffer.buffer,
+	.offset  = 0,
+	.range   = VK_WHOLE_SIZE,
+      };
+
+      VkDescriptorBufferInfo viewDrawInfo = {
+	.buffer  = view.visibleDrawBuffer.buffer,
+	.offset  = 0,
+	.range   = VK_WHOLE_SIZE,
+      };
+
+      VkDescriptorBufferInfo viewPickInfo = {
+	.buffer  = view.cullPickBuffer.buffer,
+	.offset  = 0,
+	.range   = VK_WHOLE_SIZE,
+      };
+
+      built = DescriptorBuilder::begin(&_descriptorLayoutCache, &_descriptorAllocator)
+	.bind_buffer(0, &candidateInfo,
+		     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT)
+	.bind_buffer(1, &meshFirstInfo,
+		     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT)
+	.bind_buffer(2, &viewInstanceInfo,
+		     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+	.bind_buffer(3, &viewDrawInfo,
+		     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+	.bind_buffer(4, &cameraInfo,
+		     VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT)
+	.bind_buffer(5, &visibilityInfo,
+		     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+	.bind_buffer(6, &statsInfo,
+		     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+	.bind_buffer(7, &viewPickInfo,
+		     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+	.build(view.cullSet, _cullSetLayout);
+
+      if (!built) {
+	std::cerr << "Failed to build shadow cascade culling descriptor set" << std::endl;
+	std::exit(-1);
+      }
+    }
+  }
+}
+
+void gfx::Engine::_initDepthPyramids() {
+  VkSamplerCreateInfo samplerInfo = {
+    .sType  = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+    .pNext  = nullptr,
+    .flags  = 0,
+
+    .magFilter   = VK_FILTER_NEAREST,
+    .minFilter   = VK_FILTER_NEAREST,
+    .mipmapMode  = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+
+    .addressModeU  = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+    .addressModeV  = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+    .addressModeW  = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+
+    .mipLodBias        = 0.0f,
+    .anisotropyEnable  = VK_FALSE,
+    .maxAnisotropy     = 1.0f,
+    .compareEnable     = VK_FALSE,
+    .compareOp         = VK_COMPARE_OP_ALWAYS,
+    .minLod            = 0.0f,
+    .maxLod            = VK_LOD_CLAMP_NONE,
+
+    .borderColor              = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
+    .unnormalizedCoordinates  = VK_FALSE,
+  };
+
+  // The sampler doesn't depend on the swapchain, so it outlives recreation.
+  if (_depthSampler == VK_NULL_HANDLE
+      && vkCreateSampler(_device, &samplerInfo, nullptr, &_depthSampler) != VK_SUCCESS)
+    {
+      std::cerr << "Failed to create depth sampler" << std::endl;
+      std::exit(-1);
+    }
+
+  for (auto &swap : _perSwaps) {
+    // A power-of-two extent means every texel of a level covers exactly 2x2
+    // texels of the one below, so culling can pick a level from an object's
+    // screen size alone.
+    swap.depthPyramidExtent = {
+      .width   = floorPow2(_swapExtent.width),
+      .height  = floorPow2(_swapExtent.height),
+    };
+
+    swap.depthPyramidLevels = 1;
+    while ((std::max(swap.depthPyramidExtent.width, swap.depthPyramidExtent.height)
+	    >> swap.depthPyramidLevels) > 0)
+      {
+	swap.depthPyramidLevels++;
+      }
+
+    VkExtent3D pyramidExtent = {
+      .width   = swap.depthPyramidExtent.width,
+      .height  = swap.depthPyramidExtent.height,
+      .depth   = 1,
+    };
+
+    auto pyramidInfo = _imageInfo(VK_FORMAT_R32_SFLOAT,
+				  VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+				  pyramidExtent);
+
+    pyramidInfo.mipLevels = swap.depthPyramidLevels;
+
+    VmaAllocationCreateInfo pyramidAllocInfo = {
+      .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+      .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    };
+
+    if (vmaCreateImage(_allocator,
+		       &pyramidInfo,
+		       &pyramidAllocInfo,
+		       &swap.depthPyramid,
+		       &swap.depthPyramidAlloc,
+		       nullptr) != VK_SUCCESS)
+      {
+	std::cerr << "Failed to create depth pyramid" << std::endl;
+	std::exit(-1);
+      }
+
+    _memory.track(MemoryCategory::RenderTarget, swap.depthPyramidAlloc);
+
+    auto viewInfo = _imageViewInfo(VK_FORMAT_R32_SFLOAT, swap.depthPyramid,
+				   VK_IMAGE_ASPECT_COLOR_BIT);
+
+    viewInfo.subresourceRange.levelCount = swap.depthPyramidLevels;
+
+    if (vkCreateImageView(_device, &viewInfo, nullptr, &swap.depthPyramidView) != VK_SUCCESS) {
+      std::cerr << "Failed to create depth pyramid view" << std::endl;
+      std::exit(-1);
+    }
+
+    swap.depthPyramidMips.resize(swap.depthPyramidLevels);
+    swap.reduceSets.resize(swap.depthPyramidLevels);
+
+    for (uint32_t level = 0; level < swap.depthPyramidLevels; level++) {
+      viewInfo.subresourceRange.baseMipLevel  = level;
+      viewInfo.subresourceRange.levelCount    = 1;
+
+      if (vkCreateImageView(_device, &viewInfo, nullptr, &swap.depthPyramidMips[level])
+	  != VK_SUCCESS)
+	{
+	  std::cerr << "Failed to create depth pyramid mip view" << std::endl;
+	  std::exit(-1);
+	}
+    }
+
+    // Level 0 reduces the depth image itself, and every other level the one
+    // before it.
+    for (uint32_t level = 0; level < swap.depthPyramidLevels; level++) {
+      VkDescriptorImageInfo srcInfo = {
+	.sampler      = _depthSampler,
+	.imageView    = level == 0 ? swap.depthView : swap.depthPyramidMips[level - 1],
+	.imageLayout  = level == 0 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL
+	                           : VK_IMAGE_LAYOUT_GENERAL,
+      };
+
+      VkDescriptorImageInfo dstInfo = {
+	.sampler      = VK_NULL_HANDLE,
+	.imageView    = swap.depthPyramidMips[level],
+	.imageLayout  = VK_IMAGE_LAYOUT_GENERAL,
+      };
+
+      bool built = DescriptorBuilder::begin(&_descriptorLayoutCache, &_swapDescriptorAllocator)
+	.bind_image(0, &srcInfo,
+		    VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT)
+	.bind_image(1, &dstInfo,
+		    VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT)
+	.build(swap.reduceSets[level], _reduceSetLayout);
+
+      if (!built) {
+	std::cerr << "Failed to build depth reduction descriptor set" << std::endl;
+	std::exit(-1);
+      }
+    }
+
+    VkDescriptorImageInfo pyramidImageInfo = {
+      .sampler      = _depthSampler,
+      .imageView    = swap.depthPyramidView,
+      .imageLayout  = VK_IMAGE_LAYOUT_GENERAL,
+    };
+
+    bool built = DescriptorBuilder::begin(&_descriptorLayoutCache, &_swapDescriptorAllocator)
+      .bind_image(0, &pyramidImageInfo,
+		  VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT)
+      .build(swap.depthPyramidSet, _depthPyramidSetLayout);
+
+    if (!built) {
+      std::cerr << "Failed to build depth pyramid descriptor set" << std::endl;
+      std::exit(-1);
+    }
+  }
+}
+
+// Here we can initialize any hard-coded test data used by the engine. Called at
+// the end of Engine::init().
+//
+// Log and exit on failure.
+void gfx::Engine::_initTestData() {
+  auto path = _options.library;
+  std::vector<asset::MeshID> ids = _options.meshes;
+
+  if (ids.empty()) {
+    ids = {
+      CONST_ID("asset:mesh:monkey"),
+      CONST_ID("asset:mesh:fancy-cube")
+    };
+  }
+
+  if (!_streamMultiMesh(path, ids.data(), &_testMultiMesh, ids.size())) {
+    std::cerr << "failed to load test-meshes from file '" << path << "'" << std::endl;
+    std::exit(-1);
+  }
+
+  _scene.reset(ids.size());
+
+  // draw() spins these.
+  if (_options.meshes.empty()) {
+    for (auto id : ids) _testInstances.push_back(createInstance(id, glm::mat4 { 1.0f }));
+  }
+}
+
+// Cleanup after whatever _initTestData did.
+void gfx::Engine::_cleanupTestData() {
+  _freeMultiMesh(&_testMultiMesh);
+}
+
+// Cleanup all resources used by the graphics engine, shutdown vulkan and SDL.
+void gfx::Engine::cleanup() {
+  if (_initialized) {
+    vkDeviceWaitIdle(_device);
+
+    // Stop the workers before freeing anything they might be loading into.
+    _streamer.cleanup();
+    _jobs.cleanup();
+
+    _cleanupTestData();
+
+    _streamLibraries.clear();
+
+    _geometry.cleanup();
+
+    _uploader.cleanup();
+
+    _textures.cleanup();
+
+    for (auto &frame : _perFrames) {
+      vkDestroySemaphore(_device, frame.imageAcquiredSem, nullptr);
+      vkDestroySemaphore(_device, frame.renderFinishedSem, nullptr);
+      vkDestroyFence(_device, frame.renderFinishedFence, nullptr);
+      vkDestroyCommandPool(_device, frame.commandPool, nullptr);
+
+      for (VkCommandPool pool : frame.recordPools) vkDestroyCommandPool(_device, pool, nullptr);
+
+      if (frame.timestampPool) vkDestroyQueryPool(_device, frame.timestampPool, nullptr);
+
+      frame.transient.cleanup();
+
+      if (_gpuCulling) {
+	_freeBuffer(&frame.visibleInstanceBuffer);
+	_freeBuffer(&frame.visibleDrawBuffer);
+	_freeBuffer(&frame.statsBuffer);
+	_freeBuffer(&frame.cullPickBuffer);
+
+	for (auto &view : frame.shadows) {
+	  _freeBuffer(&view.visibleInstanceBuffer);
+	  _freeBuffer(&view.visibleDrawBuffer);
+	  _freeBuffer(&view.cullPickBuffer);
+	}
+      }
+    }
+
+    if (_gpuCulling) {
+      _freeBuffer(&_visibilityBuffer);
+      _freeBuffer(&_sceneBuffer);
+    }
+
+    // These own the set layouts, and every descriptor set, respectively.
+    _descriptorLayoutCache.cleanup();
+    _descriptorAllocator.cleanup();
+
+    if (_gpuCulling) {
+      vkDestroyPipeline(_device, _cullInstancesPipeline, nullptr);
+      vkDestroyPipeline(_device, _cullDrawsPipeline, nullptr);
+      vkDestroyPipeline(_device, _cullScatterPipeline, nullptr);
+      vkDestroyPipelineLayout(_device, _cullPipelineLayout, nullptr);
+      vkDestroyPipeline(_device, _reducePipeline, nullptr);
+      vkDestroyPipelineLayout(_device, _reducePipelineLayout, nullptr);
+      vkDestroySampler(_device, _depthSampler, nullptr);
+    }
+
+    // After the compute pipelines, which were built through its cache too, so
+    // that they're saved with it.
+    _pipelines.cleanup();
+    vkDestroyPipelineLayout(_device, _pipelineLayout, nullptr);
+
+    vkDestroyRenderPass(_device, _renderPass, nullptr);
+    vkDestroyRenderPass(_device, _lateRenderPass, nullptr);
+
+    for (uint32_t c = 0; c < ShadowData::CASCADE_COUNT; c++) {
+      vkDestroyFramebuffer(_device, _shadowFramebuffers[c], nullptr);
+      vkDestroyImageView(_device, _shadowLayerViews[c], nullptr);
+    }
+
+    vkDestroyImageView(_device, _shadowMapView, nullptr);
+    _memory.untrack(_shadowMapAlloc);
+    vmaDestroyImage(_allocator, _shadowMap, _shadowMapAlloc);
+    vkDestroySampler(_device, _shadowSampler, nullptr);
+    vkDestroyRenderPass(_device, _shadowRenderPass, nullptr);
+
+    vkDestroyCommandPool(_device, _globalCommandPool, nullptr);
+
+    _cleanupSwapImages();
+    _swapDescriptorAllocator.cleanup();
+
+    if (!_options.headless) {
+      vkDestroySwapchainKHR(_device, _swapChain, nullptr);
+      vkDestroySurfaceKHR(_instance, _surface, nullptr);
+    }
+
+    vmaDestroyAllocator(_allocator);
+
+    vkDestroyDevice(_device, nullptr);
+    vkDestroyInstance(_instance, nullptr);
+    if (_window) {
+      SDL_DestroyWindow(_window);
+      SDL_Quit();
+    }
+  }
+}
+
+// This is used to synchronize our buffered frames. Basically we just wait on
+// the vkQueueSubmit fence to make sure that there's only _perFrames.size()
+// frames in flight at any given time.
+//
+// The fence is left signalled; draw() resets it once it knows it'll actually
+// submit this frame, so bailing out on a stale swapchain can't deadlock the
+// next wait.
+//
+// Log and exit on failure.
+gfx::PerFrame *gfx::Engine::_acquireNextFrame() {
+  _currentFrame = (_currentFrame + 1) % _perFrames.size();
+
+  PerFrame *frame = &_perFrames[_currentFrame];
+
+  {
+    profile::ScopedZone zone(&_profiler, "cpu:wait-frame");
+
+    if (vkWaitForFences(_device, 1, &frame->renderFinishedFence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+      std::cerr << "timeout or failure while waiting for frame fence." << std::endl;
+      std::exit(-1);
+    }
+  }
+
+  // The GPU has read everything the frame allocated last time around, and
+  // written all of its timestamps.
+  frame->transient.reset();
+
+  _collectGpuZones(frame);
+
+  return frame;
+}
+
+void gfx::Engine::_beginGpuZone(VkCommandBuffer cmdBuf, PerFrame *frame, char const *name) {
+  if (!_timestampMask || frame->gpuZones.size() == MAX_GPU_ZONES) return;
+
+  uint32_t query = 2 * (uint32_t)frame->gpuZones.size();
+
+  frame->gpuZones.push_back(name);
+
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame->timestampPool, query);
+}
+
+// Zones don't nest, so this always ends the most recently begun one.
+void gfx::Engine::_endGpuZone(VkCommandBuffer cmdBuf, PerFrame *frame) {
+  if (!_timestampMask || frame->gpuZones.empty()) return;
+
+  uint32_t query = 2 * (uint32_t)frame->gpuZones.size() - 1;
+
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame->timestampPool, query);
+}
+
+// Timestamps are in the GPU's own timebase, so the zones are put on the CPU's
+// by assuming the first of them was written the moment the frame was
+// submitted. That's early by however long the GPU took to get to it, but keeps
+// the passes in the right place relative to each other and near enough the
+// CPU zones that fed them. VK_EXT_calibrated_timestamps would do better, where
+// it's available.
+void gfx::Engine::_collectGpuZones(PerFrame *frame) {
+  if (frame->gpuZones.empty()) return;
+
+  uint32_t count = 2 * (uint32_t)frame->gpuZones.size();
+
+  std::array<uint64_t, 2 * MAX_GPU_ZONES> ticks;
+
+  if (vkGetQueryPoolResults(_device, frame->timestampPool, 0, count,
+			    count * sizeof(uint64_t), ticks.data(), sizeof(uint64_t),
+			    VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+  {
+    std::cerr << "Failed to read back frame timestamps." << std::endl;
+    std::exit(-1);
+  }
+
+  for (uint32_t i = 0; i < frame->gpuZones.size(); i++) {
+    uint64_t begin = timestampDelta(ticks[0], ticks[2 * i], _timestampMask, _timestampPeriod);
+    uint64_t end   = timestampDelta(ticks[0], ticks[2 * i + 1], _timestampMask, _timestampPeriod);
+
+    _profiler.record({
+	.name    = frame->gpuZones[i],
+	.start   = frame->submitTime + begin,
+	.end     = frame->submitTime + std::max(begin, end),
+	.frame   = frame->submitFrame,
+	.track   = profile::Track::Graphics,
+	.thread  = 0,
+      });
+  }
+
+  frame->gpuZones.clear();
+}
+
+// Block until at most _options.latencyLimit frames are queued on the GPU,
+// counting the one draw() is about to submit. Waiting here, before input is
+// read, rather than in _acquireNextFrame means that input is sampled as late as
+// possible.
+//
+// Log and exit on failure.
+void gfx::Engine::limitLatency() {
+  uint32_t n      = _perFrames.size();
+  uint32_t limit  = _options.latencyLimit;
+
+  if (limit == 0 || limit >= n) return;
+
+  // The frame submitted `limit - 1` frames before the current one; with it
+  // done, the next submission makes `limit` outstanding.
+  PerFrame *frame = &_perFrames[(_currentFrame + n - (limit - 1)) % n];
+
+  if (vkWaitForFences(_device, 1, &frame->renderFinishedFence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+    std::cerr << "timeout or failure while waiting for frame fence." << std::endl;
+    std::exit(-1);
+  }
+}
+
+// Allocate a single, non-resetable command buffer at `level` from `pool`.
+//
+// Log and exit on failure.
+VkCommandBuffer gfx::Engine::_allocCmdBuffer(VkCommandPool pool, VkCommandBufferLevel level) {
+  VkCommandBuffer cmdBuf;
+  VkCommandBufferAllocateInfo allocInfo = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .pNext = nullptr,
+
+    .commandPool          = pool,
+    .commandBufferCount   = 1,
+    .level                = level,
+  };
+
+  if (vkAllocateCommandBuffers(_device, &allocInfo, &cmdBuf) != VK_SUCCESS) {
+    std::cerr << "Failed to allocate frame command buffer" << std::endl;
+    std::exit(-1);
+  }
+
+  return cmdBuf;
+}
+
+// Call vkBeginCmdBuffer on `cmdBuf` with the given `flags` and, for a
+// secondary command buffer, `inheritance`.
+//
+// Log and exit on failure.
+void gfx::Engine::_beginCmdBuffer(VkCommandBuffer                        cmdBuf,
+				  uint32_t                               flags,
+				  VkCommandBufferInheritanceInfo const   *inheritance)
+{
+  VkCommandBufferBeginInfo beginInfo = {
+    .sType  = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .pNext  = nullptr,
+    .flags  = flags,
+
+    .pInheritanceInfo = inheritance,
+  };
+
+  if (vkBeginCommandBuffer(cmdBuf, &beginInfo) != VK_SUCCESS) {
+    std::cerr << "Failed to begin command buffer..." << std::endl;
+    std::exit(-1);
+  }
+}
+
+// Abstract over calling vkCmdBeginRenderPass on `cmdBuf`. Everything drawn in
+// the pass has to come from vkCmdExecuteCommands.
+//
+// Log and exit on failure.
+void
+gfx::Engine::_beginRenderPass(VkCommandBuffer cmdBuf,
+			      VkRenderPass renderPass,
+			      VkFramebuffer fb,
+			      VkExtent2D extent,
+			      VkClearValue *clearValues,
+			      uint32_t clearCount)
+{
+  VkRenderPassBeginInfo rpassBeginInfo = {
+    .sType  = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+    .pNext  = nullptr,
+
+    .renderPass = renderPass,
+    .renderArea = {
+      .offset = { .x = 0, .y = 0 },
+      .extent = extent,
+    },
+    .framebuffer = fb,
+
+    .clearValueCount = clearCount,
+    .pClearValues    = clearValues,
+  };
+
+  vkCmdBeginRenderPass(cmdBuf, &rpassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+}
+
+// Draw a frame. Basically, we acquire a frame and swap image, write a bunch of
+// commands to a buffer, submit those commands, and then present the frame.
+//
+// Log and exit on failure.
+void gfx::Engine::draw() {
+  _profiler.setFrame(_framesDrawn);
+
+  // With VK_EXT_memory_budget, this is when VMA asks the driver for fresh
+  // budgets, ahead of the texture streamer sizing itself against them.
+  vmaSetCurrentFrameIndex(_allocator, (uint32_t)_framesDrawn);
+
+  profile::ScopedZone frameZone(&_profiler, "cpu:frame");
+
+  {
+    profile::ScopedZone zone(&_profiler, "cpu:textures");
+    _textures.update();
+  }
+
+  {
+    profile::ScopedZone zone(&_profiler, "cpu:streaming");
+    _geometry.update();
+    _switchIndirect();
+    _pumpStreaming();
+  }
+
+  // A minimized window has nothing to draw into, so skip frames until it
+  // comes back.
+  if (_swapchainStale && !_recreateSwapchain()) return;
+
+  PerFrame *frame = _acquireNextFrame();
+
+  _textures.prepare(_currentFrame);
+  _geometry.prepare();
+
+  // The last time this frame was drawn is done, so its stats are too.
+  if (frame->statsValid) {
+    vmaInvalidateAllocation(_allocator, frame->statsBuffer.alloc, 0, VK_WHOLE_SIZE);
+    _cullStats = *frame->stats;
+  }
+
+  profile::ScopedZone acquireZone(&_profiler, "cpu:acquire-image");
+
+  // Offscreen, each frame in flight has an image of its own.
+  uint32_t swapIndex = (uint32_t)_currentFrame;
+  VkResult acquired  = VK_SUCCESS;
+
+  if (!_options.headless) {
+    acquired = vkAcquireNextImageKHR(_device,
+				     _swapChain,
+				     UINT64_MAX,
+				     frame->imageAcquiredSem,
+				     nullptr,
+				     &swapIndex);
+  }
+
+  acquireZone.end();
+
+  // Nothing was signalled, so the frame's fence and semaphore can be used
+  // again as they are. A suboptimal swapchain still works, so we draw this
+  // frame and rebuild it after presenting.
+  if (acquired == VK_ERROR_OUT_OF_DATE_KHR) {
+    _swapchainStale = true;
+    return;
+  }
+
+  if (acquired != VK_SUCCESS && acquired != VK_SUBOPTIMAL_KHR) {
+    std::cerr << "Failed to acquire swapchain image." << std::endl;
+    std::exit(-1);
+  }
+
+  if (vkResetFences(_device, 1, &frame->renderFinishedFence) != VK_SUCCESS) {
+    std::cerr << "failed to reset frame fence." << std::endl;
+    std::exit(-1);
+  }
+
+  PerSwapImage *swap = &_perSwaps[swapIndex];
+
+  profile::ScopedZone recordZone(&_profiler, "cpu:record");
+
+  if (vkResetCommandPool(_device, frame->commandPool, 0) != VK_SUCCESS) {
+    std::cerr << "Failed to reset frame command pool." << std::endl;
+    std::exit(-1);
+  }
+
+  for (VkCommandPool pool : frame->recordPools) {
+    if (vkResetCommandPool(_device, pool, 0) != VK_SUCCESS) {
+      std::cerr << "Failed to reset frame recording pool." << std::endl;
+      std::exit(-1);
+    }
+  }
+
+  VkCommandBuffer cmdBuf = _allocCmdBuffer(frame->commandPool);
+
+  _beginCmdBuffer(cmdBuf, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+
+  if (_timestampMask) vkCmdResetQueryPool(cmdBuf, frame->timestampPool, 0, 2 * MAX_GPU_ZONES);
+
+  glm::vec3 camPos = _cameraPosition;
+
+  glm::mat4 view = glm::lookAt(camPos, _cameraTarget, glm::vec3(0.0, 1.0, 0.0));
+
+  glm::mat4 project =
+    glm::perspective(glm::radians(70.0f),
+		     (float) _swapExtent.width / (float) _swapExtent.height,
+		     CAMERA_NEAR, CAMERA_FAR);
+
+  project[1][1] *= -1;
+
+  frame->cameraData = frame->transient.alloc<CameraData>(1, &frame->cameraAlloc);
+
+  *frame->cameraData = {
+    .view         = view,
+    .project      = project,
+    .viewProject  = project * view,
+    .position     = camPos,
+
+    // project[1][1] is cot(fov/2), so this is how many pixels a unit spans
+    // at a distance of 1.
+    .lodScale     = std::abs(project[1][1]) * _swapExtent.height * 0.5f / LOD_PIXEL_ERROR,
+  };
+
+  _updateShadows(frame, view, project);
+
+  // The monkey and the fancy cube, if they're still around.
+  if (_testInstances.size() == 2) {
+    updateTransform(_testInstances[0],
+		    glm::rotate(glm::mat4 { 1.0f },
+				glm::radians(_framesDrawn * 0.4f),
+				glm::vec3(0, 1, 0)));
+
+    updateTransform(_testInstances[1],
+		    glm::rotate(glm::translate(glm::mat4 { 1.0f },
+					       glm::vec3(-1.0f, 0.0f, -1.0f)),
+				glm::radians(_framesDrawn * -0.4f),
+				glm::vec3(0, 1, 0)));
+  }
+
+  Frustum frustum = Frustum::fromViewProject(project * view);
+
+  // The draws don't depend on anything recorded in the primary -- with GPU
+  // culling they read whatever the culling passes will have written by the
+  // time they run -- so they can all be recorded up front.
+  FrameDraws draws;
+
+  _frameGraph.add("engine:texture-coverage", [&]() {
+    profile::ScopedZone zone(&_profiler, "cpu:texture-coverage");
+    _requestTextureCoverage(&_testMultiMesh, frustum, *frame->cameraData);
+  });
+
+  _frameGraph.add("engine:flush-instances", [&]() {
+    profile::ScopedZone zone(&_profiler, "cpu:flush-instances");
+    _flushInstances(frame, &_testMultiMesh, frustum);
+  }, { "engine:texture-coverage" });
+
+  _frameGraph.add("engine:record-draws", [&]() {
+    profile::ScopedZone zone(&_profiler, "cpu:record-draws");
+    _recordDraws(frame, swap, &_testMultiMesh, &draws);
+  }, { "engine:flush-instances" });
+
+  _frameGraph.run(_jobs);
+
+  frame->transient.flush();
+
+  // Culling records compute passes, which can't go inside a render pass.
+  if (_gpuCulling) {
+    _beginGpuZone(cmdBuf, frame, "gpu:cull-early");
+    _cullInstances(cmdBuf, frame, swap, &_testMultiMesh, CullPhase::Early);
+    _endGpuZone(cmdBuf, frame);
+
+    _beginGpuZone(cmdBuf, frame, "gpu:cull-shadows");
+
+    for (uint32_t c = 0; c < ShadowData::CASCADE_COUNT; c++) {
+      _cullInstances(cmdBuf, frame, swap, &_testMultiMesh, CullPhase::Shadow, c);
+    }
+
+    _endGpuZone(cmdBuf, frame);
+  }
+
+  VkClearValue colorClear =  { { { 0.0f, 0.0f, 0.0f, 1.0f } } };
+  VkClearValue depthClear = {
+    .depthStencil = {
+      .depth = 1.0f,
+    },
+  };
+
+  VkClearValue clearValues[2] = { colorClear, depthClear };
+
+  VkExtent2D shadowExtent = { SHADOW_MAP_SIZE, SHADOW_MAP_SIZE };
+
+  // Every cascade is drawn before anything reads them.
+  _beginGpuZone(cmdBuf, frame, "gpu:shadow-pass");
+
+  for (uint32_t c = 0; c < ShadowData::CASCADE_COUNT; c++) {
+    _beginRenderPass(cmdBuf, _shadowRenderPass, _shadowFramebuffers[c], shadowExtent,
+		     &depthClear, 1);
+
+    vkCmdExecuteCommands(cmdBuf, 1, &draws.shadows[c]);
+
+    vkCmdEndRenderPass(cmdBuf);
+  }
+
+  _endGpuZone(cmdBuf, frame);
+
+  _beginGpuZone(cmdBuf, frame, "gpu:early-pass");
+
+  _beginRenderPass(cmdBuf, _renderPass, swap->framebuf, _swapExtent, clearValues, 2);
+
+  vkCmdExecuteCommands(cmdBuf, 1, &draws.prepass[0]);
+  vkCmdNextSubpass(cmdBuf, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  vkCmdExecuteCommands(cmdBuf, 1, &draws.forward[0]);
+
+  vkCmdEndRenderPass(cmdBuf);
+
+  _endGpuZone(cmdBuf, frame);
+
+  // Whatever wasn't visible last frame gets a second chance against what we
+  // just drew. Without occlusion culling the early phase drew everything, and
+  // the late pass only moves the swap image along to PRESENT_SRC.
+  if (_occlusionCulling) {
+    _beginGpuZone(cmdBuf, frame, "gpu:depth-pyramid");
+    _buildDepthPyramid(cmdBuf, swap);
+    _endGpuZone(cmdBuf, frame);
+
+    _beginGpuZone(cmdBuf, frame, "gpu:cull-late");
+    _cullInstances(cmdBuf, frame, swap, &_testMultiMesh, CullPhase::Late);
+    _endGpuZone(cmdBuf, frame);
+  }
+
+  _beginGpuZone(cmdBuf, frame, "gpu:late-pass");
+
+  _beginRenderPass(cmdBuf, _lateRenderPass, swap->framebuf, _swapExtent, nullptr, 0);
+
+  vkCmdExecuteCommands(cmdBuf, 1, &draws.prepass[1]);
+  vkCmdNextSubpass(cmdBuf, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  vkCmdExecuteCommands(cmdBuf, 1, &draws.forward[1]);
+
+  vkCmdEndRenderPass(cmdBuf);
+
+  _endGpuZone(cmdBuf, frame);
+
+  if (vkEndCommandBuffer(cmdBuf) != VK_SUCCESS) {
+    std::cerr << "failed to end command buffer." << std::endl;
+    std::exit(-1);
+  }
+
+  recordZone.end();
+
+  VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+  VkSubmitInfo submitInfo = {
+    .sType  = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .pNext  = nullptr,
+
+    .pWaitDstStageMask  = (&waitStage),
+
+    .waitSemaphoreCount  = _options.headless ? 0u : 1u,
+    .pWaitSemaphores     = (&frame->imageAcquiredSem),
+
+    .signalSemaphoreCount  = _options.headless ? 0u : 1u,
+    .pSignalSemaphores     = (&frame->renderFinishedSem),
+
+    .commandBufferCount  = 1,
+    .pCommandBuffers     = &cmdBuf,
+  };
+
+  frame->submitTime   = _profiler.now();
+  frame->submitFrame  = _framesDrawn;
+
+  {
+    profile::ScopedZone zone(&_profiler, "cpu:submit");
+
+    if (vkQueueSubmit(_graphicsQueue, 1, &submitInfo, frame->renderFinishedFence) != VK_SUCCESS) {
+      std::cerr << "Failed to submit command buffer for rendering..." << std::endl;
+      std::exit(-1);
+    }
+  }
+
+  // Offscreen, the frame is done once it's submitted.
+  if (_options.headless) {
+    _framesDrawn++;
+    return;
+  }
+
+  VkPresentInfoKHR presentInfo = {
+    .sType  = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+    .pNext  = nullptr,
+
+    .swapchainCount  = 1,
+    .pSwapchains     = (&_swapChain),
+
+    .waitSemaphoreCount  = 1,
+    .pWaitSemaphores     = (&frame->renderFinishedSem),
+
+    .pImageIndices  = &swapIndex,
+  };
+
+  profile::ScopedZone presentZone(&_profiler, "cpu:present");
+
+  VkResult presented = vkQueuePresentKHR(_graphicsQueue, &presentInfo);
+
+  presentZone.end();
+
+  if (presented == VK_ERROR_OUT_OF_DATE_KHR || presented == VK_SUBOPTIMAL_KHR) {
+    _swapchainStale = true;
+  } else if (presented != VK_SUCCESS) {
+    std::cerr << "Failed to present to the swapchain =[" << std::endl;
+    std::exit(-1);
+  }
+
+  _framesDrawn++;
+}
+
+// Initialize this DescriptorAllocator for use with the given `device`
+void gfx::DescriptorAllocator::init(VkDevice device) {
+  _device = device;
+}
+
+// Destroy all VkDescriptorPools in use by the allocator.
+void gfx::DescriptorAllocator::cleanup() {
+  for (auto p : _freePools) {
+    vkDestroyDescriptorPool(_device, p, nullptr);
+  }
+  for (auto p : _usedPools) {
+    vkDestroyDescriptorPool(_device, p, nullptr);
+  }
+
+  _freePools.clear();
+  _usedPools.clear();
+}
+
+// Helper to create a descriptor pool. For internal use by the allocator.
+VkDescriptorPool gfx::DescriptorAllocator::createPool(
+  size_t count,
+  VkDescriptorPoolCreateFlags flags)
+{
+  std::vector<VkDescriptorPoolSize> sizes;
+  sizes.reserve(_descriptorSizes.sizes.size());
+  for (auto sz : _descriptorSizes.sizes) {
+    sizes.push_back({ sz.first, (uint32_t)(sz.second * (float)count)});
+  }
+
+  VkDescriptorPoolCreateInfo poolInfo = {
+    .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .flags         = flags,
+    .maxSets       = (uint32_t)count,
+    .poolSizeCount = (uint32_t)sizes.size(),
+    .pPoolSizes    = sizes.data(),
+  };
+
+  VkDescriptorPool descriptorPool;
+
+  vkCreateDescriptorPool(_device, &poolInfo, nullptr, &descriptorPool);
+
+  return descriptorPool;
+}
+
+// Get an unused pool, either from the free-list or by creating a new one.
+VkDescriptorPool gfx::DescriptorAllocator::grabPool() {
+  if (_freePools.size() > 0) {
+    VkDescriptorPool pool = _freePools.back();
+    _freePools.pop_back();
+    return pool;
+  } else {
+    return createPool(1000, 0);
+  }
+}
+
+// Allocate a descriptor set with the given layout.
+bool gfx::DescriptorAllocator::allocate(
+  VkDescriptorSet *set,
+  VkDescriptorSetLayout layout)
+{
+  if (_currentPool == VK_NULL_HANDLE) {
+    _currentPool = grabPool();
+    _usedPools.push_back(_currentPool);
+  }
+
+  VkDescriptorSetAllocateInfo allocInfo = {
+    .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .pNext              = nullptr,
+    .pSetLayouts        = (&layout),
+    .descriptorPool     = _currentPool,
+    .descriptorSetCount = 1,
+  };
+
+  VkResult allocResult = vkAllocateDescriptorSets(_device, &allocInfo, set);
+
+  bool needNewPool = false;
+
+  switch (allocResult) {
+  case VK_SUCCESS:
+    return true;
+
+  case VK_ERROR_FRAGMENTED_POOL:
+  case VK_ERROR_OUT_OF_POOL_MEMORY:
+    needNewPool = true;
+    break;
+
+  default:
+    return false;
+  };
+
+  if (needNewPool) {
+    _currentPool = grabPool();
+    _usedPools.push_back(_currentPool);
+
+    allocResult = vkAllocateDescriptorSets(_device, &allocInfo, set);
+
+    if (allocResult == VK_SUCCESS) {
+      return true;
+    }
+  }
+
+  // We failed to allocate twice, even with a brand new pool --
+  // something's wrong.
+  return false;
+}
+
+// Reset all pools allocated by this allocator. This effective frees every
+// DescriptorSet it has been used to allocate.
+void gfx::DescriptorAllocator::resetPools() {
+  for (auto p : _usedPools) {
+    vkResetDescriptorPool(_device, p, 0);
+    _freePools.push_back(p);
+  }
+
+  _usedPools.clear();
+  _currentPool = VK_NULL_HANDLE;
+}
+
+// Initialize a DescriptorLayoutCache for the given `device`
+void gfx::DescriptorLayoutCache::init(VkDevice device) {
+  _device = device;
+}
+
+// Destroy all layouts created by the cache.
+void gfx::DescriptorLayoutCache::cleanup() {
+  for (auto pair : _layoutCache) {
+    vkDestroyDescriptorSetLayout(_device, pair.second, nullptr);
+  }
+}
+
+// Create a new VkDescriptorSetLayout, or if a layout that matches `info`
+// already exists, return it from the cache.
+VkDescriptorSetLayout
+gfx::DescriptorLayoutCache::createDescriptorLayout(VkDescriptorSetLayoutCreateInfo *info) {
+  DescriptorLayoutInfo layoutInfo;
+  layoutInfo.bindings.reserve(info->bindingCount);
+
+  bool isSorted = true;
+  int lastBinding = -1;
+
+  for (int i = 0; i < info->bindingCount; i++) {
+    layoutInfo.bindings.push_back(info->pBindings[i]);
+    if (info->pBindings[i].binding > lastBinding) {
+      lastBinding = info->pBindings[i].binding;
+    } else {
+      isSorted = false;
+    }
+  }
+
+  if (!isSorted) {
+    std::sort(layoutInfo.bindings.begin(), layoutInfo.bindings.end(),
+	      [](VkDescriptorSetLayoutBinding & a, VkDescriptorSetLayoutBinding & b) {
+		return a.binding > b.binding;
+	      });
+
+  }
+
+  auto it = _layoutCache.find(layoutInfo);
+  if (it != _layoutCache.end()) {
+    return (*it).second;
+  } else {
+    VkDescriptorSetLayout layout;
+    vkCreateDescriptorSetLayout(_device, info, nullptr, &layout);
+
+    _layoutCache[layoutInfo] = layout;
+    return layout;
+  }
+}
+
+// Equality operator on DescriptorLayoutInfo, for use with the hash map.
+bool gfx::DescriptorLayoutCache::DescriptorLayoutInfo::operator == (const DescriptorLayoutInfo & other) const
+{
+  if (other.bindings.size() != bindings.size()) {
+    return false;
+  }
+
+  for (int i = 0; i < bindings.size(); i++) {
+    if (other.bindings[i].binding != bindings[i].binding) {
+      return false;
+    }
+    if (other.bindings[i].descriptorType != bindings[i].descriptorType) {
+      return false;
+    }
+    if (other.bindings[i].descriptorCount != bindings[i].descriptorCount) {
+      return false;
+    }
+    if (other.bindings[i].stageFlags != bindings[i].stageFlags) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Hash implementation for DescriptorLayoutInfo, for use with the hash map.
+size_t gfx::DescriptorLayoutCache::DescriptorLayoutInfo::hash() const {
+  size_t result = bindings.size();
+
+  for (const VkDescriptorSetLayoutBinding& b : bindings)
+  {
+    size_t binding_hash = b.binding
+                        ^ b.descriptorType << 8
+                        ^ b.descriptorCount << 16
+                        ^ b.stageFlags << 24;
+
+    result = (result << 5)
+           ^ binding_hash
+           ^ (result >> 45);
+  }
+
+  return result;
+}
+
+// Create a new, blank DescriptorBuilder
+gfx::DescriptorBuilder gfx::DescriptorBuilder::begin(
+  DescriptorLayoutCache *layoutCache,
+  DescriptorAllocator *allocator)
+{
+  DescriptorBuilder builder;
+
+  builder._cache     = layoutCache;
+  builder._allocator = allocator;
+
+  return builder;
+}
+
+// Bind a buffer to the resulting VkDescriptorSet
+gfx::DescriptorBuilder &gfx::DescriptorBuilder::bind_buffer(
+  uint32_t binding,
+  VkDescriptorBufferInfo *bufferInfo,
+  VkDescriptorType type,
+  VkShaderStageFlags stageFlags)
+{
+  VkDescriptorSetLayoutBinding dslb {
+    .descriptorCount    = 1,
+    .descriptorType     = type,
+    .pImmutableSamplers = nullptr,
+    .stageFlags         = stageFlags,
+    .binding            = binding,
+  };
+
+  _bindings.push_back(dslb);
+
+  VkWriteDescriptorSet wds {
+    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .pNext = nullptr,
+
+    .descriptorCount = 1,
+    .descriptorType  = type,
+    .pBufferInfo     = bufferInfo,
+    .dstBinding      = binding,
+  };
+
+  _writes.push_back(wds);
+
+  return *this;
+}
+
+// Bind an image to the resulting VkDescriptorSet
+gfx::DescriptorBuilder &gfx::DescriptorBuilder::bind_image(
+  uint32_t binding,
+  VkDescriptorImageInfo *imageInfo,
+  VkDescriptorType type,
+  VkShaderStageFlags stageFlags)
+{
+  VkDescriptorSetLayoutBinding dslb = {
+    .descriptorCount    = 1,
+    .descriptorType     = type,
+    .pImmutableSamplers = nullptr,
+    .stageFlags         = stageFlags,
+    .binding            = binding,
+  };
+
+  _bindings.push_back(dslb);
+
+  VkWriteDescriptorSet wds = {
+    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .pNext = nullptr,
+
+    .descriptorCount = 1,
+    .descriptorType  = type,
+    .dstBinding      = binding,
+    .pImageInfo      = imageInfo,
+  };
+
+  _writes.push_back(wds);
+
+  return *this;
+}
+
+// Build a VkDescriptorSet from this builder.
+bool gfx::DescriptorBuilder::build(VkDescriptorSet &set, VkDescriptorSetLayout &layout) {
+  VkDescriptorSetLayoutCreateInfo layoutInfo = {
+    .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .pNext        = nullptr,
+    .pBindings    = _bindings.data(),
+    .bindingCount = (uint32_t)_bindings.size(),
+  };
+
+  layout = _cache->createDescriptorLayout(&layoutInfo);
+
+  bool success = _allocator->allocate(&set, layout);
+
+  if (!success) { return false; };
+
+  for (auto &w : _writes) {
+    w.dstSet = set;
+  }
+
+  vkUpdateDescriptorSets(_allocator->_device, _writes.size(), _writes.data(), 0, nullptr);
+
+  return true;
+}
+
+char const *gfx::memoryCategoryName(uint32_t category) {
+  switch (category) {
+  case MemoryCategory::MeshPool:      return "meshPool";
+  case MemoryCategory::Staging:       return "staging";
+  case MemoryCategory::PerFrame:      return "perFrame";
+  case MemoryCategory::Texture:       return "texture";
+  case MemoryCategory::RenderTarget:  return "renderTarget";
+  case MemoryCategory::Other:         return "other";
+  }
+
+  return "unknown";
+}
+
+void gfx::MemoryTracker::init(VmaAllocator allocator, bool budgetExtension) {
+  _allocator        = allocator;
+  _budgetExtension  = budgetExtension;
+}
+
+// The category is kept in the allocation's user data, offset by one so that
+// an allocation nobody tracked reads as null.
+void gfx::MemoryTracker::track(uint32_t category, VmaAllocation alloc) {
+  VmaAllocationInfo info;
+  vmaGetAllocationInfo(_allocator, alloc, &info);
+
+  vmaSetAllocationUserData(_allocator, alloc, (void *)(uintptr_t)(category + 1));
+
+  _allocations[category]++;
+  _bytes[category] += info.size;
+}
+
+void gfx::MemoryTracker::untrack(VmaAllocation alloc) {
+  VmaAllocationInfo info;
+  vmaGetAllocationInfo(_allocator, alloc, &info);
+
+  if (!info.pUserData) return;
+
+  uint32_t category = (uint32_t)(uintptr_t)info.pUserData - 1;
+
+  vmaSetAllocationUserData(_allocator, alloc, nullptr);
+
+  _allocations[category]--;
+  _bytes[category] -= info.size;
+}
+
+VkDeviceSize gfx::MemoryTracker::deviceHeadroom() const {
+  VkPhysicalDeviceMemoryProperties const *memProps;
+  vmaGetMemoryProperties(_allocator, &memProps);
+
+  VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+  vmaGetBudget(_allocator, budgets);
+
+  VkDeviceSize headroom = 0;
+
+  for (uint32_t h = 0; h < memProps->memoryHeapCount; h++) {
+    if (!(memProps->memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)) continue;
+
+    if (budgets[h].usage < budgets[h].budget) {
+      headroom = std::max(headroom, budgets[h].budget - budgets[h].usage);
+    }
+  }
+
+  return headroom;
+}
+
+// Create one persistently mapped buffer of `capacity + slack` bytes, with
+// `usage`, which alloc hands out by bumping an offset to the next multiple of
+// `alignment`.
+//
+// Log and exit on failure.
+void gfx::FrameAllocator::init(VmaAllocator        allocator,
+			       MemoryTracker       *memory,
+			       VkDeviceSize        capacity,
+			       VkDeviceSize        slack,
+			       VkDeviceSize        alignment,
+			       VkBufferUsageFlags  usage)
+{
+  _allocator  = allocator;
+  _memory     = memory;
+  _capacity   = capacity;
+  _alignment  = alignment;
+  _used       = 0;
+
+  VkBufferCreateInfo bufferInfo = {
+    .sType  = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .pNext  = nullptr,
+
+    .size   = capacity + slack,
+    .usage  = usage,
+  };
+
+  VmaAllocationCreateInfo vmaAllocInfo = {};
+
+  vmaAllocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+  vmaAllocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+  VmaAllocationInfo allocInfo;
+
+  if (vmaCreateBuffer(_allocator,
+		      &bufferInfo,
+		      &vmaAllocInfo,
+		      &_buffer.buffer,
+		      &_buffer.alloc,
+		      &allocInfo) != VK_SUCCESS)
+  {
+    std::cerr << "Failed to allocate frame allocator buffer of size "
+	      << capacity + slack << std::endl;
+    std::exit(-1);
+  }
+
+  _memory->track(MemoryCategory::PerFrame, _buffer.alloc);
+
+  _mapped = (uint8_t *)allocInfo.pMappedData;
+}
+
+void gfx::FrameAllocator::cleanup() {
+  _memory->untrack(_buffer.alloc);
+  vmaDestroyBuffer(_allocator, _buffer.buffer, _buffer.alloc);
+}
+
+gfx::FrameAlloc gfx::FrameAllocator::alloc(VkDeviceSize size) {
+  VkDeviceSize offset = (_used + _alignment - 1) / _alignment * _alignment;
+
+  if (offset + size > _capacity) {
+    std::cerr << "Frame allocator out of space, wanted " << size << " bytes with "
+	      << _used << " of " << _capacity << " used" << std::endl;
+    std::exit(-1);
+  }
+
+  _used = offset + size;
+
+  return {
+    .buffer  = _buffer.buffer,
+    .offset  = offset,
+    .data    = _mapped + offset,
+  };
+}
+
+// One flush for the whole frame, rather than one per allocation. It does
+// nothing at all on HOST_COHERENT memory.
+void gfx::FrameAllocator::flush() {
+  if (_used > 0) vmaFlushAllocation(_allocator, _buffer.alloc, 0, _used);
+}
+
+// Each pass is a counting sort on one byte, which is stable, so sorting from
+// the least significant byte up leaves the whole key in order. A byte that's
+// the same in every key would just copy the queue, so we don't bother.
+void gfx::RenderQueue::sort() {
+  size_t n = _entries.size();
+
+  if (n < 2) return;
+
+  _scratch.resize(n);
+
+  for (uint32_t shift = 0; shift < 64; shift += 8) {
+    size_t counts[257] = { };
+
+    for (auto const &entry : _entries) counts[((entry.key >> shift) & 0xFF) + 1]++;
+
+    if (counts[((_entries[0].key >> shift) & 0xFF) + 1] == n) continue;
+
+    for (size_t b = 0; b < 256; b++) counts[b + 1] += counts[b];
+
+    for (auto const &entry : _entries) _scratch[counts[(entry.key >> shift) & 0xFF]++] = entry;
+
+    _entries.swap(_scratch);
+  }
+}
+
+void gfx::Scene::reset(size_t meshCount) {
+  _models.clear();
+  _meshIndices.clear();
+  _ids.clear();
+  _places.clear();
+  _freeIDs.clear();
+  _dirty.clear();
+  _isDirty.clear();
+
+  _meshCounts.assign(meshCount, 0);
+  _dirtySorted = true;
+}
+
+gfx::InstanceID gfx::Scene::create(uint32_t meshIndex, glm::mat4 const &model) {
+  InstanceID id;
+
+  if (_freeIDs.empty()) {
+    id = (InstanceID)_places.size();
+    _places.push_back(NO_INSTANCE);
+  } else {
+    id = _freeIDs.back();
+    _freeIDs.pop_back();
+  }
+
+  uint32_t place = (uint32_t)_models.size();
+
+  _models.push_back(model);
+  _meshIndices.push_back(meshIndex);
+  _ids.push_back(id);
+
+  _places[id] = place;
+  _meshCounts[meshIndex]++;
+
+  _markDirty(place);
+
+  return id;
+}
+
+bool gfx::Scene::update(InstanceID id, glm::mat4 const &model) {
+  if (id >= _places.size() || _places[id] == NO_INSTANCE) return false;
+
+  uint32_t place = _places[id];
+
+  _models[place] = model;
+  _markDirty(place);
+
+  return true;
+}
+
+// The last instance fills the hole, so only its place needs sending again.
+bool gfx::Scene::destroy(InstanceID id) {
+  if (id >= _places.size() || _places[id] == NO_INSTANCE) return false;
+
+  uint32_t place = _places[id];
+  uint32_t last  = (uint32_t)_models.size() - 1;
+
+  _meshCounts[_meshIndices[place]]--;
+
+  if (place != last) {
+    _models[place]       = _models[last];
+    _meshIndices[place]  = _meshIndices[last];
+    _ids[place]          = _ids[last];
+
+    _places[_ids[place]] = place;
+
+    _markDirty(place);
+  }
+
+  _models.pop_back();
+  _meshIndices.pop_back();
+  _ids.pop_back();
+
+  _places[id] = NO_INSTANCE;
+  _freeIDs.push_back(id);
+
+  return true;
+}
+
+void gfx::Scene::_markDirty(uint32_t place) {
+  if (place >= _isDirty.size()) _isDirty.resize(place + 1, false);
+
+  if (_isDirty[place]) return;
+
+  _isDirty[place] = true;
+
+  if (!_dirty.empty() && _dirty.back() > place) _dirtySorted = false;
+
+  _dirty.push_back(place);
+}
+
+std::vector<uint32_t> const &gfx::Scene::dirty() {
+  if (!_dirtySorted) {
+    std::sort(_dirty.begin(), _dirty.end());
+    _dirtySorted = true;
+  }
+
+  return _dirty;
+}
+
+void gfx::Scene::clearDirty() {
+  for (uint32_t place : _dirty) _isDirty[place] = false;
+
+  _dirty.clear();
+  _dirtySorted = true;
+}
+
+// Initialize this Uploader to submit copies to `queue`, which must belong to
+// `queueFamily`.
+//
+// Log and exit on failure.
+void gfx::Uploader::init(VkDevice            device,
+			 VmaAllocator        allocator,
+			 MemoryTracker       *memory,
+			 uint32_t            queueFamily,
+			 VkQueue             queue,
+			 profile::Profiler   *profiler,
+			 uint32_t            timestampBits,
+			 float               timestampPeriod)
+{
+  _device           = device;
+  _allocator        = allocator;
+  _memory           = memory;
+  _queueFamily      = queueFamily;
+  _queue            = queue;
+  _current          = 0;
+  _timestampMask    = profiler ? timestampMask(timestampBits) : 0;
+  _timestampPeriod  = timestampPeriod;
+  _profiler         = _timestampMask ? profiler : nullptr;
+
+  for (auto &slot : _slots) {
+    VkBufferCreateInfo bufferInfo = {
+      .sType  = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .pNext  = nullptr,
+
+      .size   = STAGING_SIZE,
+      .usage  = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    };
+
+    VmaAllocationCreateInfo vmaAllocInfo = {};
+
+    vmaAllocInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+    vmaAllocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+    VmaAllocationInfo allocInfo;
+
+    if (vmaCreateBuffer(_allocator,
+			&bufferInfo,
+			&vmaAllocInfo,
+			&slot.staging.buffer,
+			&slot.staging.alloc,
+			&allocInfo) != VK_SUCCESS)
+    {
+      std::cerr << "Failed to allocate staging buffer" << std::endl;
+      std::exit(-1);
+    }
+
+    _memory->track(MemoryCategory::Staging, slot.staging.alloc);
+
+    slot.mapped = (uint8_t *)allocInfo.pMappedData;
+
+    VkCommandPoolCreateInfo poolInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .pNext = nullptr,
+
+      .queueFamilyIndex = _queueFamily,
+      .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+    };
+
+    if (vkCreateCommandPool(_device, &poolInfo, nullptr, &slot.pool) != VK_SUCCESS) {
+      std::cerr << "Failed to create upload command pool" << std::endl;
+      std::exit(-1);
+    }
+
+    VkCommandBufferAllocateInfo cmdInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .pNext = nullptr,
+
+      .commandPool          = slot.pool,
+      .commandBufferCount   = 1,
+      .level                = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    };
+
+    if (vkAllocateCommandBuffers(_device, &cmdInfo, &slot.cmdBuf) != VK_SUCCESS) {
+      std::cerr << "Failed to allocate upload command buffer" << std::endl;
+      std::exit(-1);
+    }
+
+    VkFenceCreateInfo fenceInfo = {
+      .sType  = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+      .pNext  = nullptr,
+      .flags  = 0,
+    };
+
+    if (vkCreateFence(_device, &fenceInfo, nullptr, &slot.fence) != VK_SUCCESS) {
+      std::cerr << "Failed to create upload fence" << std::endl;
+      std::exit(-1);
+    }
+
+    if (_profiler) {
+      VkQueryPoolCreateInfo queryInfo = {
+	.sType  = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+	.pNext  = nullptr,
+	.flags  = 0,
+
+	.queryType   = VK_QUERY_TYPE_TIMESTAMP,
+	.queryCount  = 2,
+      };
+
+      if (vkCreateQueryPool(_device, &queryInfo, nullptr, &slot.queries) != VK_SUCCESS) {
+	std::cerr << "Failed to create upload timestamp pool" << std::endl;
+	std::exit(-1);
+      }
+
+      vkResetQueryPool(_device, slot.queries, 0, 2);
+    }
+  }
+}
+
+// Wait for any outstanding copies, then destroy everything created by init.
+void gfx::Uploader::cleanup() {
+  wait();
+
+  for (auto &slot : _slots) {
+    vkDestroyFence(_device, slot.fence, nullptr);
+    vkDestroyCommandPool(_device, slot.pool, nullptr);
+
+    if (slot.queries) vkDestroyQueryPool(_device, slot.queries, nullptr);
+
+    _memory->untrack(slot.staging.alloc);
+    vmaDestroyBuffer(_allocator, slot.staging.buffer, slot.staging.alloc);
+  }
+}
+
+// If `slot` was submitted and hasn't been reclaimed yet, wait for its copies to
+// finish so its staging memory and command buffer can be reused.
+//
+// Log and exit on failure.
+void gfx::Uploader::_reclaim(Slot *slot) {
+  if (!slot->pending) return;
+
+  if (vkWaitForFences(_device, 1, &slot->fence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+    std::cerr << "timeout or failure while waiting for upload fence." << std::endl;
+    std::exit(-1);
+  }
+
+  vkResetFences(_device, 1, &slot->fence);
+  vkResetCommandPool(_device, slot->pool, 0);
+
+  // Timed the same way as the engine's GPU zones, see _collectGpuZones.
+  if (_profiler) {
+    uint64_t ticks[2];
+
+    if (vkGetQueryPoolResults(_device, slot->queries, 0, 2, sizeof(ticks), ticks,
+			      sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+    {
+      std::cerr << "Failed to read back upload timestamps." << std::endl;
+      std::exit(-1);
+    }
+
+    _profiler->record({
+	.name    = "gpu:upload",
+	.start   = slot->submitTime,
+	.end     = slot->submitTime + timestampDelta(ticks[0], ticks[1], _timestampMask, _timestampPeriod),
+	.frame   = slot->frame,
+	.track   = profile::Track::Transfer,
+	.thread  = 0,
+      });
+
+    vkResetQueryPool(_device, slot->queries, 0, 2);
+  }
+
+  slot->pending = false;
+
+  _completed = std::max(_completed, slot->serial);
+}
+
+// Slots are submitted in ring order, to a single queue, so we can stop polling
+// at the first one that hasn't finished.
+bool gfx::Uploader::completed(uint64_t serial) {
+  // Nothing has been staged for `serial` yet, so there's nothing to wait for.
+  if (serial > _submitted
+      && _slots[_current].copies.empty()
+      && _slots[_current].deviceCopies.empty()
+      && _slots[_current].imageCopies.empty())
+  {
+    return true;
+  }
+
+  for (size_t k = 1; k <= RING_SIZE && serial > _completed; k++) {
+    Slot *slot = &_slots[(_current + k) % RING_SIZE];
+
+    if (!slot->pending) continue;
+
+    if (vkGetFenceStatus(_device, slot->fence) != VK_SUCCESS) break;
+
+    _reclaim(slot);
+  }
+
+  return serial <= _completed;
+}
+
+bool gfx::Uploader::reserve(VkDeviceSize size, uint32_t regions) {
+  VkDeviceSize needed = size + regions * (ALIGNMENT - 1);
+
+  if (needed > STAGING_SIZE) return false;
+
+  Slot *slot = &_slots[_current];
+
+  if (slot->used + needed > STAGING_SIZE) flush();
+
+  return true;
+}
+
+void *gfx::Uploader::stage(VkBuffer dst, VkDeviceSize dstOffset, VkDeviceSize size) {
+  if (size > STAGING_SIZE) return nullptr;
+
+  Slot *slot = &_slots[_current];
+
+  VkDeviceSize offset = (slot->used + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+  if (offset + size > STAGING_SIZE) {
+    flush();
+
+    slot    = &_slots[_current];
+    offset  = 0;
+  }
+
+  slot->used = offset + size;
+
+  slot->copies.push_back({ dst, VkBufferCopy {
+	.srcOffset  = offset,
+	.dstOffset  = dstOffset,
+	.size       = size,
+      }});
+
+  return slot->mapped + offset;
+}
+
+void *gfx::Uploader::stageImage(VkImage       dst,
+				uint32_t      level,
+				VkExtent3D    extent,
+				VkDeviceSize  size)
+{
+  if (size > STAGING_SIZE) return nullptr;
+
+  Slot *slot = &_slots[_current];
+
+  VkDeviceSize offset = (slot->used + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+  if (offset + size > STAGING_SIZE) {
+    flush();
+
+    slot    = &_slots[_current];
+    offset  = 0;
+  }
+
+  slot->used = offset + size;
+
+  // Rows are tightly packed, in texels or blocks as the format has them.
+  slot->imageCopies.push_back({ dst, VkBufferImageCopy {
+	.bufferOffset       = offset,
+	.bufferRowLength    = 0,
+	.bufferImageHeight  = 0,
+
+	.imageSubresource = {
+	  .aspectMask      = VK_IMAGE_ASPECT_COLOR_BIT,
+	  .mipLevel        = level,
+	  .baseArrayLayer  = 0,
+	  .layerCount      = 1,
+	},
+
+	.imageOffset  = { 0, 0, 0 },
+	.imageExtent  = extent,
+      }});
+
+  return slot->mapped + offset;
+}
+
+void gfx::Uploader::upload(VkBuffer      dst,
+			   VkDeviceSize  dstOffset,
+			   void const    *src,
+			   VkDeviceSize  size)
+{
+  uint8_t const *bytes = (uint8_t const *)src;
+
+  while (size > 0) {
+    Slot *slot = &_slots[_current];
+
+    if (slot->used + ALIGNMENT > STAGING_SIZE) {
+      flush();
+      slot = &_slots[_current];
+    }
+
+    VkDeviceSize offset = (slot->used + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    VkDeviceSize chunk  = std::min(size, STAGING_SIZE - offset);
+
+    memcpy(stage(dst, dstOffset, chunk), bytes, chunk);
+
+    bytes      += chunk;
+    dstOffset  += chunk;
+    size       -= chunk;
+  }
+}
+
+void gfx::Uploader::copy(VkBuffer      buffer,
+			 VkDeviceSize  srcOffset,
+			 VkDeviceSize  dstOffset,
+			 VkDeviceSize  size)
+{
+  _slots[_current].deviceCopies.push_back({ buffer, VkBufferCopy {
+	.srcOffset  = srcOffset,
+	.dstOffset  = dstOffset,
+	.size       = size,
+      }});
+}
+
+// Record every copy staged into the current slot -- the device copies first,
+// then one vkCmdCopyBuffer per destination buffer, and one
+// vkCmdCopyBufferToImage per image level, between a barrier each side that
+// moves all the levels at once -- submit them, and advance to the next slot in
+// the ring, waiting for it if it's still in flight.
+//
+// Log and exit on failure.
+void gfx::Uploader::flush() {
+  Slot *slot = &_slots[_current];
+
+  if (slot->copies.empty() && slot->deviceCopies.empty() && slot->imageCopies.empty()) return;
+
+  std::stable_sort(slot->copies.begin(), slot->copies.end(),
+		   [](auto const &a, auto const &b) { return a.first < b.first; });
+
+  VkCommandBufferBeginInfo beginInfo = {
+    .sType  = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .pNext  = nullptr,
+    .flags  = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+
+    .pInheritanceInfo = nullptr,
+  };
+
+  if (vkBeginCommandBuffer(slot->cmdBuf, &beginInfo) != VK_SUCCESS) {
+    std::cerr << "Failed to begin upload command buffer" << std::endl;
+    std::exit(-1);
+  }
 
-  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_physicalDevice, _surface, &details.capabilities);
+  if (_profiler) vkCmdWriteTimestamp(slot->cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, slot->queries, 0);
 
-  uint32_t formatCount = 0;
-  vkGetPhysicalDeviceSurfaceFormatsKHR(_physicalDevice, _surface, &formatCount, nullptr);
-  if (formatCount != 0) {
-    details.formats.resize(formatCount);
-    vkGetPhysicalDeviceSurfaceFormatsKHR(
-      _physicalDevice,
-      _surface,
-      &formatCount,
-      details.formats.data());
+  for (auto const &[buffer, region] : slot->deviceCopies) {
+    vkCmdCopyBuffer(slot->cmdBuf, buffer, buffer, 1, &region);
   }
 
+  std::vector<VkBufferCopy> regions;
 
-  uint32_t presentModeCount = 0;
-  vkGetPhysicalDeviceSurfacePresentModesKHR(_physicalDevice, _surface, &presentModeCount, nullptr);
-  if (presentModeCount != 0) {
-    details.presentModes.resize(presentModeCount);
-    vkGetPhysicalDeviceSurfacePresentModesKHR(
-      _physicalDevice,
-      _surface,
-      &presentModeCount,
-      details.presentModes.data());
+  for (size_t i = 0; i < slot->copies.size();) {
+    VkBuffer dst = slot->copies[i].first;
+
+    regions.clear();
+
+    for (; i < slot->copies.size() && slot->copies[i].first == dst; i++) {
+      regions.push_back(slot->copies[i].second);
+    }
+
+    vkCmdCopyBuffer(slot->cmdBuf, slot->staging.buffer, dst, regions.size(), regions.data());
+  }
+
+  if (!slot->imageCopies.empty()) {
+    std::vector<VkImageMemoryBarrier> barriers;
+
+    for (auto const &[image, copy] : slot->imageCopies) {
+      barriers.push_back({
+	  .sType  = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+	  .pNext  = nullptr,
+
+	  .srcAccessMask  = 0,
+	  .dstAccessMask  = VK_ACCESS_TRANSFER_WRITE_BIT,
+
+	  .oldLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
+	  .newLayout  = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+
+	  .srcQueueFamilyIndex  = VK_QUEUE_FAMILY_IGNORED,
+	  .dstQueueFamilyIndex  = VK_QUEUE_FAMILY_IGNORED,
+
+	  .image  = image,
+
+	  .subresourceRange = {
+	    .aspectMask      = VK_IMAGE_ASPECT_COLOR_BIT,
+	    .baseMipLevel    = copy.imageSubresource.mipLevel,
+	    .levelCount      = 1,
+	    .baseArrayLayer  = 0,
+	    .layerCount      = 1,
+	  },
+	});
+    }
+
+    vkCmdPipelineBarrier(slot->cmdBuf,
+			 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+			 VK_PIPELINE_STAGE_TRANSFER_BIT,
+			 0, 0, nullptr, 0, nullptr,
+			 barriers.size(), barriers.data());
+
+    for (auto const &[image, copy] : slot->imageCopies) {
+      vkCmdCopyBufferToImage(slot->cmdBuf, slot->staging.buffer, image,
+			     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+    }
+
+    // The graphics queue only samples these once completed() says the
+    // submission is done, so there's nothing to wait for on this side.
+    for (auto &barrier : barriers) {
+      barrier.srcAccessMask  = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barrier.dstAccessMask  = 0;
+      barrier.oldLayout      = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barrier.newLayout      = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
+
+    vkCmdPipelineBarrier(slot->cmdBuf,
+			 VK_PIPELINE_STAGE_TRANSFER_BIT,
+			 VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			 0, 0, nullptr, 0, nullptr,
+			 barriers.size(), barriers.data());
+  }
+
+  if (_profiler) vkCmdWriteTimestamp(slot->cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, slot->queries, 1);
+
+  if (vkEndCommandBuffer(slot->cmdBuf) != VK_SUCCESS) {
+    std::cerr << "Failed to end upload command buffer" << std::endl;
+    std::exit(-1);
+  }
+
+  VkSubmitInfo submitInfo = {
+    .sType  = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .pNext  = nullptr,
+
+    .commandBufferCount  = 1,
+    .pCommandBuffers     = &slot->cmdBuf,
+  };
+
+  if (_profiler) {
+    slot->submitTime  = _profiler->now();
+    slot->frame       = _profiler->frame();
+  }
+
+  if (vkQueueSubmit(_queue, 1, &submitInfo, slot->fence) != VK_SUCCESS) {
+    std::cerr << "Failed to submit upload command buffer" << std::endl;
+    std::exit(-1);
+  }
+
+  slot->pending  = true;
+  slot->serial   = ++_submitted;
+  slot->used     = 0;
+  slot->copies.clear();
+  slot->deviceCopies.clear();
+  slot->imageCopies.clear();
+
+  _current = (_current + 1) % RING_SIZE;
+
+  _reclaim(&_slots[_current]);
+}
+
+// Flush, then wait on every slot. Once this returns, everything uploaded so far
+// is safe to use from later submissions on any queue.
+void gfx::Uploader::wait() {
+  flush();
+
+  for (auto &slot : _slots) {
+    _reclaim(&slot);
+  }
+}
+
+void gfx::RangeAllocator::init(VkDeviceSize capacity, VkDeviceSize alignment) {
+  _alignment  = alignment;
+  _capacity   = capacity & ~(alignment - 1);
+  _used       = 0;
+
+  _freeByOffset.clear();
+  _freeBySize.clear();
+
+  if (_capacity > 0) _insertFree(0, _capacity);
+}
+
+bool gfx::RangeAllocator::alloc(VkDeviceSize size, PoolRange *out, VkDeviceSize below) {
+  size = (size + _alignment - 1) & ~(_alignment - 1);
+
+  if (size == 0) {
+    *out = { };
+    return true;
+  }
+
+  // The smallest range that fits, unless it runs past `below`, in which case
+  // the next smallest, and so on.
+  for (auto it = _freeBySize.lower_bound(size); it != _freeBySize.end(); it++) {
+    VkDeviceSize offset = it->second;
+
+    if (offset + size > below) continue;
+
+    VkDeviceSize rest = it->first - size;
+
+    _eraseFree(_freeByOffset.find(offset));
+
+    if (rest > 0) _insertFree(offset + size, rest);
+
+    _used += size;
+
+    *out = { .offset = offset, .size = size };
+    return true;
+  }
+
+  return false;
+}
+
+void gfx::RangeAllocator::free(PoolRange range) {
+  if (range.size == 0) return;
+
+  VkDeviceSize offset = range.offset;
+  VkDeviceSize size   = range.size;
+
+  _used -= size;
+
+  auto next = _freeByOffset.lower_bound(offset);
+
+  if (next != _freeByOffset.begin()) {
+    auto prev = std::prev(next);
+
+    if (prev->first + prev->second == offset) {
+      offset  = prev->first;
+      size   += prev->second;
+      _eraseFree(prev);
+    }
+  }
+
+  if (next != _freeByOffset.end() && next->first == range.offset + range.size) {
+    size += next->second;
+    _eraseFree(next);
+  }
+
+  _insertFree(offset, size);
+}
+
+VkDeviceSize gfx::RangeAllocator::largestFree() const {
+  return _freeBySize.empty() ? 0 : _freeBySize.rbegin()->first;
+}
+
+void gfx::RangeAllocator::_insertFree(VkDeviceSize offset, VkDeviceSize size) {
+  _freeByOffset.emplace(offset, size);
+  _freeBySize.emplace(size, offset);
+}
+
+void gfx::RangeAllocator::_eraseFree(std::map<VkDeviceSize, VkDeviceSize>::iterator byOffset) {
+  auto [first, last] = _freeBySize.equal_range(byOffset->second);
+
+  for (auto it = first; it != last; it++) {
+    if (it->second == byOffset->first) {
+      _freeBySize.erase(it);
+      break;
+    }
+  }
+
+  _freeByOffset.erase(byOffset);
+}
+
+void gfx::GeometryPool::init(VmaAllocator   allocator,
+			     MemoryTracker  *memory,
+			     Uploader       *uploader,
+			     uint32_t       graphicsFamily,
+			     uint32_t       transferFamily,
+			     uint32_t       frameCount,
+			     MoveFn         onMove)
+{
+  _allocator    = allocator;
+  _memory       = memory;
+  _uploader     = uploader;
+  _frameCount   = frameCount;
+  _families[0]  = graphicsFamily;
+  _families[1]  = transferFamily;
+  _onMove       = std::move(onMove);
+
+  _heaps[INDEX_HEAP].unit = 1;
+  _heaps[INDEX_HEAP].ranges.init(INDEX_BUFFER_SIZE, INDEX_ALIGNMENT);
+
+  for (auto format : { asset::VertexFormat::Full, asset::VertexFormat::Packed }) {
+    Heap &heap = _heaps[_vertexHeap(format)];
+
+    heap.unit = asset::vertexSize(format);
+    heap.ranges.init(VERTEX_BUFFER_SIZE / heap.unit);
+  }
+}
+
+void gfx::GeometryPool::cleanup() {
+  for (auto &heap : _heaps) {
+    if (heap.buffer.buffer) {
+      _memory->untrack(heap.buffer.alloc);
+      vmaDestroyBuffer(_allocator, heap.buffer.buffer, heap.buffer.alloc);
+    }
+
+    heap.buffer = { VK_NULL_HANDLE, VK_NULL_HANDLE };
+  }
+
+  _live.clear();
+  _moves.clear();
+  _garbage.clear();
+}
+
+bool gfx::GeometryPool::alloc(GeometryAlloc        *alloc,
+			      asset::VertexFormat  format,
+			      VkDeviceSize         vertexCount,
+			      VkDeviceSize         indexBytes)
+{
+  uint32_t vertexHeap = _vertexHeap(format);
+
+  *alloc = { };
+
+  alloc->format = format;
+
+  if (!_heaps[vertexHeap].ranges.alloc(vertexCount, &alloc->vertices)) return false;
+
+  if (!_heaps[INDEX_HEAP].ranges.alloc(indexBytes, &alloc->indices)) {
+    _heaps[vertexHeap].ranges.free(alloc->vertices);
+    alloc->vertices = { };
+    return false;
+  }
+
+  if ((vertexCount > 0 && !_createBuffer(vertexHeap))
+      || (indexBytes > 0 && !_createBuffer(INDEX_HEAP)))
+  {
+    _heaps[vertexHeap].ranges.free(alloc->vertices);
+    _heaps[INDEX_HEAP].ranges.free(alloc->indices);
+    alloc->vertices  = { };
+    alloc->indices   = { };
+    return false;
+  }
+
+  _live.push_back(alloc);
+
+  return true;
+}
+
+void gfx::GeometryPool::free(GeometryAlloc *alloc) {
+  auto found = std::find(_live.begin(), _live.end(), alloc);
+
+  if (found == _live.end()) return;
+
+  _live.erase(found);
+
+  uint64_t serial = alloc->serial;
+
+  for (auto &move : _moves) {
+    if (move.alloc != alloc) continue;
+
+    move.alloc  = nullptr;
+    serial      = std::max(serial, move.serial);
+  }
+
+  // Its ranges may still be read by frames in flight, or by uploads and moves
+  // that haven't landed, so neither can be reused yet.
+  _retire(_vertexHeap(alloc->format), alloc->vertices, serial);
+  _retire(INDEX_HEAP, alloc->indices, serial);
+
+  *alloc = { };
+}
+
+VkBuffer gfx::GeometryPool::vertexBuffer(asset::VertexFormat format) const {
+  return _heaps[_vertexHeap(format)].buffer.buffer;
+}
+
+VkDeviceSize gfx::GeometryPool::usedBytes() const {
+  VkDeviceSize bytes = 0;
+
+  for (auto const &heap : _heaps) bytes += heap.ranges.used() * heap.unit;
+
+  return bytes;
+}
+
+VkDeviceSize gfx::GeometryPool::capacityBytes() const {
+  VkDeviceSize bytes = 0;
+
+  for (auto const &heap : _heaps) {
+    if (heap.buffer.buffer) bytes += heap.ranges.capacity() * heap.unit;
   }
 
-  if (details.presentModes.empty() || details.formats.empty()) {
-    std::cerr << "swap  chain is inadequate!" << std::endl;
+  return bytes;
+}
+
+void gfx::GeometryPool::update() {
+  for (auto &move : _moves) {
+    if (!_uploader->completed(move.serial)) continue;
+
+    // Freed mid-move, so the copy went nowhere anyone will look.
+    if (!move.alloc) {
+      _retire(move.heap, move.to, move.serial);
+      move.serial = 0;
+      continue;
+    }
+
+    int64_t delta = (int64_t)move.to.offset - (int64_t)move.from.offset;
+
+    _range(move.alloc, move.heap) = move.to;
+
+    if (_onMove) {
+      bool accepted = move.heap == INDEX_HEAP
+	? _onMove(move.alloc, 0, delta)
+	: _onMove(move.alloc, delta, 0);
+
+      // The owner can't let go of the old range yet; ask again next update.
+      if (!accepted) {
+	_range(move.alloc, move.heap) = move.from;
+	continue;
+      }
+    }
+
+    // Whatever the owner uploaded to point at the new range goes out in the
+    // next submission, and frames drawn until it lands still use the old one.
+    move.alloc->serial = std::max(move.alloc->serial, _uploader->nextSerial());
+
+    _retire(move.heap, move.from, _uploader->nextSerial());
+
+    move.serial = 0;
   }
 
-  VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  _moves.erase(std::remove_if(_moves.begin(), _moves.end(),
+			      [](Move const &move) { return move.serial == 0; }),
+	       _moves.end());
 
-  // for (const auto &pm : details.presentModes) {
-  //   if (pm == VK_PRESENT_MODE_MAILBOX_KHR) {
-  // 	presentMode = pm;
-  // 	break;
-  //   }
-  // }
+  VkDeviceSize budget = DEFRAG_BUDGET;
 
-  VkSurfaceFormatKHR format = details.formats[0];
+  for (uint32_t heap = 0; heap < HEAP_COUNT; heap++) {
+    if (!_heaps[heap].buffer.buffer) continue;
 
-  for (const auto &fmt : details.formats) {
-    if (fmt.format == VK_FORMAT_B8G8R8A8_SRGB &&
-	fmt.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-      format = fmt;
+    while (budget > 0) {
+      VkDeviceSize copied = _startMove(heap);
+
+      if (copied == 0) break;
+
+      budget -= std::min(budget, copied);
     }
   }
+}
 
-  VkExtent2D swapExtent;
+void gfx::GeometryPool::prepare() {
+  for (auto &garbage : _garbage) {
+    // Frames only stop reading it once that submission has landed.
+    if (!_uploader->completed(garbage.serial)) continue;
 
-  if (details.capabilities.currentExtent.width != UINT32_MAX) {
-    swapExtent = details.capabilities.currentExtent;
-  } else {
-    int width, height;
+    if (garbage.prepares > 0) garbage.prepares--;
 
-    SDL_Vulkan_GetDrawableSize(_window, &width, &height);
+    if (garbage.prepares == 0) {
+      _heaps[garbage.heap].ranges.free(garbage.range);
+      garbage.range = { };
+    }
+  }
 
-    swapExtent = { (uint32_t)width, (uint32_t)height };
+  _garbage.erase(std::remove_if(_garbage.begin(), _garbage.end(),
+				[](Garbage const &garbage) { return garbage.range.size == 0; }),
+		 _garbage.end());
+}
 
-    auto const & caps = details.capabilities;
+// Every use the engine makes of the pool's buffers -- vertex and index reads
+// on the graphics queue, uploads and moves on the Uploader's -- so they're
+// shared concurrently like the buffers _allocBuffer makes for the Uploader.
+//
+// Log and exit on failure.
+bool gfx::GeometryPool::_createBuffer(uint32_t heap) {
+  Heap &h = _heaps[heap];
 
-    swapExtent.width = std::max(
-      caps.minImageExtent.width,
-      std::min(caps.maxImageExtent.width, swapExtent.width));
+  if (h.buffer.buffer) return true;
 
-    swapExtent.height = std::max(
-      caps.minImageExtent.height,
-      std::min(caps.maxImageExtent.height, swapExtent.height));
-  }
+  bool concurrent = _families[0] != _families[1];
 
-  uint32_t imageCount = std::min(
-    details.capabilities.minImageCount + 1,
-    details.capabilities.maxImageCount == 0 ? UINT32_MAX
-    : details.capabilities.maxImageCount);
+  VkBufferUsageFlags usage = heap == INDEX_HEAP
+    ? VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+    : VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
 
-  std::set<uint32_t> familySet {
-    _graphicsFamily.value(),
-    _presentFamily.value(),
-  };
+  VkBufferCreateInfo bufferInfo = {
+    .sType  = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .pNext  = nullptr,
 
-  std::vector<uint32_t> familyIndices(familySet.begin(), familySet.end());
+    .size   = h.ranges.capacity() * h.unit,
+    .usage  = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 
-  VkSwapchainCreateInfoKHR swapCreateInfo {
-    .sType                 = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
-    .surface               = _surface,
-    .minImageCount         = imageCount,
-    .imageFormat           = format.format,
-    .imageColorSpace       = format.colorSpace,
-    .imageExtent           = swapExtent,
-    .imageArrayLayers      = 1,
-    .imageUsage            = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-    .imageSharingMode      = familyIndices.empty() ? VK_SHARING_MODE_CONCURRENT
-    : VK_SHARING_MODE_EXCLUSIVE,
-    .queueFamilyIndexCount = familyIndices.empty() ? 0
-    : (uint32_t)familyIndices.size(),
-    .pQueueFamilyIndices   = familyIndices.empty() ? nullptr
-    : familyIndices.data(),
-    .preTransform          = details.capabilities.currentTransform,
-    .compositeAlpha        = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-    .presentMode           = presentMode,
-    .clipped               = VK_TRUE,
-    .oldSwapchain          = VK_NULL_HANDLE,
+    .sharingMode            = concurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+    .queueFamilyIndexCount  = concurrent ? 2u : 0u,
+    .pQueueFamilyIndices    = concurrent ? _families : nullptr,
   };
 
-  if (vkCreateSwapchainKHR(_device, &swapCreateInfo, nullptr, &_swapChain)
-      != VK_SUCCESS)
-    {
-      std::cerr << "failed to create swapchain!" << std::endl;
-      std::exit (-1);
-    }
+  VmaAllocationCreateInfo vmaAllocInfo = {
+    .flags = VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT,
+    .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+  };
 
-  _swapFormat = format.format;
-  _swapExtent = swapExtent;
+  if (vmaCreateBuffer(_allocator,
+		      &bufferInfo,
+		      &vmaAllocInfo,
+		      &h.buffer.buffer,
+		      &h.buffer.alloc,
+		      nullptr) != VK_SUCCESS)
+  {
+    std::cerr << "Failed to allocate a geometry pool buffer of size "
+	      << bufferInfo.size << " within the memory budget" << std::endl;
+    h.buffer = { VK_NULL_HANDLE, VK_NULL_HANDLE };
+    return false;
+  }
 
-  std::vector<VkImage> swapImages;
+  _memory->track(MemoryCategory::MeshPool, h.buffer.alloc);
 
-  vkGetSwapchainImagesKHR(_device, _swapChain, &imageCount, nullptr);
-  _perSwaps.resize(imageCount);
-  swapImages.resize(imageCount);
-  vkGetSwapchainImagesKHR(_device, _swapChain, &imageCount, swapImages.data());
+  return true;
+}
 
-  _depthFormat = VK_FORMAT_D32_SFLOAT;
+// Allocations are tried from the top of the heap down, so the heap compacts
+// towards its start, and the free space left behind merges into one range at
+// its end.
+VkDeviceSize gfx::GeometryPool::_startMove(uint32_t heap) {
+  Heap &h = _heaps[heap];
 
-  for (size_t i = 0; i < _perSwaps.size(); i++) {
-    _perSwaps[i].image = swapImages[i];
-    VkImageViewCreateInfo swapViewInfo {
-      .sType    = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-      .image    = _perSwaps[i].image,
-      .viewType = VK_IMAGE_VIEW_TYPE_2D,
-      .format   = _swapFormat,
-      .components = {
-	.r = VK_COMPONENT_SWIZZLE_IDENTITY,
-	.g = VK_COMPONENT_SWIZZLE_IDENTITY,
-	.b = VK_COMPONENT_SWIZZLE_IDENTITY,
-	.a = VK_COMPONENT_SWIZZLE_IDENTITY,
-      },
-      .subresourceRange = {
-	.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-	.baseMipLevel   = 0,
-	.levelCount     = 1,
-	.baseArrayLayer = 0,
-	.layerCount     = 1,
-      },
-    };
+  std::vector<GeometryAlloc *> candidates;
 
-    if (vkCreateImageView(_device, &swapViewInfo, nullptr, &_perSwaps[i].imageView) != VK_SUCCESS) {
-      std::cerr << "Failed to create image views" << std::endl;
-      std::exit(-1);
-    }
+  for (auto *alloc : _live) {
+    if (alloc->pinned || _range(alloc, heap).size == 0 || _moving(alloc)) continue;
 
-    VkExtent3D depthExtent = {
-      .width  = _swapExtent.width,
-      .height = _swapExtent.height,
-      .depth  = 1,
-    };
+    // Still being uploaded into, which a copy would race with.
+    if (!_uploader->completed(alloc->serial)) continue;
 
-    auto depthInfo = _imageInfo(_depthFormat, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, depthExtent);
-    VmaAllocationCreateInfo depthAllocInfo = {
-      .usage = VMA_MEMORY_USAGE_GPU_ONLY,
-      .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-    };
+    // Only the vertex heap this allocation's format lives in.
+    if (heap != INDEX_HEAP && _vertexHeap(alloc->format) != heap) continue;
 
-    vmaCreateImage(_allocator,
-		   &depthInfo,
-		   &depthAllocInfo,
-		   &_perSwaps[i].depth,
-		   &_perSwaps[i].depthAlloc,
-		   nullptr);
+    candidates.push_back(alloc);
+  }
 
-    auto depthViewInfo = _imageViewInfo(_depthFormat, _perSwaps[i].depth, VK_IMAGE_ASPECT_DEPTH_BIT);
+  std::sort(candidates.begin(), candidates.end(),
+	    [&](GeometryAlloc *a, GeometryAlloc *b) {
+	      return _range(a, heap).offset > _range(b, heap).offset;
+	    });
 
-    if (vkCreateImageView(_device, &depthViewInfo, nullptr, &_perSwaps[i].depthView) != VK_SUCCESS) {
-      std::cerr << "Failed to create depth image view" << std::endl;
-      std::exit(-1);
-    }
-  }
+  for (auto *alloc : candidates) {
+    PoolRange from = _range(alloc, heap);
+    PoolRange to;
 
-  vkGetDeviceQueue(_device, _graphicsFamily.value(), 0, &_graphicsQueue);
-  vkGetDeviceQueue(_device, _presentFamily.value(), 0, &_presentQueue);
+    if (!h.ranges.alloc(from.size, &to, from.offset)) continue;
 
-  VkCommandPoolCreateInfo globalPoolInfo = {
-    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-    .pNext = nullptr,
+    _uploader->copy(h.buffer.buffer, from.offset * h.unit, to.offset * h.unit, from.size * h.unit);
 
-    .queueFamilyIndex = _graphicsFamily.value(),
-    .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-  };
+    _moves.push_back({
+	.alloc   = alloc,
+	.heap    = heap,
+	.from    = from,
+	.to      = to,
+	.serial  = _uploader->nextSerial(),
+      });
 
-  if (vkCreateCommandPool(_device, &globalPoolInfo, nullptr, &_globalCommandPool) != VK_SUCCESS) {
-    std::cerr << "Failed to create global command pool" << std::endl;
-    std::exit(-1);
+    return from.size * h.unit;
   }
 
-  VkCommandBufferAllocateInfo globalBufferAllocInfo = {
-    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-    .pNext = nullptr,
-
-    .commandPool          = _globalCommandPool,
-    .commandBufferCount   = 1,
-    .level                = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-  };
+  return 0;
+}
 
-  if (vkAllocateCommandBuffers(_device, &globalBufferAllocInfo, &_globalCommandBuffer) != VK_SUCCESS) {
-    std::cerr << "Failed to allocate global command buffer" << std::endl;
-    std::exit(-1);
+bool gfx::GeometryPool::_moving(GeometryAlloc const *alloc) const {
+  for (auto const &move : _moves) {
+    if (move.alloc == alloc) return true;
   }
 
-  VkAttachmentDescription colorAttach = {
-    .format   = _swapFormat,
-    .samples  = VK_SAMPLE_COUNT_1_BIT,
+  return false;
+}
 
-    .loadOp   = VK_ATTACHMENT_LOAD_OP_CLEAR,
-    .storeOp  = VK_ATTACHMENT_STORE_OP_STORE,
+void gfx::GeometryPool::_retire(uint32_t heap, PoolRange range, uint64_t serial) {
+  if (range.size == 0) return;
 
-    .stencilLoadOp   = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-    .stencilStoreOp  = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+  _garbage.push_back({
+      .heap      = heap,
+      .range     = range,
+      .prepares  = _frameCount + 1,
+      .serial    = serial,
+    });
+}
 
-    .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
-    .finalLayout    = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+// Build the bindless layout, its pool and sets, the sampler, and the white
+// texture in slot 0. The array is as long as MAX_TEXTURES, or whatever the
+// device allows for update-after-bind samplers if that's less.
+//
+// Log and exit on failure.
+void gfx::TextureManager::init(VkDevice          device,
+			       VkPhysicalDevice  physicalDevice,
+			       VmaAllocator      allocator,
+			       MemoryTracker     *memory,
+			       Uploader          *uploader,
+			       uint32_t          graphicsFamily,
+			       uint32_t          transferFamily,
+			       uint32_t          setCount,
+			       bool              bc,
+			       bool              astc)
+{
+  _device       = device;
+  _allocator    = allocator;
+  _memory       = memory;
+  _uploader     = uploader;
+  _families[0]  = graphicsFamily;
+  _families[1]  = transferFamily;
+  _bc           = bc;
+  _astc         = astc;
+
+  VkPhysicalDeviceVulkan12Properties props12 = {
+    .sType  = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES,
+    .pNext  = nullptr,
   };
 
-  VkAttachmentReference colorRef = {
-    .attachment = 0,
-    .layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+  VkPhysicalDeviceProperties2 props = {
+    .sType  = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+    .pNext  = &props12,
   };
 
-  VkAttachmentDescription depthAttach = {
-    .flags  = 0,
+  vkGetPhysicalDeviceProperties2(physicalDevice, &props);
 
-    .format   = _depthFormat,
-    .samples  = VK_SAMPLE_COUNT_1_BIT,
+  _maxTextures = std::min({
+      MAX_TEXTURES,
+      props12.maxPerStageDescriptorUpdateAfterBindSamplers,
+      props12.maxPerStageDescriptorUpdateAfterBindSampledImages,
+      props12.maxDescriptorSetUpdateAfterBindSamplers,
+      props12.maxDescriptorSetUpdateAfterBindSampledImages,
+    });
 
-    .loadOp   = VK_ATTACHMENT_LOAD_OP_CLEAR,
-    .storeOp  = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+  VkDescriptorBindingFlags bindingFlags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT
+                                        | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
 
-    .stencilLoadOp   = VK_ATTACHMENT_LOAD_OP_CLEAR,
-    .stencilStoreOp  = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+  VkDescriptorSetLayoutBindingFlagsCreateInfo flagsInfo = {
+    .sType  = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+    .pNext  = nullptr,
 
-    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-    .finalLayout   = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    .bindingCount   = 1,
+    .pBindingFlags  = &bindingFlags,
   };
 
-  VkAttachmentReference depthRef = {
-    .attachment = 1,
-    .layout     = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+  VkDescriptorSetLayoutBinding binding = {
+    .binding             = 0,
+    .descriptorType      = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .descriptorCount     = _maxTextures,
+    .stageFlags          = VK_SHADER_STAGE_FRAGMENT_BIT,
+    .pImmutableSamplers  = nullptr,
   };
 
-  VkSubpassDescription subpass = {
-    .pipelineBindPoint  = VK_PIPELINE_BIND_POINT_GRAPHICS,
-
-    .colorAttachmentCount  = 1,
-    .pColorAttachments     = (&colorRef),
+  // Not through the DescriptorLayoutCache, which doesn't know about binding
+  // flags.
+  VkDescriptorSetLayoutCreateInfo layoutInfo = {
+    .sType  = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .pNext  = &flagsInfo,
+    .flags  = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
 
-    .pDepthStencilAttachment  = (&depthRef),
+    .bindingCount  = 1,
+    .pBindings     = &binding,
   };
 
-  VkAttachmentDescription attachments[2] = { colorAttach, depthAttach };
+  if (vkCreateDescriptorSetLayout(_device, &layoutInfo, nullptr, &_layout) != VK_SUCCESS) {
+    std::cerr << "Failed to create texture descriptor set layout" << std::endl;
+    std::exit(-1);
+  }
 
-  VkRenderPassCreateInfo renderPassInfo = {
-    .sType  = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+  VkDescriptorPoolSize poolSize = {
+    .type             = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .descriptorCount  = _maxTextures * setCount,
+  };
 
-    .attachmentCount  = 2,
-    .pAttachments     = attachments,
+  VkDescriptorPoolCreateInfo poolInfo = {
+    .sType  = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .pNext  = nullptr,
+    .flags  = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
 
-    .subpassCount  = 1,
-    .pSubpasses    = (&subpass),
+    .maxSets        = setCount,
+    .poolSizeCount  = 1,
+    .pPoolSizes     = &poolSize,
   };
 
-  if (vkCreateRenderPass(_device, &renderPassInfo, nullptr, &_renderPass) != VK_SUCCESS) {
-    std::cerr << "Failed to create render pass..." << std::endl;
+  if (vkCreateDescriptorPool(_device, &poolInfo, nullptr, &_pool) != VK_SUCCESS) {
+    std::cerr << "Failed to create texture descriptor pool" << std::endl;
     std::exit(-1);
   }
 
-  VkFramebufferCreateInfo framebufInfo = {
-    .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-    .pNext = nullptr,
+  std::vector<VkDescriptorSetLayout> layouts(setCount, _layout);
 
-    .renderPass       = _renderPass,
-    .attachmentCount  = 2,
+  _sets.resize(setCount);
 
-    .width   = _swapExtent.width,
-    .height  = _swapExtent.height,
-    .layers  = 1,
+  VkDescriptorSetAllocateInfo allocInfo = {
+    .sType  = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .pNext  = nullptr,
+
+    .descriptorPool      = _pool,
+    .descriptorSetCount  = setCount,
+    .pSetLayouts         = layouts.data(),
   };
 
-  for (auto & swap : _perSwaps) {
-    VkImageView attachments[2] = { swap.imageView, swap.depthView };
-    framebufInfo.pAttachments = attachments;
-    if (vkCreateFramebuffer(_device, &framebufInfo, nullptr, &swap.framebuf) != VK_SUCCESS) {
-      std::cerr << "Unable to create framebuffer" << std::endl;
-      std::exit(1);
-    }
+  if (vkAllocateDescriptorSets(_device, &allocInfo, _sets.data()) != VK_SUCCESS) {
+    std::cerr << "Failed to allocate texture descriptor sets" << std::endl;
+    std::exit(-1);
   }
 
-  _initPerFrames();
-
-  _initPipelines();
+  VkSamplerCreateInfo samplerInfo = {
+    .sType  = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+    .pNext  = nullptr,
+    .flags  = 0,
 
-  _initTestData();
+    .magFilter   = VK_FILTER_LINEAR,
+    .minFilter   = VK_FILTER_LINEAR,
+    .mipmapMode  = VK_SAMPLER_MIPMAP_MODE_LINEAR,
 
-  _initialized = true;
-}
+    .addressModeU  = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+    .addressModeV  = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+    .addressModeW  = VK_SAMPLER_ADDRESS_MODE_REPEAT,
 
-// Helper function to allocate per-frame synchronization primitives, called from
-// Engine::init().
-//
-// Log and exit on failure.
-void gfx::Engine::_initPerFrames() {
-  for (auto &frame : _perFrames) {
-    VkFenceCreateInfo fenceInfo = {
-      .sType  = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-      .pNext  = nullptr,
-      .flags  = VK_FENCE_CREATE_SIGNALED_BIT,
-    };
+    .mipLodBias        = 0.0f,
+    .anisotropyEnable  = VK_FALSE,
+    .maxAnisotropy     = 1.0f,
+    .compareEnable     = VK_FALSE,
+    .compareOp         = VK_COMPARE_OP_ALWAYS,
+    .minLod            = 0.0f,
+    .maxLod            = VK_LOD_CLAMP_NONE,
 
-    if (vkCreateFence(_device, &fenceInfo, nullptr, &frame.renderFinishedFence) != VK_SUCCESS) {
-      std::cerr << "Failed to create 'render finished' fence" << std::endl;
-      std::exit(-1);
-    }
+    .borderColor              = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
+    .unnormalizedCoordinates  = VK_FALSE,
+  };
 
-    VkSemaphoreCreateInfo semInfo = {
-      .sType  = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-      .pNext  = nullptr,
-      .flags  = 0,
-    };
+  if (vkCreateSampler(_device, &samplerInfo, nullptr, &_sampler) != VK_SUCCESS) {
+    std::cerr << "Failed to create texture sampler" << std::endl;
+    std::exit(-1);
+  }
 
-    if (vkCreateSemaphore(_device, &semInfo, nullptr, &frame.imageAcquiredSem) != VK_SUCCESS) {
-      std::cerr << "Failed to create 'render finished' fence" << std::endl;
-      std::exit(-1);
-    }
-    if (vkCreateSemaphore(_device, &semInfo, nullptr, &frame.renderFinishedSem) != VK_SUCCESS) {
-      std::cerr << "Failed to create 'render finished' fence" << std::endl;
-      std::exit(-1);
-    }
+  // Slot 0 is never released, and never streamed.
+  static asset::TextureMip const whiteMip = {
+    .offset  = 0,
+    .size    = 4,
+    .width   = 1,
+    .height  = 1,
+  };
 
-    VkCommandPoolCreateInfo framePoolInfo = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-      .pNext = nullptr,
+  Texture white;
 
-      .queueFamilyIndex = _graphicsFamily.value(),
-      .flags = 0,
-    };
+  white.format     = VK_FORMAT_R8G8B8A8_UNORM;
+  white.refs       = 1;
+  white.mips       = { &whiteMip, 1 };
+  white.tailBytes  = { 4 };
 
-    if (vkCreateCommandPool(_device, &framePoolInfo, nullptr, &frame.commandPool) != VK_SUCCESS) {
-      std::cerr << "Failed to create frame command pool" << std::endl;
-      std::exit(-1);
-    }
+  if (!_createImage(white, 0, &white.image)) {
+    std::cerr << "Failed to create the white texture" << std::endl;
+    std::exit(-1);
   }
-}
 
-// Here we can initialize any hard-coded test data used by the engine. Called at
-// the end of Engine::init().
-//
-// Log and exit on failure.
-void gfx::Engine::_initTestData() {
-  auto path = ".data/library.assets";
-  std::vector ids = {
-    ID("asset:mesh:monkey"),
-    ID("asset:mesh:fancy-cube")
+  uint32_t texel = 0xffffffff;
+
+  memcpy(_uploader->stageImage(white.image.image, 0, { 1, 1, 1 }, 4), &texel, 4);
+
+  _textures.push_back(std::move(white));
+
+  // Every slot starts out white, so a slot that's read before it's written
+  // still holds something valid.
+  VkDescriptorImageInfo whiteInfo = {
+    .sampler      = _sampler,
+    .imageView    = _textures[0].image.view,
+    .imageLayout  = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
   };
 
-  if (!_loadMultiMesh(path, ids.data(), &_testMultiMesh, ids.size())) {
-    std::cerr << "failed to load test-meshes from file '" << path << "'" << std::endl;
-    std::exit(-1);
+  std::vector<VkDescriptorImageInfo> imageInfos(_maxTextures, whiteInfo);
+  std::vector<VkWriteDescriptorSet>  writes;
+
+  for (VkDescriptorSet set : _sets) {
+    writes.push_back({
+	.sType  = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+	.pNext  = nullptr,
+
+	.dstSet           = set,
+	.dstBinding       = 0,
+	.dstArrayElement  = 0,
+	.descriptorCount  = _maxTextures,
+	.descriptorType   = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+	.pImageInfo       = imageInfos.data(),
+      });
   }
-}
 
-// Cleanup after whatever _initTestData did.
-void gfx::Engine::_cleanupTestData() {
-  _freeMultiMesh(&_testMultiMesh);
+  // The white texture has to be there before any frame samples it.
+  _uploader->wait();
+
+  vkUpdateDescriptorSets(_device, writes.size(), writes.data(), 0, nullptr);
 }
 
-// Cleanup all resources used by the graphics engine, shutdown vulkan and SDL.
-void gfx::Engine::cleanup() {
-  if (_initialized) {
-    vkDeviceWaitIdle(_device);
+void gfx::TextureManager::cleanup() {
+  for (auto &texture : _textures) {
+    _destroy(texture.image);
+    _destroy(texture.pending);
+  }
 
-    _cleanupTestData();
+  for (auto &garbage : _garbage) _destroy(garbage.image);
 
-    for (auto &frame : _perFrames) {
-      vkDestroySemaphore(_device, frame.imageAcquiredSem, nullptr);
-      vkDestroySemaphore(_device, frame.renderFinishedSem, nullptr);
-      vkDestroyFence(_device, frame.renderFinishedFence, nullptr);
-      vkDestroyCommandPool(_device, frame.commandPool, nullptr);
-    }
+  _textures.clear();
+  _garbage.clear();
+  _libraries.clear();
 
-    vkDestroyPipeline(_device, _graphicsPipeline, nullptr);
-    vkDestroyPipelineLayout(_device, _pipelineLayout, nullptr);
+  vkDestroySampler(_device, _sampler, nullptr);
+  vkDestroyDescriptorPool(_device, _pool, nullptr);
+  vkDestroyDescriptorSetLayout(_device, _layout, nullptr);
+}
 
-    for (auto &psi : _perSwaps) {
-      vkDestroyFramebuffer(_device, psi.framebuf, nullptr);
-    }
+VkFormat gfx::TextureManager::_vkFormat(asset::TextureData const &data) const {
+  bool srgb = data.flags & asset::TextureData::SRGB;
 
-    vkDestroyRenderPass(_device, _renderPass, nullptr);
+  switch (data.format) {
+  case asset::TextureFormat::RGBA8:
+    return srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
 
-    vkDestroyCommandPool(_device, _globalCommandPool, nullptr);
+  case asset::TextureFormat::BC1:
+    if (!_bc) break;
+    return srgb ? VK_FORMAT_BC1_RGBA_SRGB_BLOCK : VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
 
-    for (auto &swap : _perSwaps) {
-      vmaDestroyImage(_allocator, swap.depth, swap.depthAlloc);
-      vkDestroyImageView(_device, swap.depthView, nullptr);
-      vkDestroyImageView(_device, swap.imageView, nullptr);
-    }
+  case asset::TextureFormat::BC3:
+    if (!_bc) break;
+    return srgb ? VK_FORMAT_BC3_SRGB_BLOCK : VK_FORMAT_BC3_UNORM_BLOCK;
 
-    vkDestroySwapchainKHR(_device, _swapChain, nullptr);
-    vkDestroySurfaceKHR(_instance, _surface, nullptr);
+  case asset::TextureFormat::BC5:
+    if (!_bc) break;
+    return VK_FORMAT_BC5_UNORM_BLOCK;
 
-    vmaDestroyAllocator(_allocator);
+  case asset::TextureFormat::BC7:
+    if (!_bc) break;
+    return srgb ? VK_FORMAT_BC7_SRGB_BLOCK : VK_FORMAT_BC7_UNORM_BLOCK;
 
-    vkDestroyDevice(_device, nullptr);
-    vkDestroyInstance(_instance, nullptr);
-    SDL_DestroyWindow(_window);
-    SDL_Quit();
+  case asset::TextureFormat::ASTC4x4:
+    if (!_astc) break;
+    return srgb ? VK_FORMAT_ASTC_4x4_SRGB_BLOCK : VK_FORMAT_ASTC_4x4_UNORM_BLOCK;
   }
+
+  return VK_FORMAT_UNDEFINED;
 }
 
-// This is used to synchronize our double-buffered frames. Basically we just
-// wait on the vkQueueSubmit fence to make sure that there's only two frames in
-// flight at any given time.
-//
-// Log and exit on failure.
-gfx::PerFrame *gfx::Engine::_acquireNextFrame() {
-  _currentFrame = (_currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+uint32_t gfx::TextureManager::acquire(std::string const &libraryPath, asset::TextureID id) {
+  auto shared = _slotIndex.find(id);
 
-  PerFrame *frame = &_perFrames[_currentFrame];
+  if (shared != _slotIndex.end()) {
+    _textures[shared->second].refs++;
+    return shared->second;
+  }
 
-  if (vkWaitForFences(_device, 1, &frame->renderFinishedFence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
-    std::cerr << "timeout or failure while waiting for frame fence." << std::endl;
-    std::exit(-1);
+  auto found = _libraries.find(libraryPath);
+
+  if (found == _libraries.end()) {
+    found = _libraries.emplace(libraryPath, asset::openLibraryFile(libraryPath)).first;
   }
 
-  if (vkResetFences(_device, 1, &frame->renderFinishedFence) != VK_SUCCESS) {
-    std::cerr << "failed to reset frame fence." << std::endl;
+  asset::TextureFileHandleBuffer *file = found->second->textureFile(id);
+  asset::TextureData             *data = file ? file->getTextureData(id) : nullptr;
+
+  if (!data) {
+    std::cerr << "Can't find texture with ID " << id << " in asset library." << std::endl;
+    return 0;
   }
 
-  return frame;
-}
+  VkFormat format = _vkFormat(*data);
 
-// Allocate a single, non-resetable, primary command buffer from `pool`.
-//
-// Log and exit on failure.
-VkCommandBuffer gfx::Engine::_allocCmdBuffer(VkCommandPool pool) {
-  VkCommandBuffer cmdBuf;
-  VkCommandBufferAllocateInfo allocInfo = {
-    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-    .pNext = nullptr,
+  if (format == VK_FORMAT_UNDEFINED) {
+    std::cerr << "Texture " << id << " is in a format this device can't sample" << std::endl;
+    return 0;
+  }
 
-    .commandPool          = pool,
-    .commandBufferCount   = 1,
-    .level                = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-  };
+  uint32_t slot;
 
-  if (vkAllocateCommandBuffers(_device, &allocInfo, &cmdBuf) != VK_SUCCESS) {
-    std::cerr << "Failed to allocate frame command buffer" << std::endl;
-    std::exit(-1);
+  if (!_freeSlots.empty()) {
+    slot = _freeSlots.back();
+    _freeSlots.pop_back();
+  } else if (_textures.size() < _maxTextures) {
+    slot = (uint32_t)_textures.size();
+    _textures.emplace_back();
+  } else {
+    std::cerr << "Out of texture slots, " << id << " won't be drawn" << std::endl;
+    return 0;
   }
 
-  return cmdBuf;
-}
+  Texture &texture = _textures[slot];
 
-// Call vkBeginCmdBuffer on `cmdBuf` with the given `flags`.
-//
-// Log and exit on failure.
-void gfx::Engine::_beginCmdBuffer(VkCommandBuffer cmdBuf, uint32_t flags) {
-  VkCommandBufferBeginInfo beginInfo = {
-    .sType  = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-    .pNext  = nullptr,
-    .flags  = flags,
+  // The slot's old descriptors may not all have been rewritten yet, and they
+  // still need to be before its old image goes.
+  uint32_t dirtySets = texture.dirtySets;
 
-    .pInheritanceInfo = nullptr,
-  };
+  texture = Texture { };
 
-  if (vkBeginCommandBuffer(cmdBuf, &beginInfo) != VK_SUCCESS) {
-    std::cerr << "Failed to begin command buffer..." << std::endl;
-    std::exit(-1);
+  texture.dirtySets = dirtySets;
+
+  texture.id      = id;
+  texture.file    = file;
+  texture.format  = format;
+  texture.refs    = 1;
+  texture.mips    = file->mips(id);
+
+  texture.tailBytes.resize(texture.mips.size + 1, 0);
+
+  for (uint32_t l = texture.mips.size; l-- > 0;) {
+    texture.tailBytes[l] = texture.tailBytes[l + 1] + texture.mips[l].size;
+  }
+
+  texture.tailBytes.pop_back();
+
+  texture.minLevel = 0;
+
+  while (texture.minLevel < texture.mips.size
+	 && texture.mips[texture.minLevel].size > Uploader::STAGING_SIZE)
+  {
+    texture.minLevel++;
+  }
+
+  if (texture.minLevel == texture.mips.size) {
+    std::cerr << "Texture " << id << " has no level small enough to stage" << std::endl;
   }
+
+  _slotIndex[id] = slot;
+
+  return slot;
 }
 
-// Abstract over calling vkCmdBeginRenderPass on `cmdBuf`
-//
-// Log and exit on failure.
-void
-gfx::Engine::_beginRenderPass(VkCommandBuffer cmdBuf,
-			      VkFramebuffer fb,
-			      VkClearValue *clearValues,
-			      uint32_t clearCount)
-{
-  VkRenderPassBeginInfo rpassBeginInfo = {
-    .sType  = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-    .pNext  = nullptr,
+void gfx::TextureManager::release(uint32_t slot) {
+  Texture &texture = _textures[slot];
 
-    .renderPass = _renderPass,
-    .renderArea = {
-      .offset = { .x = 0, .y = 0 },
-      .extent = _swapExtent,
-    },
-    .framebuffer = fb,
+  if (slot == 0 || --texture.refs > 0) return;
 
-    .clearValueCount = clearCount,
-    .pClearValues    = clearValues,
-  };
+  _retire(texture.image, 0);
+  _retire(texture.pending, texture.pendingSerial);
+
+  _residentBytes -= texture.image.image ? texture.tailBytes[texture.image.firstLevel] : 0;
+  _residentBytes -= texture.pending.image ? texture.tailBytes[texture.pending.firstLevel] : 0;
+
+  _slotIndex.erase(texture.id);
+
+  texture.image    = { };
+  texture.pending  = { };
+  texture.file     = nullptr;
+
+  _markDirty(slot);
 
-  vkCmdBeginRenderPass(cmdBuf, &rpassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+  _freeSlots.push_back(slot);
 }
 
-// Draw a frame. Basically, we acquire a frame and swap image, write a bunch of
-// commands to a buffer, submit those commands, and then present the frame.
+void gfx::TextureManager::request(uint32_t slot, float pixels) {
+  Texture &texture = _textures[slot];
+
+  texture.coverage = std::max(texture.coverage, pixels);
+}
+
+uint32_t gfx::TextureManager::_residentLevel(Texture const &texture) const {
+  return texture.image.image ? texture.image.firstLevel : (uint32_t)texture.mips.size;
+}
+
+// Textures get their levels in order of coverage, so when the budget runs
+// short it's the smallest things on screen that go blurry. Each one gets the
+// level that puts about a texel under every pixel, coarsened until it fits in
+// what's left, but never coarser than its last level -- which is all a texture
+// that's off screen keeps.
 //
-// Log and exit on failure.
-void gfx::Engine::draw() {
-  PerFrame *frame = _acquireNextFrame();
+// The budget is VRAM_BUDGET, or less if the device's own budget can't fit
+// that. Going over it skips LOWER_DELAY, so textures start giving up levels
+// as soon as the device runs short.
+void gfx::TextureManager::update() {
+  for (size_t slot = 1; slot < _textures.size(); slot++) {
+    Texture &texture = _textures[slot];
 
-  uint32_t swapIndex;
-  if (vkAcquireNextImageKHR(_device,
-			    _swapChain,
-			    UINT64_MAX,
-			    frame->imageAcquiredSem,
-			    nullptr,
-			    &swapIndex)
-      != VK_SUCCESS)
-    {
-      std::cerr << "Failed to acquire swapchain image." << std::endl;
-      std::exit(-1);
-    }
+    if (!texture.pending.image || !_uploader->completed(texture.pendingSerial)) continue;
 
-  PerSwapImage *swap = &_perSwaps[swapIndex];
+    _residentBytes -= texture.image.image ? texture.tailBytes[texture.image.firstLevel] : 0;
 
-  if (vkResetCommandPool(_device, frame->commandPool, 0) != VK_SUCCESS) {
-    std::cerr << "Failed to reset frame command pool." << std::endl;
-    std::exit(-1);
+    _retire(texture.image, 0);
+
+    texture.image    = texture.pending;
+    texture.pending  = { };
+
+    _markDirty(slot);
   }
 
-  VkCommandBuffer cmdBuf = _allocCmdBuffer(frame->commandPool);
+  std::vector<uint32_t> order;
 
-  _beginCmdBuffer(cmdBuf, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+  for (uint32_t slot = 1; slot < _textures.size(); slot++) {
+    Texture const &texture = _textures[slot];
 
-  VkClearValue colorClear =  { { { 0.0f, 0.0f, 0.0f, 1.0f } } };
-  VkClearValue depthClear = {
-    .depthStencil = {
-      .depth = 1.0f,
-    },
-  };
+    if (texture.refs > 0 && texture.minLevel < texture.mips.size) order.push_back(slot);
+  }
 
-  VkClearValue clearValues[2] = { colorClear, depthClear };
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return _textures[a].coverage > _textures[b].coverage;
+  });
 
-  _beginRenderPass(cmdBuf, swap->framebuf, clearValues, 2);
+  // What we hold now, plus what the device can still take, is what we could
+  // hold at most.
+  VkDeviceSize available  = _residentBytes + _garbageBytes + _memory->deviceHeadroom();
+  VkDeviceSize budget     = std::min(VRAM_BUDGET,
+				     available > MEMORY_RESERVE ? available - MEMORY_RESERVE : 0);
 
-  // Draw commands go here :D
+  VkDeviceSize budgeted  = 0;
+  VkDeviceSize staged    = 0;
+  bool         any       = false;
 
-  glm::vec3 camPos = { 0.0f, 0.8f, 1.5f };
+  for (uint32_t slot : order) {
+    Texture &texture = _textures[slot];
 
-  glm::mat4 view = glm::lookAt(camPos, glm::vec3(0.0f), glm::vec3(0.0, 1.0, 0.0));
+    uint32_t last    = (uint32_t)texture.mips.size - 1;
+    uint32_t wanted  = last;
 
-  glm::mat4 project =
-    glm::perspective(glm::radians(70.0f),
-		     (float) _swapExtent.width / (float) _swapExtent.height,
-		     0.1f, 200.0f);
+    if (texture.coverage > 0.0f) {
+      float size = (float)std::max(texture.mips[0].width, texture.mips[0].height);
 
-  project[1][1] *= -1;
+      wanted = (uint32_t)std::clamp(std::floor(std::log2(size / texture.coverage)),
+				    0.0f, (float)last);
+    }
 
-  glm::mat4 model = glm::rotate(glm::mat4 { 1.0f },
-				glm::radians(_framesDrawn * 0.4f),
-				glm::vec3(0, 1, 0));
+    wanted = std::max(wanted, texture.minLevel);
 
-  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, _graphicsPipeline);
+    while (wanted < last && budgeted + texture.tailBytes[wanted] > budget) wanted++;
 
-  VkDeviceSize offset = 0;
+    budgeted += texture.tailBytes[wanted];
 
-  vkCmdBindVertexBuffers(cmdBuf, 0, 1, &_testMultiMesh.vertexBuffer.buffer, &offset);
-  vkCmdBindIndexBuffer(cmdBuf, _testMultiMesh.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT16);
+    texture.coverage = 0.0f;
 
-  MeshPushConstants constants = {
-    .renderMatrix = project * view * model,
-  };
+    uint32_t resident = _residentLevel(texture);
 
-  vkCmdPushConstants(cmdBuf, _pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0,
-		     sizeof(MeshPushConstants), &constants);
+    if (wanted < resident) {
+      texture.lowerFrames = 0;
+    } else if (wanted > resident) {
+      texture.lowerFrames++;
 
-  _drawMultiMesh(cmdBuf, &_testMultiMesh, ID("asset:mesh:monkey"));
+      if (texture.lowerFrames < LOWER_DELAY && _residentBytes <= budget) continue;
+    } else {
+      texture.lowerFrames = 0;
+      continue;
+    }
 
+    // One change at a time; whatever we'd do next is reconsidered once the
+    // pending levels land.
+    if (texture.pending.image) continue;
 
-  model = glm::rotate(glm::translate(glm::mat4 { 1.0f },
-					       glm::vec3(-1.0f, 0.0f, -1.0f)),
-				glm::radians(_framesDrawn * -0.4f),
-				glm::vec3(0, 1, 0));
+    if (any && staged + texture.tailBytes[wanted] > STREAM_BUDGET) continue;
 
-  constants.renderMatrix = project * view * model;
+    VkDeviceSize bytes = _upload(&texture, wanted);
 
+    // No room even for fewer levels, so free the ones it has; the slot
+    // samples white until there's room again.
+    if (bytes == 0 && wanted > resident) {
+      _residentBytes -= texture.tailBytes[resident];
 
-  vkCmdPushConstants(cmdBuf, _pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0,
-		     sizeof(MeshPushConstants), &constants);
+      _retire(texture.image, 0);
+      texture.image = { };
 
-  _drawMultiMesh(cmdBuf, &_testMultiMesh, ID("asset:mesh:fancy-cube"));
+      _markDirty(slot);
+    }
 
-  vkCmdEndRenderPass(cmdBuf);
+    staged += bytes;
+    any     = true;
 
-  if (vkEndCommandBuffer(cmdBuf) != VK_SUCCESS) {
-    std::cerr << "failed to end command buffer." << std::endl;
-    std::exit(-1);
+    texture.lowerFrames = 0;
   }
 
-  VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  _uploader->flush();
+}
 
-  VkSubmitInfo submitInfo = {
-    .sType  = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+bool gfx::TextureManager::_createImage(Texture const  &texture,
+				       uint32_t       firstLevel,
+				       Image          *image)
+{
+  bool concurrent = _families[0] != _families[1];
+
+  VkImageCreateInfo imageInfo = {
+    .sType  = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
     .pNext  = nullptr,
 
-    .pWaitDstStageMask  = (&waitStage),
+    .imageType  = VK_IMAGE_TYPE_2D,
+    .format     = texture.format,
+    .extent     = {
+      .width   = texture.mips[firstLevel].width,
+      .height  = texture.mips[firstLevel].height,
+      .depth   = 1,
+    },
 
-    .waitSemaphoreCount  = 1,
-    .pWaitSemaphores     = (&frame->imageAcquiredSem),
+    .mipLevels    = (uint32_t)texture.mips.size - firstLevel,
+    .arrayLayers  = 1,
+    .samples      = VK_SAMPLE_COUNT_1_BIT,
+    .tiling       = VK_IMAGE_TILING_OPTIMAL,
+    .usage        = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
 
-    .signalSemaphoreCount  = 1,
-    .pSignalSemaphores     = (&frame->renderFinishedSem),
+    // Written on the transfer queue and sampled on the graphics queue, like
+    // the buffers the Uploader fills.
+    .sharingMode            = concurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+    .queueFamilyIndexCount  = concurrent ? 2u : 0u,
+    .pQueueFamilyIndices    = concurrent ? _families : nullptr,
 
-    .commandBufferCount  = 1,
-    .pCommandBuffers     = &cmdBuf,
+    .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
   };
 
-  if (vkQueueSubmit(_graphicsQueue, 1, &submitInfo, frame->renderFinishedFence) != VK_SUCCESS) {
-    std::cerr << "Failed to submit command buffer for rendering..." << std::endl;
-    std::exit(-1);
-  }
+  // Fail rather than push the heap over its budget, where the driver might
+  // start paging, or fail something that can't cope with it.
+  VmaAllocationCreateInfo vmaAllocInfo = {
+    .flags = VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT,
+    .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+  };
 
-  VkPresentInfoKHR presentInfo = {
-    .sType  = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-    .pNext  = nullptr,
+  *image = { };
 
-    .swapchainCount  = 1,
-    .pSwapchains     = (&_swapChain),
+  image->firstLevel = firstLevel;
 
-    .waitSemaphoreCount  = 1,
-    .pWaitSemaphores     = (&frame->renderFinishedSem),
+  if (vmaCreateImage(_allocator, &imageInfo, &vmaAllocInfo,
+		     &image->image, &image->alloc, nullptr) != VK_SUCCESS)
+    {
+      *image = { };
+      return false;
+    }
 
-    .pImageIndices  = &swapIndex,
+  _memory->track(MemoryCategory::Texture, image->alloc);
+
+  VkImageViewCreateInfo viewInfo = {
+    .sType  = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+    .pNext  = nullptr,
+
+    .viewType  = VK_IMAGE_VIEW_TYPE_2D,
+    .image     = image->image,
+    .format    = texture.format,
+
+    .subresourceRange = {
+      .aspectMask      = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseMipLevel    = 0,
+      .levelCount      = imageInfo.mipLevels,
+      .baseArrayLayer  = 0,
+      .layerCount      = 1,
+    },
   };
 
-  if (vkQueuePresentKHR(_graphicsQueue, &presentInfo) != VK_SUCCESS) {
-    std::cerr << "Failed to present to the swapchain =[" << std::endl;
+  if (vkCreateImageView(_device, &viewInfo, nullptr, &image->view) != VK_SUCCESS) {
+    std::cerr << "Failed to create texture image view" << std::endl;
     std::exit(-1);
   }
 
-  _framesDrawn++;
+  return true;
 }
 
-// Initialize this DescriptorAllocator for use with the given `device`
-void gfx::DescriptorAllocator::init(VkDevice device) {
-  _device = device;
-}
+// Each level is read from the texture's file straight into staging memory.
+// They may go out over several Uploader submissions, but nothing samples the
+// image until the last of them is done.
+VkDeviceSize gfx::TextureManager::_upload(Texture *texture, uint32_t firstLevel) {
+  if (!_createImage(*texture, firstLevel, &texture->pending)) return 0;
 
-// Destroy all VkDescriptorPools in use by the allocator.
-void gfx::DescriptorAllocator::cleanup() {
-  for (auto p : _freePools) {
-    vkDestroyDescriptorPool(_device, p, nullptr);
-  }
-  for (auto p : _usedPools) {
-    vkDestroyDescriptorPool(_device, p, nullptr);
+  for (uint32_t l = firstLevel; l < texture->mips.size; l++) {
+    auto const &mip = texture->mips[l];
+
+    void *dst = _uploader->stageImage(texture->pending.image, l - firstLevel,
+				      { mip.width, mip.height, 1 }, mip.size);
+
+    if (!texture->file->readMip(texture->id, l, dst)) {
+      std::cerr << "Failed to read level " << l << " of texture " << texture->id << std::endl;
+    }
   }
 
-  _freePools.clear();
-  _usedPools.clear();
+  texture->pendingSerial = _uploader->nextSerial();
+
+  _residentBytes += texture->tailBytes[firstLevel];
+
+  return texture->tailBytes[firstLevel];
 }
 
-// Helper to create a descriptor pool. For internal use by the allocator.
-VkDescriptorPool gfx::DescriptorAllocator::createPool(
-  size_t count,
-  VkDescriptorPoolCreateFlags flags)
-{
-  std::vector<VkDescriptorPoolSize> sizes;
-  sizes.reserve(_descriptorSizes.sizes.size());
-  for (auto sz : _descriptorSizes.sizes) {
-    sizes.push_back({ sz.first, (uint32_t)(sz.second * (float)count)});
+void gfx::TextureManager::_markDirty(uint32_t slot) {
+  if (_textures[slot].dirtySets == 0) _dirty.push_back(slot);
+
+  _textures[slot].dirtySets = (1u << _sets.size()) - 1;
+}
+
+// `image` may still be in some set, or in use by a frame in flight. Once every
+// set has been prepared again, its next frame's fence has been waited on, so
+// neither can be true. An image that was still being uploaded also has to wait
+// for Uploader submission `serial`.
+void gfx::TextureManager::_retire(Image const &image, uint64_t serial) {
+  if (!image.image) return;
+
+  VmaAllocationInfo info;
+  vmaGetAllocationInfo(_allocator, image.alloc, &info);
+
+  _garbage.push_back({ image, (uint32_t)_sets.size(), serial, info.size });
+
+  _garbageBytes += info.size;
+}
+
+void gfx::TextureManager::_destroy(Image const &image) {
+  if (!image.image) return;
+
+  vkDestroyImageView(_device, image.view, nullptr);
+
+  _memory->untrack(image.alloc);
+  vmaDestroyImage(_allocator, image.image, image.alloc);
+}
+
+void gfx::TextureManager::prepare(uint32_t frameIndex) {
+  uint32_t bit = 1u << frameIndex;
+
+  std::vector<VkDescriptorImageInfo>  imageInfos;
+  std::vector<VkWriteDescriptorSet>   writes;
+
+  imageInfos.reserve(_dirty.size());
+
+  for (uint32_t slot : _dirty) {
+    Texture &texture = _textures[slot];
+
+    if (!(texture.dirtySets & bit)) continue;
+
+    texture.dirtySets &= ~bit;
+
+    imageInfos.push_back({
+	.sampler      = _sampler,
+	.imageView    = texture.image.image ? texture.image.view : _textures[0].image.view,
+	.imageLayout  = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      });
+
+    writes.push_back({
+	.sType  = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+	.pNext  = nullptr,
+
+	.dstSet           = _sets[frameIndex],
+	.dstBinding       = 0,
+	.dstArrayElement  = slot,
+	.descriptorCount  = 1,
+	.descriptorType   = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+	.pImageInfo       = &imageInfos.back(),
+      });
   }
 
-  VkDescriptorPoolCreateInfo poolInfo = {
-    .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-    .flags         = flags,
-    .maxSets       = (uint32_t)count,
-    .poolSizeCount = (uint32_t)sizes.size(),
-    .pPoolSizes    = sizes.data(),
-  };
+  if (!writes.empty()) vkUpdateDescriptorSets(_device, writes.size(), writes.data(), 0, nullptr);
 
-  VkDescriptorPool descriptorPool;
+  _dirty.erase(std::remove_if(_dirty.begin(), _dirty.end(),
+			      [&](uint32_t slot) { return _textures[slot].dirtySets == 0; }),
+	       _dirty.end());
 
-  vkCreateDescriptorPool(_device, &poolInfo, nullptr, &descriptorPool);
+  for (auto &garbage : _garbage) {
+    if (garbage.prepares > 0) garbage.prepares--;
 
-  return descriptorPool;
-}
+    if (garbage.prepares == 0 && _uploader->completed(garbage.serial)) {
+      _destroy(garbage.image);
+      garbage.image = { };
 
-// Get an unused pool, either from the free-list or by creating a new one.
-VkDescriptorPool gfx::DescriptorAllocator::grabPool() {
-  if (_freePools.size() > 0) {
-    VkDescriptorPool pool = _freePools.back();
-    _freePools.pop_back();
-    return pool;
-  } else {
-    return createPool(1000, 0);
+      _garbageBytes -= garbage.bytes;
+    }
   }
+
+  _garbage.erase(std::remove_if(_garbage.begin(), _garbage.end(),
+				[](Garbage const &garbage) { return !garbage.image.image; }),
+		 _garbage.end());
 }
 
-// Allocate a descriptor set with the given layout.
-bool gfx::DescriptorAllocator::allocate(
-  VkDescriptorSet *set,
-  VkDescriptorSetLayout layout)
+// Load the cache at `cachePath` if it's there and matches this device.
+//
+// Log and exit on failure.
+void gfx::PipelineRegistry::init(VkDevice            device,
+				 VkPhysicalDevice    physicalDevice,
+				 std::string const   &cachePath,
+				 jobs::System        *jobs,
+				 BuildFn             build)
 {
-  if (_currentPool == VK_NULL_HANDLE) {
-    _currentPool = grabPool();
-    _usedPools.push_back(_currentPool);
-  }
+  _device     = device;
+  _cachePath  = cachePath;
+  _jobs       = jobs;
+  _build      = std::move(build);
 
-  VkDescriptorSetAllocateInfo allocInfo = {
-    .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-    .pNext              = nullptr,
-    .pSetLayouts        = (&layout),
-    .descriptorPool     = _currentPool,
-    .descriptorSetCount = 1,
-  };
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physicalDevice, &props);
 
-  VkResult allocResult = vkAllocateDescriptorSets(_device, &allocInfo, set);
+  std::vector<char> data;
 
-  bool needNewPool = false;
+  std::ifstream file(cachePath, std::ios::ate | std::ios::binary);
 
-  switch (allocResult) {
-  case VK_SUCCESS:
-    return true;
+  if (file.is_open()) {
+    data.resize(static_cast<size_t>(file.tellg()));
 
-  case VK_ERROR_FRAGMENTED_POOL:
-  case VK_ERROR_OUT_OF_POOL_MEMORY:
-    needNewPool = true;
-    break;
+    file.seekg(0);
+    file.read(data.data(), data.size());
 
-  default:
-    return false;
-  };
+    if (!file) data.clear();
+  }
 
-  if (needNewPool) {
-    _currentPool = grabPool();
-    _usedPools.push_back(_currentPool);
+  // Not every driver checks the blob it's given before trusting it, so make
+  // sure it came from this device and driver version first. A driver update
+  // changes pipelineCacheUUID, which throws the old cache away.
+  VkPipelineCacheHeaderVersionOne header;
 
-    allocResult = vkAllocateDescriptorSets(_device, &allocInfo, set);
+  bool valid = data.size() >= sizeof(header);
 
-    if (allocResult == VK_SUCCESS) {
-      return true;
-    }
-  }
+  if (valid) {
+    std::memcpy(&header, data.data(), sizeof(header));
 
-  // We failed to allocate twice, even with a brand new pool --
-  // something's wrong.
-  return false;
-}
+    valid = header.headerSize >= sizeof(header)
+      && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+      && header.vendorID == props.vendorID
+      && header.deviceID == props.deviceID
+      && std::memcmp(header.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+  }
 
-// Reset all pools allocated by this allocator. This effective frees every
-// DescriptorSet it has been used to allocate.
-void gfx::DescriptorAllocator::resetPools() {
-  for (auto p : _usedPools) {
-    vkResetDescriptorPool(_device, p, 0);
-    _freePools.push_back(p);
+  if (!valid && !data.empty()) {
+    std::cerr << "Ignoring pipeline cache '" << cachePath
+	      << "' from a different device or driver" << std::endl;
   }
 
-  _usedPools.clear();
-  _currentPool = VK_NULL_HANDLE;
-}
+  if (!valid) data.clear();
 
-// Initialize a DescriptorLayoutCache for the given `device`
-void gfx::DescriptorLayoutCache::init(VkDevice device) {
-  _device = device;
-}
+  VkPipelineCacheCreateInfo info = {
+    .sType  = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+    .pNext  = nullptr,
+    .flags  = 0,
 
-// Destroy all layouts created by the cache.
-void gfx::DescriptorLayoutCache::cleanup() {
-  for (auto pair : _layoutCache) {
-    vkDestroyDescriptorSetLayout(_device, pair.second, nullptr);
+    .initialDataSize  = data.size(),
+    .pInitialData     = data.empty() ? nullptr : data.data(),
+  };
+
+  if (vkCreatePipelineCache(_device, &info, nullptr, &_cache) != VK_SUCCESS) {
+    std::cerr << "Failed to create pipeline cache" << std::endl;
+    std::exit(-1);
   }
 }
 
-// Create a new VkDescriptorSetLayout, or if a layout that matches `info`
-// already exists, return it from the cache.
-VkDescriptorSetLayout
-gfx::DescriptorLayoutCache::createDescriptorLayout(VkDescriptorSetLayoutCreateInfo *info) {
-  DescriptorLayoutInfo layoutInfo;
-  layoutInfo.bindings.reserve(info->bindingCount);
+// Failing to save the cache isn't fatal; the next launch just compiles
+// everything again.
+void gfx::PipelineRegistry::cleanup() {
+  size_t size = 0;
 
-  bool isSorted = true;
-  int lastBinding = -1;
+  if (vkGetPipelineCacheData(_device, _cache, &size, nullptr) == VK_SUCCESS && size > 0) {
+    std::vector<char> data(size);
 
-  for (int i = 0; i < info->bindingCount; i++) {
-    layoutInfo.bindings.push_back(info->pBindings[i]);
-    if (info->pBindings[i].binding > lastBinding) {
-      lastBinding = info->pBindings[i].binding;
-    } else {
-      isSorted = false;
+    if (vkGetPipelineCacheData(_device, _cache, &size, data.data()) == VK_SUCCESS) {
+      // Write next to the old cache and rename over it, so a crash part way
+      // through can't leave a truncated cache behind.
+      std::string tmpPath = _cachePath + ".tmp";
+
+      std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+
+      file.write(data.data(), size);
+      file.close();
+
+      if (!file || std::rename(tmpPath.c_str(), _cachePath.c_str()) != 0) {
+	std::cerr << "Failed to save pipeline cache '" << _cachePath << "'" << std::endl;
+	std::remove(tmpPath.c_str());
+      }
     }
   }
 
-  if (!isSorted) {
-    std::sort(layoutInfo.bindings.begin(), layoutInfo.bindings.end(),
-	      [](VkDescriptorSetLayoutBinding & a, VkDescriptorSetLayoutBinding & b) {
-		return a.binding > b.binding;
-	      });
+  for (auto &[key, pass] : _passes) {
+    vkDestroyPipeline(_device, pass.pipeline, nullptr);
+  }
 
+  for (auto &[path, module] : _modules) {
+    vkDestroyShaderModule(_device, module, nullptr);
   }
 
-  auto it = _layoutCache.find(layoutInfo);
-  if (it != _layoutCache.end()) {
-    return (*it).second;
-  } else {
-    VkDescriptorSetLayout layout;
-    vkCreateDescriptorSetLayout(_device, info, nullptr, &layout);
+  vkDestroyPipelineCache(_device, _cache, nullptr);
 
-    _layoutCache[layoutInfo] = layout;
-    return layout;
-  }
+  _materials.clear();
+  _passes.clear();
+  _effects.clear();
+  _modules.clear();
+
+  _cache = VK_NULL_HANDLE;
 }
 
-// Equality operator on DescriptorLayoutInfo, for use with the hash map.
-bool gfx::DescriptorLayoutCache::DescriptorLayoutInfo::operator == (const DescriptorLayoutInfo & other) const
+VkShaderModule gfx::PipelineRegistry::_module(std::string const &path) {
+  auto found = _modules.find(path);
+
+  if (found != _modules.end()) return found->second;
+
+  VkShaderModule module = loadShaderModule(_device, path);
+
+  _modules.emplace(path, module);
+
+  return module;
+}
+
+gfx::ShaderEffect *gfx::PipelineRegistry::effect(std::string const  &vertPath,
+						 std::string const  &fragPath,
+						 VkPipelineLayout   layout)
 {
-  if (other.bindings.size() != bindings.size()) {
-    return false;
-  }
+  auto key   = std::make_tuple(vertPath, fragPath, layout);
+  auto found = _effects.find(key);
 
-  for (int i = 0; i < bindings.size(); i++) {
-    if (other.bindings[i].binding != bindings[i].binding) {
-      return false;
-    }
-    if (other.bindings[i].descriptorType != bindings[i].descriptorType) {
-      return false;
-    }
-    if (other.bindings[i].descriptorCount != bindings[i].descriptorCount) {
-      return false;
-    }
-    if (other.bindings[i].stageFlags != bindings[i].stageFlags) {
-      return false;
-    }
+  if (found != _effects.end()) return &found->second;
+
+  ShaderEffect effect = {
+    .descLayout  = VK_NULL_HANDLE,
+    .layout      = layout,
+    .stages      = {
+      { _module(vertPath), VK_SHADER_STAGE_VERTEX_BIT },
+    },
+  };
+
+  // Depth-only passes need no fragment shader at all.
+  if (!fragPath.empty()) {
+    effect.stages.push_back({ _module(fragPath), VK_SHADER_STAGE_FRAGMENT_BIT });
   }
 
-  return true;
+  return &_effects.emplace(key, std::move(effect)).first->second;
 }
 
-// Hash implementation for DescriptorLayoutInfo, for use with the hash map.
-size_t gfx::DescriptorLayoutCache::DescriptorLayoutInfo::hash() const {
-  size_t result = bindings.size();
+gfx::ShaderPass *gfx::PipelineRegistry::pass(ShaderEffect *effect, PassVariant const &variant) {
+  PassKey key = _key(effect, variant);
 
-  for (const VkDescriptorSetLayoutBinding& b : bindings)
   {
-    size_t binding_hash = b.binding
-                        ^ b.descriptorType << 8
-                        ^ b.descriptorCount << 16
-                        ^ b.stageFlags << 24;
+    std::lock_guard<std::mutex> guard(_lock);
 
-    result = (result << 5)
-           ^ binding_hash
-           ^ (result >> 45);
-  }
+    auto found = _passes.find(key);
 
-  return result;
-}
+    if (found != _passes.end()) return &found->second;
+  }
 
-// Create a new, blank DescriptorBuilder
-gfx::DescriptorBuilder gfx::DescriptorBuilder::begin(
-  DescriptorLayoutCache *layoutCache,
-  DescriptorAllocator *allocator)
-{
-  DescriptorBuilder builder;
+  compile({ { effect, variant } });
 
-  builder._cache     = layoutCache;
-  builder._allocator = allocator;
+  std::lock_guard<std::mutex> guard(_lock);
 
-  return builder;
+  return &_passes.at(key);
 }
 
-// Bind a buffer to the resulting VkDescriptorSet
-gfx::DescriptorBuilder &gfx::DescriptorBuilder::bind_buffer(
-  uint32_t binding,
-  VkDescriptorBufferInfo *bufferInfo,
-  VkDescriptorType type,
-  VkShaderStageFlags stageFlags)
-{
-  VkDescriptorSetLayoutBinding dslb {
-    .descriptorCount    = 1,
-    .descriptorType     = type,
-    .pImmutableSamplers = nullptr,
-    .stageFlags         = stageFlags,
-    .binding            = binding,
-  };
-
-  _bindings.push_back(dslb);
+// VkPipelineCache is internally synchronized, so every build shares _cache.
+void gfx::PipelineRegistry::compile(std::vector<std::pair<ShaderEffect *, PassVariant>> const &passes) {
+  std::vector<std::pair<ShaderEffect *, PassVariant>> todo;
+  std::vector<PassKey>                                todoKeys;
 
-  VkWriteDescriptorSet wds {
-    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-    .pNext = nullptr,
+  {
+    std::lock_guard<std::mutex> guard(_lock);
 
-    .descriptorCount = 1,
-    .descriptorType  = type,
-    .pBufferInfo     = bufferInfo,
-    .dstBinding      = binding,
-  };
+    for (auto const &[effect, variant] : passes) {
+      PassKey key = _key(effect, variant);
 
-  _writes.push_back(wds);
+      if (_passes.count(key)) continue;
+      if (std::find(todoKeys.begin(), todoKeys.end(), key) != todoKeys.end()) continue;
 
-  return *this;
-}
+      todo.push_back({ effect, variant });
+      todoKeys.push_back(key);
+    }
+  }
 
-// Bind an image to the resulting VkDescriptorSet
-gfx::DescriptorBuilder &gfx::DescriptorBuilder::bind_image(
-  uint32_t binding,
-  VkDescriptorImageInfo *imageInfo,
-  VkDescriptorType type,
-  VkShaderStageFlags stageFlags)
-{
-  VkDescriptorSetLayoutBinding dslb = {
-    .descriptorCount    = 1,
-    .descriptorType     = type,
-    .pImmutableSamplers = nullptr,
-    .stageFlags         = stageFlags,
-    .binding            = binding,
-  };
+  if (todo.empty()) return;
 
-  _bindings.push_back(dslb);
+  std::vector<VkPipeline> built(todo.size(), VK_NULL_HANDLE);
 
-  VkWriteDescriptorSet wds = {
-    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-    .pNext = nullptr,
+  _jobs->parallelFor(todo.size(), [&](size_t i, size_t) {
+    built[i] = _build(todo[i].first, todo[i].second, _cache);
+  });
 
-    .descriptorCount = 1,
-    .descriptorType  = type,
-    .dstBinding      = binding,
-    .pImageInfo      = imageInfo,
-  };
+  std::lock_guard<std::mutex> guard(_lock);
 
-  _writes.push_back(wds);
+  for (size_t i = 0; i < todo.size(); i++) {
+    ShaderPass pass = {
+      .effect    = todo[i].first,
+      .pipeline  = built[i],
+      .layout    = todo[i].first->layout,
+      .id        = (uint32_t)_passes.size(),
+    };
 
-  return *this;
+    // Another thread may have built the same pass while we were busy.
+    if (!_passes.emplace(todoKeys[i], pass).second) {
+      vkDestroyPipeline(_device, built[i], nullptr);
+    }
+  }
 }
 
-// Build a VkDescriptorSet from this builder.
-bool gfx::DescriptorBuilder::build(VkDescriptorSet &set, VkDescriptorSetLayout &layout) {
-  VkDescriptorSetLayoutCreateInfo layoutInfo = {
-    .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-    .pNext        = nullptr,
-    .pBindings    = _bindings.data(),
-    .bindingCount = (uint32_t)_bindings.size(),
-  };
+gfx::Material *gfx::PipelineRegistry::material(std::string const &name, MaterialInfo const &info) {
+  if (Material *existing = material(name)) return existing;
 
-  layout = _cache->createDescriptorLayout(&layoutInfo);
+  std::vector<std::pair<ShaderEffect *, PassVariant>> passes;
 
-  bool success = _allocator->allocate(&set, layout);
+  for (size_t p = 0; p < MeshPass::MAX; p++) {
+    if (info.effects[p]) passes.push_back({ info.effects[p], info.variants[p] });
+  }
 
-  if (!success) { return false; };
+  compile(passes);
 
-  for (auto &w : _writes) {
-    w.dstSet = set;
+  Material material = { };
+
+  for (size_t p = 0; p < MeshPass::MAX; p++) {
+    material.shaders[p]         = info.effects[p] ? pass(info.effects[p], info.variants[p]) : nullptr;
+    material.descriptorSets[p]  = info.descriptorSets[p];
   }
 
-  vkUpdateDescriptorSets(_allocator->_device, _writes.size(), _writes.data(), 0, nullptr);
+  std::lock_guard<std::mutex> guard(_lock);
 
-  return true;
+  material.id = (uint32_t)_materials.size();
+
+  return &_materials.emplace(name, material).first->second;
+}
+
+gfx::Material *gfx::PipelineRegistry::material(std::string const &name) {
+  std::lock_guard<std::mutex> guard(_lock);
+
+  auto found = _materials.find(name);
+
+  return found == _materials.end() ? nullptr : &found->second;
 }
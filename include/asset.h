@@ -35,13 +35,19 @@
 #include <fstream>
 #include <iostream>
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <vulkan/vulkan.h>
 #include <glm/glm.hpp>
 
+#include <zstd.h>
+
 #include "util.h"
 
 namespace asset {
@@ -93,6 +99,80 @@ namespace asset {
     static VertexInputDescription vertexInputDescription();
   };
 
+  // A 20 byte encoding of StaticVertexData, for when vertex fetch bandwidth
+  // matters more than precision:
+  //
+  //     position - snorm16, relative to the mesh's bounds (see MeshInfo in
+  //                static-mesh-packed.vert). `w` is always 0.
+  //     normal   - octahedral-encoded unit vector, snorm16.
+  //     tangent  - octahedral-encoded unit vector, snorm16.
+  //     uv       - half floats.
+  struct PackedVertexData {
+    int16_t   position[4];
+    int16_t   normal[2];
+    int16_t   tangent[2];
+    uint16_t  uv[2];
+
+    static VertexInputDescription vertexInputDescription();
+
+    static PackedVertexData pack(StaticVertexData const &vertex, BoundingBox const &bounds);
+    StaticVertexData        unpack(BoundingBox const &bounds) const;
+  };
+
+  // How a mesh's vertices are stored, both in its file and in vertex buffers.
+  enum class VertexFormat : uint32_t {
+    Full    = 0,  // StaticVertexData
+    Packed  = 1,  // PackedVertexData
+  };
+
+  // Size in bytes of one vertex in `format`.
+  inline size_t vertexSize(VertexFormat format) {
+    return format == VertexFormat::Packed ? sizeof(PackedVertexData) : sizeof(StaticVertexData);
+  }
+
+  // Width of a mesh's indices, both in its file and in index buffers.
+  enum class IndexType : uint32_t {
+    U16  = 0,
+    U32  = 1,
+  };
+
+  inline size_t indexSize(IndexType type) {
+    return type == IndexType::U32 ? sizeof(uint32_t) : sizeof(uint16_t);
+  }
+
+  // A small cluster of a mesh's triangles, with its own vertices. Meshlets
+  // keep big meshes on 16-bit indices, and give culling something finer than
+  // a whole mesh to work with.
+  //
+  // Offsets are relative to the mesh's first vertex and index, and the
+  // meshlet's indices are relative to its own first vertex. So each meshlet
+  // can be drawn as an indexed draw with
+  //
+  //     firstIndex   = <mesh's first index> + indexOffset
+  //     vertexOffset = <mesh's first vertex> + vertexOffset
+  struct Meshlet {
+    BoundingBox  bounds;
+    uint32_t     vertexOffset;
+    uint32_t     vertexCount;
+    uint32_t     indexOffset;
+    uint32_t     indexCount;
+  };
+
+  // One level of detail of a mesh. Every level draws from the mesh's one set
+  // of vertices, with its own range of the mesh's indices -- and of its
+  // meshlets, if it's split into meshlets. Offsets are relative to the mesh's
+  // first index and meshlet.
+  //
+  // `error` is how far the level strays from the full-detail surface, in the
+  // mesh's own units. Levels go from finest to coarsest, so errors only grow.
+  struct MeshLOD {
+    float     error;
+    uint32_t  indexOffset;
+    uint32_t  indexCount;
+    uint32_t  meshletOffset;
+    uint32_t  meshletCount;
+  };
+
   struct StaticMeshData {
     BoundingBox  bounds;
     MeshID       id;
@@ -105,38 +185,160 @@ namespace asset {
     uint32_t     vertexCount;
     uint32_t     indexOffset;
     uint32_t     indexCount;
+    VertexFormat vertexFormat  { VertexFormat::Full };
+    IndexType    indexType     { IndexType::U16 };
+
+    // The mesh's meshlets, in its file's meshlet table. A meshletCount of 0
+    // means the mesh isn't split, and is drawn in one piece.
+    uint32_t     meshletOffset { 0 };
+    uint32_t     meshletCount  { 0 };
+
+    // The mesh's levels of detail, in its file's LOD table. A lodCount of 0
+    // means the mesh has a single level, covering all of its indices and
+    // meshlets.
+    uint32_t     lodOffset     { 0 };
+    uint32_t     lodCount      { 0 };
   };
 
+  // A static mesh file is laid out as:
+  //
+  //     StaticMeshFileHeader
+  //     StaticMeshData[meshCount]
+  //     StaticMeshChunk[meshCount]
+  //     Meshlet[meshletCount]
+  //     MeshLOD[lodCount]
+  //     chunk data, each chunk starting on a CHUNK_ALIGNMENT boundary
+  //
+  // Each mesh has one chunk holding its vertices followed by its indices,
+  // either raw or as a single zstd frame. The vertices are in the mesh's
+  // vertexFormat, and the indices in its indexType.
+  //
+  // Older versions are not readable, and need to be regenerated with
+  // convert-gltf.
   struct StaticMeshFileHeader {
-    static constexpr char const *MAGIC_NUMBER = "crpg:asset:static-mesh";
+    static constexpr char const *MAGIC_NUMBER     = "crpg:asset:static-mesh";
+    static constexpr uint32_t    VERSION          = 6;
+    static constexpr uint32_t    CHUNK_ALIGNMENT  = 16;
     char      magicNumber[32];
+    uint32_t  version        { VERSION };
     uint32_t  meshCount;
     uint32_t  vertexCount;
     uint32_t  indexCount;
+    uint32_t  meshletCount   { 0 };
+    uint32_t  lodCount       { 0 };
+
+    // ID of the zstd dictionary chunks were compressed with, or 0 for none.
+    // The dictionary itself is stored in the library referencing this file.
+    uint32_t  dictionaryID   { 0 };
 
     StaticMeshFileHeader() {
       strcpy(magicNumber, MAGIC_NUMBER);
     }
   };
 
+  enum class Compression : uint32_t {
+    None  = 0,
+    Zstd  = 1,
+  };
+
+  struct StaticMeshChunk {
+    uint64_t     offset;        // in bytes, from the start of the file
+    uint32_t     size;          // in bytes, as stored
+    Compression  compression;
+  };
+
+  // How a texture's texels are stored, both in its file and in its image. The
+  // BC and ASTC formats are made of 4x4 blocks, so each level's size is
+  // rounded up to whole blocks.
+  enum class TextureFormat : uint32_t {
+    RGBA8    = 0,
+    BC1      = 1,  // RGB, 8 bytes per block
+    BC3      = 2,  // RGBA, 16 bytes per block
+    BC5      = 3,  // Two channels, for normal maps, 16 bytes per block
+    BC7      = 4,  // RGBA, 16 bytes per block
+    ASTC4x4  = 5,  // RGBA, 16 bytes per block
+  };
+
+  // Size in bytes of a `width` x `height` level in `format`.
+  size_t textureLevelSize(TextureFormat format, uint32_t width, uint32_t height);
+
   struct TextureData {
-    TextureID  id;
-    uint16_t   width;
-    uint16_t   height;
-    uint16_t   components;
-    uint32_t   offset; // in bytes
+    static constexpr uint32_t SRGB = 1;  // Color data, decoded from sRGB
+
+    TextureID      id;
+    TextureFormat  format;
+    uint32_t       width;      // of level 0
+    uint32_t       height;
+    uint32_t       flags       { 0 };
+
+    // The texture's levels in its file's mip table, finest first, each half
+    // the size of the one before (rounding down, but at least 1).
+    uint32_t       mipOffset;
+    uint32_t       mipCount;
+  };
+
+  struct TextureMip {
+    uint64_t  offset;  // in bytes, from the start of the file
+    uint32_t  size;    // in bytes
+    uint32_t  width;
+    uint32_t  height;
   };
 
+  // Write a static mesh file. Each mesh's vertexOffset and indexOffset index
+  // into `verts` and `indices`, its meshletOffset into `meshlets`, and its
+  // lodOffset into `lods`.
+  //
+  // Indices are stored 16-bit wherever they fit -- meshes that are split into
+  // meshlets always fit -- and 32-bit otherwise, which overrides the meshes'
+  // own indexType.
+  //
+  // Vertices are stored in `vertexFormat`, which overrides the meshes' own
+  // vertexFormat. Packed vertices are quantized within each mesh's bounds.
+  //
+  // With a `compressionLevel` above 0, chunks are zstd-compressed at that
+  // level -- using `dictionary` if it's non-empty -- and stored raw only when
+  // compression doesn't make them smaller.
   void writeStaticMeshFile(char const             *path,
 			   const StaticMeshData   *meshes,  uint32_t meshCount,
 			   const StaticVertexData *verts,   uint32_t vertCount,
-			   const uint16_t         *indices, uint32_t indexCount);
+			   const uint32_t         *indices, uint32_t indexCount,
+			   const Meshlet          *meshlets = nullptr, uint32_t meshletCount = 0,
+			   const MeshLOD          *lods = nullptr,     uint32_t lodCount = 0,
+			   VertexFormat           vertexFormat = VertexFormat::Full,
+			   int                    compressionLevel = 0,
+			   Span<char const>       dictionary = {});
 
   class StaticMeshFileHandleBuffer;
 
   using StaticMeshFileHandle = std::unique_ptr<StaticMeshFileHandleBuffer>;
 
-  StaticMeshFileHandle openStaticMeshFile(std::string const &path);
+  // How a StaticMeshFileHandle gets at the file's contents.
+  //
+  //     Mapped - The whole file is mmap'd read-only, and meshes are read (or
+  //              viewed) directly out of the mapping.
+  //
+  //     Stream - The file is kept open, with a pread for every vertex or
+  //              index range.
+  //
+  // Mapped handles fall back to Stream if the file can't be mapped. Either
+  // way, reading from a handle is safe from several threads at once.
+  enum class FileMode {
+    Mapped,
+    Stream,
+  };
+
+  // `dict` must be given for files compressed with a dictionary, and must
+  // outlive the handle.
+  StaticMeshFileHandle openStaticMeshFile(std::string const &path,
+					  FileMode          mode = FileMode::Mapped,
+					  ZSTD_DDict const  *dict = nullptr);
+
+  // Open a static mesh file that's been packed into memory someone else owns,
+  // like a library archive's mapping. `bytes` must outlive the handle, which
+  // is always Mapped. `name` is only for error messages.
+  StaticMeshFileHandle openStaticMeshRegion(std::string const    &name,
+					    Span<uint8_t const>  bytes,
+					    ZSTD_DDict const     *dict = nullptr);
 
   // This is the structure that backs a StaticMeshFileHandle. It holds all the
   // data that's necessary to load meshes from a static mesh file without
@@ -148,43 +350,201 @@ namespace asset {
 				      const StaticMeshFileHandle &handle);
 
 
-    friend StaticMeshFileHandle openStaticMeshFile(std::string const &path);
+    friend StaticMeshFileHandle openStaticMeshFile(std::string const &path,
+						   FileMode          mode,
+						   ZSTD_DDict const  *dict);
+
+    friend StaticMeshFileHandle openStaticMeshRegion(std::string const    &name,
+						     Span<uint8_t const>  bytes,
+						     ZSTD_DDict const     *dict);
 
     StaticMeshData *getMeshData(MeshID id);
 
-    bool readMesh(MeshID id, StaticVertexData *verts, uint16_t *indices);
+    // Read (decompressing if need be) mesh `id` into `verts` and `indices`.
+    // Compressed meshes are decompressed straight into the destinations, with
+    // no intermediate copy.
+    //
+    // `verts` and `indices` get the mesh's data as stored, in its
+    // vertexFormat and indexType.
+    bool readMesh(MeshID id, void *verts, void *indices);
+
+    // Views straight into the mapped file, valid for the lifetime of this
+    // handle. Empty if the mesh isn't in this file, is compressed, or the
+    // handle isn't Mapped.
+    //
+    // These are in the mesh's vertexFormat and indexType, so they're spans of
+    // bytes.
+    Span<uint8_t const>  vertices(MeshID id);
+    Span<uint8_t const>  indices(MeshID id);
+
+    // Mesh `id`'s meshlets; empty if it isn't split into meshlets, or isn't
+    // in this file.
+    Span<Meshlet const>  meshlets(MeshID id);
+
+    // Mesh `id`'s levels of detail; empty if it only has the one, or isn't in
+    // this file.
+    Span<MeshLOD const>  lods(MeshID id);
+
+    bool compressed(MeshID id);
+
+    // Hint that mesh `id` will be read soon, so the kernel can start paging it
+    // in. Does nothing for Stream handles.
+    void prefetch(MeshID id);
+
+    // Touch every page of mesh `id`'s chunk, so later reads of it don't fault.
+    // Does nothing for Stream handles.
+    void faultIn(MeshID id);
+
+    // Mesh `id`'s chunk as it sits in the mapping, compressed or not. Empty if
+    // the mesh isn't in this file, or the handle isn't Mapped.
+    Span<uint8_t const> chunk(MeshID id);
+
+    FileMode mode() const { return _mode; }
 
   private:
-    size_t _vertexOffsetToBytes(size_t vertOffset) const;
-    size_t _indexOffsetToBytes(size_t indexOffset) const;
-    
-    std::ifstream                _stream;
+    uint32_t _find(MeshID id) const { return _meshIndex.find(id); }
+
+    void _map();
+    bool _readTable();
+    bool _readAt(void *dst, size_t offset, size_t size) const;
+
+    void _buildIndex();
+
+    FileMode                     _mode      { FileMode::Stream };
+    int                          _fd        { -1 };
+    size_t                       _fileSize  { 0 };
+    uint8_t const                *_mapping  { nullptr };
+
+    // False for handles from openStaticMeshRegion, whose mapping belongs to
+    // someone else.
+    bool                         _ownsMapping  { true };
+
+    ZSTD_DDict const             *_dict     { nullptr };
     StaticMeshFileHeader         _header;
     std::vector<StaticMeshData>  _meshes;
+
+    // Parallel to _meshes.
+    std::vector<StaticMeshChunk>  _chunks;
+
+    std::vector<Meshlet>  _meshlets;
+    std::vector<MeshLOD>  _lods;
+
+    // Maps MeshID to its position in _meshes.
+    IDIndex                      _meshIndex;
   };
 
+  // A texture file is laid out as:
+  //
+  //     TextureFileHeader
+  //     TextureData[textureCount]
+  //     TextureMip[mipCount]
+  //     mip data, each level starting on a MIP_ALIGNMENT boundary
+  //
+  // Levels are stored raw, in their texture's format, so they can be copied
+  // straight into an image.
   struct TextureFileHeader {
-    static constexpr char const *MAGIC_NUMBER = "crpg:asset:texture";
+    static constexpr char const *MAGIC_NUMBER   = "crpg:asset:texture";
+    static constexpr uint32_t    VERSION        = 2;
+    static constexpr uint32_t    MIP_ALIGNMENT  = 16;
     char      magicNumber[32];
+    uint32_t  version       { VERSION };
     uint32_t  textureCount;
-    uint32_t  sampleCount;
+    uint32_t  mipCount;
 
     TextureFileHeader() {
       strcpy(magicNumber, MAGIC_NUMBER);
     }
   };
 
+  // Write a texture file. Each texture's mipOffset and mipCount index into
+  // `mips`, which hold its levels' data, finest first. The mip table's sizes
+  // and extents are worked out from the textures' own.
+  void writeTextureFile(char const                 *path,
+			TextureData const          *textures,  uint32_t textureCount,
+			Span<uint8_t const> const  *mips,      uint32_t mipCount);
+
+  class TextureFileHandleBuffer;
+
+  using TextureFileHandle = std::unique_ptr<TextureFileHandleBuffer>;
+
+  // Texture files are always mapped, falling back on pread if the mapping
+  // fails.
+  TextureFileHandle openTextureFile(std::string const &path);
+
+  class TextureFileHandleBuffer {
+  public:
+    ~TextureFileHandleBuffer();
+
+    friend TextureFileHandle openTextureFile(std::string const &path);
+
+    TextureData *getTextureData(TextureID id);
+
+    // Texture `id`'s levels, finest first; empty if it isn't in this file.
+    Span<TextureMip const> mips(TextureID id);
+
+    // Copy level `level` of texture `id` into `dst`, which must have room for
+    // mips(id)[level].size bytes. Safe to call from several threads at once.
+    bool readMip(TextureID id, uint32_t level, void *dst);
+
+  private:
+    bool _readTable();
+    bool _readAt(void *dst, size_t offset, size_t size) const;
+
+    int                       _fd        { -1 };
+    size_t                    _fileSize  { 0 };
+    uint8_t const             *_mapping  { nullptr };
+    TextureFileHeader         _header;
+    std::vector<TextureData>  _textures;
+    std::vector<TextureMip>   _mips;
+
+    // Maps TextureID to its position in _textures.
+    IDIndex                   _textureIndex;
+  };
+
+  // `nameOffset` and `pathOffset` are both into the library's path strings.
+  // The name is what assetID is the ID of, which is what lets the library
+  // catch two names hashing alike.
   struct LibraryAssetRef {
     AssetID    assetID;
     AssetType  assetType;
     uint32_t   pathOffset;
+    uint32_t   nameOffset;
+  };
+
+  // A static mesh file packed into a library archive. `offset` is from the
+  // start of the library file, and the packed file is byte-for-byte what it
+  // was on disk.
+  struct LibraryArchiveFile {
+    uint64_t  offset;
+    uint64_t  size;
+    uint32_t  pathOffset;
+    uint32_t  reserved  { 0 };
   };
 
+  // A library file is laid out as:
+  //
+  //     LibraryFileHeader
+  //     LibraryAssetRef[assetRefCount]
+  //     path strings, pathByteCount bytes in all
+  //     zstd dictionary, dictionaryByteCount bytes
+  //     LibraryArchiveFile[archiveFileCount]
+  //     packed mesh files, each starting on an ARCHIVE_ALIGNMENT boundary
+  //
+  // A plain library has no archive files, and every ref's path names a file
+  // on disk. An archive packs every mesh file its refs name into the library
+  // itself, so a whole library can come from one mmap; refs keep their paths,
+  // which the archive table matches them up by. Texture files always stay on
+  // disk.
   struct LibraryFileHeader {
-    static constexpr char const *MAGIC_NUMBER = "crpg:asset:library";
+    static constexpr char const *MAGIC_NUMBER       = "crpg:asset:library";
+    static constexpr uint32_t    VERSION            = 4;
+    static constexpr uint32_t    ARCHIVE_ALIGNMENT  = 4096;
     char     magicNumber[32];
+    uint32_t version              { VERSION };
     uint32_t assetRefCount;
     uint32_t pathByteCount;
+    uint32_t dictionaryByteCount  { 0 };
+    uint32_t archiveFileCount     { 0 };
 
     LibraryFileHeader() {
       strcpy(magicNumber, MAGIC_NUMBER);
@@ -201,32 +561,189 @@ namespace asset {
 
   class LibraryFileHandleBuffer {
   public:
+    ~LibraryFileHandleBuffer();
+
     friend std::ostream & operator <<(std::ostream &os,
 				      const LibraryFileHandle &handle);
 
+    // Always writes a plain library, even if this one was opened from an
+    // archive.
     void write(std::string const &path) const;
 
+    // Write the library to `path` as an archive, packing in every mesh file
+    // its refs name. Files are read from disk, or copied out of this library
+    // if it's an archive itself; `path` mustn't be the archive this library
+    // was opened from. Log and exit on failure.
+    void writeArchive(std::string const &path) const;
+
+    bool archive() const { return _archive != nullptr; }
 
     friend LibraryFileHandle openLibraryFile(std::string const & path);
 
-    void addMeshRef(MeshID id, const std::string &path);
+    // Add a ref to the asset called `name` in the file at `path`, and return
+    // its ID. If the library already has a ref for that ID it's pointed at
+    // `path` instead, so re-converting an asset doesn't pile up duplicate
+    // refs -- unless the existing ref is for a different name, in which case
+    // the two names collide and this logs and exits.
+    MeshID     addMeshRef(std::string const &name, std::string const &path);
+    TextureID  addTextureRef(std::string const &name, std::string const &path);
+
+    // The zstd dictionary shared by every compressed mesh file in this
+    // library, if any. Setting it only affects files opened afterwards; files
+    // already open keep the dictionary they were opened with, so they can
+    // still be read from other threads while it changes.
+    Span<char const> dictionary() const { return { _dictionary.data(), _dictionary.size() }; }
+
+    void setDictionary(std::vector<char> dictionary);
+
+    // The handle for the file holding mesh `id`. Logs and exits if there's no
+    // such mesh.
+    StaticMeshFileHandleBuffer *meshFile(MeshID id) { return _getStaticMeshFileHandle(id).get(); }
 
     StaticMeshData *getMeshData(MeshID id);
 
-    bool readMesh(MeshID id, StaticVertexData *verts, uint16_t *indices);
+    bool readMesh(MeshID id, void *verts, void *indices);
+
+    // See StaticMeshFileHandleBuffer::vertices, ::indices, ::meshlets, ::lods
+    // and ::prefetch
+    Span<uint8_t const>  meshVertices(MeshID id);
+    Span<uint8_t const>  meshIndices(MeshID id);
+    Span<Meshlet const>  meshMeshlets(MeshID id);
+    Span<MeshLOD const>  meshLODs(MeshID id);
+    void                 prefetchMesh(MeshID id);
+
+    // Like prefetchMesh for every one of `ids`, but with their chunks merged
+    // into as few ranges as possible first. Meshes packed together in an
+    // archive page in with a handful of large sequential reads.
+    void prefetchMultiMesh(MeshID const *ids, size_t count);
 
     bool getMultiMeshData(MeshID *ids, StaticMeshData *data, size_t count);
 
-    bool readMultiMesh(MeshID *ids, size_t count, StaticVertexData *verts, uint16_t *indices);
+    // Meshes are read back to back, so they should all share a vertexFormat
+    // and indexType.
+    bool readMultiMesh(MeshID *ids, size_t count, void *verts, void *indices);
+
+    // The handle for the file holding texture `id`, or nullptr if there's no
+    // such texture -- a mesh can name textures that were never converted.
+    TextureFileHandleBuffer *textureFile(TextureID id);
 
   private:
-    StaticMeshFileHandle &_getStaticMeshFileHandle(const std::string &path);
     StaticMeshFileHandle &_getStaticMeshFileHandle(MeshID id);
 
-    std::unordered_map<std::string, StaticMeshFileHandle> _staticMeshHandleCache;
+    // Shared by addMeshRef and addTextureRef.
+    AssetID _addRef(AssetType type, std::string const &name, std::string const &path);
+
+    // Append `s` to _pathData, returning its offset.
+    uint32_t _addString(std::string const &s);
+
+    // Add _assetRefs[refIdx] to _refIndex, and assign it a slot in _meshFiles.
+    void _indexRef(uint32_t refIdx);
+
+    // Map the archive at `path`, and point the slots of the mesh files packed
+    // in it at their bytes. Log and exit on failure.
+    void _mapArchive(std::string const &path, std::vector<LibraryArchiveFile> const &files);
+
+    // Sort `refs` by ID, pointing each at its name's and path's one copy in
+    // `pathData`. Shared by write and writeArchive.
+    void _packRefs(std::vector<LibraryAssetRef> *refs, std::vector<char> *pathData) const;
 
     std::vector<LibraryAssetRef>  _assetRefs;
     std::vector<char>             _pathData;
+    std::vector<char>             _dictionary;
+    ZSTD_DDict                    *_ddict { nullptr };
+
+    // Dictionaries replaced by setDictionary, which files opened before then
+    // still point at. Freed with the library.
+    std::vector<ZSTD_DDict *>     _retiredDDicts;
+
+    // Maps AssetID to its position in _assetRefs.
+    IDIndex                       _refIndex;
+
+    // One slot per distinct path, so every ref to the same file shares a
+    // handle. Handles are opened the first time one of their assets is used,
+    // as a mesh or texture file depending on the ref's assetType.
+    std::vector<uint32_t>                      _refFileSlot;
+    std::vector<std::string>                   _meshFilePaths;
+    std::vector<StaticMeshFileHandle>          _meshFiles;
+    std::vector<TextureFileHandle>             _textureFiles;
+    std::unordered_map<std::string, uint32_t>  _meshFileSlots;
+
+    // For archives, the whole library file mapped read-only, and where each
+    // slot's file sits in it -- empty for slots that aren't packed, which are
+    // opened from disk as usual.
+    uint8_t const                     *_archive      { nullptr };
+    size_t                            _archiveSize  { 0 };
+    std::vector<Span<uint8_t const>>  _archiveFiles;
+
+    // Guards opening the handles in _meshFiles and _textureFiles, so assets
+    // can be read from several threads at once. addMeshRef and addTextureRef
+    // are not thread-safe.
+    std::mutex  _openMutex;
+  };
+
+  // A mesh read by the StreamService. `verts` and `indices` either point into
+  // a mapped file, whose pages have already been faulted in, or into
+  // `ownedVerts` and `ownedIndices`.
+  //
+  // For compressed meshes in mapped files they're left empty, and `file` is
+  // set instead: the consumer should readMesh from `file` into wherever the
+  // data is going, which decompresses it from pages that are already resident.
+  struct MeshLoad {
+    uint64_t        ticket  { 0 };
+    uint32_t        index   { 0 };    // Position of the mesh in its request
+    MeshID          id      { NULL_ASSET_ID };
+    bool            ok      { false };
+    StaticMeshData  data;
+
+    StaticMeshFileHandleBuffer  *file  { nullptr };
+    Span<uint8_t const>         verts;      // In data.vertexFormat
+    Span<uint8_t const>         indices;    // In data.indexType
+    std::vector<uint8_t>        ownedVerts;
+    std::vector<uint8_t>        ownedIndices;
+  };
+
+  // Reads meshes on a pool of worker threads, and hands them back through a
+  // lock-free completion queue, so the thread that polls it never waits on
+  // I/O.
+  //
+  // Workers use pread (or, for mapped files, madvise plus touching each page)
+  // rather than io_uring, which keeps this portable to any POSIX system.
+  class StreamService {
+  public:
+    void init(size_t workerCount = 2, size_t queueDepth = 256);
+    void cleanup();
+
+    // Queue reads of `count` meshes from `library`, which must outlive them.
+    // Returns a ticket which is attached to each of the resulting MeshLoads.
+    uint64_t request(LibraryFileHandleBuffer *library, MeshID const *ids, size_t count);
+
+    // Pop a finished load into `load`, if there is one. Only one thread may
+    // poll a given StreamService.
+    bool poll(MeshLoad *load);
+
+    // Number of requested meshes which haven't been polled yet.
+    size_t pending() const { return _pending.load(std::memory_order_acquire); }
+
+  private:
+    struct Job {
+      LibraryFileHandleBuffer  *library;
+      uint64_t                 ticket;
+      uint32_t                 index;
+      MeshID                   id;
+    };
+
+    void _work();
+    void _load(Job const &job, MeshLoad *load);
+
+    std::vector<std::thread>  _workers;
+    std::mutex                _mutex;
+    std::condition_variable   _wake;
+    std::deque<Job>           _jobs;
+    std::atomic<bool>         _stopping  { false };
+
+    std::unique_ptr<BoundedQueue<MeshLoad>>  _completions;
+    std::atomic<size_t>                      _pending    { 0 };
+    uint64_t                                 _nextTicket { 1 };
   };
 };
 
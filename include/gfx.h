@@ -37,7 +37,16 @@
 #include <set>
 #include <optional>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <initializer_list>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
 
 #include <SDL.h>
 #include <SDL_vulkan.h>
@@ -50,6 +59,8 @@
 
 #include "util.h"
 #include "asset.h"
+#include "jobs.h"
+#include "profile.h"
 
 namespace gfx {
 
@@ -58,226 +69,700 @@ namespace gfx {
     VmaAllocation  alloc;
   };
 
-  struct Mesh {
-    asset::StaticMeshData  meshData;
-
-    Buffer  vbuffer;
-    Buffer  ibuffer;
+  // What the engine's GPU memory is spent on, as counted by MemoryTracker.
+  struct MemoryCategory {
+    enum {
+      MeshPool,      // GeometryPool's vertex and index buffers
+      Staging,       // the Uploader's staging ring
+      PerFrame,      // FrameAllocators and the culling buffers
+      Texture,       // TextureManager's images
+      RenderTarget,  // offscreen, depth, depth pyramid and shadow images
+      Other,         // mesh metadata, the scene buffer and the like
+      MAX,
+    };
   };
 
-  struct MultiMesh {
-    std::vector<asset::MeshID>                 ids;
-    std::vector<VkDrawIndexedIndirectCommand>  cmds;
+  char const *memoryCategoryName(uint32_t category);
+
+  /// MemoryTracker - Counts the engine's VMA allocations, and their bytes, by
+  ///                 MemoryCategory, and answers how much room the device
+  ///                 has left under its budget.
+  ///
+  /// Budgets come from VK_EXT_memory_budget when the device has it, and are
+  /// VMA's estimate -- 80% of each heap -- when it doesn't. An allocation
+  /// remembers its category through its VMA user data, so untrack only needs
+  /// the allocation. Both may be called from any thread.
+
+  class MemoryTracker {
+  public:
+    void init(VmaAllocator allocator, bool budgetExtension);
+
+    // Count `alloc` under `category` until it's untracked.
+    void track(uint32_t category, VmaAllocation alloc);
+
+    // Stop counting `alloc`. Call it before freeing anything that was tracked;
+    // anything that wasn't is ignored.
+    void untrack(VmaAllocation alloc);
+
+    uint64_t      allocations(uint32_t category) const { return _allocations[category]; }
+    VkDeviceSize  bytes(uint32_t category) const { return _bytes[category]; }
+
+    // Bytes the device-local heap with the most room can still take before
+    // going over its budget. The budget itself is refreshed once a frame, by
+    // Engine::draw; usage is always current.
+    VkDeviceSize deviceHeadroom() const;
 
-    Buffer  vertexBuffer;
-    Buffer  indexBuffer;
+    bool budgetExtension() const { return _budgetExtension; }
+
+  private:
+    std::array<std::atomic<uint64_t>, MemoryCategory::MAX>  _allocations  { };
+    std::array<std::atomic<uint64_t>, MemoryCategory::MAX>  _bytes        { };
+
+    bool          _budgetExtension  { false };
+    VmaAllocator  _allocator        { VK_NULL_HANDLE };
   };
 
-  struct MeshPushConstants {
-    glm::mat4 renderMatrix;
+  // A run of a RangeAllocator's units.
+  struct PoolRange {
+    VkDeviceSize  offset  { 0 };
+    VkDeviceSize  size    { 0 };
   };
 
-  struct PerFrame {
-    VkSemaphore      imageAcquiredSem    { VK_NULL_HANDLE };
-    VkSemaphore      renderFinishedSem   { VK_NULL_HANDLE };
-    VkFence          renderFinishedFence { VK_NULL_HANDLE };
-    VkCommandPool    commandPool         { VK_NULL_HANDLE };
+  // Where something's geometry lives in the GeometryPool: `vertices` counts
+  // vertices of `format` in that format's vertex buffer, and `indices` bytes in
+  // the index buffer.
+  struct GeometryAlloc {
+    asset::VertexFormat  format  { asset::VertexFormat::Full };
+    PoolRange            vertices;
+    PoolRange            indices;
+
+    // Handed to the pool's MoveFn when defragmentation moves this, e.g. the
+    // MultiMesh it belongs to.
+    void  *owner  { nullptr };
+
+    // Defragmentation leaves an allocation alone while it's pinned, and until
+    // Uploader submission `serial` -- the last to write to it -- completes.
+    bool      pinned  { false };
+    uint64_t  serial  { 0 };
   };
 
-  struct PerSwapImage {
-    VkImage        image;
-    VkImageView    imageView;
-    VkImage        depth;
-    VkImageView    depthView;
-    VmaAllocation  depthAlloc;
-    VkFramebuffer  framebuf;
+  struct Mesh {
+    asset::StaticMeshData  meshData;
+
+    GeometryAlloc  geometry;
   };
 
-  struct MeshPass {
+  // The textures a mesh can have, following asset::StaticMeshData.
+  struct MaterialTexture {
     enum {
-      Transparency,
-      DirectionalShadow,
-      Forward,
+      Color,
+      Normal,
+      Roughness,
+      Occlusion,
+      Emission,
       MAX,
     };
   };
 
-  template <typename T>
-  using PerPassData = std::array<T, MeshPass::MAX>;
+  // Per-mesh data, laid out to match `MeshInfo` in the static mesh shaders
+  // and the culling shaders (std430). Indexed by InstanceData::meshIndex.
+  struct MeshInfo {
+    glm::vec4   center;      // of the mesh's bounds; w is unused
+    glm::vec4   halfExtent;  // of the mesh's bounds; w is unused
+    glm::uvec4  lods;        // firstLOD, lodCount and group of its MeshRange
 
-  struct ShaderStage {
-    VkShaderModule         module;
-    VkShaderStageFlagBits  stage;
+    // A TextureManager slot for each MaterialTexture, 0 for none. The rest
+    // is padding, to keep the struct a multiple of 16 bytes.
+    uint32_t    textures[8];
   };
 
-  struct ShaderEffect {
-    VkDescriptorSetLayout     descLayout;
-    VkPipelineLayout          layout;
-    std::vector<ShaderStage>  stages;
+  // Per-LOD data, laid out to match `LODInfo` in the culling shaders (std430).
+  // `error` is the level's asset::MeshLOD::error.
+  struct LODInfo {
+    uint32_t  firstDraw;
+    uint32_t  drawCount;
+    float     error;
+    uint32_t  _pad;
   };
 
-  struct ShaderPass {
-    ShaderEffect      *effect   =  nullptr;
-    VkPipeline        pipeline  =  VK_NULL_HANDLE;
-    VkPipelineLayout  layout    =  VK_NULL_HANDLE;
+  // The six planes of a view frustum, each a normal pointing into the frustum
+  // and a distance, laid out to match `CullConstants` in the culling shaders.
+  struct Frustum {
+    glm::vec4  planes[6];
+
+    // Extract the planes from a view-projection matrix, clipping depth to
+    // 0 <= z <= w as Vulkan does.
+    static Frustum fromViewProject(glm::mat4 const &viewProject);
+
+    // False if the box `center` +/- `halfExtent`, transformed by `model`, is
+    // entirely outside the frustum. Must match isVisible in cull-instances.comp.
+    bool intersects(glm::vec3 const &center,
+		    glm::vec3 const &halfExtent,
+		    glm::mat4 const &model) const;
   };
 
-  struct Material {
-    PerPassData<ShaderPass*>      shaders;
-    PerPassData<VkDescriptorSet>  descriptorSets;
+  struct MultiMesh {
+    // Where one mesh's data and draws live. Each of its levels of detail gets
+    // a draw per meshlet, or a single draw if the mesh isn't split. firstDraw
+    // and drawCount are the full-detail level's.
+    struct MeshRange {
+      uint32_t      firstDraw;    // into `cmds`
+      uint32_t      drawCount;
+      uint32_t      firstLOD;     // into `lods`
+      uint32_t      lodCount;
+      uint32_t      firstVertex;  // into the pool's vertex buffer
+      uint32_t      group;        // into `groups`
+      VkDeviceSize  indexOffset;  // in bytes, into the pool's index buffer
+    };
+
+    // Meshes are grouped by index type, 16-bit first. A group's indices start
+    // at byte `offset` in the pool's index buffer, and its draws are
+    // cmds[firstDraw, firstDraw + drawCount). The first baseDrawCount of those
+    // are its meshes' full-detail levels, and the rest their coarser ones.
+    //
+    // The index buffer is always bound at offset 0, so every draw's
+    // firstIndex counts from the start of the pool.
+    struct IndexGroup {
+      VkIndexType   type;
+      VkDeviceSize  offset;
+      uint32_t      firstDraw;
+      uint32_t      drawCount;
+      uint32_t      baseDrawCount;
+    };
+
+    static constexpr size_t MAX_INDEX_GROUPS { 2 };
+
+    std::vector<asset::MeshID>  ids;
+    std::vector<MeshRange>      ranges;
+    std::vector<IndexGroup>     groups;
+
+    // Every draw, in group order, and the bounds of what each one draws: a
+    // meshlet or a whole mesh.
+    std::vector<VkDrawIndexedIndirectCommand>  cmds;
+    std::vector<asset::BoundingBox>            drawBounds;
+
+    // Host copies of meshInfoBuffer and lodBuffer, for culling on the CPU.
+    std::vector<MeshInfo>  meshInfos;
+    std::vector<LODInfo>   lods;
+
+    // Maps each MeshID to its position in `ids` and `ranges`.
+    IDIndex  index;
+
+    // Every mesh in a MultiMesh shares one vertex format, and so one pipeline.
+    asset::VertexFormat  vertexFormat  { asset::VertexFormat::Full };
+
+    // Every mesh's vertices back to back, and then every group's indices.
+    GeometryAlloc  geometry;
+
+    // A MeshInfo for each mesh, bound through meshSet() as set 1 along with
+    // indirectBuffer, which the culling shaders read draws from, and an
+    // LODInfo for each level of detail.
+    Buffer           meshInfoBuffer;
+    Buffer           lodBuffer;
+    VkDescriptorSet  meshSets[2];
+
+    // Two GPU-side copies of `cmds`, `indirectStride` bytes apart, each
+    // followed by a uint32_t draw count for each group (from byte offset
+    // `indirectCountOffset()` within the copy), so that each group can be
+    // drawn with a single vkCmdDrawIndexedIndirect[Count].
+    //
+    // Frames only read copy `indirectSide`, through meshSets[indirectSide].
+    // _rebaseMultiMesh writes the other copy on the transfer queue, and
+    // _switchIndirect makes it current once that write has completed, so
+    // the graphics queue never reads a copy that's being written.
+    Buffer        indirectBuffer;
+    VkDeviceSize  indirectStride  { 0 };
+    uint32_t      indirectSide    { 0 };
+    uint64_t      rebaseSerial    { 0 };  // non-zero while the other copy is written
+    size_t        sideFrame       { 0 };  // the first frame drawn from indirectSide
+
+    VkDeviceSize indirectCountOffset() const {
+      return cmds.size() * sizeof(VkDrawIndexedIndirectCommand);
+    }
+
+    // Where the current copy starts in indirectBuffer.
+    VkDeviceSize indirectOffset() const { return indirectSide * indirectStride; }
+
+    VkDescriptorSet meshSet() const { return meshSets[indirectSide]; }
+
+    // Set up by _streamMultiMesh: the StreamService ticket for this
+    // MultiMesh's meshes, how many of them haven't been staged yet, and the
+    // Uploader submission the last of them went out in.
+    uint64_t  streamTicket   { 0 };
+    uint32_t  pendingMeshes  { 0 };
+    uint64_t  uploadSerial   { 0 };
+
+    // Set if any of its meshes couldn't be streamed in. Their ranges never
+    // get valid data, so the MultiMesh is never resident.
+    bool  failed  { false };
   };
 
-  class Engine {
-  public:
-    Engine(std::initializer_list<char const *> enabledLayers)
-      : _enabledLayers(enabledLayers) {}
+  // Per-instance data, laid out to match `InstanceData` in static-mesh.vert
+  // (std430).
+  struct InstanceData {
+    glm::mat4  model;
+    uint32_t   meshIndex;
+    uint32_t   _pad[3];
+  };
 
-    void init();
-    void draw();
+  // Culling runs in two phases when occlusion culling is on. The early phase
+  // draws whatever was visible last frame, which fills in enough of the depth
+  // buffer to build a depth pyramid from. The late phase tests everything
+  // against that pyramid and draws whatever has newly become visible.
+  //
+  // Shadow cascades are culled in a phase of their own, against the frustum
+  // only, into buffers of their own -- see PerFrame::ShadowView.
+  enum class CullPhase : uint32_t {
+    Early   = 0,
+    Late    = 1,
+    Shadow  = 2,
+  };
+
+  // Push constants for cull-instances.comp and cull-draws.comp.
+  struct CullConstants {
+    Frustum    frustum;
+    uint32_t   instanceCount;
+    uint32_t   meshCount;
+    CullPhase  phase;
+    uint32_t   occlusion;  // 1 if occlusion culling is on, 0 otherwise
+    uint32_t   groupFirstDraw[MultiMesh::MAX_INDEX_GROUPS];
+  };
+
+  // What culling did with a frame's instances, laid out to match
+  // `StatsBuffer` in cull-instances.comp. Every instance is counted once:
+  //
+  //     instances == frustumCulled + occlusionCulled + drawnEarly + drawnLate
+  struct CullStats {
+    uint32_t  instances;
+    uint32_t  frustumCulled;
+    uint32_t  occlusionCulled;
+    uint32_t  drawnEarly;  // Everything, when culling on the CPU
+    uint32_t  drawnLate;
+  };
+
+  // Per-frame camera data, laid out to match `CameraBuffer` in
+  // static-mesh.vert (std140).
+  struct CameraData {
+    glm::mat4  view;
+    glm::mat4  project;
+    glm::mat4  viewProject;
+    glm::vec3  position;
+
+    // Pixels per unit of LOD error at a distance of 1, divided by the error
+    // in pixels we'll put up with. See selectLOD in cull-instances.comp.
+    float      lodScale;
+  };
+
+  // Per-frame directional shadow data, laid out to match `ShadowBuffer` in
+  // static-mesh.frag (std140). Cascade c covers view distances up to
+  // splits[c], from the end of the one before it.
+  struct ShadowData {
+    static constexpr uint32_t CASCADE_COUNT { 4 };
+
+    glm::mat4  viewProject[CASCADE_COUNT];
+    glm::vec4  splits;
+    glm::vec4  toLight;  // xyz, normalized
+  };
+
+  // Somewhere in a FrameAllocator's buffer: where to bind it from, and where
+  // to write it through.
+  struct FrameAlloc {
+    VkBuffer      buffer  { VK_NULL_HANDLE };
+    VkDeviceSize  offset  { 0 };
+    void          *data   { nullptr };
+  };
+
+  /// FrameAllocator - Hands out pieces of one large persistently mapped buffer
+  ///                  by bumping an offset, for data that only lives for a
+  ///                  frame. Nothing is freed individually; the owner resets
+  ///                  the whole thing once the GPU is done with it.
+  ///
+  /// The buffer is `slack` bytes longer than the allocator will ever hand out,
+  /// so that a dynamic descriptor with a fixed range of up to `slack` bytes can
+  /// be bound at any offset it returns. alloc doesn't lock; only one thread may
+  /// use a FrameAllocator at a time.
+
+  class FrameAllocator {
+  public:
+    // Log and exit on failure.
+    void init(VmaAllocator        allocator,
+	      MemoryTracker       *memory,
+	      VkDeviceSize        capacity,
+	      VkDeviceSize        slack,
+	      VkDeviceSize        alignment,
+	      VkBufferUsageFlags  usage);
     void cleanup();
 
-    size_t framesDrawn() { return _framesDrawn; }
+    // Take `size` bytes, starting at a multiple of the allocator's alignment.
+    // Running out means capacity doesn't cover the engine's own per-frame
+    // limits, so it logs and exits.
+    FrameAlloc alloc(VkDeviceSize size);
+
+    template <typename T>
+    T *alloc(size_t count, FrameAlloc *out) {
+      *out = alloc(count * sizeof(T));
+      return (T *)out->data;
+    }
+
+    // Make everything allocated since the last reset visible to the GPU.
+    void flush();
+
+    // Forget every allocation. Only safe once the GPU is done reading them.
+    void reset() { _used = 0; }
+
+    VkDeviceSize used() const { return _used; }
+
+    // For descriptors that are bound dynamically at offsets alloc returned.
+    VkBuffer buffer() const { return _buffer.buffer; }
 
   private:
-    void _allocBuffer(size_t              size,
-		      VkBufferUsageFlags  vkUsage,
-		      VmaMemoryUsage      memoryUsage,
-		      Buffer              *buffer);
+    Buffer        _buffer;
+    uint8_t       *_mapped     { nullptr };
+    VkDeviceSize  _capacity    { 0 };
+    VkDeviceSize  _alignment   { 1 };
+    VkDeviceSize  _used        { 0 };
+
+    VmaAllocator   _allocator;
+    MemoryTracker  *_memory;
+  };
 
-    void _freeBuffer(Buffer *buffer);
+  /// RenderQueue - Orders a view's draws by a 64-bit key, so that everything
+  ///               sharing state ends up next to each other and the state
+  ///               only has to be bound once.
+  ///
+  /// From the most significant bits down, a key is:
+  ///
+  ///     pass      -  4 bits, a MeshPass
+  ///     pipeline  - 12 bits, a ShaderPass::id
+  ///     material  - 12 bits, a Material::id
+  ///     pool      -  4 bits, which of the geometry pool's index runs, and so
+  ///                  which index type, the draw reads from
+  ///     mesh      - 16 bits, the LODInfo drawn, so that instances of the same
+  ///                  level of the same mesh are adjacent and can be drawn as
+  ///                  one instanced command
+  ///     depth     - 16 bits, front to back within the view, which orders the
+  ///                  instances within each of those commands
+  ///
+  /// Fields are masked to their width. sort is a least-significant-digit radix
+  /// sort a byte at a time, and skips any byte every key agrees on -- within a
+  /// view that's usually the top half -- so a frame's sort is typically four
+  /// passes over the queue. Like FrameAllocator, a queue is only ever used from
+  /// one thread at a time.
+  class RenderQueue {
+  public:
+    struct Entry {
+      uint64_t  key;
+      uint32_t  item;  // The caller's, e.g. an index into what was queued
+    };
 
-    bool _loadMesh(std::string const &path, asset::MeshID id, Mesh *mesh);
+    static uint64_t key(uint32_t  pass,
+			uint32_t  pipeline,
+			uint32_t  material,
+			uint32_t  pool,
+			uint32_t  mesh,
+			uint32_t  depth)
+    {
+      return (uint64_t)(pass      & 0xF)    << 60
+	   | (uint64_t)(pipeline  & 0xFFF)  << 48
+	   | (uint64_t)(material  & 0xFFF)  << 36
+	   | (uint64_t)(pool      & 0xF)    << 32
+	   | (uint64_t)(mesh      & 0xFFFF) << 16
+	   | (uint64_t)(depth     & 0xFFFF);
+    }
 
-    bool _loadMultiMesh(
-      std::string const &path,
-      asset::MeshID *ids, MultiMesh *meshes, size_t count);
+    // The fields of `key`, by the name they were given to key().
+    static uint32_t pool(uint64_t key)  { return (uint32_t)(key >> 32) & 0xF; }
+    static uint32_t mesh(uint64_t key)  { return (uint32_t)(key >> 16) & 0xFFFF; }
 
-    bool _drawMultiMesh(VkCommandBuffer cmdBuf, MultiMesh *meshes, asset::MeshID id);
+    // Whether two keys differ in anything but depth, i.e. whether their
+    // entries can be drawn by the same instanced command.
+    static bool sameDraw(uint64_t a, uint64_t b)  { return (a >> 16) == (b >> 16); }
 
-    void _freeMesh(Mesh *mesh);
-    void _freeMultiMesh(MultiMesh *mesh);
+    void clear() { _entries.clear(); }
+    void push(uint64_t key, uint32_t item) { _entries.push_back({ key, item }); }
 
-    void _initPerFrames();
+    // Sort by key, keeping entries with equal keys in the order they were
+    // pushed.
+    void sort();
 
-    void _initPipelines();
+    size_t size() const { return _entries.size(); }
 
-    // Advance _currentFrame and do the vkWaitForFences-dance to acquire the
-    // next frame, then return a pointer to its corresponding PerFrame
-    // structure.
-    PerFrame *_acquireNextFrame();
+    Entry const &operator[](size_t i) const { return _entries[i]; }
 
-    VkCommandBuffer _allocCmdBuffer(VkCommandPool pool);
+  private:
+    std::vector<Entry>  _entries;
+    std::vector<Entry>  _scratch;
+  };
 
-    // Shorthands for recording commands.
-    void _beginCmdBuffer(VkCommandBuffer  cmdBuf,
-			 uint32_t         flags = 0);
+  // Names an instance in a Scene, from Scene::create. IDs of destroyed
+  // instances are handed out again.
+  typedef uint32_t InstanceID;
 
-    void _beginRenderPass(VkCommandBuffer  cmdBuf,
-			  VkFramebuffer    framebuf,
-			  VkClearValue     *clearValues,
-			  uint32_t         clearCount);
+  static constexpr InstanceID NO_INSTANCE { UINT32_MAX };
+
+  /// Scene - The instances the Engine draws every frame until they're
+  ///         destroyed, kept structure-of-arrays so that each of a frame's
+  ///         passes over them only touches what it reads.
+  ///
+  /// The arrays are dense: destroying an instance moves the last one into its
+  /// place, and an InstanceID maps to wherever its instance is now. Every
+  /// place whose contents changed since the last clearDirty is listed once in
+  /// dirty(), which is what the Engine sends to the GPU each frame, so a scene
+  /// that holds still costs nothing to keep there.
+  ///
+  /// Like RenderQueue, a Scene doesn't lock.
+  class Scene {
+  public:
+    // Resize the per-mesh counts for `meshCount` meshes, and drop every
+    // instance.
+    void reset(size_t meshCount);
 
+    InstanceID create(uint32_t meshIndex, glm::mat4 const &model);
 
-    // Helper methods for building pipelines
-    VkPipelineShaderStageCreateInfo
-    _loadShaderStageInfo(const std::string &spirvPath, VkShaderStageFlagBits stageFlags);
+    // Both return false if `id` doesn't name a live instance.
+    bool update(InstanceID id, glm::mat4 const &model);
+    bool destroy(InstanceID id);
 
-    VkPipelineVertexInputStateCreateInfo
-    _vertexInputInfo();
+    size_t size() const { return _models.size(); }
 
-    VkPipelineInputAssemblyStateCreateInfo
-    _inputAssemblyInfo(VkPrimitiveTopology topology);
+    // By place, [0, size()).
+    glm::mat4 const  *models() const       { return _models.data(); }
+    uint32_t const   *meshIndices() const  { return _meshIndices.data(); }
 
-    VkPipelineRasterizationStateCreateInfo
-    _rasterStateInfo(VkPolygonMode polyMode);
+    // How many instances there are of each mesh.
+    std::vector<uint32_t> const &meshCounts() const { return _meshCounts; }
 
-    VkPipelineMultisampleStateCreateInfo
-    _multisampleInfo();
+    // Places changed since the last clearDirty, in ascending order. Places
+    // past size() may be listed, if the instances there were destroyed.
+    std::vector<uint32_t> const &dirty();
+    void clearDirty();
 
-    VkPipelineColorBlendAttachmentState
-    _colorBlendAttachState();
+  private:
+    void _markDirty(uint32_t place);
 
-    VkPipelineDepthStencilStateCreateInfo
-    _depthStencilState(bool depthTest, bool depthWrite, VkCompareOp cmp);
+    std::vector<glm::mat4>   _models;
+    std::vector<uint32_t>    _meshIndices;
+    std::vector<InstanceID>  _ids;  // by place
 
-    VkPushConstantRange
-    _pushConstantRange();
+    // By InstanceID, the instance's place, or NO_INSTANCE once destroyed.
+    std::vector<uint32_t>    _places;
+    std::vector<InstanceID>  _freeIDs;
 
-    VkPipelineLayoutCreateInfo
-    _pipelineLayoutInfo(VkPushConstantRange *pushRange);
+    std::vector<uint32_t>  _meshCounts;
 
-    VkImageCreateInfo
-    _imageInfo(VkFormat format, VkImageUsageFlags usageFlags, VkExtent3D extent);
+    std::vector<uint32_t>  _dirty;
+    std::vector<bool>      _isDirty;  // by place
+    bool                   _dirtySorted  { true };
+  };
 
-    VkImageViewCreateInfo
-    _imageViewInfo(VkFormat format, VkImage image, VkImageAspectFlags aspectFlags);
+  // Draws built on the CPU for one view, when culling on the CPU: an
+  // instanced command per visible mesh (or meshlet) and level of detail, with
+  // each index group's run of them starting at groupFirstDraw, and a uint32_t
+  // draw count for each group in drawCountAlloc.
+  struct DrawList {
+    FrameAlloc                    instanceAlloc;
+    FrameAlloc                    drawAlloc;
+    FrameAlloc                    drawCountAlloc;
+    VkDrawIndexedIndirectCommand  *drawCmds  { nullptr };
+
+    uint32_t  groupFirstDraw[MultiMesh::MAX_INDEX_GROUPS]  { };
+    uint32_t  groupDrawCount[MultiMesh::MAX_INDEX_GROUPS]  { };
+  };
 
-    ////////////////////////////////////
-    // For one-off testing, not part of the final form of this class..
-    //
-    void _initTestData();
-    void _cleanupTestData();
-    //
-    MultiMesh _testMultiMesh;
-    //
-    // End test decls
-    ////////////////////////////////////
-    
-    bool _initialized = false;
+  struct PerFrame {
+    VkSemaphore      imageAcquiredSem    { VK_NULL_HANDLE };
+    VkSemaphore      renderFinishedSem   { VK_NULL_HANDLE };
+    VkFence          renderFinishedFence { VK_NULL_HANDLE };
+    VkCommandPool    commandPool         { VK_NULL_HANDLE };
 
-    static constexpr size_t  MAX_FRAMES_IN_FLIGHT { 2 };
+    // One per job thread, for secondary command buffers. Indexed by
+    // jobs::System::threadIndex, and reset with commandPool.
+    std::vector<VkCommandPool>  recordPools;
+
+    // Everything the CPU writes for the GPU each frame comes out of here. It's
+    // reset by _acquireNextFrame once renderFinishedFence is signaled, so the
+    // allocations below are only good for the frame they were made in.
+    FrameAllocator  transient;
+
+    FrameAlloc    cameraAlloc;
+    CameraData    *cameraData    { nullptr };
+
+    // The camera's draws, when culling on the CPU.
+    DrawList  draws;
+
+    // When culling on the GPU, sceneAlloc holds the instances that changed
+    // since the last frame, which the early phase copies into Engine's
+    // _sceneBuffer through sceneCopies, and cullMeshFirst the first slot of
+    // each mesh's bucket in visibleInstanceBuffer.
+    FrameAlloc                 sceneAlloc;
+    std::vector<VkBufferCopy>  sceneCopies;
+
+    FrameAlloc  cullMeshAlloc;
+    uint32_t    *cullMeshFirst  { nullptr };
+
+    // Device-local, written by the culling shaders: the instances that passed,
+    // bucketed by mesh and then level of detail, and for each CullPhase a run of MAX_DRAWS commands. See
+    // VISIBLE_DRAW_COUNT_OFFSET for the counts that follow them.
+    Buffer  visibleInstanceBuffer;
+    Buffer  visibleDrawBuffer;
+
+    // Device-local scratch for the culling shaders: the level of detail each
+    // candidate picked, and its slot among that level's instances.
+    Buffer  cullPickBuffer;
+
+    // What _flushInstances handed to the culling shaders.
+    Frustum   frustum;
+    uint32_t  instanceCount  { 0 };
+
+    // The culling shaders' CullStats for this frame, read back once
+    // renderFinishedFence says they're done.
+    Buffer     statsBuffer;
+    CullStats  *stats       { nullptr };
+    bool       statsValid   { false };
+
+    // Set 0 in static-mesh.vert, binds cameraAlloc and whichever instances
+    // are drawn from. Both bindings are dynamic, see globalOffsets.
+    VkDescriptorSet  globalSet  { VK_NULL_HANDLE };
+
+    // Set 0 in the culling shaders. The candidates (always at offset 0 of
+    // _sceneBuffer), cullMeshAlloc and cameraAlloc are bound dynamically, see
+    // cullOffsets.
+    VkDescriptorSet  cullSet    { VK_NULL_HANDLE };
+
+    // The dynamic offsets to bind globalSet and cullSet with this frame, in
+    // binding order.
+    std::array<uint32_t, 2>  globalOffsets  { };
+    std::array<uint32_t, 3>  cullOffsets    { };
+
+    // One shadow cascade: the light's camera for it, and the draws of
+    // whatever it can see. Every cascade culls the same candidates as the
+    // camera does, and picks the same levels of detail.
+    struct ShadowView {
+      Frustum     frustum;
+      FrameAlloc  cameraAlloc;
+
+      // When culling on the CPU.
+      DrawList  draws;
+
+      // When culling on the GPU, for CullPhase::Shadow: like the frame's own
+      // buffers of the same names, but only the early phase's half of
+      // visibleDrawBuffer is used. cullSet binds them, and otherwise
+      // whatever the frame's does, with the frame's cullOffsets.
+      Buffer           visibleInstanceBuffer;
+      Buffer           visibleDrawBuffer;
+      Buffer           cullPickBuffer;
+      VkDescriptorSet  cullSet  { VK_NULL_HANDLE };
+
+      // Like the frame's, binding cameraAlloc and this cascade's instances.
+      VkDescriptorSet          globalSet      { VK_NULL_HANDLE };
+      std::array<uint32_t, 2>  globalOffsets  { };
+    };
 
-    std::vector<char const *>  _enabledLayers;
+    std::array<ShadowView, ShadowData::CASCADE_COUNT>  shadows;
 
-    // This is an index into _perFrames, it should always be
-    //
-    //         0 <= _currentFrame < MAX_FRAMES_IN_FLIGHT
-    //
-    size_t  _currentFrame { 0 };
+    // Set 3 in static-mesh.frag: shadowAlloc, bound dynamically, and the
+    // Engine's shadow map.
+    FrameAlloc       shadowAlloc;
+    VkDescriptorSet  shadowSet  { VK_NULL_HANDLE };
 
-    // This is just the number of times that .draw() has successfully been
-    // called on this Engine.
-    //
-    // On a 32-bit system w/ a 60Hz refresh rate, this will take more than 2
-    // years to overflow. On a 64-bit system it should be more like 9 billion
-    // years.
-    //
-    // Both are acceptable =]
-    size_t _framesDrawn { 0 };
+    // A pair of timestamps per GPU zone, begin then end, written by
+    // _beginGpuZone/_endGpuZone and read back by _collectGpuZones. gpuZones
+    // holds the name of each zone recorded this frame, in query order, and is
+    // empty when nothing is waiting to be read back.
+    VkQueryPool                timestampPool  { VK_NULL_HANDLE };
+    std::vector<char const *>  gpuZones;
 
-    SDL_Window        *_window;
-    VkInstance        _instance;
-    VkPhysicalDevice  _physicalDevice;
-    VkDevice          _device;
-    VkSurfaceKHR      _surface;
+    // When, on the profiler's clock, and in which frame the command buffer
+    // was submitted.
+    uint64_t  submitTime   { 0 };
+    uint64_t  submitFrame  { 0 };
+  };
 
-    VkExtent2D     _swapExtent;
-    VkFormat       _swapFormat;
-    VkSwapchainKHR _swapChain;
+  struct PerSwapImage {
+    VkImage        image;
+    VkImageView    imageView;
+    VkImage        depth;
+    VkImageView    depthView;
+    VmaAllocation  depthAlloc;
+    VkFramebuffer  framebuf;
 
-    VkFormat _depthFormat;
+    // Set only when rendering offscreen, in which case we own `image`.
+    VmaAllocation  imageAlloc  { VK_NULL_HANDLE };
+
+    // A mip chain of R32 images, each texel holding the farthest depth of the
+    // texels it covers in the level below, and level 0 covering `depth`. Its
+    // extent is the largest power of two that fits in the swap extent. Only
+    // allocated when culling on the GPU, and kept in VK_IMAGE_LAYOUT_GENERAL.
+    VkImage                       depthPyramid        { VK_NULL_HANDLE };
+    VmaAllocation                 depthPyramidAlloc   { VK_NULL_HANDLE };
+    VkImageView                   depthPyramidView    { VK_NULL_HANDLE };
+    VkExtent2D                    depthPyramidExtent  { };
+    uint32_t                      depthPyramidLevels  { 0 };
+    std::vector<VkImageView>      depthPyramidMips;
+
+    // Set 0 in depth-reduce.comp for building each level, and set 2 in the
+    // culling shaders.
+    std::vector<VkDescriptorSet>  reduceSets;
+    VkDescriptorSet               depthPyramidSet     { VK_NULL_HANDLE };
+  };
 
-    std::vector<PerSwapImage>  _perSwaps;
+  // The passes a Material can be drawn in. Static meshes are drawn in all but
+  // Transparency: into each shadow cascade, then depth-only, then shaded
+  // against the depth they laid down -- see Engine::_recordDraws.
+  struct MeshPass {
+    enum {
+      Transparency,
+      DirectionalShadow,
+      DepthPrepass,
+      Forward,
+      MAX,
+    };
+  };
 
-    std::array<PerFrame, MAX_FRAMES_IN_FLIGHT>  _perFrames;
+  template <typename T>
+  using PerPassData = std::array<T, MeshPass::MAX>;
 
-    std::optional<uint32_t>  _graphicsFamily;
-    std::optional<uint32_t>  _presentFamily;
-    VkQueue                  _graphicsQueue;
-    VkQueue                  _presentQueue;
+  struct ShaderStage {
+    VkShaderModule         module;
+    VkShaderStageFlagBits  stage;
+  };
 
-    // These are used for issuing commands that are independent of any frame.
-    //
-    // This pool has VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT set,
-    // whereas the frame pools don't.
-    VkCommandPool    _globalCommandPool;
-    VkCommandBuffer  _globalCommandBuffer;
+  struct ShaderEffect {
+    VkDescriptorSetLayout     descLayout;
+    VkPipelineLayout          layout;
+    std::vector<ShaderStage>  stages;
+  };
 
-    VkRenderPass      _renderPass;
-    VkPipelineLayout  _pipelineLayout;
-    VkPipeline        _graphicsPipeline;
+  // `id`s are small and dense, handed out in the order PipelineRegistry
+  // builds things; RenderQueue keys sort by them.
+  struct ShaderPass {
+    ShaderEffect      *effect   =  nullptr;
+    VkPipeline        pipeline  =  VK_NULL_HANDLE;
+    VkPipelineLayout  layout    =  VK_NULL_HANDLE;
+    uint32_t          id        =  0;
+  };
+
+  struct Material {
+    PerPassData<ShaderPass*>      shaders;
+    PerPassData<VkDescriptorSet>  descriptorSets;
+    uint32_t                      id  { 0 };
+  };
+
+  // What a ShaderPass's pipeline is built for, besides its shaders. `pass` is
+  // a MeshPass, which decides the fixed-function state.
+  struct PassVariant {
+    asset::VertexFormat  vertexFormat  { asset::VertexFormat::Full };
+    VkRenderPass         renderPass    { VK_NULL_HANDLE };
+    uint32_t             subpass       { 0 };
+    uint32_t             pass          { MeshPass::Forward };
+  };
 
-    VmaAllocator  _allocator;
+  // How to build a Material: the effect and variant it's drawn with in each
+  // MeshPass, or a null effect for passes it isn't drawn in.
+  struct MaterialInfo {
+    PerPassData<ShaderEffect*>    effects         { };
+    PerPassData<PassVariant>      variants        { };
+    PerPassData<VkDescriptorSet>  descriptorSets  { };
   };
 
   /// The following three classes are taken more-or-less directly from vkguide.dev
@@ -384,6 +869,1331 @@ namespace gfx {
     DescriptorLayoutCache  *_cache;
     DescriptorAllocator    *_allocator;
   };
+
+  /// Uploader - Streams data into GPU_ONLY buffers and images through a small
+  ///            ring of persistently mapped staging buffers. Copies staged
+  ///            into the same ring slot are recorded together at flush time,
+  ///            with one vkCmdCopyBuffer per destination buffer.
+  ///
+  /// The uploader submits to whatever queue it's given -- ideally one from a
+  /// dedicated transfer family, so uploads don't compete with rendering.
+
+  class Uploader {
+  public:
+    static constexpr size_t        RING_SIZE     { 3 };
+    static constexpr VkDeviceSize  STAGING_SIZE  { 16 * 1024 * 1024 };
+
+    // Every staged region starts at a multiple of this within its slot.
+    static constexpr VkDeviceSize  ALIGNMENT  { 16 };
+
+    // Each submission is timed as a "gpu:upload" zone on `profiler`, if it's
+    // given and the queue family has nonzero `timestampBits`.
+    void init(VkDevice            device,
+	      VmaAllocator        allocator,
+	      MemoryTracker       *memory,
+	      uint32_t            queueFamily,
+	      VkQueue             queue,
+	      profile::Profiler   *profiler         = nullptr,
+	      uint32_t            timestampBits     = 0,
+	      float               timestampPeriod   = 0.0f);
+    void cleanup();
+
+    // Make sure the current slot has room for `regions` more staged regions
+    // totaling `size` bytes, flushing it if it doesn't. Use this before staging
+    // several regions whose pointers all need to be valid at once.
+    //
+    // Returns false if they could never fit in a single slot.
+    bool reserve(VkDeviceSize size, uint32_t regions = 1);
+
+    // Reserve `size` bytes of staging memory, to be copied to `dst` at
+    // `dstOffset` when the current slot is flushed. Returns a pointer to write
+    // the data through, which is valid until the slot is flushed -- either
+    // explicitly, or by a later stage/upload that doesn't fit in it.
+    //
+    // Returns nullptr if `size` is larger than STAGING_SIZE.
+    void *stage(VkBuffer dst, VkDeviceSize dstOffset, VkDeviceSize size);
+
+    // Copy `size` bytes from `src` into `dst` at `dstOffset`, splitting the
+    // copy over as many staging slots as it takes.
+    void upload(VkBuffer dst, VkDeviceSize dstOffset, void const *src, VkDeviceSize size);
+
+    // Copy `size` bytes within `buffer`, from `srcOffset` to `dstOffset`, when
+    // the current slot is flushed. Device copies go before staged ones, so the
+    // source mustn't be something staged in the same slot, and the two ranges
+    // mustn't overlap.
+    void copy(VkBuffer buffer, VkDeviceSize srcOffset, VkDeviceSize dstOffset, VkDeviceSize size);
+
+    // Like stage, but for the whole of mip level `level` of the color image
+    // `dst`, which is `extent` texels and `size` bytes. The level is moved
+    // from VK_IMAGE_LAYOUT_UNDEFINED to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    // around the copy, so whatever was in it before is lost.
+    void *stageImage(VkImage dst, uint32_t level, VkExtent3D extent, VkDeviceSize size);
+
+    // Submit every copy staged so far, and move on to the next slot.
+    void flush();
+
+    // Flush, then block until every submitted copy has completed.
+    void wait();
+
+    // Submissions are numbered from 1 by flush. Anything staged now goes out
+    // in submission nextSerial().
+    uint64_t nextSerial() const { return _submitted + 1; }
+
+    // True once submission `serial` has completed. Never blocks.
+    bool completed(uint64_t serial);
+
+  private:
+    struct Slot {
+      Buffer           staging;
+      uint8_t          *mapped   { nullptr };
+      VkCommandPool    pool      { VK_NULL_HANDLE };
+      VkCommandBuffer  cmdBuf    { VK_NULL_HANDLE };
+      VkFence          fence     { VK_NULL_HANDLE };
+      VkDeviceSize     used      { 0 };
+      bool             pending   { false };
+      uint64_t         serial    { 0 };
+
+      std::vector<std::pair<VkBuffer, VkBufferCopy>>       copies;
+      std::vector<std::pair<VkBuffer, VkBufferCopy>>       deviceCopies;
+      std::vector<std::pair<VkImage, VkBufferImageCopy>>  imageCopies;
+
+      // Timestamps before and after the copies, when profiling.
+      VkQueryPool  queries     { VK_NULL_HANDLE };
+      uint64_t     submitTime  { 0 };
+      uint64_t     frame       { 0 };
+    };
+
+    // Wait for the current slot's previous submission, and reset it.
+    void _reclaim(Slot *slot);
+
+    std::array<Slot, RING_SIZE>  _slots;
+    size_t                       _current  { 0 };
+
+    uint64_t  _submitted  { 0 };
+    uint64_t  _completed  { 0 };
+
+    VkDevice       _device;
+    VmaAllocator   _allocator;
+    MemoryTracker  *_memory;
+    VkQueue        _queue;
+    uint32_t       _queueFamily;
+
+    profile::Profiler  *_profiler         { nullptr };
+    uint64_t           _timestampMask     { 0 };
+    float              _timestampPeriod   { 0.0f };
+  };
+
+  /// RangeAllocator - Best-fit suballocation of [0, capacity), in whatever
+  ///                  unit the owner counts in. Free ranges are kept by offset
+  ///                  and by size, and merged with their neighbours as they
+  ///                  come back, so freeing never leaves two free ranges side
+  ///                  by side.
+  ///
+  /// Every range it hands out starts and ends on a multiple of `alignment`.
+  /// Not thread-safe.
+
+  class RangeAllocator {
+  public:
+    void init(VkDeviceSize capacity, VkDeviceSize alignment = 1);
+
+    // Take `size` units from the smallest free range they fit in, and that
+    // ends at or before `below`. A size of 0 always succeeds, with an empty
+    // range. Returns false if nothing fits.
+    bool alloc(VkDeviceSize  size,
+	       PoolRange     *out,
+	       VkDeviceSize  below = std::numeric_limits<VkDeviceSize>::max());
+
+    void free(PoolRange range);
+
+    VkDeviceSize capacity() const { return _capacity; }
+    VkDeviceSize used() const { return _used; }
+
+    // The largest single alloc that would succeed right now.
+    VkDeviceSize largestFree() const;
+
+  private:
+    void _insertFree(VkDeviceSize offset, VkDeviceSize size);
+    void _eraseFree(std::map<VkDeviceSize, VkDeviceSize>::iterator byOffset);
+
+    // Free ranges, offset to size and size to offset.
+    std::map<VkDeviceSize, VkDeviceSize>       _freeByOffset;
+    std::multimap<VkDeviceSize, VkDeviceSize>  _freeBySize;
+
+    VkDeviceSize  _capacity   { 0 };
+    VkDeviceSize  _alignment  { 1 };
+    VkDeviceSize  _used       { 0 };
+  };
+
+  /// GeometryPool - The vertices and indices of every mesh the engine draws:
+  ///                one large vertex buffer per vertex format, and one index
+  ///                buffer they all share, so static meshes draw from the
+  ///                same bindings however many MultiMeshes they come from.
+  ///                Vertex buffers are suballocated in vertices, and the index
+  ///                buffer in bytes; index ranges are INDEX_ALIGNMENT-aligned,
+  ///                so either index type's firstIndex lands on a whole index.
+  ///
+  /// update() defragments in the background. It copies the highest allocation
+  /// that fits in a hole below it down into that hole, on the Uploader's
+  /// queue, and once the copy has completed tells the allocation's owner
+  /// through the MoveFn, which rewrites whatever pointed at the old range. The
+  /// old range is then retired like a TextureManager image, and only reused
+  /// once whatever the owner uploaded has landed and every frame in flight
+  /// since has come around. Until then the two ranges hold the same bytes, so
+  /// a frame that still draws from the old one is none the wiser.
+  ///
+  /// Buffers are created the first time something is allocated from them.
+
+  class GeometryPool {
+  public:
+    static constexpr VkDeviceSize  VERTEX_BUFFER_SIZE  { 256 * 1024 * 1024 };
+    static constexpr VkDeviceSize  INDEX_BUFFER_SIZE   { 128 * 1024 * 1024 };
+    static constexpr VkDeviceSize  INDEX_ALIGNMENT     { 4 };
+
+    // Most bytes defragmentation copies in one update. A single allocation
+    // larger than this still moves, in an update of its own.
+    static constexpr VkDeviceSize  DEFRAG_BUDGET  { 4 * 1024 * 1024 };
+
+    // Called by update when `alloc` has moved: its vertices by `vertexDelta`
+    // vertices, and its indices by `indexDelta` bytes. `alloc` already has
+    // its new ranges. Returning false turns the move down for now: `alloc`
+    // keeps its old ranges, and the MoveFn is called again next update.
+    using MoveFn = std::function<bool (GeometryAlloc *alloc,
+				       int64_t        vertexDelta,
+				       int64_t        indexDelta)>;
+
+    // A retired range waits out `frameCount` prepares, plus one, once the
+    // last Uploader submission that touched it has completed. The extra one
+    // covers an owner that only switches to its new range on the update
+    // after that.
+    void init(VmaAllocator   allocator,
+	      MemoryTracker  *memory,
+	      Uploader       *uploader,
+	      uint32_t       graphicsFamily,
+	      uint32_t       transferFamily,
+	      uint32_t       frameCount,
+	      MoveFn         onMove);
+
+    // The device must be idle.
+    void cleanup();
+
+    // Reserve `vertexCount` vertices of `format` and `indexBytes` bytes of
+    // indices for `alloc`, which the pool holds on to until it's freed, so it
+    // mustn't move. Returns false, having allocated nothing, if there isn't
+    // room for both, or a heap's buffer can't be created within the memory
+    // budget.
+    bool alloc(GeometryAlloc        *alloc,
+	       asset::VertexFormat  format,
+	       VkDeviceSize         vertexCount,
+	       VkDeviceSize         indexBytes);
+
+    // Retire `alloc`'s ranges, and forget it. A move it had in progress is
+    // dropped.
+    void free(GeometryAlloc *alloc);
+
+    VkBuffer vertexBuffer(asset::VertexFormat format) const;
+    VkBuffer indexBuffer() const { return _heaps[INDEX_HEAP].buffer.buffer; }
+
+    // Bytes allocated, and bytes across every buffer created so far.
+    VkDeviceSize usedBytes() const;
+    VkDeviceSize capacityBytes() const;
+
+    // Finish the moves whose copies have completed, and start new ones, up to
+    // DEFRAG_BUDGET bytes. Called once per frame by Engine::draw, before
+    // anything is staged for the frame.
+    void update();
+
+    // Count down the retired ranges, and free those that nothing can be
+    // using any more. Call it once a frame's fence has been waited on.
+    void prepare();
+
+  private:
+    // _heaps[INDEX_HEAP] is the index buffer, and the rest are vertex buffers
+    // by VertexFormat.
+    static constexpr uint32_t  INDEX_HEAP  { 0 };
+    static constexpr uint32_t  HEAP_COUNT  { 3 };
+
+    struct Heap {
+      Buffer          buffer  { VK_NULL_HANDLE, VK_NULL_HANDLE };
+      RangeAllocator  ranges;
+      VkDeviceSize    unit    { 1 };  // bytes per unit of `ranges`
+    };
+
+    struct Move {
+      GeometryAlloc  *alloc;  // null once freed
+      uint32_t       heap;
+      PoolRange      from;
+      PoolRange      to;
+      uint64_t       serial;  // the Uploader submission doing the copy
+    };
+
+    struct Garbage {
+      uint32_t   heap;
+      PoolRange  range;
+      uint32_t   prepares;  // left before it's safe to reuse
+      uint64_t   serial;    // the last Uploader submission that touched it
+    };
+
+    static uint32_t _vertexHeap(asset::VertexFormat format) {
+      return format == asset::VertexFormat::Packed ? 2 : 1;
+    }
+
+    // The range `alloc` has in `heap`.
+    static PoolRange &_range(GeometryAlloc *alloc, uint32_t heap) {
+      return heap == INDEX_HEAP ? alloc->indices : alloc->vertices;
+    }
+
+    // Create `heap`'s buffer if it doesn't have one yet. The buffers are made
+    // on first use, part way through streaming, and are a fixed reservation
+    // that the budget doesn't manage, so don't push the memory heap over it.
+    //
+    // Log and return false on failure.
+    bool _createBuffer(uint32_t heap);
+
+    // Start moving the highest allocation in `heap` that fits below itself.
+    // Returns the bytes copied, or 0 if nothing could move.
+    VkDeviceSize _startMove(uint32_t heap);
+
+    bool _moving(GeometryAlloc const *alloc) const;
+
+    void _retire(uint32_t heap, PoolRange range, uint64_t serial);
+
+    std::array<Heap, HEAP_COUNT>  _heaps;
+
+    std::vector<GeometryAlloc *>  _live;
+    std::vector<Move>             _moves;
+    std::vector<Garbage>          _garbage;
+
+    uint32_t  _frameCount  { 1 };
+    uint32_t  _families[2];
+
+    MoveFn         _onMove;
+    VmaAllocator   _allocator;
+    MemoryTracker  *_memory;
+    Uploader       *_uploader;
+  };
+
+  /// TextureManager - Owns every texture the engine has loaded, and the one
+  ///                  bindless array of them that shaders index by slot. Only
+  ///                  some of a texture's mip levels are resident at a time:
+  ///                  update works out how many each texture's screen
+  ///                  coverage calls for, fits them into VRAM_BUDGET, and
+  ///                  streams levels in (or drops them) through the Uploader.
+  ///
+  /// VRAM_BUDGET shrinks to whatever the device has left under its memory
+  /// budget, less MEMORY_RESERVE, so that on a small or shared heap textures
+  /// give up levels before an allocation can fail. One that fails anyway
+  /// isn't fatal: the texture keeps what it has, or if it was giving up
+  /// levels, drops them all and samples white until there's room.
+  ///
+  /// The array is written through one descriptor set per frame in flight, so a
+  /// slot changing never touches a set the GPU might be reading. Slot 0 is a
+  /// 1x1 white texture, which also stands in for a texture until its first
+  /// levels arrive.
+
+  class TextureManager {
+  public:
+    // The most slots we'll ask for, before clamping to the device's limits.
+    static constexpr uint32_t      MAX_TEXTURES   { 4096 };
+
+    // Bytes of texture levels we try to keep resident.
+    static constexpr VkDeviceSize  VRAM_BUDGET    { 256 * 1024 * 1024 };
+
+    // Bytes of the device's memory budget textures leave for everything else.
+    static constexpr VkDeviceSize  MEMORY_RESERVE  { 64 * 1024 * 1024 };
+
+    // Most bytes of texture levels staged in a single update. A texture larger
+    // than this still goes out, in an update of its own.
+    static constexpr VkDeviceSize  STREAM_BUDGET  { 8 * 1024 * 1024 };
+
+    // Updates a texture has to want fewer levels for before we drop any,
+    // unless we're over budget. Keeps textures at the edge of the screen from
+    // bouncing in and out.
+    static constexpr uint32_t      LOWER_DELAY    { 60 };
+
+    // Build the layout and `setCount` sets -- one per frame in flight -- and
+    // the white texture. BC and ASTC textures are only accepted when the
+    // device has those features enabled.
+    //
+    // Log and exit on failure.
+    void init(VkDevice          device,
+	      VkPhysicalDevice  physicalDevice,
+	      VmaAllocator      allocator,
+	      MemoryTracker     *memory,
+	      Uploader          *uploader,
+	      uint32_t          graphicsFamily,
+	      uint32_t          transferFamily,
+	      uint32_t          setCount,
+	      bool              bc,
+	      bool              astc);
+
+    // The device must be idle.
+    void cleanup();
+
+    VkDescriptorSetLayout layout() const { return _layout; }
+
+    // The set for frame `frameIndex`, up to date once prepare(frameIndex) has
+    // been called.
+    VkDescriptorSet set(uint32_t frameIndex) const { return _sets[frameIndex]; }
+
+    // A slot for texture `id` from the library at `libraryPath`, shared with
+    // anything else that acquired it. Returns 0 if the library doesn't have
+    // it, or the device can't sample its format.
+    uint32_t acquire(std::string const &libraryPath, asset::TextureID id);
+
+    // Give back a slot from acquire. Its texture is freed when nothing else
+    // holds it.
+    void release(uint32_t slot);
+
+    // Note that the texture in `slot` covers about `pixels` pixels across on
+    // screen this frame. Only the largest request per update counts. Not
+    // thread-safe, but may be called from any one thread at a time.
+    void request(uint32_t slot, float pixels);
+
+    // Swap in finished uploads, pick every texture's levels for the coverage
+    // requested since the last update, and stage whatever needs to change.
+    // Called once per frame by Engine::draw.
+    void update();
+
+    // Write every slot that changed since frame `frameIndex` last came
+    // around into its set, and free whatever its old descriptors pointed at
+    // once no set or frame can still be using it. Call it once the frame's
+    // fence has been waited on.
+    void prepare(uint32_t frameIndex);
+
+  private:
+    // A texture's levels [firstLevel, mipCount) in one image.
+    struct Image {
+      VkImage        image       { VK_NULL_HANDLE };
+      VmaAllocation  alloc       { VK_NULL_HANDLE };
+      VkImageView    view        { VK_NULL_HANDLE };
+      uint32_t       firstLevel  { 0 };
+    };
+
+    struct Texture {
+      asset::TextureID                id      { asset::NULL_ASSET_ID };
+      asset::TextureFileHandleBuffer  *file   { nullptr };
+      VkFormat                        format  { VK_FORMAT_UNDEFINED };
+      uint32_t                        refs    { 0 };
+
+      // The texture's levels in `file`, and tailBytes[l] the size of levels
+      // [l, mipCount) together. Levels finer than minLevel are too large to
+      // stage, so they're never made resident.
+      Span<asset::TextureMip const>  mips;
+      std::vector<VkDeviceSize>      tailBytes;
+      uint32_t                       minLevel  { 0 };
+
+      // Nothing is resident while image.image is null, and the slot samples
+      // the white texture.
+      Image     image;
+      Image     pending;
+      uint64_t  pendingSerial  { 0 };
+
+      float     coverage     { 0.0f };  // the largest request since update
+      uint32_t  lowerFrames  { 0 };     // updates in a row it's wanted fewer
+      uint32_t  dirtySets    { 0 };     // bit i set if _sets[i] is stale
+    };
+
+    struct Garbage {
+      Image         image;
+      uint32_t      prepares;  // left before it's safe to destroy
+      uint64_t      serial;    // the Uploader submission that last wrote it
+      VkDeviceSize  bytes;     // of device memory it still holds
+    };
+
+    // The first level resident in `texture`, or mipCount if there are none.
+    uint32_t _residentLevel(Texture const &texture) const;
+
+    // Create an image for levels [firstLevel, mipCount) of `texture`.
+    // Returns false if there isn't memory for it within the budget.
+    //
+    // Log and exit if the image view can't be created.
+    bool _createImage(Texture const &texture, uint32_t firstLevel, Image *image);
+
+    // Read levels [firstLevel, mipCount) of `texture` into a new pending
+    // image. Returns the bytes staged, which are 0 if the image couldn't be
+    // created.
+    VkDeviceSize _upload(Texture *texture, uint32_t firstLevel);
+
+    // Have every set's descriptor for `slot` rewritten by its next prepare.
+    void _markDirty(uint32_t slot);
+
+    // Destroy `image` once nothing can be using it.
+    void _retire(Image const &image, uint64_t serial);
+    void _destroy(Image const &image);
+
+    VkFormat _vkFormat(asset::TextureData const &data) const;
+
+    std::vector<Texture>   _textures;
+    std::vector<uint32_t>  _freeSlots;
+
+    // Slots by the texture they hold, so acquire can share them.
+    std::unordered_map<asset::TextureID, uint32_t>  _slotIndex;
+
+    // Slots with a non-zero dirtySets.
+    std::vector<uint32_t>  _dirty;
+
+    std::vector<Garbage>   _garbage;
+
+    // Libraries opened by acquire. Each texture's `file` belongs to one.
+    std::unordered_map<std::string, asset::LibraryFileHandle>  _libraries;
+
+    // Bytes in every resident and pending image, by tailBytes.
+    VkDeviceSize  _residentBytes  { 0 };
+
+    // Bytes of device memory held by _garbage. They're as good as free when
+    // sizing the budget, since they will be in a few frames.
+    VkDeviceSize  _garbageBytes   { 0 };
+
+    uint32_t  _maxTextures  { 0 };
+    bool      _bc           { false };
+    bool      _astc         { false };
+
+    VkDescriptorSetLayout         _layout  { VK_NULL_HANDLE };
+    VkDescriptorPool              _pool    { VK_NULL_HANDLE };
+    std::vector<VkDescriptorSet>  _sets;
+
+    // Linear, with repeat addressing.
+    VkSampler  _sampler  { VK_NULL_HANDLE };
+
+    uint32_t  _families[2];
+
+    VkDevice       _device;
+    VmaAllocator   _allocator;
+    MemoryTracker  *_memory;
+    Uploader       *_uploader;
+  };
+
+  /// PipelineRegistry - Builds ShaderEffects, ShaderPasses and Materials on
+  ///                    demand, and keeps them until cleanup. Every pipeline
+  ///                    is built through one VkPipelineCache, which is read
+  ///                    from disk at init and written back at cleanup, so
+  ///                    later launches on the same driver skip most of the
+  ///                    shader compilation.
+  ///
+  /// The registry doesn't know how to fill in fixed-function state; the Engine
+  /// hands it a BuildFn for that. BuildFn is called from job threads by
+  /// compile, so it mustn't touch anything mutable.
+
+  class PipelineRegistry {
+  public:
+    using BuildFn = std::function<VkPipeline (ShaderEffect const  *effect,
+					      PassVariant const   &variant,
+					      VkPipelineCache     cache)>;
+
+    // Load the cache at `cachePath`, unless it was written by a different
+    // device or driver, in which case we start from an empty one.
+    //
+    // Log and exit on failure.
+    void init(VkDevice            device,
+	      VkPhysicalDevice    physicalDevice,
+	      std::string const   &cachePath,
+	      jobs::System        *jobs,
+	      BuildFn             build);
+
+    // Write the cache back to disk, then destroy every pipeline and shader
+    // module this built. Pipeline layouts belong to the caller.
+    void cleanup();
+
+    VkPipelineCache cache() const { return _cache; }
+
+    // The effect running the SPIR-V at `vertPath` and `fragPath` with
+    // `layout`, or just `vertPath` if `fragPath` is empty, for depth-only
+    // passes. Each module is only loaded once, however many effects use it.
+    //
+    // Log and exit on failure.
+    ShaderEffect *effect(std::string const  &vertPath,
+			 std::string const  &fragPath,
+			 VkPipelineLayout   layout);
+
+    // `effect`'s pass for `variant`, built now if it hasn't been already.
+    ShaderPass *pass(ShaderEffect *effect, PassVariant const &variant);
+
+    // Build every pass in `passes` that hasn't been built already, spread
+    // over the job system's threads.
+    void compile(std::vector<std::pair<ShaderEffect *, PassVariant>> const &passes);
+
+    // The material called `name`, built from `info` -- compiling all of its
+    // passes together -- if this is the first time it's been asked for.
+    Material *material(std::string const &name, MaterialInfo const &info);
+
+    // Returns nullptr unless material(name, info) has been called.
+    Material *material(std::string const &name);
+
+  private:
+    using PassKey = std::tuple<ShaderEffect const *, asset::VertexFormat, VkRenderPass, uint32_t, uint32_t>;
+
+    static PassKey _key(ShaderEffect const *effect, PassVariant const &variant) {
+      return { effect, variant.vertexFormat, variant.renderPass, variant.subpass, variant.pass };
+    }
+
+    // Log and exit on failure.
+    VkShaderModule _module(std::string const &path);
+
+    // Guards _passes and _materials, which compile and pass may touch from
+    // different threads. Everything else is only used from the thread that
+    // called init.
+    std::mutex  _lock;
+
+    // These are std::maps so that pointers into them stay valid.
+    std::map<std::string, VkShaderModule>  _modules;
+
+    std::map<std::tuple<std::string, std::string, VkPipelineLayout>, ShaderEffect>  _effects;
+
+    std::map<PassKey, ShaderPass>      _passes;
+    std::map<std::string, Material>    _materials;
+
+    std::string      _cachePath;
+    VkPipelineCache  _cache  { VK_NULL_HANDLE };
+    BuildFn          _build;
+    jobs::System     *_jobs  { nullptr };
+
+    VkDevice  _device;
+  };
+
+  // How the swapchain presents. Anything the surface doesn't support falls
+  // back to Fifo, which every surface does.
+  enum class PresentMode {
+    Fifo,         // Vsync, queueing frames
+    FifoRelaxed,  // Vsync, unless a frame is late, in which case it tears
+    Mailbox,      // Vsync, replacing any frame still waiting
+    Immediate,    // No vsync, may tear
+  };
+
+  char const *presentModeName(PresentMode mode);
+
+  struct EngineOptions {
+    // Frames the CPU may record ahead of the GPU, at most
+    // Engine::MAX_FRAMES_IN_FLIGHT. Fixed once the engine is initialized.
+    uint32_t     framesInFlight  { 2 };
+    PresentMode  presentMode     { PresentMode::Fifo };
+
+    // See Engine::limitLatency, 0 to leave it to framesInFlight.
+    uint32_t     latencyLimit    { 0 };
+
+    // Render into images of the engine's own, one per frame in flight, rather
+    // than a window's swapchain, and never present. No window is opened, and
+    // presentMode is ignored. For benchmarking.
+    bool        headless        { false };
+    VkExtent2D  headlessExtent  { 1920, 1080 };
+
+    // The meshes streamed in at init, and the library they're in. Empty for
+    // the built-in test meshes.
+    std::string                 library  { ".data/library.assets" };
+    std::vector<asset::MeshID>  meshes;
+  };
+
+  // What the engine's VMA allocations add up to, split by whether their heap
+  // is device-local. `blocks` counts whole VkDeviceMemory blocks, which is
+  // what the driver actually sees.
+  struct MemoryStats {
+    VkDeviceSize  deviceAllocated  { 0 };
+    VkDeviceSize  deviceBlocks     { 0 };
+    VkDeviceSize  hostAllocated    { 0 };
+    VkDeviceSize  hostBlocks       { 0 };
+
+    // One per memory heap. `usage` and `budget` cover the whole process, and
+    // come from VK_EXT_memory_budget when `budgetExtension` is set; otherwise
+    // they're VMA's estimates.
+    struct Heap {
+      VkDeviceSize  size         { 0 };
+      VkDeviceSize  usage        { 0 };
+      VkDeviceSize  budget       { 0 };
+      VkDeviceSize  allocated    { 0 };
+      VkDeviceSize  blocks       { 0 };
+      bool          deviceLocal  { false };
+    };
+
+    std::vector<Heap>  heaps;
+    bool               budgetExtension  { false };
+
+    // Live allocations, and their bytes, by MemoryCategory.
+    std::array<uint64_t, MemoryCategory::MAX>      allocations  { };
+    std::array<VkDeviceSize, MemoryCategory::MAX>  bytes        { };
+  };
+
+  class Engine {
+  public:
+    Engine(std::initializer_list<char const *>  enabledLayers,
+	   EngineOptions const                  &options = { })
+      : _enabledLayers(enabledLayers), _options(options) {}
+
+    void init();
+    void draw();
+    void cleanup();
+
+    size_t framesDrawn() { return _framesDrawn; }
+
+    // Add an instance of `mesh`, one of EngineOptions::meshes, to what every
+    // frame draws. Returns NO_INSTANCE, with a warning, if `mesh` wasn't
+    // loaded or there are already MAX_INSTANCES.
+    //
+    // Only instances created, moved or destroyed since the last frame are
+    // sent to the GPU. With the built-in test meshes, init creates two
+    // spinning instances of its own.
+    InstanceID createInstance(asset::MeshID mesh, glm::mat4 const &model);
+
+    // Both ignore IDs that don't name a live instance.
+    void updateTransform(InstanceID id, glm::mat4 const &model);
+    void destroyInstance(InstanceID id);
+
+    void setCamera(glm::vec3 const &position, glm::vec3 const &target);
+
+    // True once every mesh from EngineOptions::meshes has streamed in; until
+    // then draw() draws nothing.
+    bool sceneResident() { return _isResident(&_testMultiMesh); }
+
+    // True if any of those meshes failed to stream in, in which case the
+    // scene never becomes resident.
+    bool sceneFailed() { return _testMultiMesh.failed; }
+
+    // Per-heap usage and budget, and what the engine has allocated from them,
+    // as of now.
+    MemoryStats memoryStats();
+
+    // Ask for a different present mode. The swapchain is rebuilt at the start
+    // of the next draw().
+    void setPresentMode(PresentMode mode);
+
+    // The mode the swapchain is actually using, which isn't necessarily the
+    // one asked for.
+    PresentMode presentMode() { return _presentMode; }
+
+    // Tell the engine the window changed size, so it rebuilds the swapchain
+    // rather than waiting for the driver to say it's out of date.
+    void resized() { _swapchainStale = !_options.headless; }
+
+    // Block until no more than `latencyLimit` frames are still on the GPU,
+    // waiting on the most recent frames' renderFinishedFence rather than
+    // the oldest's. Call it right before polling input, so that the input
+    // goes into a frame that will be shown soon after. Does nothing when the
+    // limit is 0, or no tighter than framesInFlight.
+    void limitLatency();
+
+    void setLatencyLimit(uint32_t frames) { _options.latencyLimit = frames; }
+
+    // Turn two-phase occlusion culling on or off. It's on by default when
+    // culling on the GPU, and unavailable otherwise.
+    void setOcclusionCulling(bool enabled);
+
+    // CullStats for the most recent frame the GPU has finished with.
+    CullStats cullStats() { return _cullStats; }
+
+    // The scheduler the engine records on. Available between init and
+    // cleanup.
+    jobs::System &jobs() { return _jobs; }
+
+    // CPU zones for each phase of draw(), and GPU zones for each of its passes
+    // and for uploads, when the device can time them. GPU zones show up a few
+    // frames late, once the GPU is done with them.
+    profile::Profiler &profiler() { return _profiler; }
+
+    // Nodes added here run during the next draw(), alongside the engine's
+    // own, which are:
+    //
+    //     "engine:texture-coverage" - Requests texture levels for every
+    //                                 instance in view.
+    //     "engine:flush-instances"  - Culls (on the CPU) and sorts instances,
+    //                                 after texture-coverage.
+    //     "engine:record-draws"     - Records the frame's secondary command
+    //                                 buffers, after flush-instances.
+    //
+    // The engine's nodes read the scene, so nodes added here mustn't create,
+    // move or destroy instances.
+    jobs::FrameGraph &frameGraph() { return _frameGraph; }
+
+  private:
+    // Counted by _memory under `category`, a MemoryCategory.
+    void _allocBuffer(size_t              size,
+		      VkBufferUsageFlags  vkUsage,
+		      VmaMemoryUsage      memoryUsage,
+		      uint32_t            category,
+		      Buffer              *buffer);
+
+    // Like _allocBuffer, but the buffer is host-visible and stays mapped for
+    // its entire lifetime. Returns the mapped pointer.
+    void *_allocMappedBuffer(size_t              size,
+			     VkBufferUsageFlags  vkUsage,
+			     uint32_t            category,
+			     Buffer              *buffer);
+
+    void _freeBuffer(Buffer *buffer);
+
+    // Read mesh `id` from `handle` through the _uploader, into `vbuffer` at
+    // vertex `firstVertex` and `ibuffer` at byte `indexOffset`.
+    bool _uploadMesh(asset::LibraryFileHandle &handle,
+		     asset::MeshID              id,
+		     VkBuffer                   vbuffer,
+		     size_t                     firstVertex,
+		     VkBuffer                   ibuffer,
+		     VkDeviceSize               indexOffset);
+
+    bool _loadMesh(std::string const &path, asset::MeshID id, Mesh *mesh);
+
+    // Lay out `count` meshes from `handle` in `meshes`, allocate its buffers
+    // and upload its draw commands, for _streamMultiMesh.
+    //
+    // `path` is where `handle` was opened from, for acquiring the meshes'
+    // textures. On failure nothing is left allocated or acquired.
+    bool _allocMultiMesh(
+      std::string const &path, asset::LibraryFileHandle &handle,
+      asset::MeshID *ids, MultiMesh *meshes, size_t count);
+
+    // Load `count` meshes from the library at `path` into a single
+    // allocation from the _geometry pool, describing where they went in
+    // `meshes`. Returns as soon as the meshes are queued with the _streamer;
+    // nothing in `meshes` should be drawn until _isResident.
+    bool _streamMultiMesh(
+      std::string const &path,
+      asset::MeshID *ids, MultiMesh *meshes, size_t count);
+
+    // Stage finished loads from the _streamer, up to STREAM_BUDGET bytes.
+    // Called once per frame by draw().
+    void _pumpStreaming();
+
+    // True once every mesh in `meshes` has been uploaded, and none failed.
+    bool _isResident(MultiMesh *meshes);
+
+    // Issue `maxDraws` indirect draws from `buffer`, starting with the command
+    // at byte `offset`, with a uint32_t draw count at `countOffset`. `cpuCmds`
+    // is a host copy of the commands from `offset` on, used when the device
+    // can't honor firstInstance in indirect commands.
+    void _drawIndirect(VkCommandBuffer                     cmdBuf,
+		       VkBuffer                            buffer,
+		       VkDeviceSize                        offset,
+		       VkDeviceSize                        countOffset,
+		       uint32_t                            maxDraws,
+		       VkDrawIndexedIndirectCommand const  *cpuCmds);
+
+    // Request texture levels for every instance in _scene that's in
+    // `frustum`, by how big it is on screen through `camera`. The scene's
+    // instances are all of `meshes`.
+    void _requestTextureCoverage(MultiMesh         *meshes,
+				 Frustum const     &frustum,
+				 CameraData const  &camera);
+
+    // Hand _scene to `frame`, to be culled against `frustum` and each of the
+    // frame's shadow cascades. When culling on the CPU that happens here;
+    // otherwise it's up to _cullInstances, and only the instances that changed
+    // are written.
+    void _flushInstances(PerFrame *frame, MultiMesh *meshes, Frustum const &frustum);
+
+    // Cull _scene's instances against `frustum` when culling on the CPU,
+    // and write the survivors and their draws into `draws`, sorted for the
+    // MeshPass `pass`. Levels of detail are picked by their distance from
+    // `camera`.
+    //
+    // Returns how many instances survived.
+    uint32_t _writeDraws(PerFrame          *frame,
+			 MultiMesh         *meshes,
+			 Frustum const     &frustum,
+			 CameraData const  &camera,
+			 uint32_t          pass,
+			 DrawList          *draws);
+
+    // Fit each of `frame`'s shadow cascades around its slice of the view
+    // through `view` and `project`, and write their cameras and the
+    // ShadowData static-mesh.frag reads.
+    void _updateShadows(PerFrame *frame, glm::mat4 const &view, glm::mat4 const &project);
+
+    // Record the compute passes that cull `frame`'s instances of `meshes` for
+    // `phase`, and compact the survivors' draws. The late phase tests against
+    // `swap`'s depth pyramid, and the shadow phase culls for the shadow
+    // cascade `cascade`. Must be called outside a render pass.
+    void _cullInstances(VkCommandBuffer  cmdBuf,
+			PerFrame         *frame,
+			PerSwapImage     *swap,
+			MultiMesh        *meshes,
+			CullPhase        phase,
+			uint32_t         cascade = 0);
+
+    // Build `swap`'s depth pyramid from its depth image, which must hold the
+    // early phase's depth in VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL.
+    void _buildDepthPyramid(VkCommandBuffer cmdBuf, PerSwapImage *swap);
+
+    // Draw the instances in index group `group` that _flushInstances or
+    // _cullInstances chose for `phase` (and, for the shadow phase, the
+    // cascade `cascade`), with one instanced indirect command per visible
+    // mesh (or meshlet).
+    void _drawInstances(VkCommandBuffer  cmdBuf,
+			PerFrame         *frame,
+			MultiMesh        *meshes,
+			CullPhase        phase,
+			uint32_t         cascade,
+			uint32_t         group);
+
+    // The secondary command buffers _recordDraws fills, by where draw()
+    // executes them. `prepass` and `forward` are indexed by CullPhase, Early or
+    // Late.
+    struct FrameDraws {
+      std::array<VkCommandBuffer, ShadowData::CASCADE_COUNT>  shadows;
+
+      std::array<VkCommandBuffer, 2>  prepass;
+      std::array<VkCommandBuffer, 2>  forward;
+    };
+
+    // Record every MeshPass's draws of `meshes` into secondary command
+    // buffers in parallel -- one per pass, phase and cascade -- to be executed
+    // in _shadowRenderPass, _renderPass and _lateRenderPass.
+    void _recordDraws(PerFrame      *frame,
+		      PerSwapImage  *swap,
+		      MultiMesh     *meshes,
+		      FrameDraws    *draws);
+
+    void _freeMesh(Mesh *mesh);
+    void _freeMultiMesh(MultiMesh *mesh);
+
+    // Point everything in `meshes` that refers to its geometry at where
+    // the _geometry pool has moved it, by `vertexDelta` vertices and
+    // `indexDelta` bytes of indices, and upload its new draw commands into
+    // the copy frames aren't reading. Returns false, changing nothing, if
+    // that copy may still be in use.
+    bool _rebaseMultiMesh(MultiMesh *meshes, int64_t vertexDelta, int64_t indexDelta);
+
+    // Make the copy of the draw commands _rebaseMultiMesh wrote current, for
+    // each of _rebasing whose upload has completed. Called once per frame by
+    // draw(), after _geometry.update.
+    void _switchIndirect();
+
+    void _initPerFrames();
+
+    // Create the swapchain for the window's current size and _options'
+    // present mode, and each PerSwapImage's views and depth image. Replaces
+    // and destroys any swapchain we already had.
+    //
+    // Log and exit on failure.
+    void _initSwapchain();
+
+    // Like _initSwapchain, but for _options.headless: allocate an image of
+    // _options.headlessExtent per frame in flight, in place of a swapchain.
+    //
+    // Log and exit on failure.
+    void _initOffscreenImages();
+
+    // Create the views and depth image of every PerSwapImage, whose `image`
+    // has been filled in already. Shared by the two above.
+    //
+    // Log and exit on failure.
+    void _initSwapImages();
+
+    // Create _shadowRenderPass, and the shadow map with a framebuffer for each
+    // of its cascades.
+    //
+    // Log and exit on failure.
+    void _initShadows();
+
+    // Create each PerSwapImage's framebuffer. Needs _renderPass.
+    //
+    // Log and exit on failure.
+    void _initFramebuffers();
+
+    // Destroy everything _initSwapchain (or _initOffscreenImages),
+    // _initFramebuffers and _initDepthPyramids made per swap image, but not
+    // the swapchain itself.
+    void _cleanupSwapImages();
+
+    // Wait for the device to go idle and rebuild everything that depends on
+    // the swapchain. Returns false, leaving the swapchain stale, if the window
+    // has no area to draw to -- e.g. while it's minimized.
+    bool _recreateSwapchain();
+
+    void _initPipelines();
+
+    // Build `effect`'s static mesh pipeline for `variant` through `cache`.
+    // This is _pipelines' BuildFn, so it may run on any thread.
+    //
+    // Log and exit on failure.
+    VkPipeline _initMeshPipeline(ShaderEffect const  *effect,
+				 PassVariant const   &variant,
+				 VkPipelineCache     cache);
+
+    // The Material that draws `meshes`, by their vertex format.
+    Material *_meshMaterial(MultiMesh *meshes);
+
+    // Bind the pipeline for `meshes`' vertex format in the MeshPass `pass`,
+    // its set 1, and its vertex buffer. Index buffers are bound per group, by
+    // _bindIndexGroup.
+    void _bindMultiMesh(VkCommandBuffer cmdBuf, MultiMesh *meshes, uint32_t pass);
+
+    // Allocate each PerSwapImage's depth pyramid, and build its descriptor
+    // sets from _swapDescriptorAllocator. Must run after _initPerFrames, which
+    // sets up the descriptor layout cache.
+    //
+    // Log and exit on failure.
+    void _initDepthPyramids();
+
+    // Build _cullPipelineLayout and the culling pipelines, and the depth
+    // reduction pipeline. Must run after _initPerFrames and
+    // _initDepthPyramids, which build the set layouts.
+    //
+    // Log and exit on failure.
+    void _initCullPipelines();
+
+    // Log and exit on failure.
+    VkPipeline _initComputePipeline(char const *shaderPath, VkPipelineLayout layout);
+
+    // Bind `meshes`' index buffer for its group `group`.
+    void _bindIndexGroup(VkCommandBuffer cmdBuf, MultiMesh *meshes, uint32_t group);
+
+    // Advance _currentFrame and do the vkWaitForFences-dance to acquire the
+    // next frame, then return a pointer to its corresponding PerFrame
+    // structure.
+    PerFrame *_acquireNextFrame();
+
+    // Bracket commands recorded into `cmdBuf` -- a primary, outside any render
+    // pass -- as the GPU zone `name`. Does nothing if the device can't time
+    // the graphics queue, or the frame already has MAX_GPU_ZONES.
+    void _beginGpuZone(VkCommandBuffer cmdBuf, PerFrame *frame, char const *name);
+    void _endGpuZone(VkCommandBuffer cmdBuf, PerFrame *frame);
+
+    // Hand the zones `frame` recorded last time around to _profiler. Only call
+    // once its renderFinishedFence is signaled.
+    //
+    // Log and exit on failure.
+    void _collectGpuZones(PerFrame *frame);
+
+    VkCommandBuffer _allocCmdBuffer(VkCommandPool         pool,
+				    VkCommandBufferLevel  level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+
+    // Shorthands for recording commands. A secondary command buffer recorded
+    // for a render pass needs `inheritance`.
+    void _beginCmdBuffer(VkCommandBuffer                        cmdBuf,
+			 uint32_t                               flags        = 0,
+			 VkCommandBufferInheritanceInfo const   *inheritance = nullptr);
+
+    // The pass's contents all come from secondary command buffers, in every
+    // subpass.
+    void _beginRenderPass(VkCommandBuffer  cmdBuf,
+			  VkRenderPass     renderPass,
+			  VkFramebuffer    framebuf,
+			  VkExtent2D       extent,
+			  VkClearValue     *clearValues,
+			  uint32_t         clearCount);
+
+
+    // Helper methods for building pipelines
+    VkPipelineShaderStageCreateInfo
+    _loadShaderStageInfo(const std::string &spirvPath, VkShaderStageFlagBits stageFlags);
+
+    VkPipelineVertexInputStateCreateInfo
+    _vertexInputInfo();
+
+    VkPipelineInputAssemblyStateCreateInfo
+    _inputAssemblyInfo(VkPrimitiveTopology topology);
+
+    VkPipelineRasterizationStateCreateInfo
+    _rasterStateInfo(VkPolygonMode polyMode);
+
+    VkPipelineMultisampleStateCreateInfo
+    _multisampleInfo();
+
+    VkPipelineColorBlendAttachmentState
+    _colorBlendAttachState();
+
+    VkPipelineDepthStencilStateCreateInfo
+    _depthStencilState(bool depthTest, bool depthWrite, VkCompareOp cmp);
+
+    VkPipelineLayoutCreateInfo
+    _pipelineLayoutInfo(VkDescriptorSetLayout  *setLayouts,
+			uint32_t               setLayoutCount);
+
+    VkImageCreateInfo
+    _imageInfo(VkFormat format, VkImageUsageFlags usageFlags, VkExtent3D extent);
+
+    VkImageViewCreateInfo
+    _imageViewInfo(VkFormat format, VkImage image, VkImageAspectFlags aspectFlags);
+
+    ////////////////////////////////////
+    // For one-off testing, not part of the final form of this class..
+    //
+    void _initTestData();
+    void _cleanupTestData();
+    //
+    MultiMesh _testMultiMesh;
+    //
+    // End test decls
+    ////////////////////////////////////
+    
+    bool _initialized = false;
+
+    static constexpr size_t  MAX_FRAMES_IN_FLIGHT { 4 };
+
+    // Most threads, counting the one that called init, that _jobs runs on.
+    static constexpr size_t  MAX_JOB_THREADS { 8 };
+
+    // Most GPU zones a frame can record; each takes two timestamp queries.
+    static constexpr uint32_t  MAX_GPU_ZONES { 16 };
+
+    // Capacity of the per-frame instance and indirect draw buffers.
+    static constexpr size_t  MAX_INSTANCES { 16384 };
+    static constexpr size_t  MAX_DRAWS     { 1024 };
+
+    // Each PerFrame::transient hands out this much. It covers the most a
+    // frame can take -- MAX_INSTANCES instances and MAX_DRAWS draws for the
+    // camera and for each shadow cascade, and change -- with room to spare.
+    static constexpr VkDeviceSize  TRANSIENT_SIZE { 8 * 1024 * 1024 };
+
+    // The largest fixed range a dynamic descriptor reads through in a
+    // PerFrame::transient, that being the instances.
+    static constexpr VkDeviceSize  TRANSIENT_SLACK {
+      MAX_INSTANCES * sizeof(InstanceData)
+    };
+    // visibleDrawBuffer holds MAX_DRAWS commands for each CullPhase, then a
+    // draw count for each phase and group, then a visible instance count for
+    // each phase and level of detail, and finally each level's first visible
+    // instance for each phase.
+    static constexpr VkDeviceSize  VISIBLE_DRAW_COUNT_OFFSET {
+      2 * MAX_DRAWS * sizeof(VkDrawIndexedIndirectCommand)
+    };
+    static constexpr VkDeviceSize  VISIBLE_LOD_COUNT_OFFSET {
+      VISIBLE_DRAW_COUNT_OFFSET + 2 * MultiMesh::MAX_INDEX_GROUPS * sizeof(uint32_t)
+    };
+    static constexpr VkDeviceSize  VISIBLE_LOD_FIRST_OFFSET {
+      VISIBLE_LOD_COUNT_OFFSET + 2 * MAX_DRAWS * sizeof(uint32_t)
+    };
+
+    // The most a level of detail may be off by on screen, in pixels, before
+    // we switch to a finer one.
+    static constexpr float  LOD_PIXEL_ERROR { 1.0f };
+
+    // The camera's near and far planes.
+    static constexpr float  CAMERA_NEAR { 0.1f };
+    static constexpr float  CAMERA_FAR  { 200.0f };
+
+    // Width and height of each shadow cascade, in texels.
+    static constexpr uint32_t  SHADOW_MAP_SIZE { 2048 };
+
+    // How far from the camera shadows reach, and how the cascades split that
+    // up: 0 spaces them evenly, 1 logarithmically.
+    static constexpr float  SHADOW_DISTANCE     { 50.0f };
+    static constexpr float  SHADOW_SPLIT_LAMBDA { 0.75f };
+
+    // How far behind a cascade, towards the light, its casters may be.
+    static constexpr float  SHADOW_CASTER_MARGIN { 50.0f };
+
+    // Depth bias for the DirectionalShadow pass, in the units of
+    // VkPipelineRasterizationStateCreateInfo.
+    static constexpr float  SHADOW_DEPTH_BIAS { 1.25f };
+    static constexpr float  SHADOW_SLOPE_BIAS { 1.75f };
+
+    // Threads per workgroup in the culling shaders.
+    static constexpr uint32_t  CULL_GROUP_SIZE { 64 };
+
+    // Most bytes of streamed mesh data staged in a single frame. A mesh larger
+    // than this still goes out, on a frame of its own.
+    static constexpr VkDeviceSize  STREAM_BUDGET { 8 * 1024 * 1024 };
+
+    std::vector<char const *>  _enabledLayers;
+
+    EngineOptions  _options;
+
+    // This is an index into _perFrames, it should always be
+    //
+    //         0 <= _currentFrame < _perFrames.size()
+    //
+    size_t  _currentFrame { 0 };
+
+    // This is just the number of times that .draw() has successfully been
+    // called on this Engine.
+    //
+    // On a 32-bit system w/ a 60Hz refresh rate, this will take more than 2
+    // years to overflow. On a 64-bit system it should be more like 9 billion
+    // years.
+    //
+    // Both are acceptable =]
+    size_t _framesDrawn { 0 };
+
+    SDL_Window        *_window    { nullptr };  // Null when headless
+    VkInstance        _instance;
+    VkPhysicalDevice  _physicalDevice;
+    VkDevice          _device;
+    VkSurfaceKHR      _surface    { VK_NULL_HANDLE };
+
+    VkExtent2D     _swapExtent;
+    VkFormat       _swapFormat;
+    VkSwapchainKHR _swapChain  { VK_NULL_HANDLE };
+
+    PresentMode    _presentMode  { PresentMode::Fifo };
+
+    // Set when the swapchain needs rebuilding before the next frame: the
+    // window was resized, the present mode changed, or the driver said so.
+    bool  _swapchainStale  { false };
+
+    VkFormat _depthFormat;
+
+    // Optional device features, these are enabled in init() whenever the
+    // physical device supports them, and the draw code picks the fastest path
+    // that is available.
+    bool  _multiDrawIndirect          { false };
+    bool  _drawIndirectCount          { false };
+    bool  _drawIndirectFirstInstance  { false };
+    bool  _textureCompressionBC       { false };
+    bool  _textureCompressionASTC     { false };  // LDR only
+    bool  _hostQueryReset             { false };
+
+    // Cull instances in a compute pass writing straight to the indirect
+    // buffer, rather than on the CPU. Needs drawIndirectCount and
+    // drawIndirectFirstInstance, and a graphics queue that can do compute.
+    bool  _gpuCulling  { false };
+
+    // Whether the culling shaders run the late phase. Only ever set when
+    // _gpuCulling is.
+    bool  _occlusionCulling  { false };
+
+    // Set when _visibilityBuffer needs clearing before it's next read.
+    bool  _resetVisibility  { true };
+
+    // One uint32_t per place in _scene, non-zero if the instance there passed
+    // the late phase last frame. An instance that gets moved by another's
+    // destruction is judged by its new place's history for a frame, which at
+    // worst draws it in the wrong phase.
+    Buffer  _visibilityBuffer;
+
+    CullStats  _cullStats  { };
+
+    // Everything draw() draws, all of it from _testMultiMesh, and where it
+    // looks from.
+    Scene  _scene;
+
+    glm::vec3  _cameraPosition  { 0.0f, 0.8f, 1.5f };
+    glm::vec3  _cameraTarget    { 0.0f };
+
+    // Device-local, MAX_INSTANCES InstanceData by place in _scene, when
+    // culling on the GPU. It's shared by every frame in flight; each frame's
+    // early phase copies in whatever changed, after the frames before it are
+    // done culling.
+    Buffer  _sceneBuffer;
+
+    // The spinning instances of the built-in test meshes, when
+    // EngineOptions::meshes is empty.
+    std::vector<InstanceID>  _testInstances;
+
+    // Scratch space for _writeDraws, kept around so we don't reallocate every
+    // frame.
+    RenderQueue  _renderQueue;
+
+    // Towards the one directional light, which static-mesh.frag gets through
+    // ShadowData::toLight.
+    glm::vec3  _toLight  { glm::normalize(glm::vec3(1.0f, -0.5f, -1.0f)) };
+
+    std::vector<PerSwapImage>  _perSwaps;
+
+    // _options.framesInFlight of them.
+    std::vector<PerFrame>  _perFrames;
+
+    std::optional<uint32_t>  _graphicsFamily;
+    std::optional<uint32_t>  _presentFamily;
+    VkQueue                  _graphicsQueue;
+    VkQueue                  _presentQueue;
+
+    // A family with TRANSFER but not GRAPHICS, if the device has one. Falls
+    // back to _graphicsFamily otherwise.
+    std::optional<uint32_t>  _transferFamily;
+    VkQueue                  _transferQueue;
+
+    Uploader  _uploader;
+
+    profile::Profiler  _profiler;
+
+    // Masks off the bits of a graphics queue timestamp that mean anything, and
+    // nanoseconds per tick. A zero mask means the queue can't be timed.
+    uint64_t  _timestampMask    { 0 };
+    float     _timestampPeriod  { 0.0f };
+
+    // The device's minStorageBufferOffsetAlignment, which each copy of a
+    // MultiMesh's draw commands starts on.
+    VkDeviceSize  _storageAlignment  { 1 };
+
+    TextureManager  _textures;
+
+    GeometryPool  _geometry;
+
+    jobs::System      _jobs;
+    jobs::FrameGraph  _frameGraph;
+
+    asset::StreamService  _streamer;
+
+    // Libraries opened by _streamMultiMesh; the _streamer reads from them
+    // until it's shut down.
+    std::unordered_map<std::string, asset::LibraryFileHandle>  _streamLibraries;
+
+    // In-flight _streamMultiMesh calls, by ticket.
+    std::unordered_map<uint64_t, MultiMesh *>  _streamTargets;
+
+    // MultiMeshes with a rebaseSerial, waiting on _switchIndirect.
+    std::vector<MultiMesh *>  _rebasing;
+
+    // A finished load that didn't fit in the last frame's STREAM_BUDGET.
+    std::optional<asset::MeshLoad>  _deferredLoad;
+
+    // These are used for issuing commands that are independent of any frame.
+    //
+    // This pool has VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT set,
+    // whereas the frame pools don't.
+    VkCommandPool    _globalCommandPool;
+    VkCommandBuffer  _globalCommandBuffer;
+
+    // _renderPass clears the frame and draws the early CullPhase, leaving depth
+    // readable for _buildDepthPyramid. _lateRenderPass loads what it left and
+    // draws the late phase. They're compatible, so they share pipelines and
+    // framebuffers. Both have two subpasses: the MeshPass::DepthPrepass, then
+    // MeshPass::Forward.
+    VkRenderPass      _renderPass;
+    VkRenderPass      _lateRenderPass;
+    VkPipelineLayout  _pipelineLayout;
+
+    // Draws one shadow cascade into its layer of _shadowMap, leaving it
+    // readable by static-mesh.frag.
+    VkRenderPass  _shadowRenderPass;
+
+    // One layer per cascade, shared by every frame in flight --
+    // _shadowRenderPass orders each frame's use of it after the last's.
+    VkImage        _shadowMap;
+    VmaAllocation  _shadowMapAlloc;
+    VkImageView    _shadowMapView;  // Of every layer, for static-mesh.frag
+
+    std::array<VkImageView, ShadowData::CASCADE_COUNT>    _shadowLayerViews;
+    std::array<VkFramebuffer, ShadowData::CASCADE_COUNT>  _shadowFramebuffers;
+
+    // Comparing, clamped to a white border.
+    VkSampler  _shadowSampler  { VK_NULL_HANDLE };
+
+    // Owns every graphics pipeline, and the cache compute pipelines are built
+    // through too.
+    PipelineRegistry  _pipelines;
+
+    Material  *_staticMaterial;  // For VertexFormat::Full
+    Material  *_packedMaterial;  // For VertexFormat::Packed
+
+    DescriptorAllocator    _descriptorAllocator;
+    DescriptorLayoutCache  _descriptorLayoutCache;
+    VkDescriptorSetLayout  _globalSetLayout;
+    VkDescriptorSetLayout  _meshSetLayout;
+    VkDescriptorSetLayout  _cullSetLayout;
+    VkDescriptorSetLayout  _depthPyramidSetLayout;
+    VkDescriptorSetLayout  _reduceSetLayout;
+    VkDescriptorSetLayout  _shadowSetLayout;
+
+    // For descriptor sets that refer to swap images, so they can all be thrown
+    // away with them when the swapchain is rebuilt.
+    DescriptorAllocator    _swapDescriptorAllocator;
+
+    // Nearest-neighbour, clamped. The depth pyramid is only ever texelFetch'd.
+    VkSampler  _depthSampler  { VK_NULL_HANDLE };
+
+    VkPipelineLayout  _reducePipelineLayout;
+    VkPipeline        _reducePipeline;
+
+    // Set 0 is the per-frame cullSet, set 1 the per-MultiMesh meshSet, and set
+    // 2 the per-swap depthPyramidSet.
+    VkPipelineLayout  _cullPipelineLayout;
+    VkPipeline        _cullInstancesPipeline;
+    VkPipeline        _cullDrawsPipeline;
+    VkPipeline        _cullScatterPipeline;
+
+    VmaAllocator   _allocator;
+    MemoryTracker  _memory;
+  };
+
 }
 
 #endif // gfx.h
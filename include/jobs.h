@@ -0,0 +1,173 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef CRPG_JOBS_H
+#define CRPG_JOBS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace jobs {
+
+  class System;
+
+  // One unit of work, and the jobs waiting on it. Only ever handled through a
+  // Handle; see System::submit.
+  class Job {
+  public:
+    bool done() const { return _done.load(std::memory_order_acquire); }
+
+  private:
+    friend class System;
+
+    std::function<void ()>  _fn;
+
+    // Dependencies that haven't finished yet, plus one held by submit until
+    // it has registered with all of them, so the job can't start early.
+    std::atomic<uint32_t>  _waitingOn  { 1 };
+    std::atomic<bool>      _done       { false };
+
+    // Jobs to release once this one is done. Guarded by _lock, which is also
+    // what makes setting _done and reading the continuations atomic.
+    std::mutex                        _lock;
+    std::vector<std::shared_ptr<Job>> _continuations;
+  };
+
+  using Handle = std::shared_ptr<Job>;
+
+  // A work-stealing job scheduler. Every thread that runs jobs -- the workers,
+  // and the thread that called init -- has a deque of its own: it pushes and
+  // pops at the back, so it works through what it just spawned first while
+  // it's still in cache, and idle threads steal from the front of everybody
+  // else's.
+  //
+  // Jobs may depend on other jobs, and only start once all of them are done.
+  // wait() runs other jobs until the one it's waiting on finishes, so jobs can
+  // wait on jobs they spawned without tying up a thread.
+  class System {
+  public:
+    // Start `workerCount` workers. The calling thread becomes thread 0, and
+    // the workers 1 through workerCount.
+    void init(size_t workerCount);
+
+    // Run whatever is still queued, then stop the workers.
+    void cleanup();
+
+    size_t threadCount() const { return _queues.size(); }
+
+    // The calling thread's number, below threadCount(). Anything else calling
+    // into the System counts as thread 0, so only the thread that called
+    // init and the workers should.
+    static size_t threadIndex();
+
+    // Queue `fn` to run once every job in `after` is done.
+    Handle submit(std::function<void ()> fn, std::initializer_list<Handle> after = { });
+    Handle submit(std::function<void ()> fn, std::vector<Handle> const &after);
+
+    // Run other jobs until `job` is done.
+    void wait(Handle const &job);
+
+    // Call fn(i, thread) for every i below `count`, on as many threads as
+    // there are, and wait for them all. `thread` is the threadIndex() it ran
+    // on, for picking per-thread resources.
+    void parallelFor(size_t count, std::function<void (size_t i, size_t thread)> const &fn);
+
+  private:
+    struct Queue {
+      std::mutex           lock;
+      std::deque<Handle>   jobs;
+    };
+
+    void _push(Handle job);
+
+    // Pop from our own queue, or steal from someone else's. Returns nullptr
+    // if there's nothing anywhere.
+    Handle _take(size_t thread);
+
+    void _run(Handle const &job);
+
+    void _work(size_t thread);
+
+    std::vector<std::unique_ptr<Queue>>  _queues;
+    std::vector<std::thread>             _workers;
+
+    // Jobs sitting in a queue. Workers sleep on _wake while it's zero.
+    std::atomic<size_t>      _queued    { 0 };
+    std::atomic<size_t>      _sleeping  { 0 };
+    std::mutex               _sleepLock;
+    std::condition_variable  _wake;
+    bool                     _shutdown  { false };
+  };
+
+  // A frame's worth of named jobs, built up over the frame by whoever has
+  // work to do, and run all at once by Engine::draw. A node names the nodes
+  // it has to come after, so subsystems can order themselves against each
+  // other without knowing anything else about each other.
+  class FrameGraph {
+  public:
+    // Add a node called `name`, which runs `fn` after every node in `after`.
+    // Every name in `after` has to have been added by the time run() is
+    // called.
+    void add(std::string const                   &name,
+	     std::function<void ()>              fn,
+	     std::initializer_list<std::string>  after = { });
+
+    // Submit every node to `system`, wait for all of them, and start over
+    // with an empty graph.
+    //
+    // Logs and exits if the graph has a cycle, or a node runs after one
+    // that was never added.
+    void run(System &system);
+
+    bool empty() const { return _nodes.empty(); }
+
+  private:
+    struct Node {
+      std::string               name;
+      std::function<void ()>    fn;
+      std::vector<std::string>  after;
+    };
+
+    std::vector<Node>  _nodes;
+  };
+
+};
+
+#endif
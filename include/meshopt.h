@@ -0,0 +1,165 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef CRPG_MESHOPT_H
+#define CRPG_MESHOPT_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+#include "asset.h"
+
+// Offline optimizations for static meshes, run by convert-gltf before a mesh
+// is written. Each pass keeps the mesh's triangles, and only changes what
+// order they and their vertices are stored in.
+//
+// The recommended order is the one optimizeMesh uses:
+//
+//     dedupeVertices       - Merge bit-identical vertices.
+//     optimizeVertexCache  - Reorder triangles for post-transform cache hits.
+//     optimizeOverdraw     - Reorder clusters of triangles to draw outward
+//                            facing ones first, without undoing the above.
+//     optimizeVertexFetch  - Renumber vertices in the order they're first
+//                            used, so vertex fetches walk memory linearly.
+//
+// simplify can then build coarser levels of detail from the result, and
+// buildMeshlets can optionally split each level into meshlets.
+namespace meshopt {
+  // Meshlet limits that suit mesh shaders as well as culling: 64 vertices and
+  // 124 triangles keep a meshlet's outputs within what current hardware
+  // handles well.
+  constexpr size_t MESHLET_MAX_VERTICES   = 64;
+  constexpr size_t MESHLET_MAX_TRIANGLES  = 124;
+
+  // The cache size we optimize for and measure with. Most desktop GPUs have
+  // at least this many post-transform entries, and optimizing for a larger
+  // cache than the hardware has is worse than optimizing for a smaller one.
+  constexpr unsigned CACHE_SIZE = 16;
+
+  // Cost of a mesh's vertex processing, in a simulated FIFO cache:
+  //
+  //     acmr - Average Cache Miss Ratio, vertex shader invocations per
+  //            triangle. 0.5 is the ideal for a regular grid, 3 the worst.
+  //
+  //     atvr - Average Transformed Vertex Ratio, vertex shader invocations
+  //            per vertex. 1 is the ideal.
+  struct CacheStats {
+    float  acmr;
+    float  atvr;
+  };
+
+  CacheStats analyzeVertexCache(uint32_t const  *indices,
+				size_t          indexCount,
+				size_t          vertexCount,
+				unsigned        cacheSize = CACHE_SIZE);
+
+  // Merge vertices which are bit-for-bit identical, and rewrite `indices` to
+  // match. Returns the new vertex count; `verts` is compacted in place.
+  size_t dedupeVertices(asset::StaticVertexData  *verts,
+			size_t                   vertexCount,
+			uint32_t                 *indices,
+			size_t                   indexCount);
+
+  // Tom Forsyth's "Linear-Speed Vertex Cache Optimisation": greedily emit the
+  // triangle whose vertices score highest, favouring vertices that are
+  // recently used and have few triangles left.
+  void optimizeVertexCache(uint32_t  *indices,
+			   size_t    indexCount,
+			   size_t    vertexCount);
+
+  // Split the (already cache-optimized) triangle list into clusters wherever
+  // the cache was effectively flushed anyway, then sort the clusters so the
+  // ones facing away from the mesh's center are drawn first. Outward facing
+  // triangles tend to be in front, so this lets early-Z reject more of what
+  // follows.
+  //
+  // Clusters are split further wherever that costs less than `threshold`
+  // times the cluster's ACMR, so a higher threshold trades cache hits for
+  // finer-grained sorting.
+  void optimizeOverdraw(uint32_t                       *indices,
+			size_t                         indexCount,
+			asset::StaticVertexData const  *verts,
+			size_t                         vertexCount,
+			float                          threshold = 1.05f);
+
+  // Renumber vertices in order of first use, and reorder `verts` to match.
+  // Returns the new vertex count, which is smaller if any were unused.
+  size_t optimizeVertexFetch(asset::StaticVertexData  *verts,
+			     size_t                   vertexCount,
+			     uint32_t                 *indices,
+			     size_t                   indexCount);
+
+  // Garland and Heckbert's quadric error simplification: collapse edges,
+  // cheapest first, until at most `targetIndexCount` indices are left or
+  // nothing more can go. Each collapse moves a vertex onto one of its
+  // neighbours, so the result indexes the same `verts` -- which is what lets
+  // every level of detail share a vertex buffer.
+  //
+  // Vertices on the mesh's borders or its attribute seams (several vertices
+  // sharing one position) never move, so the result has no new cracks.
+  //
+  // Returns the new indices, and stores in `error` how far, in the mesh's own
+  // units, the result strays from the original surface.
+  std::vector<uint32_t> simplify(asset::StaticVertexData const  *verts,
+				 size_t                         vertexCount,
+				 uint32_t const                 *indices,
+				 size_t                         indexCount,
+				 size_t                         targetIndexCount,
+				 float                          *error);
+
+  // Split a mesh into meshlets of at most `maxVertices` vertices and
+  // `maxTriangles` triangles, walking its triangles in order, so it should run
+  // after the passes above. Each meshlet gets its own copy of the vertices it
+  // uses, so vertices on the borders between meshlets are duplicated.
+  //
+  // The meshlets' vertices and meshlet-relative indices are written to
+  // `meshletVerts` and `meshletIndices`, laid out as asset::Meshlet describes.
+  std::vector<asset::Meshlet>
+  buildMeshlets(asset::StaticVertexData const   *verts,
+		size_t                          vertexCount,
+		uint32_t const                  *indices,
+		size_t                          indexCount,
+		size_t                          maxVertices,
+		size_t                          maxTriangles,
+		std::vector<asset::StaticVertexData>  *meshletVerts,
+		std::vector<uint32_t>                 *meshletIndices);
+
+  // Run every pass above except buildMeshlets on `mesh`, whose vertices and
+  // indices start at `verts` and `indices`. Updates mesh->vertexCount.
+  //
+  // If `before` or `after` are non-null, they get the mesh's cache stats.
+  void optimizeMesh(asset::StaticMeshData    *mesh,
+		    asset::StaticVertexData  *verts,
+		    uint32_t                 *indices,
+		    CacheStats               *before = nullptr,
+		    CacheStats               *after  = nullptr);
+}
+
+#endif // meshopt.h
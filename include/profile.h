@@ -0,0 +1,158 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef CRPG_PROFILE_H
+#define CRPG_PROFILE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace profile {
+
+  // Where a zone ran: on some CPU thread, or on one of the GPU's queues.
+  enum class Track : uint32_t {
+    Cpu       = 0,
+    Graphics  = 1,
+    Transfer  = 2,
+  };
+
+  // A span of time, in nanoseconds since its Profiler was made. `name` isn't
+  // copied, so it has to outlive the Profiler; in practice it's always a
+  // string literal.
+  struct Zone {
+    char const  *name;
+    uint64_t    start;
+    uint64_t    end;
+    uint64_t    frame;
+    Track       track;
+    uint32_t    thread;  // threadID() of a Cpu zone, 0 otherwise
+  };
+
+  // Rolling statistics for the zones of one name, in milliseconds.
+  struct Stats {
+    uint32_t  count  { 0 };
+    double    mean   { 0.0 };
+    double    p50    { 0.0 };
+    double    p99    { 0.0 };
+    double    max    { 0.0 };
+  };
+
+  // A small number for the calling thread, for telling CPU zones apart.
+  // Threads are numbered from 0, in the order they first ask.
+  uint32_t threadID();
+
+  /// Profiler - Collects zones from any thread into a ring of the last
+  ///            RING_SIZE, and keeps the last HISTORY durations of each zone
+  ///            name for rolling percentiles. The ring can be written out as
+  ///            Chrome trace JSON, which chrome://tracing and Perfetto load.
+  ///
+  /// Recording takes a lock, so zones should be coarse: passes and frame
+  /// phases, not individual draws.
+
+  class Profiler {
+  public:
+    static constexpr size_t  RING_SIZE  { 65536 };
+    static constexpr size_t  HISTORY    { 256 };
+
+    Profiler();
+
+    // Nanoseconds since the Profiler was made, on the clock CPU zones are
+    // measured with.
+    uint64_t now() const;
+
+    // The frame that zones recorded from now on belong to.
+    void setFrame(uint64_t frame);
+    uint64_t frame() const;
+
+    void record(Zone const &zone);
+
+    // Stats over the last HISTORY zones called `name`; all zeros if there
+    // haven't been any.
+    Stats stats(std::string const &name) const;
+
+    // stats() for every name seen so far, sorted by name.
+    std::vector<std::pair<std::string, Stats>> allStats() const;
+
+    // Write every zone still in the ring to `path` as Chrome trace JSON.
+    // Returns false if the file can't be written.
+    bool writeChromeTrace(std::string const &path) const;
+
+  private:
+    struct History {
+      std::array<double, HISTORY>  ms      { };
+      size_t                       next    { 0 };
+      size_t                       count   { 0 };
+    };
+
+    static Stats _stats(History const &history);
+
+    std::chrono::steady_clock::time_point  _epoch;
+
+    mutable std::mutex  _lock;
+
+    std::vector<Zone>  _ring;
+    size_t             _next     { 0 };
+    bool               _wrapped  { false };
+
+    std::unordered_map<std::string, History>  _history;
+
+    uint64_t  _frame  { 0 };
+  };
+
+  // Records its own lifetime as a Cpu zone on the calling thread. Does
+  // nothing if `profiler` is null.
+  class ScopedZone {
+  public:
+    ScopedZone(Profiler *profiler, char const *name)
+      : _profiler(profiler), _name(name), _start(profiler ? profiler->now() : 0) {}
+
+    ~ScopedZone() { end(); }
+
+    // Record the zone now, rather than when it goes out of scope.
+    void end();
+
+    ScopedZone(ScopedZone const &) = delete;
+    ScopedZone &operator =(ScopedZone const &) = delete;
+
+  private:
+    Profiler    *_profiler;
+    char const  *_name;
+    uint64_t    _start;
+  };
+
+}
+
+#endif // profile.h
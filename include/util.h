@@ -30,32 +30,213 @@
 #define CRPG_UTIL_H
 
 #include <cstdlib>
+#include <cstddef>
+#include <cstdint>
 
+#include <atomic>
+#include <memory>
 #include <string>
+#include <type_traits>
+#include <vector>
 
-#define __CRPG_32_BIT_PRIME 4294967291
+// An asset's ID is the 64-bit FNV-1a hash of its name, folded down to 32
+// bits. Names are things like "asset:mesh:monkey"; nothing checks that two
+// names don't hash alike except LibraryFileHandleBuffer, which refuses to
+// hold both.
+static inline constexpr uint32_t ID(char const *s, size_t n) noexcept {
+  uint64_t hash = 0xCBF29CE484222325ull;
 
-template <size_t N> 
+  for (size_t i = 0; i < n; i++) {
+    hash ^= (uint8_t)s[i];
+    hash *= 0x100000001B3ull;
+  }
+
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+template <size_t N>
 static inline constexpr uint32_t ID(char const (&s)[N]) noexcept {
-  uint64_t val = 0;
+  return ID(s, N - 1);
+}
+
+static inline uint32_t ID(std::string const &s) {
+  return ID(s.data(), s.size());
+}
+
+// The ID of the string literal `s`, worked out at compile time whatever the
+// optimization level -- a template argument has to be a constant expression.
+// Use it wherever a name is known up front.
+#define CONST_ID(s) (std::integral_constant<uint32_t, ::ID(s)>::value)
+
+// A non-owning view of `size` contiguous T's. Empty (data == nullptr) when
+// whatever produced it had nothing to point at.
+template <typename T>
+struct Span {
+  T       *data  { nullptr };
+  size_t  size   { 0 };
+
+  T *begin() const { return data; }
+  T *end()   const { return data + size; }
+
+  T &operator [](size_t i) const { return data[i]; }
+
+  size_t bytes() const { return size * sizeof(T); }
+
+  bool empty() const { return size == 0; }
+};
 
-  for (size_t i = 0; i < N - 1; i++) {
-    val  = (val << 8) + (uint32_t)s[i];
-    val %= __CRPG_32_BIT_PRIME;
+// A flat, open-addressed map from 32-bit IDs to 32-bit indices, meant to be
+// built once when an asset file is loaded and then only read. Lookups probe
+// linearly from a multiplicative hash of the ID, and never allocate.
+class IDIndex {
+public:
+  static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+  // Forget every entry, and size the table for `count` of them.
+  void reset(size_t count) {
+    size_t capacity = 16;
+    while (capacity < 2 * count) capacity *= 2;
+
+    _slots.assign(capacity, Slot {});
+    _count = 0;
   }
 
-  return (uint32_t)(val & 0xFFFFFFFF);
-}
+  // Map `id` to `index`, replacing any previous mapping for `id`.
+  void insert(uint32_t id, uint32_t index) {
+    if (2 * (_count + 1) > _slots.size()) _grow();
+
+    Slot &slot = _slots[_probe(id)];
 
-static inline  uint32_t ID(std::string const &s) {
-  uint64_t val = 0;
+    if (slot.index == NOT_FOUND) _count++;
 
-  for (auto c : s) {
-    val  = (val << 8) + (uint32_t)c;
-    val %= __CRPG_32_BIT_PRIME;
+    slot.id    = id;
+    slot.index = index;
   }
 
-  return (uint32_t)(val & 0xFFFFFFFF);
-}
+  // Returns the index mapped to `id`, or NOT_FOUND.
+  uint32_t find(uint32_t id) const {
+    if (_slots.empty()) return NOT_FOUND;
+
+    return _slots[_probe(id)].index;
+  }
+
+  size_t size() const { return _count; }
+
+private:
+  struct Slot {
+    uint32_t  id     { 0 };
+    uint32_t  index  { NOT_FOUND };
+  };
+
+  // The slot holding `id`, or the empty slot where it belongs.
+  size_t _probe(uint32_t id) const {
+    size_t mask = _slots.size() - 1;
+    size_t i    = ((uint64_t)id * 0x9E3779B97F4A7C15ull >> 32) & mask;
+
+    while (_slots[i].index != NOT_FOUND && _slots[i].id != id) {
+      i = (i + 1) & mask;
+    }
+
+    return i;
+  }
+
+  void _grow() {
+    std::vector<Slot> old = std::move(_slots);
+
+    reset(old.size() ? old.size() : 8);
+
+    for (auto const &slot : old) {
+      if (slot.index != NOT_FOUND) insert(slot.id, slot.index);
+    }
+  }
+
+  std::vector<Slot>  _slots;
+  size_t             _count { 0 };
+};
+
+// A bounded, lock-free, multi-producer multi-consumer queue (after Dmitry
+// Vyukov's design). Each cell carries a sequence number telling producers and
+// consumers whose turn it is, so the only contended operations are a CAS on
+// the head or tail.
+template <typename T>
+class BoundedQueue {
+public:
+  // `capacity` is rounded up to a power of two.
+  explicit BoundedQueue(size_t capacity) {
+    size_t  size  = 2;
+    while (size < capacity) size *= 2;
+
+    _cells = std::make_unique<Cell[]>(size);
+    _mask  = size - 1;
+
+    for (size_t i = 0; i < size; i++) {
+      _cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false, leaving `value` alone, if the queue is full.
+  bool push(T &&value) {
+    Cell    *cell;
+    size_t  pos  = _tail.load(std::memory_order_relaxed);
+
+    for (;;) {
+      cell = &_cells[pos & _mask];
+
+      intptr_t diff = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)pos;
+
+      if (diff == 0) {
+	if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+	return false;
+      } else {
+	pos = _tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->value = std::move(value);
+    cell->seq.store(pos + 1, std::memory_order_release);
+
+    return true;
+  }
+
+  // Returns false if the queue is empty.
+  bool pop(T *value) {
+    Cell    *cell;
+    size_t  pos  = _head.load(std::memory_order_relaxed);
+
+    for (;;) {
+      cell = &_cells[pos & _mask];
+
+      intptr_t diff = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+
+      if (diff == 0) {
+	if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+	return false;
+      } else {
+	pos = _head.load(std::memory_order_relaxed);
+      }
+    }
+
+    *value = std::move(cell->value);
+    cell->seq.store(pos + _mask + 1, std::memory_order_release);
+
+    return true;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t>  seq;
+    T                    value;
+  };
+
+  std::unique_ptr<Cell[]>  _cells;
+  size_t                   _mask;
+
+  // Kept on separate cache lines, so producers and consumers don't fight over
+  // one line.
+  alignas(64) std::atomic<size_t>  _head { 0 };
+  alignas(64) std::atomic<size_t>  _tail { 0 };
+};
 
 #endif // util.h
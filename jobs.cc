@@ -0,0 +1,294 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "jobs.h"
+
+#include <iostream>
+
+// Which of its System's threads this is. Everything that isn't a worker is
+// thread 0.
+static thread_local size_t tThreadIndex = 0;
+
+size_t jobs::System::threadIndex() {
+  return tThreadIndex;
+}
+
+void jobs::System::init(size_t workerCount) {
+  _shutdown = false;
+
+  for (size_t i = 0; i <= workerCount; i++) {
+    _queues.push_back(std::make_unique<Queue>());
+  }
+
+  tThreadIndex = 0;
+
+  for (size_t i = 1; i <= workerCount; i++) {
+    _workers.emplace_back(&System::_work, this, i);
+  }
+}
+
+// Jobs may still be spawning jobs while we drain, so the workers keep going
+// until the queues are empty, and only then look at _shutdown.
+void jobs::System::cleanup() {
+  while (Handle job = _take(0)) _run(job);
+
+  {
+    std::lock_guard<std::mutex> guard(_sleepLock);
+    _shutdown = true;
+  }
+
+  _wake.notify_all();
+
+  for (auto &worker : _workers) worker.join();
+
+  _workers.clear();
+  _queues.clear();
+}
+
+jobs::Handle jobs::System::submit(std::function<void ()> fn, std::initializer_list<Handle> after) {
+  return submit(std::move(fn), std::vector<Handle>(after));
+}
+
+jobs::Handle jobs::System::submit(std::function<void ()> fn, std::vector<Handle> const &after) {
+  Handle job = std::make_shared<Job>();
+
+  job->_fn = std::move(fn);
+
+  for (auto const &dep : after) {
+    if (!dep) continue;
+
+    std::lock_guard<std::mutex> guard(dep->_lock);
+
+    if (dep->_done.load(std::memory_order_relaxed)) continue;
+
+    job->_waitingOn.fetch_add(1);
+    dep->_continuations.push_back(job);
+  }
+
+  // Drop the reference we started with. If every dependency was already done,
+  // or finished while we were registering, that was the last one.
+  if (job->_waitingOn.fetch_sub(1) == 1) _push(job);
+
+  return job;
+}
+
+void jobs::System::wait(Handle const &job) {
+  size_t thread = threadIndex();
+
+  while (!job->done()) {
+    if (Handle next = _take(thread)) {
+      _run(next);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+// One job per thread, each pulling indices off a shared counter, so uneven
+// items even themselves out and we don't pay for a job per item.
+void jobs::System::parallelFor(size_t count, std::function<void (size_t i, size_t thread)> const &fn) {
+  if (count == 0) return;
+
+  std::atomic<size_t> next { 0 };
+
+  auto body = [&]() {
+    size_t thread = threadIndex();
+
+    for (size_t i = next++; i < count; i = next++) fn(i, thread);
+  };
+
+  std::vector<Handle> spawned;
+
+  for (size_t j = 1; j < std::min(count, threadCount()); j++) {
+    spawned.push_back(submit(body));
+  }
+
+  body();
+
+  for (auto const &job : spawned) wait(job);
+}
+
+void jobs::System::_push(Handle job) {
+  Queue &queue = *_queues[threadIndex()];
+
+  {
+    std::lock_guard<std::mutex> guard(queue.lock);
+    queue.jobs.push_back(std::move(job));
+  }
+
+  _queued.fetch_add(1);
+
+  // A worker that's about to sleep bumps _sleeping before it checks _queued,
+  // so one of us always sees the other.
+  if (_sleeping.load() > 0) {
+    std::lock_guard<std::mutex> guard(_sleepLock);
+    _wake.notify_one();
+  }
+}
+
+jobs::Handle jobs::System::_take(size_t thread) {
+  if (_queued.load() == 0) return nullptr;
+
+  size_t count = _queues.size();
+
+  for (size_t i = 0; i < count; i++) {
+    Queue &queue = *_queues[(thread + i) % count];
+
+    std::lock_guard<std::mutex> guard(queue.lock);
+
+    if (queue.jobs.empty()) continue;
+
+    Handle job;
+
+    // Newest first from our own queue, oldest first from anybody else's.
+    if (i == 0) {
+      job = std::move(queue.jobs.back());
+      queue.jobs.pop_back();
+    } else {
+      job = std::move(queue.jobs.front());
+      queue.jobs.pop_front();
+    }
+
+    _queued.fetch_sub(1);
+
+    return job;
+  }
+
+  return nullptr;
+}
+
+void jobs::System::_run(Handle const &job) {
+  job->_fn();
+
+  // Let go of whatever the job captured as soon as we can.
+  job->_fn = nullptr;
+
+  std::vector<Handle> continuations;
+
+  {
+    std::lock_guard<std::mutex> guard(job->_lock);
+
+    job->_done.store(true, std::memory_order_release);
+    continuations.swap(job->_continuations);
+  }
+
+  for (auto &next : continuations) {
+    if (next->_waitingOn.fetch_sub(1) == 1) _push(std::move(next));
+  }
+}
+
+void jobs::System::_work(size_t thread) {
+  tThreadIndex = thread;
+
+  for (;;) {
+    if (Handle job = _take(thread)) {
+      _run(job);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(_sleepLock);
+
+    _sleeping.fetch_add(1);
+    _wake.wait(lock, [&]() { return _queued.load() > 0 || _shutdown; });
+    _sleeping.fetch_sub(1);
+
+    if (_shutdown && _queued.load() == 0) return;
+  }
+}
+
+void jobs::FrameGraph::add(std::string const                   &name,
+			   std::function<void ()>              fn,
+			   std::initializer_list<std::string>  after)
+{
+  _nodes.push_back({ name, std::move(fn), after });
+}
+
+// Nodes are submitted in dependency order, since a job can only depend on
+// jobs that have already been submitted. If a pass over the graph can't submit
+// anything new, whatever is left is part of a cycle.
+void jobs::FrameGraph::run(System &system) {
+  std::unordered_map<std::string, size_t> byName;
+
+  for (size_t i = 0; i < _nodes.size(); i++) byName[_nodes[i].name] = i;
+
+  // A misspelled name would quietly drop the ordering it was there for.
+  for (auto const &node : _nodes) {
+    for (auto const &name : node.after) {
+      if (byName.count(name)) continue;
+
+      std::cerr << "Frame graph node " << node.name << " runs after unknown node "
+		<< name << std::endl;
+      std::exit(-1);
+    }
+  }
+
+  std::vector<Handle> handles(_nodes.size());
+  size_t              submitted = 0;
+
+  while (submitted < _nodes.size()) {
+    size_t before = submitted;
+
+    for (size_t i = 0; i < _nodes.size(); i++) {
+      if (handles[i]) continue;
+
+      std::vector<Handle> deps;
+      bool                ready = true;
+
+      for (auto const &name : _nodes[i].after) {
+	auto found = byName.find(name);
+
+	if (!handles[found->second]) {
+	  ready = false;
+	  break;
+	}
+
+	deps.push_back(handles[found->second]);
+      }
+
+      if (!ready) continue;
+
+      handles[i] = system.submit(std::move(_nodes[i].fn), deps);
+      submitted++;
+    }
+
+    if (submitted == before) {
+      std::cerr << "Frame graph has a cycle through:";
+
+      for (size_t i = 0; i < _nodes.size(); i++) {
+	if (!handles[i]) std::cerr << " " << _nodes[i].name;
+      }
+
+      std::cerr << std::endl;
+      std::exit(-1);
+    }
+  }
+
+  for (auto const &handle : handles) system.wait(handle);
+
+  _nodes.clear();
+}
@@ -0,0 +1,820 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "meshopt.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+meshopt::CacheStats
+meshopt::analyzeVertexCache(uint32_t const  *indices,
+			    size_t          indexCount,
+			    size_t          vertexCount,
+			    unsigned        cacheSize)
+{
+  // A vertex is in the FIFO iff fewer than `cacheSize` misses have happened
+  // since it was added, so we only need to remember when that was.
+  std::vector<size_t> addedAt(vertexCount, std::numeric_limits<size_t>::max());
+
+  size_t misses = 0;
+  size_t used   = 0;
+
+  for (size_t i = 0; i < indexCount; i++) {
+    uint32_t v = indices[i];
+
+    if (addedAt[v] == std::numeric_limits<size_t>::max()) used++;
+
+    if (addedAt[v] == std::numeric_limits<size_t>::max() || misses - addedAt[v] >= cacheSize) {
+      addedAt[v] = misses++;
+    }
+  }
+
+  size_t triangles = indexCount / 3;
+
+  return {
+    .acmr = triangles ? (float)misses / triangles : 0.0f,
+    .atvr = used ? (float)misses / used : 0.0f,
+  };
+}
+
+size_t meshopt::dedupeVertices(asset::StaticVertexData  *verts,
+			       size_t                   vertexCount,
+			       uint32_t                 *indices,
+			       size_t                   indexCount)
+{
+  // Keys are indices into `verts`, hashed and compared by the bytes of the
+  // vertex they refer to.
+  auto hash = [verts](uint32_t i) {
+    auto     bytes = (uint8_t const *)&verts[i];
+    uint64_t h     = 14695981039346656037ull;
+
+    for (size_t k = 0; k < sizeof(asset::StaticVertexData); k++) {
+      h = (h ^ bytes[k]) * 1099511628211ull;
+    }
+
+    return (size_t)h;
+  };
+
+  auto equal = [verts](uint32_t a, uint32_t b) {
+    return !memcmp(&verts[a], &verts[b], sizeof(asset::StaticVertexData));
+  };
+
+  std::unordered_map<uint32_t, uint32_t, decltype(hash), decltype(equal)>
+    unique(vertexCount, hash, equal);
+
+  std::vector<uint32_t> remap(vertexCount);
+
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < (uint32_t)vertexCount; i++) {
+    auto found = unique.find(i);
+
+    if (found != unique.end()) {
+      remap[i] = found->second;
+      continue;
+    }
+
+    // Compacting in place is safe, since `count` never passes `i`, and the
+    // map only holds indices below `count`.
+    verts[count] = verts[i];
+    unique.emplace(count, count);
+
+    remap[i] = count++;
+  }
+
+  for (size_t i = 0; i < indexCount; i++) {
+    indices[i] = remap[indices[i]];
+  }
+
+  return count;
+}
+
+// Tuning constants from Forsyth's article. The scoring cache is larger than
+// CACHE_SIZE on purpose; the scores just need to fall off smoothly.
+static const int    FORSYTH_CACHE_SIZE    = 32;
+static const float  CACHE_DECAY_POWER     = 1.5f;
+static const float  LAST_TRI_SCORE        = 0.75f;
+static const float  VALENCE_BOOST_SCALE   = 2.0f;
+static const float  VALENCE_BOOST_POWER   = 0.5f;
+
+static float forsythScore(int cachePos, uint32_t remaining) {
+  // Vertices with nothing left to draw should never pull in a triangle.
+  if (remaining == 0) return -1.0f;
+
+  float score = 0.0f;
+
+  if (cachePos >= 0) {
+    // The last triangle's vertices get a fixed score, so the next triangle
+    // doesn't just reuse the edge we came in on.
+    if (cachePos < 3) {
+      score = LAST_TRI_SCORE;
+    } else {
+      float scale = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+
+      score = std::pow(1.0f - (cachePos - 3) * scale, CACHE_DECAY_POWER);
+    }
+  }
+
+  // Favour vertices with few triangles left, so we don't leave lone
+  // triangles behind that will need a cold cache later.
+  score += VALENCE_BOOST_SCALE * std::pow((float)remaining, -VALENCE_BOOST_POWER);
+
+  return score;
+}
+
+void meshopt::optimizeVertexCache(uint32_t  *indices,
+				  size_t    indexCount,
+				  size_t    vertexCount)
+{
+  size_t triCount = indexCount / 3;
+
+  if (triCount == 0) return;
+
+  // Each vertex's not-yet-emitted triangles live in adjacency[offsets[v]],
+  // with remaining[v] of them left.
+  std::vector<uint32_t> remaining(vertexCount, 0);
+  std::vector<uint32_t> offsets(vertexCount + 1, 0);
+
+  for (size_t i = 0; i < indexCount; i++) remaining[indices[i]]++;
+
+  for (size_t v = 0; v < vertexCount; v++) offsets[v + 1] = offsets[v] + remaining[v];
+
+  std::vector<uint32_t> adjacency(indexCount);
+  std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+
+  for (size_t i = 0; i < indexCount; i++) {
+    adjacency[fill[indices[i]]++] = (uint32_t)(i / 3);
+  }
+
+  std::vector<int>    cachePos(vertexCount, -1);
+  std::vector<float>  vertScore(vertexCount);
+  std::vector<float>  triScore(triCount, 0.0f);
+  std::vector<bool>   emitted(triCount, false);
+
+  for (size_t v = 0; v < vertexCount; v++) {
+    vertScore[v] = forsythScore(-1, remaining[v]);
+  }
+
+  for (size_t i = 0; i < indexCount; i++) {
+    triScore[i / 3] += vertScore[indices[i]];
+  }
+
+  std::vector<uint32_t> input(indices, indices + indexCount);
+
+  std::vector<uint32_t> cache;
+  std::vector<uint32_t> nextCache;
+
+  cache.reserve(FORSYTH_CACHE_SIZE + 3);
+  nextCache.reserve(FORSYTH_CACHE_SIZE + 3);
+
+  int64_t  best   = std::max_element(triScore.begin(), triScore.end()) - triScore.begin();
+  size_t   cursor = 0;
+
+  for (size_t out = 0; out < triCount; out++) {
+    // Nothing in the cache has triangles left, so start somewhere new. Any
+    // triangle will do; they all score about the same from a cold cache.
+    if (best < 0) {
+      while (emitted[cursor]) cursor++;
+
+      best = (int64_t)cursor;
+    }
+
+    uint32_t const *tri = &input[best * 3];
+
+    indices[out * 3 + 0] = tri[0];
+    indices[out * 3 + 1] = tri[1];
+    indices[out * 3 + 2] = tri[2];
+
+    emitted[best] = true;
+
+    for (int k = 0; k < 3; k++) {
+      uint32_t v     = tri[k];
+      uint32_t *adj  = &adjacency[offsets[v]];
+
+      for (uint32_t a = 0; a < remaining[v]; a++) {
+	if (adj[a] == (uint32_t)best) {
+	  adj[a] = adj[remaining[v] - 1];
+	  break;
+	}
+      }
+
+      remaining[v]--;
+    }
+
+    // The emitted triangle's vertices move to the front of the LRU cache.
+    nextCache.clear();
+    nextCache.insert(nextCache.end(), tri, tri + 3);
+
+    for (uint32_t v : cache) {
+      if (v != tri[0] && v != tri[1] && v != tri[2]) nextCache.push_back(v);
+    }
+
+    // Rescore everything whose cache position changed, including whatever
+    // just fell out of the cache.
+    for (size_t i = 0; i < nextCache.size(); i++) {
+      uint32_t v    = nextCache[i];
+      int      pos   = i < (size_t)FORSYTH_CACHE_SIZE ? (int)i : -1;
+      float    score = forsythScore(pos, remaining[v]);
+      float    delta = score - vertScore[v];
+
+      cachePos[v]  = pos;
+      vertScore[v] = score;
+
+      for (uint32_t a = 0; a < remaining[v]; a++) {
+	triScore[adjacency[offsets[v] + a]] += delta;
+      }
+    }
+
+    if (nextCache.size() > (size_t)FORSYTH_CACHE_SIZE) nextCache.resize(FORSYTH_CACHE_SIZE);
+
+    std::swap(cache, nextCache);
+
+    // Only triangles touching the cache can have improved, so the next one
+    // comes from there if it can.
+    best = -1;
+
+    float bestScore = -std::numeric_limits<float>::infinity();
+
+    for (uint32_t v : cache) {
+      for (uint32_t a = 0; a < remaining[v]; a++) {
+	uint32_t t = adjacency[offsets[v] + a];
+
+	if (triScore[t] > bestScore) {
+	  bestScore = triScore[t];
+	  best      = t;
+	}
+      }
+    }
+  }
+}
+
+void meshopt::optimizeOverdraw(uint32_t                       *indices,
+			       size_t                         indexCount,
+			       asset::StaticVertexData const  *verts,
+			       size_t                         vertexCount,
+			       float                          threshold)
+{
+  size_t triCount = indexCount / 3;
+
+  if (triCount == 0) return;
+
+  // Simulate the cache over the triangle list, recording each triangle's
+  // misses the same way analyzeVertexCache counts them.
+  std::vector<uint8_t> misses(triCount, 0);
+
+  {
+    std::vector<size_t> addedAt(vertexCount, std::numeric_limits<size_t>::max());
+
+    size_t total = 0;
+
+    for (size_t i = 0; i < indexCount; i++) {
+      uint32_t v = indices[i];
+
+      if (addedAt[v] == std::numeric_limits<size_t>::max() || total - addedAt[v] >= CACHE_SIZE) {
+	addedAt[v] = total++;
+	misses[i / 3]++;
+      }
+    }
+  }
+
+  // A triangle that misses on all three vertices starts from an effectively
+  // cold cache, so nothing is lost by moving it. These are the hard cluster
+  // boundaries.
+  std::vector<size_t> hard;
+
+  for (size_t t = 0; t < triCount; t++) {
+    if (t == 0 || misses[t] == 3) hard.push_back(t);
+  }
+
+  hard.push_back(triCount);
+
+  // Soft boundaries split a hard cluster wherever the run of triangles since
+  // the last split does no worse than `threshold` times the whole cluster,
+  // even starting from a cold cache. Otherwise moving the run elsewhere could
+  // cost more cache misses than it saves in overdraw.
+  std::vector<size_t> starts;
+  std::vector<size_t> addedAt(vertexCount, 0);
+
+  // Advancing the clock by CACHE_SIZE ages every entry out of the cache.
+  size_t clock = CACHE_SIZE;
+
+  for (size_t c = 0; c + 1 < hard.size(); c++) {
+    size_t begin = hard[c];
+    size_t end   = hard[c + 1];
+
+    size_t clusterMisses = 0;
+
+    for (size_t t = begin; t < end; t++) clusterMisses += misses[t];
+
+    float limit = (float)clusterMisses / (end - begin) * threshold;
+
+    size_t runMisses = 0;
+    size_t runStart  = begin;
+
+    starts.push_back(begin);
+
+    clock += CACHE_SIZE;
+
+    for (size_t t = begin; t < end; t++) {
+      for (size_t i = t * 3; i < t * 3 + 3; i++) {
+	uint32_t v = indices[i];
+
+	if (clock - addedAt[v] >= CACHE_SIZE) {
+	  addedAt[v] = clock++;
+	  runMisses++;
+	}
+      }
+
+      size_t runLength = t + 1 - runStart;
+
+      if (t + 1 < end && (float)runMisses / runLength <= limit) {
+	starts.push_back(t + 1);
+
+	runStart  = t + 1;
+	runMisses = 0;
+	clock    += CACHE_SIZE;
+      }
+    }
+  }
+
+  if (starts.size() < 2) return;
+
+  starts.push_back(triCount);
+
+  // Area-weighted centroids and normals, for the mesh and each cluster. The
+  // cross product's length is twice the triangle's area, which is all the
+  // weighting we need.
+  struct Cluster {
+    size_t     begin;
+    size_t     end;
+    glm::vec3  centroid;
+    glm::vec3  normal;
+    float      sortKey;
+  };
+
+  std::vector<Cluster> clusters(starts.size() - 1);
+
+  glm::vec3  meshCentroid(0.0f);
+  float      meshArea = 0.0f;
+
+  for (size_t c = 0; c < clusters.size(); c++) {
+    auto &cluster = clusters[c];
+
+    cluster.begin    = starts[c];
+    cluster.end      = starts[c + 1];
+    cluster.centroid = glm::vec3(0.0f);
+    cluster.normal   = glm::vec3(0.0f);
+
+    float area = 0.0f;
+
+    for (size_t t = cluster.begin; t < cluster.end; t++) {
+      glm::vec3 p0 = verts[indices[t * 3 + 0]].position;
+      glm::vec3 p1 = verts[indices[t * 3 + 1]].position;
+      glm::vec3 p2 = verts[indices[t * 3 + 2]].position;
+
+      glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+      float     w = glm::length(n);
+
+      cluster.centroid += (p0 + p1 + p2) * (w / 3.0f);
+      cluster.normal   += n;
+      area             += w;
+    }
+
+    meshCentroid += cluster.centroid;
+    meshArea     += area;
+
+    if (area > 0.0f) cluster.centroid /= area;
+  }
+
+  if (meshArea > 0.0f) meshCentroid /= meshArea;
+
+  for (auto &cluster : clusters) {
+    float length = glm::length(cluster.normal);
+
+    cluster.sortKey = length > 0.0f
+      ? glm::dot(cluster.centroid - meshCentroid, cluster.normal / length)
+      : 0.0f;
+  }
+
+  std::stable_sort(clusters.begin(), clusters.end(),
+		   [](auto const &a, auto const &b) { return a.sortKey > b.sortKey; });
+
+  std::vector<uint32_t> input(indices, indices + indexCount);
+
+  size_t out = 0;
+
+  for (auto const &cluster : clusters) {
+    for (size_t i = cluster.begin * 3; i < cluster.end * 3; i++) {
+      indices[out++] = input[i];
+    }
+  }
+}
+
+size_t meshopt::optimizeVertexFetch(asset::StaticVertexData  *verts,
+				    size_t                   vertexCount,
+				    uint32_t                 *indices,
+				    size_t                   indexCount)
+{
+  const uint32_t UNUSED = std::numeric_limits<uint32_t>::max();
+
+  std::vector<uint32_t> remap(vertexCount, UNUSED);
+
+  uint32_t count = 0;
+
+  for (size_t i = 0; i < indexCount; i++) {
+    uint32_t v = indices[i];
+
+    if (remap[v] == UNUSED) remap[v] = count++;
+
+    indices[i] = remap[v];
+  }
+
+  std::vector<asset::StaticVertexData> input(verts, verts + vertexCount);
+
+  for (size_t v = 0; v < vertexCount; v++) {
+    if (remap[v] != UNUSED) verts[remap[v]] = input[v];
+  }
+
+  return count;
+}
+
+// The sum of squared distances to a set of planes, each weighted by the area
+// of the triangle it came from. Symmetric, so only the upper triangle of the
+// 4x4 matrix is kept.
+struct Quadric {
+  double  a2, ab, ac, ad;
+  double      b2, bc, bd;
+  double          c2, cd;
+  double              d2;
+  double  area;
+
+  static Quadric fromTriangle(glm::vec3 const &p0, glm::vec3 const &p1, glm::vec3 const &p2) {
+    glm::vec3  cross  = glm::cross(p1 - p0, p2 - p0);
+    float      length = glm::length(cross);
+
+    if (length == 0.0f) return {};
+
+    glm::vec3  n = cross / length;
+    double     d = -glm::dot(n, p0);
+    double     w = length * 0.5;
+
+    return {
+      .a2 = w*n.x*n.x, .ab = w*n.x*n.y, .ac = w*n.x*n.z, .ad = w*n.x*d,
+      .b2 = w*n.y*n.y, .bc = w*n.y*n.z, .bd = w*n.y*d,
+      .c2 = w*n.z*n.z, .cd = w*n.z*d,
+      .d2 = w*d*d,
+      .area = w,
+    };
+  }
+
+  Quadric &operator +=(Quadric const &q) {
+    a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+    b2 += q.b2; bc += q.bc; bd += q.bd;
+    c2 += q.c2; cd += q.cd;
+    d2 += q.d2;
+    area += q.area;
+    return *this;
+  }
+
+  // The area-weighted mean squared distance from `p` to our planes.
+  double meanError(glm::vec3 const &p) const {
+    if (area == 0.0) return 0.0;
+
+    double x = p.x, y = p.y, z = p.z;
+
+    double e = a2*x*x + 2*ab*x*y + 2*ac*x*z + 2*ad*x
+             + b2*y*y + 2*bc*y*z + 2*bd*y
+             + c2*z*z + 2*cd*z
+             + d2;
+
+    return std::max(e, 0.0) / area;
+  }
+};
+
+std::vector<uint32_t>
+meshopt::simplify(asset::StaticVertexData const  *verts,
+		  size_t                         vertexCount,
+		  uint32_t const                 *indices,
+		  size_t                         indexCount,
+		  size_t                         targetIndexCount,
+		  float                          *error)
+{
+  std::vector<uint32_t> result(indices, indices + indexCount);
+
+  // Collapses are decided per position, so that vertices on either side of a
+  // seam agree. rep[v] is the first vertex with v's position.
+  auto hashPosition = [](glm::vec3 const &p) {
+    uint32_t bits[3];
+    memcpy(bits, &p, sizeof bits);
+    return (size_t)(bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u);
+  };
+
+  std::unordered_map<glm::vec3, uint32_t, decltype(hashPosition)>
+    positions(vertexCount, hashPosition);
+
+  std::vector<uint32_t>  rep(vertexCount);
+  std::vector<bool>      locked(vertexCount, false);
+
+  for (uint32_t v = 0; v < (uint32_t)vertexCount; v++) {
+    auto found = positions.emplace(verts[v].position, v);
+
+    rep[v] = found.first->second;
+
+    // A second vertex at the same position, so both sit on a seam.
+    if (!found.second) locked[v] = locked[rep[v]] = true;
+  }
+
+  for (uint32_t v = 0; v < (uint32_t)vertexCount; v++) {
+    if (locked[rep[v]]) locked[v] = true;
+  }
+
+  // An edge only one triangle uses is on a border.
+  std::unordered_map<uint64_t, uint32_t> edgeUses;
+
+  auto edgeKey = [&](uint32_t a, uint32_t b) {
+    a = rep[a];
+    b = rep[b];
+    return a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+  };
+
+  for (size_t t = 0; t + 2 < indexCount; t += 3) {
+    for (size_t k = 0; k < 3; k++) {
+      edgeUses[edgeKey(indices[t + k], indices[t + (k + 1) % 3])]++;
+    }
+  }
+
+  for (size_t t = 0; t + 2 < indexCount; t += 3) {
+    for (size_t k = 0; k < 3; k++) {
+      uint32_t a = indices[t + k], b = indices[t + (k + 1) % 3];
+
+      if (edgeUses[edgeKey(a, b)] == 1) locked[a] = locked[b] = true;
+    }
+  }
+
+  // Quadrics are kept per position, and always measure against the original
+  // surface.
+  std::vector<Quadric> quadrics(vertexCount, Quadric {});
+
+  for (size_t t = 0; t + 2 < indexCount; t += 3) {
+    auto q = Quadric::fromTriangle(verts[indices[t]].position,
+				   verts[indices[t + 1]].position,
+				   verts[indices[t + 2]].position);
+
+    for (size_t k = 0; k < 3; k++) quadrics[rep[indices[t + k]]] += q;
+  }
+
+  struct Collapse {
+    uint32_t  from;
+    uint32_t  to;
+    double    cost;
+  };
+
+  std::vector<Collapse>  collapses;
+  std::vector<uint32_t>  firstTriangle, triangles;
+  std::vector<uint32_t>  remap(vertexCount);
+  std::vector<bool>      touched(vertexCount);
+
+  double worst = 0.0;
+
+  // Each pass collapses the cheapest edges whose neighbourhoods don't overlap,
+  // then rebuilds the triangle list.
+  while (result.size() > targetIndexCount) {
+    size_t triangleCount = result.size() / 3;
+
+    // Which triangles use each vertex, as offsets into `triangles`.
+    firstTriangle.assign(vertexCount + 1, 0);
+
+    for (uint32_t v : result) firstTriangle[v + 1]++;
+    for (size_t v = 0; v < vertexCount; v++) firstTriangle[v + 1] += firstTriangle[v];
+
+    triangles.resize(result.size());
+
+    {
+      std::vector<uint32_t> cursor(firstTriangle.begin(), firstTriangle.end() - 1);
+
+      for (size_t i = 0; i < result.size(); i++) triangles[cursor[result[i]]++] = i / 3;
+    }
+
+    collapses.clear();
+
+    for (size_t t = 0; t < triangleCount; t++) {
+      for (size_t k = 0; k < 3; k++) {
+	uint32_t a = result[3*t + k], b = result[3*t + (k + 1) % 3];
+
+	Quadric q = quadrics[rep[a]];
+	q += quadrics[rep[b]];
+
+	if (!locked[a]) collapses.push_back({ a, b, q.meanError(verts[b].position) });
+	if (!locked[b]) collapses.push_back({ b, a, q.meanError(verts[a].position) });
+      }
+    }
+
+    if (collapses.empty()) break;
+
+    std::sort(collapses.begin(), collapses.end(),
+	      [](auto const &x, auto const &y) { return x.cost < y.cost; });
+
+    for (uint32_t v = 0; v < (uint32_t)vertexCount; v++) remap[v] = v;
+
+    touched.assign(vertexCount, false);
+
+    size_t removed  = 0;
+    size_t toRemove = (result.size() - targetIndexCount + 2) / 3;
+
+    for (auto const &c : collapses) {
+      if (removed >= toRemove) break;
+      if (touched[rep[c.from]] || touched[rep[c.to]]) continue;
+
+      glm::vec3 target = verts[c.to].position;
+
+      // Moving `from` mustn't flip any of the triangles that survive.
+      bool     flips = false;
+      uint32_t gone  = 0;
+
+      for (uint32_t i = firstTriangle[c.from]; i < firstTriangle[c.from + 1]; i++) {
+	uint32_t const *tri = &result[3 * triangles[i]];
+
+	if (rep[tri[0]] == rep[c.to] || rep[tri[1]] == rep[c.to] || rep[tri[2]] == rep[c.to]) {
+	  gone++;
+	  continue;
+	}
+
+	glm::vec3 p[3], q[3];
+
+	for (size_t k = 0; k < 3; k++) {
+	  p[k] = verts[tri[k]].position;
+	  q[k] = tri[k] == c.from ? target : p[k];
+	}
+
+	glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+	glm::vec3 after  = glm::cross(q[1] - q[0], q[2] - q[0]);
+
+	if (glm::dot(before, after) <= 0.0f) {
+	  flips = true;
+	  break;
+	}
+      }
+
+      if (flips) continue;
+
+      remap[c.from] = c.to;
+      quadrics[rep[c.to]] += quadrics[rep[c.from]];
+      worst = std::max(worst, c.cost);
+
+      for (uint32_t i = firstTriangle[c.from]; i < firstTriangle[c.from + 1]; i++) {
+	uint32_t const *tri = &result[3 * triangles[i]];
+
+	for (size_t k = 0; k < 3; k++) touched[rep[tri[k]]] = true;
+      }
+
+      removed += gone;
+    }
+
+    if (removed == 0) break;
+
+    size_t out = 0;
+
+    for (size_t t = 0; t < triangleCount; t++) {
+      uint32_t a = remap[result[3*t]], b = remap[result[3*t + 1]], c = remap[result[3*t + 2]];
+
+      if (rep[a] == rep[b] || rep[b] == rep[c] || rep[c] == rep[a]) continue;
+
+      result[out++] = a;
+      result[out++] = b;
+      result[out++] = c;
+    }
+
+    result.resize(out);
+  }
+
+  *error = (float)std::sqrt(worst);
+
+  return result;
+}
+
+std::vector<asset::Meshlet>
+meshopt::buildMeshlets(asset::StaticVertexData const   *verts,
+		       size_t                          vertexCount,
+		       uint32_t const                  *indices,
+		       size_t                          indexCount,
+		       size_t                          maxVertices,
+		       size_t                          maxTriangles,
+		       std::vector<asset::StaticVertexData>  *meshletVerts,
+		       std::vector<uint32_t>                 *meshletIndices)
+{
+  std::vector<asset::Meshlet> meshlets;
+
+  meshletVerts->clear();
+  meshletIndices->clear();
+
+  // Where each vertex landed in the current meshlet, valid only while
+  // owner[v] is the current meshlet's number.
+  std::vector<uint32_t>  local(vertexCount);
+  std::vector<size_t>    owner(vertexCount, std::numeric_limits<size_t>::max());
+
+  asset::Meshlet current = {};
+
+  auto finish = [&]() {
+    if (current.indexCount == 0) return;
+
+    auto first = meshletVerts->begin() + current.vertexOffset;
+
+    current.bounds.min = current.bounds.max = first->position;
+
+    for (auto v = first; v != meshletVerts->end(); v++) {
+      current.bounds.min = glm::min(current.bounds.min, v->position);
+      current.bounds.max = glm::max(current.bounds.max, v->position);
+    }
+
+    meshlets.push_back(current);
+
+    current = {};
+    current.vertexOffset = (uint32_t)meshletVerts->size();
+    current.indexOffset  = (uint32_t)meshletIndices->size();
+  };
+
+  for (size_t t = 0; t + 2 < indexCount; t += 3) {
+    size_t fresh = 0;
+
+    for (size_t k = 0; k < 3; k++) {
+      if (owner[indices[t + k]] != meshlets.size()) fresh++;
+    }
+
+    // Repeated vertices within a triangle would be counted twice, but that
+    // only ever makes us finish a meshlet a little early.
+    if (current.vertexCount + fresh > maxVertices || current.indexCount / 3 + 1 > maxTriangles) {
+      finish();
+    }
+
+    for (size_t k = 0; k < 3; k++) {
+      uint32_t v = indices[t + k];
+
+      if (owner[v] != meshlets.size()) {
+	owner[v] = meshlets.size();
+	local[v] = current.vertexCount++;
+
+	meshletVerts->push_back(verts[v]);
+      }
+
+      meshletIndices->push_back(local[v]);
+      current.indexCount++;
+    }
+  }
+
+  finish();
+
+  return meshlets;
+}
+
+void meshopt::optimizeMesh(asset::StaticMeshData    *mesh,
+			   asset::StaticVertexData  *verts,
+			   uint32_t                 *indices,
+			   CacheStats               *before,
+			   CacheStats               *after)
+{
+  size_t vertexCount = mesh->vertexCount;
+  size_t indexCount  = mesh->indexCount;
+
+  if (before) *before = analyzeVertexCache(indices, indexCount, vertexCount);
+
+  vertexCount = dedupeVertices(verts, vertexCount, indices, indexCount);
+
+  optimizeVertexCache(indices, indexCount, vertexCount);
+  optimizeOverdraw(indices, indexCount, verts, vertexCount);
+
+  vertexCount = optimizeVertexFetch(verts, vertexCount, indices, indexCount);
+
+  mesh->vertexCount = (uint32_t)vertexCount;
+
+  if (after) *after = analyzeVertexCache(indices, indexCount, vertexCount);
+}
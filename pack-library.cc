@@ -0,0 +1,75 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+// Packs a library and every mesh file it names into one archive, which the
+// engine can load in place of the library:
+//
+//     pack-library <library filename> <archive filename>
+//
+// The mesh files are copied as they are, so an archive is only as current as
+// the files were when it was packed -- re-run this after converting.
+
+#include "asset.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <filesystem>
+
+static void usage(char const *argv0) {
+  char const *strippedName = strrchr(argv0, '/');
+
+  strippedName = strippedName ? strippedName + 1 : argv0;
+
+  fprintf(stderr,
+	  "\n"
+	  "    usage: %s <library filename> <archive filename>\n"
+	  "\n",
+	  strippedName);
+
+  std::exit(-1);
+}
+
+int main(int argc, char const *argv[]) {
+  if (argc != 3) usage(argv[0]);
+
+  char const *libPath      = argv[1];
+  char const *archivePath  = argv[2];
+
+  // Re-packing an archive over itself would truncate the file out from under
+  // its own mapping.
+  std::error_code error;
+
+  if (std::filesystem::equivalent(libPath, archivePath, error)) usage(argv[0]);
+
+  auto library = asset::openLibraryFile(libPath);
+
+  library->writeArchive(archivePath);
+
+  return 0;
+}
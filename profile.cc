@@ -0,0 +1,179 @@
+/*-
+ * Copyright (c) 2021 Samantha Payson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+
+uint32_t profile::threadID() {
+  static std::atomic<uint32_t> nextID { 0 };
+
+  thread_local uint32_t id = nextID.fetch_add(1, std::memory_order_relaxed);
+
+  return id;
+}
+
+profile::Profiler::Profiler()
+  : _epoch(std::chrono::steady_clock::now()), _ring(RING_SIZE) {}
+
+uint64_t profile::Profiler::now() const {
+  auto elapsed = std::chrono::steady_clock::now() - _epoch;
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+void profile::Profiler::setFrame(uint64_t frame) {
+  std::lock_guard<std::mutex> lock(_lock);
+
+  _frame = frame;
+}
+
+uint64_t profile::Profiler::frame() const {
+  std::lock_guard<std::mutex> lock(_lock);
+
+  return _frame;
+}
+
+void profile::Profiler::record(Zone const &zone) {
+  std::lock_guard<std::mutex> lock(_lock);
+
+  _ring[_next] = zone;
+
+  if (++_next == RING_SIZE) {
+    _next     = 0;
+    _wrapped  = true;
+  }
+
+  History &history = _history[zone.name];
+
+  history.ms[history.next] = (zone.end - zone.start) * 1e-6;
+  history.next             = (history.next + 1) % HISTORY;
+  history.count            = std::min(history.count + 1, HISTORY);
+}
+
+// Nearest-rank percentiles, which for HISTORY samples is plenty.
+profile::Stats profile::Profiler::_stats(History const &history) {
+  Stats stats;
+
+  if (history.count == 0) return stats;
+
+  std::vector<double> sorted(history.ms.begin(), history.ms.begin() + history.count);
+
+  std::sort(sorted.begin(), sorted.end());
+
+  double sum = 0.0;
+
+  for (double ms : sorted) sum += ms;
+
+  stats.count  = (uint32_t)sorted.size();
+  stats.mean   = sum / sorted.size();
+  stats.p50    = sorted[(sorted.size() - 1) * 50 / 100];
+  stats.p99    = sorted[(sorted.size() - 1) * 99 / 100];
+  stats.max    = sorted.back();
+
+  return stats;
+}
+
+profile::Stats profile::Profiler::stats(std::string const &name) const {
+  std::lock_guard<std::mutex> lock(_lock);
+
+  auto found = _history.find(name);
+
+  return found == _history.end() ? Stats { } : _stats(found->second);
+}
+
+std::vector<std::pair<std::string, profile::Stats>> profile::Profiler::allStats() const {
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::vector<std::pair<std::string, Stats>> all;
+
+  for (auto const &[name, history] : _history) all.emplace_back(name, _stats(history));
+
+  std::sort(all.begin(), all.end(),
+	    [](auto const &a, auto const &b) { return a.first < b.first; });
+
+  return all;
+}
+
+// Each track is a "process" in the trace, so the GPU queues get rows of their
+// own under the CPU threads. Times are in microseconds, as the format wants.
+bool profile::Profiler::writeChromeTrace(std::string const &path) const {
+  std::ofstream out(path);
+
+  if (!out.is_open()) return false;
+
+  static char const *trackNames[] = { "CPU", "GPU graphics queue", "GPU transfer queue" };
+
+  std::lock_guard<std::mutex> lock(_lock);
+
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+  for (uint32_t t = 0; t < 3; t++) {
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << t
+	<< ",\"args\":{\"name\":\"" << trackNames[t] << "\"}},\n";
+  }
+
+  size_t count = _wrapped ? RING_SIZE : _next;
+  size_t first = _wrapped ? _next : 0;
+
+  out.precision(3);
+  out << std::fixed;
+
+  for (size_t i = 0; i < count; i++) {
+    Zone const &zone = _ring[(first + i) % RING_SIZE];
+
+    out << "{\"name\":\"" << zone.name << "\",\"ph\":\"X\""
+	<< ",\"pid\":" << (uint32_t)zone.track << ",\"tid\":" << zone.thread
+	<< ",\"ts\":" << zone.start * 1e-3 << ",\"dur\":" << (zone.end - zone.start) * 1e-3
+	<< ",\"args\":{\"frame\":" << zone.frame << "}}"
+	<< (i + 1 < count ? ",\n" : "\n");
+  }
+
+  out << "]}\n";
+
+  return out.good();
+}
+
+void profile::ScopedZone::end() {
+  if (!_profiler) return;
+
+  Profiler *profiler = _profiler;
+
+  _profiler = nullptr;
+
+  profiler->record({
+      .name    = _name,
+      .start   = _start,
+      .end     = profiler->now(),
+      .frame   = profiler->frame(),
+      .track   = Track::Cpu,
+      .thread  = threadID(),
+    });
+}
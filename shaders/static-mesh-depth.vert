@@ -0,0 +1,36 @@
+#version 450
+
+// The position-only half of static-mesh.vert, for the depth prepass and the
+// shadow cascades. Reads just the first attribute of the interleaved vertex
+// buffer.
+
+layout (location = 0) in vec3 inPosition;
+
+// The prepass's depth has to match the forward pass's exactly.
+invariant gl_Position;
+
+// Must match gfx::CameraData. A shadow cascade's, for the shadow pass.
+layout (set = 0, binding = 0) uniform CameraBuffer {
+  mat4 view;
+  mat4 project;
+  mat4 viewProject;
+  vec3 position;
+  float lodScale;
+} camera;
+
+// Must match gfx::InstanceData
+struct InstanceData {
+  mat4 model;
+  uint meshIndex;
+};
+
+layout (std430, set = 0, binding = 1) readonly buffer InstanceBuffer {
+  InstanceData instances[];
+};
+
+void main() {
+  mat4 model = instances[gl_InstanceIndex].model;
+
+  // Must match static-mesh.vert
+  gl_Position = camera.viewProject * model * vec4(inPosition, 1.0);
+}
@@ -0,0 +1,51 @@
+#version 450
+
+// The position-only half of static-mesh-packed.vert, for the depth prepass
+// and the shadow cascades. Reads just the first attribute of the interleaved
+// vertex buffer.
+
+layout (location = 0) in vec4 inPosition;  // snorm16, relative to the mesh bounds
+
+// The prepass's depth has to match the forward pass's exactly.
+invariant gl_Position;
+
+// Must match gfx::CameraData. A shadow cascade's, for the shadow pass.
+layout (set = 0, binding = 0) uniform CameraBuffer {
+  mat4 view;
+  mat4 project;
+  mat4 viewProject;
+  vec3 position;
+  float lodScale;
+} camera;
+
+// Must match gfx::InstanceData
+struct InstanceData {
+  mat4 model;
+  uint meshIndex;
+};
+
+layout (std430, set = 0, binding = 1) readonly buffer InstanceBuffer {
+  InstanceData instances[];
+};
+
+// Must match gfx::MeshInfo
+struct MeshInfo {
+  vec4  center;
+  vec4  halfExtent;
+  uvec4 lods;
+  uint  textures[8];  // TextureManager slots, by gfx::MaterialTexture
+};
+
+layout (std430, set = 1, binding = 0) readonly buffer MeshBuffer {
+  MeshInfo meshes[];
+};
+
+void main() {
+  InstanceData instance = instances[gl_InstanceIndex];
+  MeshInfo     mesh     = meshes[instance.meshIndex];
+
+  // Must match static-mesh-packed.vert
+  vec3 position = mesh.center.xyz + inPosition.xyz * mesh.halfExtent.xyz;
+
+  gl_Position = camera.viewProject * instance.model * vec4(position, 1.0);
+}
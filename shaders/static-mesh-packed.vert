@@ -0,0 +1,78 @@
+#version 450
+
+// Decodes asset::PackedVertexData. Otherwise identical to static-mesh.vert.
+
+layout (location = 0) in vec4 inPosition;  // snorm16, relative to the mesh bounds
+layout (location = 1) in vec2 inNormal;    // octahedral, snorm16
+layout (location = 2) in vec2 inUV;        // half floats
+
+layout (location = 0) out vec3 fragNormal;
+layout (location = 1) out vec2 fragUV;
+layout (location = 2) flat out uint fragColorTexture;
+layout (location = 3) out vec3 fragWorldPos;
+layout (location = 4) out float fragViewDepth;
+
+// Depth is tested for equality against what the prepass laid down.
+invariant gl_Position;
+
+// Must match gfx::CameraData
+layout (set = 0, binding = 0) uniform CameraBuffer {
+  mat4 view;
+  mat4 project;
+  mat4 viewProject;
+  vec3 position;
+  float lodScale;
+} camera;
+
+// Must match gfx::InstanceData
+struct InstanceData {
+  mat4 model;
+  uint meshIndex;
+};
+
+layout (std430, set = 0, binding = 1) readonly buffer InstanceBuffer {
+  InstanceData instances[];
+};
+
+// Must match gfx::MeshInfo
+struct MeshInfo {
+  vec4  center;
+  vec4  halfExtent;
+  uvec4 lods;
+  uint  textures[8];  // TextureManager slots, by gfx::MaterialTexture
+};
+
+layout (std430, set = 1, binding = 0) readonly buffer MeshBuffer {
+  MeshInfo meshes[];
+};
+
+// Must match unpackOctahedral in asset.cc
+vec3 octDecode(vec2 e) {
+  vec3  n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  float t = max(-n.z, 0.0);
+
+  n.x += n.x >= 0.0 ? -t : t;
+  n.y += n.y >= 0.0 ? -t : t;
+
+  return normalize(n);
+}
+
+void main() {
+  InstanceData instance = instances[gl_InstanceIndex];
+  MeshInfo     mesh     = meshes[instance.meshIndex];
+
+  mat4 model        = instance.model;
+  mat3 normalMatrix = transpose(inverse(mat3(model)));
+
+  vec3 position = mesh.center.xyz + inPosition.xyz * mesh.halfExtent.xyz;
+
+  vec4 world = model * vec4(position, 1.0);
+
+  gl_Position   = camera.viewProject * model * vec4(position, 1.0);
+  fragWorldPos  = world.xyz;
+  fragViewDepth = -(camera.view * world).z;
+  fragNormal    = normalMatrix * octDecode(inNormal);
+  fragUV        = inUV;
+
+  fragColorTexture = mesh.textures[0];
+}
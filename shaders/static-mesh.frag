@@ -1,11 +1,48 @@
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
 
 layout(location = 0) in vec3 fragNormal;
 layout(location = 1) in vec2 fragUV;
+layout(location = 2) flat in uint fragColorTexture;
+layout(location = 3) in vec3 fragWorldPos;
+layout(location = 4) in float fragViewDepth;
 
 layout(location = 0) out vec4 outColor;
 
+// gfx::TextureManager's array. Slot 0 is white, for meshes without a texture.
+layout(set = 2, binding = 0) uniform sampler2D textures[];
+
+// Must match gfx::ShadowData
+layout(std140, set = 3, binding = 0) uniform ShadowBuffer {
+  mat4 viewProject[4];  // ShadowData::CASCADE_COUNT
+  vec4 splits;          // Far edge of each cascade, in view depth
+  vec4 toLight;
+} shadow;
+
+// One layer per cascade, compared against with LESS_OR_EQUAL.
+layout(set = 3, binding = 1) uniform sampler2DArrayShadow shadowMap;
+
+// How much of the light reaches this fragment: 1 if nothing casts a shadow on
+// it, or it's beyond the last cascade.
+float shadowFactor() {
+  uint c = 0u;
+
+  while (c < 4u && fragViewDepth > shadow.splits[c]) c++;
+
+  if (c == 4u) return 1.0;
+
+  vec4 clip = shadow.viewProject[c] * vec4(fragWorldPos, 1.0);
+  vec3 ndc  = clip.xyz / clip.w;
+  vec2 uv   = ndc.xy * 0.5 + 0.5;
+
+  return texture(shadowMap, vec4(uv, float(c), ndc.z));
+}
+
 void main() {
-  vec3 lightDir = normalize(vec3(1.0, -0.5, -1.0));
-  outColor = vec4(vec3(0.9)*max(0, dot(lightDir, normalize(fragNormal))) + vec3(0.01), 1);
+  vec4 color = texture(textures[nonuniformEXT(fragColorTexture)], fragUV);
+
+  vec3  lightDir = shadow.toLight.xyz;
+  float light    = max(0, dot(lightDir, normalize(fragNormal))) * shadowFactor();
+
+  outColor = vec4(color.rgb*vec3(0.9)*light + vec3(0.01), 1);
 }
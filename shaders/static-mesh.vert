@@ -6,14 +6,57 @@ layout (location = 2) in vec2 inUV;
 
 layout (location = 0) out vec3 fragNormal;
 layout (location = 1) out vec2 fragUV;
+layout (location = 2) flat out uint fragColorTexture;
+layout (location = 3) out vec3 fragWorldPos;
+layout (location = 4) out float fragViewDepth;
 
-layout (push_constant) uniform constants {
-  mat4 renderMatrix;
-} PushConstants;
+// Depth is tested for equality against what the prepass laid down.
+invariant gl_Position;
+
+// Must match gfx::CameraData
+layout (set = 0, binding = 0) uniform CameraBuffer {
+  mat4 view;
+  mat4 project;
+  mat4 viewProject;
+  vec3 position;
+  float lodScale;
+} camera;
+
+// Must match gfx::InstanceData
+struct InstanceData {
+  mat4 model;
+  uint meshIndex;
+};
+
+layout (std430, set = 0, binding = 1) readonly buffer InstanceBuffer {
+  InstanceData instances[];
+};
+
+// Must match gfx::MeshInfo
+struct MeshInfo {
+  vec4  center;
+  vec4  halfExtent;
+  uvec4 lods;
+  uint  textures[8];  // TextureManager slots, by gfx::MaterialTexture
+};
+
+layout (std430, set = 1, binding = 0) readonly buffer MeshBuffer {
+  MeshInfo meshes[];
+};
 
 void main() {
-  mat3 normalMatrix = transpose(inverse(mat3(PushConstants.renderMatrix)));
-  gl_Position = PushConstants.renderMatrix * vec4(inPosition, 1.0);
-  fragNormal  = normalMatrix * inNormal;
-  fragUV      = inUV;
+  InstanceData instance = instances[gl_InstanceIndex];
+
+  mat4 model        = instance.model;
+  mat3 normalMatrix = transpose(inverse(mat3(model)));
+
+  vec4 world = model * vec4(inPosition, 1.0);
+
+  gl_Position   = camera.viewProject * model * vec4(inPosition, 1.0);
+  fragWorldPos  = world.xyz;
+  fragViewDepth = -(camera.view * world).z;
+  fragNormal    = normalMatrix * inNormal;
+  fragUV        = inUV;
+
+  fragColorTexture = meshes[instance.meshIndex].textures[0];
 }